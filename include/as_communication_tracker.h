@@ -36,6 +36,9 @@
 
 #include <map>
 #include <string>
+#include <atomic>
+#include <functional>
+#include <pthread.h>
 
 #include "pdlog.h"
 #include "alarm.h"
@@ -77,18 +80,37 @@ public:
   virtual void on_failure(const std::string& as_uri, const std::string& reason);
 
 private:
-  // A lock that protects all member variables of this class.
-  pthread_mutex_t _lock;
-
-  // A count of how many times we have had a communication failure to each AS
-  // in the last time period.
-  std::map<std::string, int> _as_failures;
-
-  // The time (in ms since the epoch) at which we should check the _as_failures
-  // to determine if some ASs are now OK again.
+  // The number of shards the failure counts are split across. Each AS is
+  // tracked by the shard chosen by hashing its URI, so failures on different
+  // ASs rarely contend on the same lock.
+  const static size_t NUM_SHARDS = 16;
+
+  struct Shard
+  {
+    // A lock that protects the failure counts in this shard.
+    pthread_mutex_t lock;
+
+    // A count of how many times we have had a communication failure to each
+    // AS in this shard in the last time period.
+    std::map<std::string, int> as_failures;
+  };
+
+  Shard _shards[NUM_SHARDS];
+
+  // The total number of ASs that are currently considered failed, across all
+  // shards.
+  std::atomic<size_t> _num_failed_ases;
+
+  // A lock that serializes raising and clearing the alarm, so that a check
+  // that finds no failed ASs can't clear the alarm after a concurrent failure
+  // has raised it.
+  pthread_mutex_t _alarm_lock;
+
+  // The time (in ms since the epoch) at which we should check the failure
+  // counts to determine if some ASs are now OK again.
   std::atomic<uint64_t> _next_check_time_ms;
 
-  // The length of time that must pass between checks of _as_failures.
+  // The length of time that must pass between checks of the failure counts.
   const static uint64_t NEXT_CHECK_INTERVAL_MS = 5 * 60 * 1000;
 
   // The alarm to raise when communication to some Application Servers is
@@ -108,6 +130,9 @@ private:
   /// consider clearing the alarm.
   void check_for_healthy_app_servers();
 
+  /// @return The shard that tracks the specified AS.
+  Shard& shard_for(const std::string& as_uri);
+
   /// @return The current monotonic time in ms. Note that this is not wall time!
   static uint64_t current_time_ms();
 };
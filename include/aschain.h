@@ -396,7 +396,67 @@ private:
 
   static const int TOKEN_LENGTH = 10;
 
-  /// Map from ODI token to pair of (AsChain, index).
-  std::map<std::string, AsChainLink> _odi_token_map;
-  pthread_mutex_t _lock;
+  /// Number of independently locked shards in the table.  Must be a power
+  /// of two.
+  static const size_t NUM_SHARDS = 64;
+
+  /// Initial number of slots in each shard.  Must be a power of two.
+  static const size_t INITIAL_SHARD_CAPACITY = 16;
+
+  /// ODI tokens are held in the table as fixed-width binary keys rather
+  /// than strings, so lookups don't allocate and comparisons are a single
+  /// memcmp.
+  struct OdiKey
+  {
+    uint8_t bytes[TOKEN_LENGTH];
+  };
+
+  enum SlotState { SLOT_EMPTY, SLOT_FULL, SLOT_DELETED };
+
+  /// An entry in a shard's open-addressed hash table.
+  struct Slot
+  {
+    Slot() : state(SLOT_EMPTY), hash(0), key(), link(NULL, 0) {}
+
+    SlotState state;
+    uint64_t hash;
+    OdiKey key;
+    AsChainLink link;
+  };
+
+  /// A single shard of the table.  Each shard is a linear-probed hash table
+  /// with its own lock, so registrations and lookups of unrelated chains
+  /// don't contend.
+  struct Shard
+  {
+    pthread_mutex_t lock;
+    std::vector<Slot> slots;
+
+    /// Number of slots in the SLOT_FULL state.
+    size_t count;
+
+    /// Number of slots not in the SLOT_EMPTY state (i.e. including
+    /// tombstones), which determines probe lengths.
+    size_t used;
+  };
+
+  static bool to_key(const std::string& token, OdiKey& key);
+  static uint64_t hash_key(const OdiKey& key);
+
+  Shard& shard_for(uint64_t hash)
+  {
+    return _shards[hash & (NUM_SHARDS - 1)];
+  }
+
+  // These must be called with the shard lock held.
+  static Slot* find_slot(Shard& shard, uint64_t hash, const OdiKey& key);
+  static bool insert(Shard& shard,
+                     uint64_t hash,
+                     const OdiKey& key,
+                     const AsChainLink& link);
+  static void resize(Shard& shard, size_t capacity);
+
+  /// Map from ODI token to pair of (AsChain, index), sharded by the hash of
+  /// the token.
+  Shard _shards[NUM_SHARDS];
 };
@@ -53,7 +53,9 @@ extern "C" {
 #include <utility>
 #include <vector>
 #include <list>
+#include <map>
 #include <set>
+#include <memory>
 
 #include "stack.h"
 #include "pjmodule.h"
@@ -177,6 +179,12 @@ protected:
     /// Adds the target information to a request ready to send.
     virtual void set_req_target(pjsip_tx_data* tdata, BasicProxy::Target* target);
 
+    /// Collects the result of a next hop resolution started in parallel
+    /// with the other forks of this request, if there is one.
+    /// @returns true if servers has been filled in.
+    bool take_prefetched_servers(pjsip_tx_data* tdata,
+                                 std::vector<AddrInfo>& servers);
+
     /// Allocates and initializes a UAC transaction.
     virtual pj_status_t allocate_uac(pjsip_tx_data* tdata, size_t& index);
 
@@ -247,6 +255,10 @@ protected:
     /// Count of targets the request is about to be forked to.
     size_t _pending_sends;
 
+    /// Next hop resolutions running in parallel for requests that are about
+    /// to be forked, indexed by the cloned request.
+    std::map<pjsip_tx_data*, std::shared_ptr<SIPResolver::PendingResolution> > _next_hop_resolutions;
+
     /// Count of targets the request was forked to that have yet to respond.
     size_t _pending_responses;
 
@@ -48,6 +48,7 @@
 #include <functional>
 #include "updater.h"
 #include "sas.h"
+#include "config_snapshot.h"
 
 class BgcfService
 {
@@ -64,14 +65,15 @@ public:
                                                  SAS::TrailId trail) const;
 
 private:
-  std::map<std::string, std::vector<std::string>> _domain_routes;
-  std::map<std::string, std::vector<std::string>> _number_routes;
+  struct Routes
+  {
+    std::map<std::string, std::vector<std::string>> domain_routes;
+    std::map<std::string, std::vector<std::string>> number_routes;
+  };
+
+  ConfigSnapshot<Routes> _routes;
   std::string _configuration;
   Updater<void, BgcfService>* _updater;
-
-  // Mark as mutable to flag that this can be modified without affecting the
-  // external behaviour of the class, allowing for locking in 'const' methods.
-  mutable boost::shared_mutex _routes_rw_lock;
 };
 
 #endif
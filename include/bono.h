@@ -377,7 +377,8 @@ pj_status_t init_stateful_proxy(SubscriberDataManager* sdm,
                                 QuiescingManager* quiescing_manager,
                                 bool icscf_enabled,
                                 bool scscf_enabled,
-                                bool emerg_reg_accepted);
+                                bool emerg_reg_accepted,
+                                bool stateless_in_dialog_relay = false);
 
 void destroy_stateful_proxy();
 
@@ -68,6 +68,8 @@ struct options
   int                                  pcscf_untrusted_port;
   int                                  pcscf_trusted_port;
   int                                  webrtc_port;
+  int                                  webrtc_threads;
+  bool                                 stateless_in_dialog_relay;
   std::string                          upstream_proxy;
   int                                  upstream_proxy_port;
   int                                  upstream_proxy_connections;
@@ -104,6 +106,8 @@ struct options
   std::string                          analytics_directory;
   int                                  reg_max_expires;
   int                                  sub_max_expires;
+  int                                  reg_refresh_window;
+  int                                  third_party_reg_refresh_window;
   std::string                          http_address;
   int                                  http_port;
   int                                  http_threads;
@@ -113,6 +117,8 @@ struct options
   int                                  memento_threads;
   int                                  call_list_ttl;
   int                                  worker_threads;
+  int                                  async_lookup_threads;
+  int                                  dereg_threads;
   bool                                 log_to_file;
   std::string                          log_directory;
   int                                  log_level;
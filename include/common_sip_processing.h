@@ -54,6 +54,11 @@ extern "C" {
 #include "snmp_counter_table.h"
 #include "snmp_counter_by_scope_table.h"
 #include "health_checker.h"
+#include "sas.h"
+
+// Sentinel trail ID set on messages (such as OPTIONS polls) that shouldn't be
+// logged to SAS.  Responses to these messages aren't logged either.
+static const SAS::TrailId DONT_LOG_TO_SAS = 0xFFFFFFFF;
 
 pj_status_t
 init_common_sip_processing(LoadMonitor* load_monitor_arg,
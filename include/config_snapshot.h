@@ -0,0 +1,193 @@
+/**
+ * @file config_snapshot.h Read-mostly configuration snapshots.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+#ifndef CONFIG_SNAPSHOT_H__
+#define CONFIG_SNAPSHOT_H__
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdint.h>
+#include <pthread.h>
+
+/// Holds an immutable snapshot of some configuration, which can be replaced
+/// while other threads are reading it.
+///
+/// Each thread caches a reference to the current snapshot in thread-local
+/// storage, and only goes back to the shared copy (under a lock) when the
+/// configuration has been replaced since it last looked.  The common read
+/// path therefore just loads a counter that is only written by updates, and
+/// doesn't write to any memory shared with other threads.  A snapshot is
+/// freed once every thread that read it has moved on to a newer one.
+template <class T>
+class ConfigSnapshot
+{
+private:
+  struct ThreadSlot
+  {
+    ConfigSnapshot<T>* owner;
+    std::shared_ptr<const T> snapshot;
+    uint64_t version;
+    int readers;
+  };
+
+public:
+  ConfigSnapshot(std::shared_ptr<const T> initial) :
+    _version(1),
+    _current(initial)
+  {
+    pthread_key_create(&_thread_local, destroy_slot);
+  }
+
+  ~ConfigSnapshot()
+  {
+    // Deleting the key stops thread exit tidying up the slots, so free them
+    // all here.
+    pthread_key_delete(_thread_local);
+
+    for (typename std::set<ThreadSlot*>::iterator slot = _slots.begin();
+         slot != _slots.end();
+         ++slot)
+    {
+      delete *slot;
+    }
+  }
+
+  /// Replaces the configuration.  Readers see the new snapshot the next
+  /// time they start reading.
+  void set(std::shared_ptr<const T> snapshot)
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    _current = snapshot;
+    _version.store(_version.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_release);
+  }
+
+  /// @class ConfigSnapshot::Reader
+  ///
+  /// Gives access to the current snapshot for as long as the Reader exists.
+  /// A thread sees the same snapshot through all the Readers it holds at
+  /// once, so nested reads are consistent.
+  class Reader
+  {
+  public:
+    Reader(const ConfigSnapshot<T>& config) :
+      _slot(const_cast<ConfigSnapshot<T>&>(config).get_slot())
+    {
+      if ((_slot->readers == 0) &&
+          (_slot->version != config._version.load(std::memory_order_acquire)))
+      {
+        _slot->owner->refresh(_slot);
+      }
+
+      ++_slot->readers;
+      _snapshot = _slot->snapshot.get();
+    }
+
+    ~Reader()
+    {
+      --_slot->readers;
+    }
+
+    const T& operator*() const { return *_snapshot; }
+    const T* operator->() const { return _snapshot; }
+
+  private:
+    ThreadSlot* _slot;
+    const T* _snapshot;
+
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+  };
+
+private:
+  /// Gets this thread's slot, creating it if necessary.
+  ThreadSlot* get_slot()
+  {
+    ThreadSlot* slot = (ThreadSlot*)pthread_getspecific(_thread_local);
+
+    if (slot == NULL)
+    {
+      slot = new ThreadSlot();
+      slot->owner = this;
+      slot->version = 0;
+      slot->readers = 0;
+      pthread_setspecific(_thread_local, slot);
+
+      std::unique_lock<std::mutex> lock(_lock);
+      _slots.insert(slot);
+    }
+
+    return slot;
+  }
+
+  /// Points a thread's slot at the current snapshot.
+  void refresh(ThreadSlot* slot)
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    slot->snapshot = _current;
+    slot->version = _version.load(std::memory_order_relaxed);
+  }
+
+  /// Frees a thread's slot when the thread exits.
+  static void destroy_slot(void* data)
+  {
+    ThreadSlot* slot = (ThreadSlot*)data;
+
+    {
+      std::unique_lock<std::mutex> lock(slot->owner->_lock);
+      slot->owner->_slots.erase(slot);
+    }
+
+    delete slot;
+  }
+
+  std::atomic<uint64_t> _version;
+
+  // Protects _current and _slots.
+  std::mutex _lock;
+  std::shared_ptr<const T> _current;
+  std::set<ThreadSlot*> _slots;
+
+  pthread_key_t _thread_local;
+
+  ConfigSnapshot(const ConfigSnapshot&) = delete;
+  ConfigSnapshot& operator=(const ConfigSnapshot&) = delete;
+};
+
+#endif
@@ -42,6 +42,7 @@
 
 #include <list>
 #include <string>
+#include <vector>
 #include <boost/regex.hpp>
 #include <boost/thread.hpp>
 #include <netinet/in.h>
@@ -51,6 +52,7 @@
 #include "dnsresolver.h"
 #include "communicationmonitor.h"
 #include "updater.h"
+#include "config_snapshot.h"
 
 /// @class EnumService
 ///
@@ -66,9 +68,54 @@ public:
   /// Translate a PSTN number to a SIP URI.
   virtual std::string lookup_uri_from_user(const std::string& user, SAS::TrailId trail) const = 0;
 
-  // Parse a string of the form !<regex>!<replace>! into a regular expression
-  // and a replacement string.
-  static bool parse_regex_replace(const std::string& regex_replace, boost::regex& regex, std::string& replace);
+  /// @class EnumService::Rewrite
+  ///
+  /// An ENUM regular expression and replacement.  Most rules just strip a
+  /// fixed prefix and wrap what's left (for example !^\+1(.*)$!sip:\1@domain!),
+  /// so these are applied by direct string substitution.  Anything else is
+  /// applied with Boost regex.  Either way, the result is the same as
+  /// boost::regex_replace would give.
+  class Rewrite
+  {
+  public:
+    Rewrite();
+
+    // Sets the regular expression and replacement.  Throws
+    // boost::regex_error if the regular expression isn't valid.
+    void assign(const std::string& regex, const std::string& replace);
+
+    // Whether the regular expression matches anywhere in the string.
+    bool matches(const std::string& string) const;
+    // Apply the regular expression match/replace processing to the string.
+    std::string replace(const std::string& string) const;
+
+    inline const boost::regex& regex() const { return _regex; }
+    inline const std::string& replacement() const { return _replace; }
+    inline bool is_simple() const { return _simple; }
+
+  private:
+    // Works out whether the rule can be applied without the regex engine
+    // and, if so, sets up the substitution.
+    bool classify();
+    // Whether the simple substitution gives the same results as the regex
+    // engine for this string.
+    static bool simple_applies(const std::string& string);
+
+    boost::regex _regex;
+    std::string _replace;
+
+    // Whether the rule is applied by direct substitution.  If so, a string
+    // matches if it starts with _prefix, the capture runs from
+    // _capture_start to the end of the string, and the result is the
+    // segments of _template joined by the capture.
+    bool _simple;
+    std::string _prefix;
+    size_t _capture_start;
+    std::vector<std::string> _template;
+  };
+
+  // Parse a string of the form !<regex>!<replace>! into a rewrite rule.
+  static bool parse_regex_replace(const std::string& regex_replace, Rewrite& rewrite);
 
   // Converts an input user to an Application Unique String by stripping out
   // invalid characters, specifically anything other than 0-9 and + for the
@@ -116,19 +163,17 @@ private:
   struct NumberPrefix
   {
     std::string prefix;
-    boost::regex match;
-    std::string replace;
+    Rewrite rewrite;
   };
 
-  std::vector<NumberPrefix> _number_prefixes;
+  typedef std::vector<NumberPrefix> NumberPrefixes;
+
+  ConfigSnapshot<NumberPrefixes> _number_prefixes;
   std::string _configuration;
   Updater<void, JSONEnumService>* _updater;
 
-  // Mark as mutable to flag that this can be modified without affecting the
-  // external behaviour of the class, allowing for locking in 'const' methods.
-  mutable boost::shared_mutex _number_prefixes_rw_lock;
-
-  const NumberPrefix* prefix_match(const std::string& number) const;
+  static const NumberPrefix* prefix_match(const NumberPrefixes& number_prefixes,
+                                          const std::string& number);
 };
 
 /// @class DNSEnumService
@@ -156,14 +201,13 @@ private:
   class Rule
   {
   public:
-    Rule(const boost::regex& regex,
-         const std::string& replace,
+    Rule(const EnumService::Rewrite& rewrite,
          bool terminal,
          int order,
          int preference);
 
     // Whether this rule matches.
-    inline bool matches(const std::string& string) const { return boost::regex_search(string, _regex); };
+    inline bool matches(const std::string& string) const { return _rewrite.matches(string); };
     // Whether this rule is terminal.
     inline bool is_terminal() const { return _terminal; }
     // Apply the regular expression match/replace processing for this rule.
@@ -173,8 +217,7 @@ private:
 
   private:
     // The regular expression and replacement for this rule.
-    boost::regex _regex;
-    std::string _replace;
+    EnumService::Rewrite _rewrite;
     // Whether this rule is terminal.
     bool _terminal;
     // The order and preference for this rule (used for sorting into order).
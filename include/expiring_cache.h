@@ -0,0 +1,219 @@
+/**
+ * @file expiring_cache.h Bounded cache of entries that expire.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+
+
+#ifndef EXPIRING_CACHE_H__
+#define EXPIRING_CACHE_H__
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/// A thread-safe cache of values that are only valid until a given time,
+/// indexed by string.
+///
+/// The cache holds at most a fixed number of entries.  When it is full,
+/// setting a new entry evicts the one that was set least recently.  Expired
+/// entries are removed when they are looked up, and a bounded number are
+/// removed on each set, so every operation is O(1).  Entries are spread
+/// across independently locked shards, and values are held by shared
+/// pointer, so the locks are only held for a few pointer operations.
+template <class V>
+class ExpiringCache
+{
+public:
+  ExpiringCache(size_t max_size) :
+    _max_shard_size((max_size > NUM_SHARDS) ? (max_size / NUM_SHARDS) : 1)
+  {
+  }
+
+  /// Returns the value cached against the key, or NULL if there is none or
+  /// it has expired.
+  std::shared_ptr<const V> get(const std::string& key, int now)
+  {
+    Shard& shard = get_shard(key);
+    std::unique_lock<std::mutex> lock(shard.lock);
+    std::shared_ptr<const V> value;
+
+    typename Entries::iterator i = shard.entries.find(key);
+
+    if (i != shard.entries.end())
+    {
+      if (i->second.expires > now)
+      {
+        value = i->second.value;
+      }
+      else
+      {
+        erase_entry(shard, i);
+      }
+    }
+
+    return value;
+  }
+
+  /// Caches a value until the specified expiry time, replacing any value
+  /// already cached against the key.
+  void set(const std::string& key,
+           std::shared_ptr<const V> value,
+           int expires,
+           int now)
+  {
+    Shard& shard = get_shard(key);
+    std::unique_lock<std::mutex> lock(shard.lock);
+
+    // Remove a couple of expired entries (if there are any at the front of
+    // the age list), so that the cache doesn't stay full of entries that
+    // are never looked up again.
+    for (int ii = 0;
+         (ii < PRUNE_PER_SET) &&
+         (!shard.order.empty()) &&
+         (shard.entries.find(*shard.order.front())->second.expires <= now);
+         ++ii)
+    {
+      erase_entry(shard, shard.entries.find(*shard.order.front()));
+    }
+
+    typename Entries::iterator i = shard.entries.find(key);
+
+    if (i != shard.entries.end())
+    {
+      // Move the existing entry to the back of the age list.
+      shard.order.splice(shard.order.end(), shard.order, i->second.order);
+    }
+    else
+    {
+      if (shard.entries.size() >= _max_shard_size)
+      {
+        // The shard is full, so evict the entry set least recently.
+        erase_entry(shard, shard.entries.find(*shard.order.front()));
+      }
+
+      i = shard.entries.emplace(key, Entry()).first;
+      i->second.order = shard.order.insert(shard.order.end(), &i->first);
+    }
+
+    i->second.value = value;
+    i->second.expires = expires;
+  }
+
+  /// Removes any value cached against the key.
+  void erase(const std::string& key)
+  {
+    Shard& shard = get_shard(key);
+    std::unique_lock<std::mutex> lock(shard.lock);
+
+    typename Entries::iterator i = shard.entries.find(key);
+
+    if (i != shard.entries.end())
+    {
+      erase_entry(shard, i);
+    }
+  }
+
+  /// Removes all the cached values.
+  void clear()
+  {
+    for (size_t ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      std::unique_lock<std::mutex> lock(_shards[ii].lock);
+      _shards[ii].order.clear();
+      _shards[ii].entries.clear();
+    }
+  }
+
+  /// Returns the number of cached values, including any that have expired
+  /// but not yet been removed.
+  size_t size()
+  {
+    size_t size = 0;
+
+    for (size_t ii = 0; ii < NUM_SHARDS; ++ii)
+    {
+      std::unique_lock<std::mutex> lock(_shards[ii].lock);
+      size += _shards[ii].entries.size();
+    }
+
+    return size;
+  }
+
+private:
+  static const size_t NUM_SHARDS = 16;
+  static const int PRUNE_PER_SET = 2;
+
+  struct Entry
+  {
+    std::shared_ptr<const V> value;
+    int expires;
+
+    // Position of this entry in the shard's age list.  The list points at
+    // the keys in the map, which don't move when the map is rehashed.
+    std::list<const std::string*>::iterator order;
+  };
+  typedef std::unordered_map<std::string, Entry> Entries;
+
+  struct Shard
+  {
+    std::mutex lock;
+    Entries entries;
+
+    // Keys in the order they were last set, oldest first.
+    std::list<const std::string*> order;
+  };
+
+  Shard& get_shard(const std::string& key)
+  {
+    return _shards[std::hash<std::string>()(key) % NUM_SHARDS];
+  }
+
+  static void erase_entry(Shard& shard, typename Entries::iterator i)
+  {
+    shard.order.erase(i->second.order);
+    shard.entries.erase(i);
+  }
+
+  Shard _shards[NUM_SHARDS];
+  const size_t _max_shard_size;
+
+  ExpiringCache(const ExpiringCache&) = delete;
+  ExpiringCache& operator=(const ExpiringCache&) = delete;
+};
+
+#endif
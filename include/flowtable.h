@@ -94,8 +94,6 @@ public:
                                          pjsip_transport_state state,
                                          const pjsip_transport_state_info *info);
 
-  static void on_timer_expiry(pj_timer_heap_t *th, pj_timer_entry *e);
-
   friend class FlowTable;
 
 private:
@@ -107,6 +105,7 @@ private:
   void select_default_identity();
   void restart_timer(int id, int timeout);
   void expiry_timer();
+  void on_timer_expiry(int id);
 
   void inc_ref();
 
@@ -118,8 +117,17 @@ private:
 
   /// Timer used to expire the associated registration bindings.  This is also
   /// used to expire idle UDP flows (ie. when there are no more associated
-  /// registration bindings.
-  pj_timer_entry _timer;
+  /// registration bindings.  The timer is an entry on the FlowTable's timing
+  /// wheel, so these fields are protected by FlowTable::_wheel_lock.
+  int _timer_id;
+  int _timer_expires;
+  int _wheel_slot;
+  Flow* _wheel_prev;
+  Flow* _wheel_next;
+
+  /// Time the flow was last touched.  This is checked when the idle timer
+  /// pops rather than restarting the timer on every touch.
+  std::atomic_int _last_touch;
 
   /// Lock used to protect accesses to the various data structures managing
   /// the identifiers authorized on this flow.
@@ -187,6 +195,11 @@ public:
   /// Removes a flow from the flow table.
   void remove_flow(Flow* flow);
 
+  /// Number of slots on the flow timer wheel, and the interval (in
+  /// milliseconds) between sweeps of the wheel.  Each slot covers one second.
+  static const int WHEEL_SLOTS = 1024;
+  static const int WHEEL_TICK_MS = 1000;
+
   // Functions for quiescing a Bono.
   void check_quiescing_state();
   void quiesce();
@@ -239,6 +252,22 @@ private:
   std::map<FlowKey, Flow*> _tp2flow_map;        // map from transport addresses to flow
   std::map<std::string, Flow*> _tk2flow_map;    // map from token to flow
 
+  // Flow timers.  Rather than each flow running its own PJSIP timer, flows
+  // are held on a hashed timing wheel which is swept once a second.  The
+  // wheel lock may be taken while holding the flow map lock or a flow lock,
+  // but not the other way round.
+  void schedule_flow(Flow* flow, int id, int expires, bool earlier_only);
+  void cancel_flow(Flow* flow);
+  void link_flow(Flow* flow);
+  void unlink_flow(Flow* flow);
+  void sweep_wheel();
+  static void on_wheel_timer(pj_timer_heap_t *th, pj_timer_entry *e);
+
+  pthread_mutex_t _wheel_lock;
+  Flow* _wheel[WHEEL_SLOTS];
+  int _wheel_time;
+  pj_timer_entry _wheel_timer;
+
   // Statistics
   void report_flow_count();
   SNMP::U32Scalar* _conn_count;
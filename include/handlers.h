@@ -44,6 +44,7 @@
 #include "subscriber_data_manager.h"
 #include "sipresolver.h"
 #include "impistore.h"
+#include "snmp_event_accumulator_table.h"
 
 /// Common factory for all handlers that deal with chronos timer pops. This is
 /// a subclass of SpawningHandler that requests HTTP flows to be
@@ -113,20 +114,38 @@ public:
            std::vector<SubscriberDataManager*> remote_sdms,
            HSSConnection* hss,
            SIPResolver* sipresolver,
-           ImpiStore* impi_store) :
+           ImpiStore* impi_store,
+           int num_threads = 1,
+           SNMP::EventAccumulatorTable* batch_latency_tbl = NULL) :
       _sdm(sdm),
       _remote_sdms(remote_sdms),
       _hss(hss),
       _sipresolver(sipresolver),
-      _impi_store(impi_store)
+      _impi_store(impi_store),
+      _num_threads(num_threads),
+      _batch_latency_tbl(batch_latency_tbl)
     {}
     SubscriberDataManager* _sdm;
     std::vector<SubscriberDataManager*> _remote_sdms;
     HSSConnection* _hss;
     SIPResolver* _sipresolver;
     ImpiStore* _impi_store;
+
+    /// Number of threads each request is spread across.
+    int _num_threads;
+
+    /// Time taken to deregister each batch of registrations.
+    SNMP::EventAccumulatorTable* _batch_latency_tbl;
   };
 
+  /// Number of registrations deregistered as a batch by one thread.
+  static const size_t BATCH_SIZE = 100;
+
+  /// Starts the pool of helper threads shared by all deregistration
+  /// requests.  Each request runs on its HTTP thread, plus up to
+  /// Config::_num_threads - 1 of these.
+  static pj_status_t start_helper_threads(int num_threads);
+  static void stop_helper_threads();
 
   DeregistrationTask(HttpStack::Request& req,
                      const Config* cfg,
@@ -137,6 +156,10 @@ public:
   void run();
   HTTPCode handle_request();
   HTTPCode parse_request(std::string body);
+  bool deregister_registration(const std::string& aor_id,
+                               const std::string& private_id,
+                               std::set<std::string>& impis_to_delete);
+  void delete_impi(const std::string& impi);
   SubscriberDataManager::AoRPair* deregister_bindings(
                     SubscriberDataManager* current_sdm,
                     std::string aor_id,
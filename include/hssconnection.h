@@ -41,6 +41,9 @@
 #define HSSCONNECTION_H__
 
 #include <curl/curl.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include "rapidjson/document.h"
 
 #include "httpconnection.h"
@@ -48,6 +51,7 @@
 #include "ifchandler.h"
 #include "sas.h"
 #include "snmp_event_accumulator_table.h"
+#include "snmp_counter_table.h"
 #include "load_monitor.h"
 
 /// @class HSSConnection
@@ -140,7 +144,15 @@ public:
                                          std::map<std::string, Ifcs >& service_profiles,
                                          std::vector<std::string>& associated_uris,
                                          SAS::TrailId trail);
-  rapidxml::xml_document<>* parse_xml(std::string raw, const std::string& url);
+  std::shared_ptr<rapidxml::xml_document<> > parse_xml(std::string raw,
+                                                       const std::string& url);
+
+  /// Sets the table used to count requests that were answered by joining an
+  /// identical request already in flight to Homestead.
+  void set_coalesced_table(SNMP::CounterTable* coalesced_tbl)
+  {
+    _coalesced_tbl = coalesced_tbl;
+  }
 
   static const std::string REG;
   static const std::string CALL;
@@ -158,14 +170,37 @@ private:
                                rapidjson::Document*& object,
                                SAS::TrailId trail);
   virtual long get_xml_object(const std::string& path,
-                              rapidxml::xml_document<>*& root,
+                              std::shared_ptr<rapidxml::xml_document<> >& root,
                               SAS::TrailId trail);
   virtual long put_for_xml_object(const std::string& path,
                                   std::string body,
                                   bool cache_allowed,
-                                  rapidxml::xml_document<>*& root,
+                                  std::shared_ptr<rapidxml::xml_document<> >& root,
                                   SAS::TrailId trail);
 
+  /// A Homestead XML request that is currently in flight. Callers that make
+  /// an identical request while it is outstanding wait for it to complete
+  /// and share its parsed response.
+  struct InFlightRequest
+  {
+    bool complete;
+    HTTPCode http_code;
+    std::shared_ptr<rapidxml::xml_document<> > root;
+    SAS::TrailId trail;
+  };
+
+  HTTPCode coalesced_xml_request(const std::string& path,
+                                 const std::string& body,
+                                 bool is_put,
+                                 bool cache_allowed,
+                                 std::shared_ptr<rapidxml::xml_document<> >& root,
+                                 SAS::TrailId trail);
+
+  void complete_in_flight_request(const std::string& key,
+                                  std::shared_ptr<InFlightRequest> request,
+                                  HTTPCode http_code,
+                                  std::shared_ptr<rapidxml::xml_document<> > root);
+
   HttpConnection* _http;
   SNMP::EventAccumulatorTable* _latency_tbl;
   SNMP::EventAccumulatorTable* _mar_latency_tbl;
@@ -174,6 +209,11 @@ private:
   SNMP::EventAccumulatorTable* _lir_latency_tbl;
   std::string _scscf_uri;
   bool _fallback_if_no_matching_ifc;
+  SNMP::CounterTable* _coalesced_tbl;
+
+  std::mutex _in_flight_lock;
+  std::condition_variable _in_flight_cond;
+  std::map<std::string, std::shared_ptr<InFlightRequest> > _in_flight;
 };
 
 #endif
@@ -62,6 +62,17 @@ public:
 
   int get_scscf(pj_pool_t* pool, pjsip_sip_uri*& scscf_uri, bool do_billing=false);
 
+  /// Selects an S-CSCF, querying the HSS if necessary.  This doesn't use any
+  /// pool memory, so can be done off the transaction's thread.
+  int select_scscf(std::string& scscf, bool do_billing=false);
+
+  /// Converts an S-CSCF chosen by select_scscf to a SIP URI allocated from
+  /// the pool, and logs the result of the selection.
+  int get_scscf_uri(pj_pool_t* pool,
+                    int status_code,
+                    const std::string& scscf,
+                    pjsip_sip_uri*& scscf_uri);
+
 protected:
   /// Do the HSS query.  This must be implemented by the request-type specific
   /// routers.
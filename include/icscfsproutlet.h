@@ -204,11 +204,19 @@ public:
   virtual void on_rx_response(pjsip_msg* rsp, int fork_id) override;
   virtual void on_tx_response(pjsip_msg* rsp) override;
   virtual void on_rx_cancel(int status_code, pjsip_msg* req) override;
+  virtual void on_async_complete(void* context, bool success) override;
 
 private:
   ICSCFSproutlet* _icscf;
   ACR* _acr;
   ICSCFRouter* _router;
+
+  /// The request waiting for the initial S-CSCF lookup to complete, and the
+  /// result of that lookup.  The lookup runs on an async lookup thread, so
+  /// the result is held outside the request's pool until it completes.
+  pjsip_msg* _pending_req;
+  std::string _scscf;
+  int _status_code;
 };
 
 #endif
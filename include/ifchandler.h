@@ -115,12 +115,12 @@ public:
 
   size_t size() const
   {
-    return _ifcs.size();
+    return (_ifcs != NULL) ? _ifcs->size() : 0;
   }
 
   const Ifc& operator[](size_t index) const
   {
-    return _ifcs[index];
+    return (*_ifcs)[index];
   }
 
   void interpret(const SessionCase& session_case,
@@ -132,7 +132,10 @@ public:
 
 private:
   std::shared_ptr<rapidxml::xml_document<> > _ifc_doc;
-  std::vector<Ifc> _ifcs;
+
+  // The parsed iFCs are immutable once built, so copies of an Ifcs (e.g. one
+  // per public identity in a ServiceProfile) share a single list.
+  std::shared_ptr<const std::vector<Ifc> > _ifcs;
 };
 
 
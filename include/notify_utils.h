@@ -46,6 +46,7 @@ extern "C" {
 }
 
 #include <string>
+#include <vector>
 #include "subscriber_data_manager.h"
 #include "ifchandler.h"
 #include "hssconnection.h"
@@ -76,21 +77,37 @@ namespace NotifyUtils
     NotifyUtils::ContactEvent _contact_event;
   };
 
+  // The reginfo XML body for an AoR.  This is rendered once per AoR change
+  // and shared by the NOTIFYs sent to each of its subscriptions.  The only
+  // per-subscription field is the registration id (the subscription's To
+  // tag), so the rendered text either side of each id is stored and the ids
+  // are filled in when a NOTIFY is built.
+  class RegInfoBody
+  {
+  public:
+    RegInfoBody(const std::vector<std::string>& irs_impus,
+                const std::vector<BindingNotifyInformation*>& bnis,
+                NotifyUtils::RegistrationState reg_state);
+
+    // Returns the body with the registration ids set for the subscription.
+    std::string render(const std::string& reg_id) const;
+
+  private:
+    std::vector<std::string> _segments;
+    size_t _length;
+  };
+
   pj_status_t create_subscription_notify(pjsip_tx_data** tdata_notify,
                                          SubscriberDataManager::AoR::Subscription* s,
-                                         std::string aor,
-                                         std::vector<std::string> irs_impus,
                                          SubscriberDataManager::AoR* aor_data,
-                                         std::vector<BindingNotifyInformation*> bnis,
+                                         const RegInfoBody& body,
                                          NotifyUtils::RegistrationState reg_state,
                                          int now);
 
   pj_status_t create_notify(pjsip_tx_data** tdata_notify,
                             SubscriberDataManager::AoR::Subscription* subscription,
-                            std::string aor,
-                            std::vector<std::string> irs_impus,
                             int cseq,
-                            std::vector<BindingNotifyInformation*> bnis,
+                            const RegInfoBody& body,
                             NotifyUtils::RegistrationState reg_state,
                             NotifyUtils::SubscriptionState subscription_state,
                             int expiry);
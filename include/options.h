@@ -40,9 +40,16 @@
 #ifndef OPTIONS_H__
 #define OPTIONS_H__
 
+#include "snmp_counter_by_scope_table.h"
+
 extern pjsip_module mod_options;
+extern pjsip_module mod_options_fast_path;
 
-pj_status_t init_options();
+/// Initializes OPTIONS handling.
+///
+/// @param fast_path_counter - Counts OPTIONS polls answered directly on the
+///                            transport thread (may be NULL).
+pj_status_t init_options(SNMP::CounterByScopeTable* fast_path_counter = NULL);
 
 void destroy_options();
 
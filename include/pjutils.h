@@ -53,6 +53,7 @@ extern "C" {
 #include <string>
 #include <map>
 #include <deque>
+#include <memory>
 #include "sas.h"
 #include "sipresolver.h"
 #include "enumservice.h"
@@ -190,6 +191,10 @@ void resolve_next_hop(pjsip_tx_data* tdata,
                       std::vector<AddrInfo>& servers,
                       SAS::TrailId trail);
 
+std::shared_ptr<SIPResolver::PendingResolution> resolve_next_hop_async(pjsip_tx_data* tdata,
+                                                                       int retries,
+                                                                       SAS::TrailId trail);
+
 void blacklist_server(AddrInfo& server);
 
 void set_dest_info(pjsip_tx_data* tdata, const AddrInfo& ai);
@@ -227,6 +232,8 @@ void clone_header(const pj_str_t* hdr_name, pjsip_msg* old_msg, pjsip_msg* new_m
 
 void add_top_via(pjsip_tx_data* tdata);
 
+void add_stateless_top_via(pjsip_tx_data* tdata, pjsip_rx_data* rdata);
+
 void remove_top_via(pjsip_tx_data* tdata);
 
 void add_reason(pjsip_tx_data* tdata, int reason_code);
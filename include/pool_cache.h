@@ -0,0 +1,165 @@
+/**
+ * @file pool_cache.h Per-thread cache of PJLIB memory pools.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef POOL_CACHE_H__
+#define POOL_CACHE_H__
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <atomic>
+#include <vector>
+#include <pthread.h>
+
+/// Pool factory that sits in front of a PJLIB caching pool and keeps a
+/// per-thread cache of released pools, so that the pools created and freed
+/// for every transaction, tdata and cloned message can be recycled without
+/// taking the caching pool's global lock.
+///
+/// Cached pools are grouped by increment size, which identifies the kind of
+/// object the pool is used for (tdata, transaction, group lock and so on).
+/// For each class the cache also learns how much of a pool is typically
+/// used, and creates new pools with a first block of that size so that most
+/// messages fit without allocating further blocks.
+class PoolCache
+{
+public:
+  PoolCache(pj_caching_pool* cp,
+            size_t max_pools_per_class = DEFAULT_MAX_POOLS_PER_CLASS);
+  ~PoolCache();
+
+  /// The factory to pass to PJLIB/PJSIP in place of the caching pool's.
+  pj_pool_factory* factory() { return &_factory.base; }
+
+  struct Stats
+  {
+    /// Pools handed out from a thread cache.
+    uint64_t hits;
+
+    /// Pools that had to be created by the caching pool.
+    uint64_t misses;
+
+    /// Released pools that were returned to the caching pool because the
+    /// thread cache was full.
+    uint64_t overflows;
+
+    /// Number of pools currently held across all thread caches.
+    size_t cached_pools;
+
+    /// Highest value cached_pools has reached.
+    size_t cached_pools_hwm;
+  };
+
+  void get_stats(Stats& stats) const;
+
+  /// Log the statistics.
+  void log_stats() const;
+
+  static const size_t DEFAULT_MAX_POOLS_PER_CLASS = 32;
+
+private:
+  /// Maximum number of distinct increment sizes cached per thread.  Pools of
+  /// any other size bypass the cache.
+  static const size_t MAX_SIZE_CLASSES = 8;
+
+  /// Bounds on the learned first block size.
+  static const pj_size_t MAX_LEARNED_SIZE = 32 * 1024;
+  static const pj_size_t LEARNED_SIZE_GRANULARITY = 512;
+
+  struct SizeClass
+  {
+    pj_size_t increment_size;
+
+    /// Moving average of the memory used by pools of this class when they
+    /// are released.
+    pj_size_t learned_size;
+
+    std::vector<pj_pool_t*> pools;
+  };
+
+  struct ThreadCache
+  {
+    std::vector<SizeClass> classes;
+  };
+
+  /// PJLIB factory structure, with a pointer back to this object.
+  struct Factory
+  {
+    pj_pool_factory base;
+    PoolCache* cache;
+  };
+
+  static pj_pool_t* create_pool(pj_pool_factory* factory,
+                                const char* name,
+                                pj_size_t initial_size,
+                                pj_size_t increment_size,
+                                pj_pool_callback* callback);
+  static void release_pool(pj_pool_factory* factory, pj_pool_t* pool);
+  static void dump_status(pj_pool_factory* factory, pj_bool_t detail);
+  static pj_bool_t on_block_alloc(pj_pool_factory* factory, pj_size_t size);
+  static void on_block_free(pj_pool_factory* factory, pj_size_t size);
+
+  pj_pool_t* create(const char* name,
+                    pj_size_t initial_size,
+                    pj_size_t increment_size,
+                    pj_pool_callback* callback);
+  void release(pj_pool_t* pool);
+
+  ThreadCache* thread_cache();
+  SizeClass* size_class(ThreadCache* cache, pj_size_t increment_size);
+  void release_to_caching_pool(pj_pool_t* pool);
+
+  Factory _factory;
+  pj_caching_pool* _cp;
+  size_t _max_pools_per_class;
+
+  /// Unique ID of this cache, used to tell whether the calling thread's
+  /// cache belongs to this instance.
+  uint64_t _id;
+
+  /// All the thread caches, so they can be emptied on destruction.
+  pthread_mutex_t _thread_caches_lock;
+  std::vector<ThreadCache*> _thread_caches;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+  std::atomic<uint64_t> _overflows;
+  std::atomic<size_t> _cached_pools;
+  std::atomic<size_t> _cached_pools_hwm;
+};
+
+#endif
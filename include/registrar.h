@@ -47,6 +47,7 @@ extern "C" {
 #include "chronosconnection.h"
 #include "acr.h"
 #include "snmp_success_fail_count_table.h"
+#include "snmp_counter_table.h"
 
 extern pjsip_module mod_registrar;
 
@@ -60,7 +61,10 @@ extern pj_status_t init_registrar(SubscriberDataManager* sdm,
                                   int cfg_max_expires,
                                   bool force_third_party_register_body,
                                   SNMP::RegistrationStatsTables* reg_stats_tbls,
-                                  SNMP::RegistrationStatsTables* third_party_reg_stats_tbls);
+                                  SNMP::RegistrationStatsTables* third_party_reg_stats_tbls,
+                                  int cfg_reg_refresh_window = 0,
+                                  int cfg_third_party_reg_refresh_window = 0,
+                                  SNMP::CounterTable* third_party_reg_suppressed_tbl = NULL);
 
 
 /// Calculate the expiry time for a binding.
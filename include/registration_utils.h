@@ -49,11 +49,14 @@ extern "C" {
 #include "ifchandler.h"
 #include "hssconnection.h"
 #include "snmp_success_fail_count_table.h"
+#include "snmp_counter_table.h"
 
 namespace RegistrationUtils {
 
 void init(SNMP::RegistrationStatsTables* third_party_reg_stats_tables_arg,
-          bool force_third_party_register_body_arg);
+          bool force_third_party_register_body_arg,
+          int third_party_reg_refresh_window_arg = 0,
+          SNMP::CounterTable* third_party_reg_suppressed_tbl_arg = NULL);
 
 bool remove_bindings(SubscriberDataManager* sdm,
                      std::vector<SubscriberDataManager*> remote_sdms,
@@ -71,7 +74,8 @@ void register_with_application_servers(Ifcs& ifcs,
                                        int expires,
                                        bool is_initial_registration,
                                        const std::string& served_user,
-                                       SAS::TrailId trail);
+                                       SAS::TrailId trail,
+                                       SubscriberDataManager::AoR* aor_data = NULL);
 
 void deregister_with_application_servers(Ifcs&,
                                          SubscriberDataManager* sdm,
@@ -41,9 +41,11 @@
 #include <vector>
 #include <map>
 #include <functional>
+#include <stdint.h>
 #include <boost/thread.hpp>
 #include "updater.h"
 #include "sas.h"
+#include "config_snapshot.h"
 
 class SCSCFSelector
 {
@@ -69,11 +71,44 @@ private:
     std::vector<int> capabilities;
   } scscf_t;
 
+  // Number of capability bitset words that get_scscf can hold on the stack.
+  // Configurations with more distinct capabilities than this fall back to a
+  // heap-allocated mask.
+  static const size_t MAX_INLINE_CAPABILITY_WORDS = 8;
+
+  // A snapshot of the S-CSCF configuration, built by update_scscf.
+  struct Config
+  {
+    Config() : capability_words(0) {}
+
+    std::vector<scscf> scscfs;
+
+    // Capability index. Each capability that any S-CSCF supports is assigned
+    // a bit, and each S-CSCF's capabilities are stored as a bitset of
+    // capability_words words at offset (S-CSCF index * capability_words) in
+    // capability_sets.
+    std::map<int, size_t> capability_bits;
+    size_t capability_words;
+    std::vector<uint64_t> capability_sets;
+  };
+
+  // Returns whether the S-CSCF at the given index has all the capabilities
+  // set in the mandatory mask.
+  static bool has_capabilities(const Config& config,
+                               size_t index,
+                               const uint64_t* mask);
+
+  // Returns the number of capabilities set in the optional mask that the
+  // S-CSCF at the given index has.
+  static int count_capabilities(const Config& config,
+                                size_t index,
+                                const uint64_t* mask);
+
   std::string _fallback_scscf_uri;
   std::string _configuration;
-  std::vector<scscf> _scscfs;
+  ConfigSnapshot<Config> _config;
+
   Updater<void, SCSCFSelector>* _updater;
-  boost::shared_mutex _scscfs_rw_lock;
 };
 
 #endif
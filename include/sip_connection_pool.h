@@ -47,6 +47,7 @@ extern "C" {
 #include <random>
 
 #include "snmp_ip_count_table.h"
+#include "snmp_scalar.h"
 
 class SIPConnectionPool
 {
@@ -57,11 +58,19 @@ public:
                  pj_pool_t* pool,
                  pjsip_endpoint* endpt,
                  pjsip_tpfactory* tp_factory,
-                 SNMP::IPCountTable* sprout_count_tbl);
+                 SNMP::IPCountTable* sprout_count_tbl,
+                 SNMP::U32Scalar* max_load_scalar = NULL);
   ~SIPConnectionPool();
 
   void init();
 
+  /// Selects a connection for a new request.  The connection is chosen by
+  /// picking two connected slots at random and using the one with less
+  /// outstanding work, which keeps the load across the upstream nodes even
+  /// when some connections are slower than others.
+  ///
+  /// @return  The selected transport, with a reference added that the
+  ///          caller must release, or NULL if there are no connections.
   pjsip_transport* get_connection();
 
   // Callback static function passed to PJSIP
@@ -81,6 +90,14 @@ private:
   void recycle_connections();
   void increment_connection_count(pjsip_transport *);
   void decrement_connection_count(pjsip_transport *);
+  int random_connected_slot();
+  void report_connection_load();
+
+  /// Returns the outstanding work on a connection.  Every message and
+  /// transaction using a transport holds a reference to it, so the
+  /// reference count (less the one held by the pool) measures the requests
+  /// in flight on the connection.
+  static int connection_load(pjsip_transport* tp);
 
   pjsip_host_port _target;
   int _num_connections;
@@ -113,12 +130,16 @@ private:
     int recycle_time;
   } tp_hash_slot;
 
-  pthread_mutex_t _tp_hash_lock;
+  // Protects the hash and the map.  Selecting a connection only needs to
+  // read the hash, so takes this lock shared; it is only held exclusively
+  // when connections are created, fail or are recycled.
+  pthread_rwlock_t _tp_hash_lock;
   std::vector<tp_hash_slot> _tp_hash;
   std::map<pjsip_transport*, int> _tp_map;
 
   // Statistics
   SNMP::IPCountTable* _sprout_count_tbl;
+  SNMP::U32Scalar* _max_load_scalar;
 };
 
 #endif // CONNECTION_POOL_H__
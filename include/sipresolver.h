@@ -37,14 +37,25 @@
 #ifndef SIPRESOLVER_H__
 #define SIPRESOLVER_H__
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "baseresolver.h"
+#include "expiring_cache.h"
 #include "sas.h"
 
 class SIPResolver : public BaseResolver
 {
 public:
   SIPResolver(DnsCachedResolver* dns_client,
-              int blacklist_duration = DEFAULT_BLACKLIST_DURATION);
+              int blacklist_duration = DEFAULT_BLACKLIST_DURATION,
+              int num_threads = DEFAULT_RESOLVER_THREADS);
   ~SIPResolver();
 
   void resolve(const std::string& name,
@@ -55,10 +66,150 @@ public:
                std::vector<AddrInfo>& targets,
                SAS::TrailId trail = 0);
 
+  /// A resolution started by resolve_async.
+  class PendingResolution
+  {
+  public:
+    PendingResolution(std::function<void(std::vector<AddrInfo>&)> resolve);
+
+    /// Returns the resolved targets.  If a resolver thread hasn't started the
+    /// resolution yet, it is done on the calling thread instead, so this only
+    /// waits for a resolution that is already in progress.
+    std::vector<AddrInfo> get();
+
+    /// Abandons the resolution if a resolver thread hasn't started it yet,
+    /// after which get returns no targets.  This never waits.
+    void cancel();
+
+    /// Runs the resolution, unless it has already been started or
+    /// cancelled.
+    void run();
+
+  private:
+    enum State {PENDING, RUNNING, DONE, CANCELLED};
+
+    std::mutex _lock;
+    std::condition_variable _cond;
+    State _state;
+    std::function<void(std::vector<AddrInfo>&)> _resolve;
+    std::vector<AddrInfo> _targets;
+  };
+
+  /// Starts resolving a name on one of the resolver threads, so that a caller
+  /// with several names to resolve can resolve them concurrently.
+  std::shared_ptr<PendingResolution> resolve_async(const std::string& name,
+                                                   int af,
+                                                   int port,
+                                                   int transport,
+                                                   int retries,
+                                                   SAS::TrailId trail = 0);
+
+  /// Waits until the resolver threads have finished all the work that is
+  /// due, including refreshes of targets that have expired.  For use in UTs.
+  void wait_for_idle();
+
   /// Default duration to blacklist hosts after we fail to connect to them.
   static const int DEFAULT_BLACKLIST_DURATION = 30;
 
+  /// Default number of threads used for asynchronous resolutions and
+  /// refreshes.
+  static const int DEFAULT_RESOLVER_THREADS = 4;
+
+  /// Maximum time (in seconds) after its DNS TTL has expired that a resolved
+  /// set of targets is served while it is refreshed in the background.
+  static const int MAX_STALE_TIME = 30;
+
+  /// Time (in seconds) before its DNS TTL expires within which looking up a
+  /// resolved set of targets schedules a refresh for when it expires, so
+  /// that names in regular use don't go stale.
+  static const int REFRESH_AHEAD_TIME = 5;
+
+  /// Maximum number of resolved sets of targets that are kept.
+  static const size_t MAX_CACHED_TARGETS = 1000;
+
   std::string get_transport_str(int transport);
+
+private:
+  /// A target a name can resolve to, with the priority and weight of the SRV
+  /// record it came from.  Targets from A/AAAA records all have the same
+  /// priority and weight.
+  struct WeightedTarget
+  {
+    AddrInfo ai;
+    int priority;
+    int weight;
+  };
+
+  void resolve_uncached(const std::string& name,
+                        int af,
+                        int port,
+                        int transport,
+                        int retries,
+                        std::vector<AddrInfo>& targets,
+                        int& ttl,
+                        SAS::TrailId trail,
+                        std::vector<WeightedTarget>* candidates = NULL);
+
+  void add_candidates(const std::string& name,
+                      int af,
+                      int port,
+                      int transport,
+                      int priority,
+                      int weight,
+                      std::vector<WeightedTarget>& candidates);
+
+  void select_targets(const std::vector<WeightedTarget>& candidates,
+                      int retries,
+                      std::vector<AddrInfo>& targets);
+
+  /// All the targets each name could have resolved to last time.  These are
+  /// only used once the DNS records have expired - while they are valid,
+  /// every resolution goes through the DNS cache.  Either way, SRV weighting
+  /// and blacklisting are applied afresh to each resolution.
+  struct CachedTargets
+  {
+    std::vector<WeightedTarget> targets;
+    time_t expires;
+    mutable std::atomic<bool> refreshing;
+  };
+
+  /// A set of targets to be refreshed.
+  struct RefreshRequest
+  {
+    std::string key;
+    std::string name;
+    int af;
+    int port;
+    int transport;
+    int retries;
+  };
+
+  void cache_targets(const std::string& key,
+                     const std::vector<AddrInfo>& targets,
+                     const std::vector<WeightedTarget>& candidates,
+                     int ttl);
+
+  void refresh_targets(std::shared_ptr<const CachedTargets> cached,
+                       const RefreshRequest& request,
+                       time_t due);
+
+  void queue_work(time_t due, std::function<void()> work);
+
+  void thread_fn();
+
+  ExpiringCache<CachedTargets> _cached_targets;
+
+  /// Work for the resolver threads, ordered by when it is due.  Refreshes
+  /// scheduled ahead of time aren't due until the targets have expired.
+  /// The threads are woken for them by later lookups.
+  std::mutex _work_lock;
+  std::condition_variable _work_cond;
+  std::condition_variable _idle_cond;
+  std::multimap<time_t, std::function<void()> > _work;
+  std::atomic<time_t> _next_due;
+  int _busy_threads;
+  bool _terminated;
+  std::vector<std::thread> _threads;
 };
 
 #endif
@@ -0,0 +1,272 @@
+/**
+ * @file small_containers.h Small flat containers with inline storage.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SMALL_CONTAINERS_H__
+#define SMALL_CONTAINERS_H__
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+/// Vector that stores up to N elements inline, only allocating from the heap
+/// if it grows beyond that.  Intended for the per-transaction bookkeeping in
+/// the proxy, which almost always holds a handful of entries and would
+/// otherwise pay for a heap allocation on every insert.
+///
+/// Elements must be cheap to default construct and copy (pointers, small
+/// structs, pairs of these) as the inline array is constructed up front and
+/// erasing shuffles later elements down.
+template <typename T, size_t N>
+class SmallVector
+{
+public:
+  typedef T* iterator;
+  typedef const T* const_iterator;
+
+  SmallVector() : _size(0), _on_heap(false) {}
+
+  SmallVector(const SmallVector& other) : _size(0), _on_heap(false)
+  {
+    *this = other;
+  }
+
+  SmallVector& operator=(const SmallVector& other)
+  {
+    if (this != &other)
+    {
+      clear();
+      for (const_iterator it = other.begin(); it != other.end(); ++it)
+      {
+        push_back(*it);
+      }
+    }
+    return *this;
+  }
+
+  iterator begin() { return data(); }
+  iterator end() { return data() + _size; }
+  const_iterator begin() const { return data(); }
+  const_iterator end() const { return data() + _size; }
+
+  size_t size() const { return _size; }
+  bool empty() const { return (_size == 0); }
+
+  T& operator[](size_t ii) { return data()[ii]; }
+  const T& operator[](size_t ii) const { return data()[ii]; }
+
+  T& front() { return data()[0]; }
+  const T& front() const { return data()[0]; }
+
+  void push_back(const T& value)
+  {
+    if (!_on_heap)
+    {
+      if (_size < N)
+      {
+        _inline[_size++] = value;
+        return;
+      }
+
+      // Out of inline space, so move everything to the heap.
+      _heap.reserve(2 * N);
+      _heap.assign(_inline, _inline + _size);
+      _on_heap = true;
+    }
+
+    _heap.push_back(value);
+    ++_size;
+  }
+
+  /// Erases the element at the given position, preserving the order of the
+  /// remaining elements.
+  ///
+  /// @returns an iterator to the element following the erased one.
+  iterator erase(iterator pos)
+  {
+    size_t index = pos - begin();
+    std::copy(pos + 1, end(), pos);
+    --_size;
+    if (_on_heap)
+    {
+      _heap.pop_back();
+    }
+    return begin() + index;
+  }
+
+  void pop_front()
+  {
+    erase(begin());
+  }
+
+  void clear()
+  {
+    _size = 0;
+    _heap.clear();
+    _on_heap = false;
+  }
+
+private:
+  T* data() { return _on_heap ? _heap.data() : _inline; }
+  const T* data() const { return _on_heap ? _heap.data() : _inline; }
+
+  size_t _size;
+  bool _on_heap;
+  T _inline[N];
+  std::vector<T> _heap;
+};
+
+
+/// Set backed by a SmallVector.  Lookups are linear searches, which beat a
+/// tree for the handful of entries these sets normally hold.  Iteration is
+/// in insertion order.
+template <typename T, size_t N>
+class SmallSet
+{
+public:
+  typedef typename SmallVector<T, N>::iterator iterator;
+  typedef typename SmallVector<T, N>::const_iterator const_iterator;
+
+  iterator begin() { return _elements.begin(); }
+  iterator end() { return _elements.end(); }
+  const_iterator begin() const { return _elements.begin(); }
+  const_iterator end() const { return _elements.end(); }
+
+  size_t size() const { return _elements.size(); }
+  bool empty() const { return _elements.empty(); }
+
+  iterator find(const T& value)
+  {
+    return std::find(_elements.begin(), _elements.end(), value);
+  }
+
+  /// @returns whether the value was inserted (false if it was already
+  /// present).
+  bool insert(const T& value)
+  {
+    if (find(value) != end())
+    {
+      return false;
+    }
+    _elements.push_back(value);
+    return true;
+  }
+
+  /// @returns the number of elements erased (0 or 1).
+  size_t erase(const T& value)
+  {
+    iterator it = find(value);
+    if (it == end())
+    {
+      return 0;
+    }
+    _elements.erase(it);
+    return 1;
+  }
+
+  void clear() { _elements.clear(); }
+
+private:
+  SmallVector<T, N> _elements;
+};
+
+
+/// Map backed by a SmallVector of key/value pairs.  Lookups are linear
+/// searches.  Iteration is in insertion order, not key order.
+template <typename K, typename V, size_t N>
+class SmallMap
+{
+public:
+  typedef std::pair<K, V> value_type;
+  typedef typename SmallVector<value_type, N>::iterator iterator;
+  typedef typename SmallVector<value_type, N>::const_iterator const_iterator;
+
+  iterator begin() { return _elements.begin(); }
+  iterator end() { return _elements.end(); }
+  const_iterator begin() const { return _elements.begin(); }
+  const_iterator end() const { return _elements.end(); }
+
+  size_t size() const { return _elements.size(); }
+  bool empty() const { return _elements.empty(); }
+
+  iterator find(const K& key)
+  {
+    for (iterator it = _elements.begin(); it != _elements.end(); ++it)
+    {
+      if (it->first == key)
+      {
+        return it;
+      }
+    }
+    return _elements.end();
+  }
+
+  /// Returns the value for the key, inserting a default constructed value
+  /// if the key is not present.
+  V& operator[](const K& key)
+  {
+    iterator it = find(key);
+    if (it == end())
+    {
+      _elements.push_back(value_type(key, V()));
+      it = end() - 1;
+    }
+    return it->second;
+  }
+
+  iterator erase(iterator pos)
+  {
+    return _elements.erase(pos);
+  }
+
+  /// @returns the number of elements erased (0 or 1).
+  size_t erase(const K& key)
+  {
+    iterator it = find(key);
+    if (it == end())
+    {
+      return 0;
+    }
+    _elements.erase(it);
+    return 1;
+  }
+
+  void clear() { _elements.clear(); }
+
+private:
+  SmallVector<value_type, N> _elements;
+};
+
+#endif
@@ -50,6 +50,7 @@ extern "C" {
 }
 
 #include <list>
+#include <functional>
 #include "sas.h"
 #include "snmp_success_fail_count_by_request_type_table.h"
 
@@ -252,6 +253,20 @@ public:
   ///
   virtual bool timer_running(TimerID id) = 0;
 
+  /// Suspends the transaction while some blocking work (such as a Homestead
+  /// or XDMS lookup) runs off the SIP worker threads.  The on_async_complete
+  /// callback will be called back on a worker thread with the context
+  /// parameter when the work has finished.  No other callbacks are made on
+  /// the transaction while the work is outstanding, so the work may use state
+  /// owned by the SproutletTsx, but must not call any of these methods.  If
+  /// no async lookup threads are configured, the work is done immediately and
+  /// on_async_complete is called before this method returns.
+  ///
+  /// @param  work         - The work to run.
+  /// @param  context      - Context parameter returned on the callback.
+  ///
+  virtual void run_async(std::function<void()> work, void* context) = 0;
+
   /// Returns the SAS trail identifier that should be used for any SAS events
   /// related to this service invocation.
   ///
@@ -343,6 +358,15 @@ public:
   ///                        was scheduled.
   virtual void on_timer_expiry(void* context) {}
 
+  /// Called when work started by the SproutletTsx with run_async has
+  /// finished.
+  ///
+  /// @param  context      - The context parameter specified when the work
+  ///                        was started.
+  /// @param  success      - false if the work failed with an exception, in
+  ///                        which case it may not have finished.
+  virtual void on_async_complete(void* context, bool success) {}
+
 protected:
 
   /// Returns a mutable clone of the original request.  This can be modified
@@ -530,6 +554,16 @@ protected:
   bool timer_running(TimerID id)
     {return _helper->timer_running(id);}
 
+  /// Suspends the transaction while some blocking work runs off the SIP
+  /// worker threads.  The on_async_complete callback will be called back with
+  /// the context parameter when the work has finished.
+  ///
+  /// @param  work         - The work to run.
+  /// @param  context      - Context parameter returned on the callback.
+  ///
+  void run_async(std::function<void()> work, void* context)
+    {_helper->run_async(work, context);}
+
   /// Returns the SAS trail identifier that should be used for any SAS events
   /// related to this service invocation.
   ///
@@ -51,6 +51,7 @@
 #include "sproutlet.h"
 #include "snmp_sip_request_types.h"
 #include "sproutlet_options.h"
+#include "small_containers.h"
 
 class SproutletWrapper;
 
@@ -118,6 +119,27 @@ protected:
   bool is_uri_local(const pjsip_uri* uri);
   bool is_host_local(const pj_str_t* host);
 
+  /// Report the SAS event for a Sproutlet being selected by service name or
+  /// alias.
+  void report_sproutlet_match(Sproutlet* sproutlet,
+                              const std::string& alias,
+                              bool is_alias,
+                              const std::string& uri_str,
+                              SAS::TrailId trail);
+
+  /// Entry in the index from service names and aliases to Sproutlets.
+  struct SproutletIndexEntry
+  {
+    Sproutlet* sproutlet;
+
+    /// Position of the Sproutlet in _sproutlets.  Where a URI yields several
+    /// candidate names, the earliest Sproutlet in the list wins.
+    size_t position;
+
+    /// Whether the name is an alias rather than the service name.
+    bool is_alias;
+  };
+
   /// Defintion of a timer set by an child sproutlet transaction.
   struct SproutletTimerCallbackData
   {
@@ -175,6 +197,9 @@ protected:
     bool cancel_timer(TimerID id);
     bool timer_running(TimerID id);
 
+    bool run_async(SproutletWrapper* tsx, std::function<void()> work, void* context);
+    void process_async_complete(SproutletWrapper* tsx, void* context, bool success);
+
     void tx_response(SproutletWrapper* sproutlet,
                      pjsip_tx_data* rsp);
 
@@ -197,6 +222,18 @@ protected:
     /// Checks to see if it is safe to destroy the UASTsx.
     void check_destroy();
 
+    /// Clones a request for passing between Sproutlets in this transaction.
+    /// The headers are copied, but the message body is shared with the
+    /// source request, which is kept alive until the UASTsx is destroyed.
+    /// Sproutlets never modify a body in place (they replace it), so the
+    /// body only needs to be copied when the request leaves the transaction.
+    pjsip_tx_data* clone_request(pjsip_tx_data* req);
+
+    /// Gives the request its own copy of its message body if the body is
+    /// shared with another request.  This must be called before a request
+    /// is passed outside the UASTsx.
+    void unshare_body(pjsip_tx_data* req);
+
     /// The root Sproutlet for this transaction.
     SproutletWrapper* _root;
 
@@ -205,8 +242,8 @@ protected:
     template<typename T>
     struct DMap
     {
-      typedef std::map<std::pair<SproutletWrapper*, int>, T> type;
-      typedef typename std::map<std::pair<SproutletWrapper*, int>, T>::iterator iterator;
+      typedef SmallMap<std::pair<SproutletWrapper*, int>, T, 8> type;
+      typedef typename SmallMap<std::pair<SproutletWrapper*, int>, T, 8>::iterator iterator;
     };
 
     /// Mapping from upstream Sproutlet/fork to downstream Sproutlet.
@@ -217,7 +254,7 @@ protected:
 
     /// Mapping from downstream Sproutlet or UAC transaction to upstream
     /// Sproutlet/fork.
-    typedef std::map<void*, std::pair<SproutletWrapper*, int> > UMap;
+    typedef SmallMap<void*, std::pair<SproutletWrapper*, int>, 8> UMap;
     UMap _umap;
 
     /// Queue of pending requests to be scheduled.
@@ -226,7 +263,7 @@ protected:
       pjsip_tx_data* req;
       std::pair<SproutletWrapper*, int> upstream;
     } PendingRequest;
-    std::queue<PendingRequest> _pending_req_q;
+    SmallVector<PendingRequest, 8> _pending_req_q;
 
     /// Parent proxy object
     SproutletProxy* _sproutlet_proxy;
@@ -236,12 +273,24 @@ protected:
     /// (they are not freed when a timer pops or is cancelled for example).
     /// This prevents race conditions (such as a double free caused by one
     /// thread popping a timer and another thread cancelling it).
-    std::set<pj_timer_entry*> _timers;
+    SmallSet<pj_timer_entry*, 8> _timers;
 
     /// This set holds all the timers created by sproutlet tsx that are
     /// children of this UASTsx that have not popped or been cancelled yet.
     /// The UASTsx will persist while there are pending timers.
-    std::set<pj_timer_entry*> _pending_timers;
+    SmallSet<pj_timer_entry*, 8> _pending_timers;
+
+    /// Number of run_async operations started by sproutlet tsxs that are
+    /// children of this UASTsx that have not completed yet.  The UASTsx will
+    /// persist while there are pending operations.
+    int _pending_async;
+
+    /// Requests whose message bodies are shared with clones.  A reference
+    /// is held on each until the UASTsx is destroyed.
+    SmallSet<pjsip_tx_data*, 8> _body_owners;
+
+    /// Clones whose message bodies point into another request.
+    SmallSet<pjsip_tx_data*, 8> _shared_bodies;
 
     friend class SproutletWrapper;
   };
@@ -253,6 +302,13 @@ protected:
 
   std::list<Sproutlet*> _sproutlets;
 
+  /// Index from service name or alias to the first Sproutlet that handles it,
+  /// built at construction so routing doesn't need to walk _sproutlets.
+  std::unordered_map<std::string, SproutletIndexEntry> _sproutlet_index;
+
+  /// Index from port to the first Sproutlet listening on it.
+  std::unordered_map<int, Sproutlet*> _port_index;
+
   std::string _scscf_name;
 
   static const pj_str_t STR_SERVICE;
@@ -301,6 +357,7 @@ public:
   bool schedule_timer(void* context, TimerID& id, int duration);
   void cancel_timer(TimerID id);
   bool timer_running(TimerID id);
+  void run_async(std::function<void()> work, void* context);
   SAS::TrailId trail() const;
   bool is_uri_reflexive(const pjsip_uri*) const;
   pjsip_sip_uri* get_reflexive_uri(pj_pool_t*) const;
@@ -312,6 +369,7 @@ private:
   void rx_error(int status_code);
   void rx_fork_error(pjsip_event_id_e event, int fork_id);
   void on_timer_pop(TimerID id, void* context);
+  void on_async_complete(void* context, bool success);
   void register_tdata(pjsip_tx_data* tdata);
   void deregister_tdata(pjsip_tx_data* tdata);
 
@@ -347,10 +405,10 @@ private:
   typedef std::unordered_map<const pjsip_msg*, pjsip_tx_data*> Packets;
   Packets _packets;
 
-  typedef std::map<int, pjsip_tx_data*> Requests;
+  typedef SmallMap<int, pjsip_tx_data*, 8> Requests;
   Requests _send_requests;
 
-  typedef std::list<pjsip_tx_data*> Responses;
+  typedef SmallVector<pjsip_tx_data*, 8> Responses;
   Responses _send_responses;
 
   int _pending_sends;
@@ -382,7 +440,15 @@ private:
   /// Set keeping track of pending timers for this SproutletWrapper.  The
   /// SproutletWrapper (and the SproutletTsx it wraps) won't be deleted
   /// until all these timers have popped or been cancelled.
-  std::set<TimerID> _pending_timers;
+  SmallSet<TimerID, 8> _pending_timers;
+
+  /// Number of run_async operations that haven't completed yet.  While there
+  /// are any, a CANCEL or error on the transaction is held in
+  /// _deferred_cancel/_deferred_error and passed to the Sproutlet once the
+  /// operations are complete, and the SproutletWrapper won't be deleted.
+  int _pending_async;
+  pjsip_tx_data* _deferred_cancel;
+  int _deferred_error;
 
   SAS::TrailId _trail_id;
 
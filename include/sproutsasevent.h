@@ -89,6 +89,7 @@ namespace SASEvent
   const int SIPRESOLVE_SRV_LOOKUP = SPROUT_BASE + 0x000037;
   const int SIPRESOLVE_A_LOOKUP = SPROUT_BASE + 0x000038;
   const int SIPRESOLVE_IP_ADDRESS = SPROUT_BASE + 0x000039;
+  const int SIPRESOLVE_STALE_TARGETS = SPROUT_BASE + 0x00003A;
 
   const int AUTHENTICATION_FAILED_OVERLOAD = SPROUT_BASE + 0x000041;
   const int AUTHENTICATION_FAILED = SPROUT_BASE + 0x000042;
@@ -157,6 +158,7 @@ namespace SASEvent
   const int HTTP_HOMESTEAD_GET_REG = SPROUT_BASE + 0x0000A3;
   const int HTTP_HOMESTEAD_AUTH_STATUS = SPROUT_BASE + 0x0000A4;
   const int HTTP_HOMESTEAD_LOCATION = SPROUT_BASE + 0x0000A5;
+  const int HTTP_HOMESTEAD_COALESCED = SPROUT_BASE + 0x0000A6;
 
   const int IFC_INVALID = SPROUT_BASE + 0x0000C0;
   const int IFC_INVALID_NOAS = SPROUT_BASE + 0x0000C1;
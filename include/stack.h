@@ -54,6 +54,7 @@ extern "C" {
 #include "quiescing_manager.h"
 #include "load_monitor.h"
 #include "sipresolver.h"
+#include "pool_cache.h"
 
 /* Pre-declariations */
 class LastValueCache;
@@ -64,6 +65,7 @@ struct stack_data_struct
   SIPResolver*         sipresolver;
 
   pj_caching_pool      cp;
+  PoolCache           *pool_cache;
   pj_pool_t           *pool;
   pjsip_endpoint      *endpt;
   pj_thread_t         *pjsip_transport_thread;
@@ -48,11 +48,13 @@ extern "C" {
 #include <map>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "store.h"
 #include "chronosconnection.h"
 #include "sas.h"
 #include "analyticslogger.h"
+#include "snmp_counter_table.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/document.h"
 
@@ -488,7 +490,7 @@ public:
     /// @param now          The current time
     /// @param trail        SAS trail
     void send_notifys(const std::string& aor_id,
-                      std::vector<std::string> irs_impus,
+                      const std::vector<std::string>& irs_impus,
                       AoRPair* aor_pair,
                       int now,
                       SAS::TrailId trail);
@@ -506,7 +508,7 @@ public:
     // @param trail        SAS trail
     void send_notifys_for_expired_subscriptions(
                                    const std::string& aor_id,
-                                   std::vector<std::string> irs_impus,
+                                   const std::vector<std::string>& irs_impus,
                                    SubscriberDataManager::AoRPair* aor_pair,
                                    int now,
                                    SAS::TrailId trail);
@@ -520,7 +522,7 @@ public:
     // @param trail        SAS trail
     void send_notifys_for_current_subscriptions(
                                       const std::string& aor_id,
-                                      std::vector<std::string> irs_impus,
+                                      const std::vector<std::string>& irs_impus,
                                       SubscriberDataManager::AoRPair* aor_pair,
                                       int now,
                                       SAS::TrailId trail);
@@ -570,6 +572,70 @@ public:
   /// Destructor.
   virtual ~SubscriberDataManager();
 
+  /// @class SubscriberDataManager::AoRLock
+  ///
+  /// Serializes read-modify-write cycles on an AoR within this process, so
+  /// that concurrent updates to the same AoR on this node queue behind each
+  /// other rather than contending on the CAS in the store.  The store's CAS
+  /// still protects against updates from other nodes, so callers keep their
+  /// DATA_CONTENTION retry loop.
+  ///
+  /// The locking contract is:
+  /// -  Take the lock on the SubscriberDataManager being written, before the
+  ///    first get_aor_data, and hold it until the final set_aor_data of the
+  ///    retry loop has returned.
+  /// -  Release it (with release() or by going out of scope) before any work
+  ///    that doesn't touch this AoR's store entry, such as third-party
+  ///    REGISTERs or HSS requests, so slow I/O doesn't stall other updates.
+  /// -  Hold at most one AoRLock at a time.  The locks are striped by AoR,
+  ///    so unrelated AoRs can share a lock, and taking a second one could
+  ///    deadlock.
+  class AoRLock
+  {
+  public:
+    AoRLock(SubscriberDataManager* sdm, const std::string& aor_id);
+    ~AoRLock();
+
+    /// Releases the lock before the AoRLock goes out of scope.
+    void release();
+
+  private:
+    pthread_mutex_t* _lock;
+  };
+
+  /// @class SubscriberDataManager::RegistrationListener
+  ///
+  /// Interface for components that cache data about registered subscribers,
+  /// and so need to know when an AoR is registered or deregistered.
+  class RegistrationListener
+  {
+  public:
+    virtual ~RegistrationListener() {}
+
+    /// Called after an update that gives an AoR its first binding, or that
+    /// removes its last binding, has been written to the store.
+    ///
+    /// @param aor_id       The AoR ID
+    /// @param irs_impus    The IMPUs in the Implicit Registration Set for the
+    ///                     AoR.  May be empty if they aren't known.
+    /// @param registered   Whether the AoR now has bindings.
+    virtual void registration_state_changed(const std::string& aor_id,
+                                            const std::vector<std::string>& irs_impus,
+                                            bool registered) = 0;
+  };
+
+  /// Adds or removes a listener for registration state changes.  These must
+  /// only be called while no updates are being made, such as at start of day
+  /// or shutdown.
+  void add_registration_listener(RegistrationListener* listener);
+  void remove_registration_listener(RegistrationListener* listener);
+
+  /// Sets the table used to count updates rejected with DATA_CONTENTION.
+  void set_contention_table(SNMP::CounterTable* contention_tbl)
+  {
+    _contention_tbl = contention_tbl;
+  }
+
   virtual bool has_servers() { return _connector->underlying_store_has_servers(); }
 
   /// Get the data for a particular address of record (registered SIP URI,
@@ -649,10 +715,17 @@ private:
   void log_new_or_extended_bindings(ClassifiedBindings& classified_bindings);
 
   static bool unused_bool;
+
+  /// Striped locks used by AoRLock.
+  static const int NUM_AOR_LOCKS = 256;
+  pthread_mutex_t _aor_locks[NUM_AOR_LOCKS];
+  SNMP::CounterTable* _contention_tbl;
+
   AnalyticsLogger* _analytics;
   Connector* _connector;
   ChronosTimerRequestSender* _chronos_timer_request_sender;
   NotifySender* _notify_sender;
+  std::vector<RegistrationListener*> _registration_listeners;
   bool _primary_sdm;
 };
 
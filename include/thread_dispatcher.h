@@ -47,6 +47,8 @@ extern "C" {
 #include <pjsip.h>
 }
 
+#include <functional>
+
 #include "load_monitor.h"
 #include "snmp_event_accumulator_table.h"
 #include "snmp_event_accumulator_by_scope_table.h"
@@ -56,11 +58,36 @@ pj_status_t init_thread_dispatcher(int num_worker_threads_arg,
                                    SNMP::EventAccumulatorByScopeTable* latency_tbl_arg,
                                    SNMP::EventAccumulatorByScopeTable* queue_size_tbl_arg,
                                    LoadMonitor* load_monitor_arg,
-                                   ExceptionHandler* exception_handler_arg);
+                                   ExceptionHandler* exception_handler_arg,
+                                   int num_async_threads_arg = 0);
 
 void unregister_thread_dispatcher(void);
 
+/// @return true if the worker threads have not serviced the message queue
+///         for long enough that they are presumed to be deadlocked.
+bool worker_threads_deadlocked();
+
 pj_status_t start_worker_threads();
 pj_status_t stop_worker_threads();
 
+/// Runs blocking work, catching any exception it throws.
+///
+/// @return false if the work threw an exception.
+bool run_async_work(const std::function<void()>& work);
+
+/// Queues blocking work to be run on an async lookup thread.  Once the work
+/// has finished, complete is queued to a worker thread, with whether the work
+/// succeeded.  The completion is always queued, even if the work fails.
+///
+/// @return false (without queuing the work) if there are no async lookup
+///         threads, in which case the caller must do the work itself.
+bool add_async_work_to_queue(std::function<void()> work,
+                             std::function<void(bool)> complete);
+
+/// Unit test support.  While async work is held, add_async_work_to_queue
+/// queues work even though there are no async lookup threads, and the work
+/// and its completion are only run when run_held_async_work is called.
+void hold_async_work(bool hold);
+void run_held_async_work();
+
 #endif
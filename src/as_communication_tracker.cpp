@@ -39,24 +39,39 @@
 AsCommunicationTracker::AsCommunicationTracker(Alarm* alarm,
                                                const PDLog2<const char*, const char*>* as_failed_log,
                                                const PDLog1<const char*>* as_ok_log) :
+  _num_failed_ases(0),
   _next_check_time_ms(current_time_ms() + NEXT_CHECK_INTERVAL_MS),
   _alarm(alarm),
   _as_failed_log(as_failed_log),
   _as_ok_log(as_ok_log)
 {
-  pthread_mutex_init(&_lock, NULL);
+  for (size_t ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_init(&_shards[ii].lock, NULL);
+  }
+
+  pthread_mutex_init(&_alarm_lock, NULL);
 }
 
 
 AsCommunicationTracker::~AsCommunicationTracker()
 {
-  pthread_mutex_destroy(&_lock);
+  for (size_t ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_destroy(&_shards[ii].lock);
+  }
+
+  pthread_mutex_destroy(&_alarm_lock);
 }
 
 
 void AsCommunicationTracker::on_success(const std::string& as_uri)
 {
   TRC_DEBUG("Communication with AS %s successful", as_uri.c_str());
+
+  // Successes don't need to touch the failure counts - if the AS had failed
+  // it is spotted as healthy by the next periodic check, which is usually
+  // just a comparison against the next check time.
   check_for_healthy_app_servers();
 }
 
@@ -66,21 +81,16 @@ void AsCommunicationTracker::on_failure(const std::string& as_uri,
 {
   TRC_DEBUG("Communication with AS %s failed", as_uri.c_str());
 
-  pthread_mutex_lock(&_lock);
+  Shard& shard = shard_for(as_uri);
+  bool first_failure = false;
 
-  // If we didn't know of any failed ASs, we do now so we should raise the
-  // alarm.
-  if (_as_failures.empty())
-  {
-    TRC_DEBUG("First failure - raise the alarm");
-    _alarm->set();
-  }
+  pthread_mutex_lock(&shard.lock);
 
   // Add an entry to the failed ASs map (incrementing the count of failures if
   // it has already failed).
-  std::map<std::string, int>::iterator as_iter = _as_failures.find(as_uri);
+  std::map<std::string, int>::iterator as_iter = shard.as_failures.find(as_uri);
 
-  if (as_iter != _as_failures.end())
+  if (as_iter != shard.as_failures.end())
   {
     as_iter->second++;
   }
@@ -90,9 +100,20 @@ void AsCommunicationTracker::on_failure(const std::string& as_uri,
     // fact.
     TRC_DEBUG("First failure for this AS - generate log");
     _as_failed_log->log(as_uri.c_str(), reason.c_str());
-    _as_failures[as_uri] = 1;
+    shard.as_failures[as_uri] = 1;
+    first_failure = (_num_failed_ases.fetch_add(1) == 0);
+  }
+  pthread_mutex_unlock(&shard.lock);
+
+  // If we didn't know of any failed ASs, we do now so we should raise the
+  // alarm.
+  if (first_failure)
+  {
+    TRC_DEBUG("First failure - raise the alarm");
+    pthread_mutex_lock(&_alarm_lock);
+    _alarm->set();
+    pthread_mutex_unlock(&_alarm_lock);
   }
-  pthread_mutex_unlock(&_lock);
 
   // Even though communication to this AS has failed, other ASs may have become
   // healthy recently so we still need to check them.
@@ -103,30 +124,33 @@ void AsCommunicationTracker::on_failure(const std::string& as_uri,
 void AsCommunicationTracker::check_for_healthy_app_servers()
 {
   uint64_t now = current_time_ms();
+  uint64_t next_check_time_ms = _next_check_time_ms.load();
   TRC_DEBUG("Current time is %ld, next AS check at %ld",
-            now, _next_check_time_ms.load());
+            now, next_check_time_ms);
 
-  if (now > _next_check_time_ms)
+  // Only one thread wins the race to move the next check time on, and that
+  // thread does the check.
+  if ((now > next_check_time_ms) &&
+      (_next_check_time_ms.compare_exchange_strong(next_check_time_ms,
+                                                   now + NEXT_CHECK_INTERVAL_MS)))
   {
-    pthread_mutex_lock(&_lock);
+    TRC_DEBUG("Check for ASs that have become healthy again");
 
-    if (now > _next_check_time_ms)
+    for (size_t ii = 0; ii < NUM_SHARDS; ++ii)
     {
-      TRC_DEBUG("Check for ASs that have become healthy again");
+      Shard& shard = _shards[ii];
+      pthread_mutex_lock(&shard.lock);
 
-      // Don't check again for a while.
-      _next_check_time_ms = current_time_ms() + NEXT_CHECK_INTERVAL_MS;
-
-      // Iterate through all the AS in our map. If any of them have not had
+      // Iterate through all the AS in this shard. If any of them have not had
       // any failures in the last time period we will log they are now working
       // correctly and remove them from the map.
       //
       // We mutate the map as we iterate over it. The non-standard loop
       // construct avoids iterator invalidation.
-      std::map<std::string, int>::iterator curr_as = _as_failures.begin();
+      std::map<std::string, int>::iterator curr_as = shard.as_failures.begin();
       std::map<std::string, int>::iterator next_as;
 
-      while (curr_as != _as_failures.end())
+      while (curr_as != shard.as_failures.end())
       {
         next_as = std::next(curr_as);
 
@@ -134,7 +158,8 @@ void AsCommunicationTracker::check_for_healthy_app_servers()
         {
           TRC_DEBUG("AS %s has become healthy", curr_as->first.c_str());
           _as_ok_log->log(curr_as->first.c_str());
-          _as_failures.erase(curr_as);
+          shard.as_failures.erase(curr_as);
+          _num_failed_ases--;
         }
         else
         {
@@ -144,19 +169,29 @@ void AsCommunicationTracker::check_for_healthy_app_servers()
         curr_as = next_as;
       }
 
-      if (_as_failures.empty())
-      {
-        TRC_DEBUG("All ASs OK - clear the alarm");
-        // No ASs are currently failed. Clear the alarm.
-        _alarm->clear();
-      }
+      pthread_mutex_unlock(&shard.lock);
     }
 
-    pthread_mutex_unlock(&_lock);
+    pthread_mutex_lock(&_alarm_lock);
+
+    if (_num_failed_ases.load() == 0)
+    {
+      TRC_DEBUG("All ASs OK - clear the alarm");
+      // No ASs are currently failed. Clear the alarm.
+      _alarm->clear();
+    }
+
+    pthread_mutex_unlock(&_alarm_lock);
   }
 }
 
 
+AsCommunicationTracker::Shard& AsCommunicationTracker::shard_for(const std::string& as_uri)
+{
+  return _shards[std::hash<std::string>()(as_uri) % NUM_SHARDS];
+}
+
+
 uint64_t AsCommunicationTracker::current_time_ms()
 {
   struct timespec ts;
@@ -34,6 +34,7 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <string.h>
 #include <boost/lexical_cast.hpp>
 
 #include "log.h"
@@ -244,13 +245,22 @@ void AsChainLink::on_response(int status_code)
 
 AsChainTable::AsChainTable()
 {
-  pthread_mutex_init(&_lock, NULL);
+  for (size_t ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_init(&_shards[ii].lock, NULL);
+    _shards[ii].slots.resize(INITIAL_SHARD_CAPACITY);
+    _shards[ii].count = 0;
+    _shards[ii].used = 0;
+  }
 }
 
 
 AsChainTable::~AsChainTable()
 {
-  pthread_mutex_destroy(&_lock);
+  for (size_t ii = 0; ii < NUM_SHARDS; ++ii)
+  {
+    pthread_mutex_destroy(&_shards[ii].lock);
+  }
 }
 
 
@@ -259,32 +269,60 @@ AsChainTable::~AsChainTable()
 void AsChainTable::register_(AsChain* as_chain, std::vector<std::string>& tokens)
 {
   size_t len = as_chain->size() + 1;
-  pthread_mutex_lock(&_lock);
+  tokens.reserve(len);
 
   for (size_t i = 0; i < len; i++)
   {
+    // Generate the token without holding any lock, then take only the lock
+    // for the shard it lands in.  In the (vanishingly unlikely) event that
+    // the token is already in use, generate another rather than overwriting
+    // the existing entry.
     std::string token;
-    Utils::create_random_token(TOKEN_LENGTH, token);
+    bool inserted = false;
+
+    while (!inserted)
+    {
+      Utils::create_random_token(TOKEN_LENGTH, token);
+      OdiKey key;
+      to_key(token, key);
+      uint64_t hash = hash_key(key);
+      Shard& shard = shard_for(hash);
+
+      pthread_mutex_lock(&shard.lock);
+      inserted = insert(shard, hash, key, AsChainLink(as_chain, i));
+      pthread_mutex_unlock(&shard.lock);
+    }
+
     tokens.push_back(token);
-    _odi_token_map[token] = AsChainLink(as_chain, i);
   }
-
-  pthread_mutex_unlock(&_lock);
 }
 
 
 void AsChainTable::unregister(std::vector<std::string>& tokens)
 {
-  pthread_mutex_lock(&_lock);
-
   for (std::vector<std::string>::iterator it = tokens.begin();
        it != tokens.end();
        ++it)
   {
-    _odi_token_map.erase(*it);
-  }
+    OdiKey key;
+    if (to_key(*it, key))
+    {
+      uint64_t hash = hash_key(key);
+      Shard& shard = shard_for(hash);
 
-  pthread_mutex_unlock(&_lock);
+      pthread_mutex_lock(&shard.lock);
+      Slot* slot = find_slot(shard, hash, key);
+      if (slot != NULL)
+      {
+        // Leave a tombstone so that probe sequences through this slot are
+        // preserved.
+        slot->state = SLOT_DELETED;
+        slot->link = AsChainLink(NULL, 0);
+        shard.count--;
+      }
+      pthread_mutex_unlock(&shard.lock);
+    }
+  }
 }
 
 
@@ -294,32 +332,180 @@ void AsChainTable::unregister(std::vector<std::string>& tokens)
 // is finished with the link.
 AsChainLink AsChainTable::lookup(const std::string& token)
 {
-  pthread_mutex_lock(&_lock);
-  std::map<std::string, AsChainLink>::const_iterator it =
-                                                    _odi_token_map.find(token);
-  if (it == _odi_token_map.end())
+  OdiKey key;
+  if (!to_key(token, key))
+  {
+    // Not the right length to be one of our tokens.
+    return AsChainLink(NULL, 0);
+  }
+
+  uint64_t hash = hash_key(key);
+  Shard& shard = shard_for(hash);
+
+  pthread_mutex_lock(&shard.lock);
+  Slot* slot = find_slot(shard, hash, key);
+  if (slot == NULL)
   {
-    pthread_mutex_unlock(&_lock);
+    pthread_mutex_unlock(&shard.lock);
     return AsChainLink(NULL, 0);
   }
   else
   {
-    // Found the AsChainLink.  Add a reference to the AsChain.
-    const AsChainLink& as_chain_link = it->second;
+    // Found the AsChainLink.  Add a reference to the AsChain.  This must be
+    // done under the shard lock, as the AsChain unregisters itself (under
+    // the same lock) before it is freed.
+    const AsChainLink& as_chain_link = slot->link;
     if (as_chain_link._as_chain->inc_ref())
     {
       // Flag that the AS corresponding to the previous link in the chain has
       // effectively responded.
       as_chain_link._as_chain->_responsive[as_chain_link._index - 1] = true;
-      pthread_mutex_unlock(&_lock);
-      return as_chain_link;
+      AsChainLink result = as_chain_link;
+      pthread_mutex_unlock(&shard.lock);
+      return result;
     } else {
       // Failed to increment the count - AS chain must be in the process of
       // being destroyed.  Pretend we didn't find it.
       // LCOV_EXCL_START - Can't hit this window condition in UT.
-      pthread_mutex_unlock(&_lock);
+      pthread_mutex_unlock(&shard.lock);
       return AsChainLink(NULL, 0);
       // LCOV_EXCL_STOP
     }
   }
 }
+
+
+/// Convert an ODI token to its fixed-width key.
+//
+// @returns false if the token is not the right length to be an ODI token.
+bool AsChainTable::to_key(const std::string& token, OdiKey& key)
+{
+  if (token.size() != (size_t)TOKEN_LENGTH)
+  {
+    return false;
+  }
+
+  memcpy(key.bytes, token.data(), TOKEN_LENGTH);
+  return true;
+}
+
+
+/// FNV-1a hash of a key.  The low bits select the shard and the remaining
+/// bits select the starting slot within the shard.
+uint64_t AsChainTable::hash_key(const OdiKey& key)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (int ii = 0; ii < TOKEN_LENGTH; ++ii)
+  {
+    hash ^= key.bytes[ii];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+
+/// Find the slot holding the given key, or NULL if it is not present.
+AsChainTable::Slot* AsChainTable::find_slot(Shard& shard,
+                                            uint64_t hash,
+                                            const OdiKey& key)
+{
+  size_t mask = shard.slots.size() - 1;
+  size_t ii = (hash / NUM_SHARDS) & mask;
+
+  // The table is never allowed to fill up, so there is always an empty slot
+  // to terminate the probe.
+  while (shard.slots[ii].state != SLOT_EMPTY)
+  {
+    Slot& slot = shard.slots[ii];
+    if ((slot.state == SLOT_FULL) &&
+        (slot.hash == hash) &&
+        (memcmp(slot.key.bytes, key.bytes, TOKEN_LENGTH) == 0))
+    {
+      return &slot;
+    }
+    ii = (ii + 1) & mask;
+  }
+
+  return NULL;
+}
+
+
+/// Insert a key into the shard.
+//
+// @returns false if the key is already present, in which case the shard is
+// left unchanged.
+bool AsChainTable::insert(Shard& shard,
+                          uint64_t hash,
+                          const OdiKey& key,
+                          const AsChainLink& link)
+{
+  if (find_slot(shard, hash, key) != NULL)
+  {
+    return false;
+  }
+
+  // Keep the load factor (including tombstones) at or below a half.  If the
+  // table is mostly tombstones, rebuild it at the same size to clear them
+  // out, otherwise double it.
+  if ((shard.used + 1) * 2 > shard.slots.size())
+  {
+    size_t capacity = shard.slots.size();
+    if ((shard.count + 1) * 4 > capacity)
+    {
+      capacity *= 2;
+    }
+    resize(shard, capacity);
+  }
+
+  size_t mask = shard.slots.size() - 1;
+  size_t ii = (hash / NUM_SHARDS) & mask;
+
+  while (shard.slots[ii].state == SLOT_FULL)
+  {
+    ii = (ii + 1) & mask;
+  }
+
+  Slot& slot = shard.slots[ii];
+  if (slot.state == SLOT_EMPTY)
+  {
+    shard.used++;
+  }
+  slot.state = SLOT_FULL;
+  slot.hash = hash;
+  slot.key = key;
+  slot.link = link;
+  shard.count++;
+
+  return true;
+}
+
+
+/// Rebuild the shard with the given number of slots, discarding tombstones.
+void AsChainTable::resize(Shard& shard, size_t capacity)
+{
+  std::vector<Slot> old_slots(capacity);
+  old_slots.swap(shard.slots);
+  shard.count = 0;
+  shard.used = 0;
+
+  size_t mask = capacity - 1;
+
+  for (std::vector<Slot>::const_iterator it = old_slots.begin();
+       it != old_slots.end();
+       ++it)
+  {
+    if (it->state == SLOT_FULL)
+    {
+      size_t ii = (it->hash / NUM_SHARDS) & mask;
+      while (shard.slots[ii].state != SLOT_EMPTY)
+      {
+        ii = (ii + 1) & mask;
+      }
+      shard.slots[ii] = *it;
+      shard.count++;
+      shard.used++;
+    }
+  }
+}
@@ -871,10 +871,17 @@ void BasicProxy::UASTsx::add_target(BasicProxy::Target* target)
 pj_status_t BasicProxy::UASTsx::forward_to_targets()
 {
   pj_status_t status = PJ_EUNKNOWN;
+  pj_status_t clone_status = PJ_SUCCESS;
 
   // Initialise the UAC data structures for each new target.
   _pending_sends = _targets.size();
 
+  // Build the requests for all the targets first, so that when the request
+  // is being forked the next hop resolutions can run in parallel rather than
+  // one after another as each UAC transaction is initialised.
+  bool parallel_resolve = (_targets.size() > 1);
+  std::vector<pjsip_tx_data*> uac_tdatas;
+
   while (!_targets.empty())
   {
     TRC_DEBUG("Allocating transaction and data for target");
@@ -883,9 +890,9 @@ pj_status_t BasicProxy::UASTsx::forward_to_targets()
     if (uac_tdata == NULL)
     {
       // LCOV_EXCL_START
-      status = PJ_ENOMEM;
+      clone_status = PJ_ENOMEM;
       TRC_ERROR("Failed to clone request for forked transaction, %s",
-                PJUtils::pj_status_to_string(status).c_str());
+                PJUtils::pj_status_to_string(clone_status).c_str());
       break;
       // LCOV_EXCL_STOP
     }
@@ -896,26 +903,87 @@ pj_status_t BasicProxy::UASTsx::forward_to_targets()
     set_req_target(uac_tdata, target);
     delete target;
 
+    if ((parallel_resolve) &&
+        (uac_tdata->tp_sel.type != PJSIP_TPSELECTOR_TRANSPORT))
+    {
+      _next_hop_resolutions[uac_tdata] =
+                        PJUtils::resolve_next_hop_async(uac_tdata, 0, trail());
+    }
+
+    uac_tdatas.push_back(uac_tdata);
+  }
+
+  for (std::vector<pjsip_tx_data*>::iterator it = uac_tdatas.begin();
+       it != uac_tdatas.end();
+       ++it)
+  {
+    if ((status != PJ_SUCCESS) && (status != PJ_EUNKNOWN))
+    {
+      // An earlier request failed, so don't send the rest.
+      // LCOV_EXCL_START
+      pjsip_tx_data_dec_ref(*it);
+      continue;
+      // LCOV_EXCL_STOP
+    }
+
     // Forward the request.
     size_t index;
     --_pending_sends;
     ++_pending_responses;
     TRC_DEBUG("Sending request, pending %d sends and %d responses",
               _pending_sends, _pending_responses);
-    status = forward_request(uac_tdata, index);
-    if (status != PJ_SUCCESS)
-    {
-      // @TODO - handle errors better!!
-      // LCOV_EXCL_START
-      break;
-      // LCOV_EXCL_STOP
-    }
+    status = forward_request(*it, index);
+  }
+
+  // Abandon any resolutions that weren't collected by a UAC transaction.
+  // This doesn't wait for any that are already running.
+  for (std::map<pjsip_tx_data*, std::shared_ptr<SIPResolver::PendingResolution> >::iterator i =
+                                                    _next_hop_resolutions.begin();
+       i != _next_hop_resolutions.end();
+       ++i)
+  {
+    i->second->cancel();
+  }
+  _next_hop_resolutions.clear();
+
+  if (clone_status != PJ_SUCCESS)
+  {
+    // LCOV_EXCL_START
+    status = clone_status;
+    // LCOV_EXCL_STOP
   }
 
   return status;
 }
 
 
+/// Collects the result of a next hop resolution started in parallel with the
+/// other forks of this request, if there is one.
+bool BasicProxy::UASTsx::take_prefetched_servers(pjsip_tx_data* tdata,
+                                                 std::vector<AddrInfo>& servers)
+{
+  std::map<pjsip_tx_data*, std::shared_ptr<SIPResolver::PendingResolution> >::iterator i =
+                                                   _next_hop_resolutions.find(tdata);
+
+  if (i == _next_hop_resolutions.end())
+  {
+    return false;
+  }
+
+  // If a resolver thread hasn't got to this resolution yet, it's done here
+  // instead, so this only waits for a resolution that is already running.
+  servers = i->second->get();
+  _next_hop_resolutions.erase(i);
+
+  TRC_INFO("Resolved destination URI %s to %d servers",
+           PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
+                                  PJUtils::next_hop(tdata->msg)).c_str(),
+           servers.size());
+
+  return true;
+}
+
+
 /// Set the target for this request.
 void BasicProxy::UASTsx::set_req_target(pjsip_tx_data* tdata,
                                         BasicProxy::Target* target)
@@ -1626,8 +1694,13 @@ pj_status_t BasicProxy::UACTsx::init(pjsip_tx_data* tdata)
   if (tdata->tp_sel.type != PJSIP_TPSELECTOR_TRANSPORT)
   {
     // Resolve the next hop destination for this request to a set of target
-    // servers (IP address/port/transport tuples).
-    PJUtils::resolve_next_hop(tdata, 0, _servers, trail());
+    // servers (IP address/port/transport tuples), unless the resolution was
+    // already started while the request was being forked.
+    if ((_uas_tsx == NULL) ||
+        (!_uas_tsx->take_prefetched_servers(tdata, _servers)))
+    {
+      PJUtils::resolve_next_hop(tdata, 0, _servers, trail());
+    }
   }
 
   // Work out whether this UAC transaction is to a stateless proxy.
@@ -49,6 +49,7 @@
 #include "sprout_pd_definitions.h"
 
 BgcfService::BgcfService(std::string configuration) :
+  _routes(std::make_shared<const Routes>()),
   _configuration(configuration),
   _updater(NULL)
 {
@@ -102,8 +103,7 @@ void BgcfService::update_routes()
 
   try
   {
-    std::map<std::string, std::vector<std::string>> new_domain_routes;
-    std::map<std::string, std::vector<std::string>> new_number_routes;
+    std::shared_ptr<Routes> new_routes = std::make_shared<Routes>();
 
     JSON_ASSERT_CONTAINS(doc, "routes");
     JSON_ASSERT_ARRAY(doc["routes"]);
@@ -141,12 +141,12 @@ void BgcfService::update_routes()
         if ((*routes_it).HasMember("domain"))
         {
           routing_value = (*routes_it)["domain"].GetString();
-          new_domain_routes.insert(std::make_pair(routing_value, route_vec));
+          new_routes->domain_routes.insert(std::make_pair(routing_value, route_vec));
         }
         else
         {
           routing_value = (*routes_it)["number"].GetString();
-          new_number_routes.insert(
+          new_routes->number_routes.insert(
                     std::make_pair(PJUtils::remove_visual_separators(routing_value),
                                    route_vec));
         }
@@ -162,10 +162,9 @@ void BgcfService::update_routes()
       }
     }
 
-    // Take a write lock on the mutex in RAII style
-    boost::lock_guard<boost::shared_mutex> write_lock(_routes_rw_lock);
-    _domain_routes = new_domain_routes;
-    _number_routes = new_number_routes;
+    // Swap in the new routes.  Lookups in progress carry on with the old
+    // ones.
+    _routes.set(new_routes);
   }
   catch (JsonFormatError err)
   {
@@ -187,13 +186,12 @@ std::vector<std::string> BgcfService::get_route_from_domain(
 {
   TRC_DEBUG("Getting route for URI domain %s via BGCF lookup", domain.c_str());
 
-  // Take a read lock on the mutex in RAII style
-  boost::shared_lock<boost::shared_mutex> read_lock(_routes_rw_lock);
+  ConfigSnapshot<Routes>::Reader routes(_routes);
 
   // First try the specified domain.
   std::map<std::string, std::vector<std::string>>::const_iterator i =
-                                                    _domain_routes.find(domain);
-  if (i != _domain_routes.end())
+                                              routes->domain_routes.find(domain);
+  if (i != routes->domain_routes.end())
   {
     TRC_INFO("Found route to domain %s", domain.c_str());
 
@@ -213,8 +211,8 @@ std::vector<std::string> BgcfService::get_route_from_domain(
   }
 
   // Then try the default domain (*).
-  i = _domain_routes.find("*");
-  if (i != _domain_routes.end())
+  i = routes->domain_routes.find("*");
+  if (i != routes->domain_routes.end())
   {
     TRC_INFO("Found default route");
 
@@ -244,14 +242,13 @@ std::vector<std::string> BgcfService::get_route_from_number(
                                                 const std::string &number,
                                                 SAS::TrailId trail) const
 {
-  // Take a read lock on the mutex in RAII style
-  boost::shared_lock<boost::shared_mutex> read_lock(_routes_rw_lock);
+  ConfigSnapshot<Routes>::Reader routes(_routes);
 
   // The number routes map is ordered by length of key. Start from the end of
   // the map to get the longest prefixes first.
   for (std::map<std::string, std::vector<std::string>>::const_reverse_iterator it =
-        _number_routes.rbegin();
-       it != _number_routes.rend();
+        routes->number_routes.rbegin();
+       it != routes->number_routes.rend();
        it++)
   {
     int len = std::min(number.size(), (*it).first.size());
@@ -151,6 +151,7 @@ static pjsip_uri* upstream_proxy;
 static SIPConnectionPool* upstream_conn_pool = NULL;
 
 static SNMP::IPCountTable* sprout_ip_tbl = NULL;
+static SNMP::U32Scalar* upstream_load = NULL;
 static SNMP::U32Scalar* flow_count = NULL;
 
 static FlowTable* flow_table;
@@ -163,6 +164,10 @@ static bool icscf = false;
 static bool scscf = false;
 static bool allow_emergency_reg = false;
 
+// Whether in-dialog non-INVITE requests on established flows are relayed
+// without creating a transaction.
+static bool stateless_in_dialog_relay = false;
+
 PJUtils::host_list_t trusted_hosts(&PJUtils::compare_pj_sockaddr);
 PJUtils::host_list_t pbx_hosts(&PJUtils::compare_pj_sockaddr);
 std::string pbx_service_route;
@@ -241,6 +246,14 @@ static pj_status_t add_path(pjsip_tx_data* tdata,
                             const Flow* flow_data,
                             const pjsip_rx_data* rdata);
 static ACR::NodeRole acr_node_role(pjsip_msg *req);
+static bool is_stateless_relay_method(const pjsip_method* method);
+static bool can_relay_statelessly(pjsip_rx_data* rdata, Target* target);
+static void forward_request_statelessly(pjsip_rx_data* rdata,
+                                        pjsip_tx_data* tdata,
+                                        TrustBoundary* trust,
+                                        Target* target,
+                                        ACR* acr,
+                                        ACR* downstream_acr);
 
 
 // Utility class that automatically flushes a trail ID when it goes out of
@@ -312,8 +325,11 @@ static pj_bool_t proxy_on_rx_response(pjsip_rx_data *rdata)
   SAS::Event event(get_trail(rdata), SASEvent::BEGIN_STATEFUL_PROXY_RSP, 0);
   SAS::report_event(event);
 
-  // Only forward responses to INVITES
-  if (rdata->msg_info.cseq->method.id == PJSIP_INVITE_METHOD)
+  // Only forward responses to INVITES, and to any requests we relay
+  // statelessly.
+  if ((rdata->msg_info.cseq->method.id == PJSIP_INVITE_METHOD) ||
+      ((stateless_in_dialog_relay) &&
+       (is_stateless_relay_method(&rdata->msg_info.cseq->method))))
   {
     // Create response to be forwarded upstream (Via will be stripped here)
     status = PJUtils::create_response_fwd(stack_data.endpt, rdata, 0, &tdata);
@@ -490,94 +506,18 @@ void process_tsx_request(pjsip_rx_data* rdata)
   // is sent for 2xx response. An ACK that is sent for non-2xx
   // final response will be absorbed by transaction layer, and
   // it will not be received by on_rx_request() callback.
-  if (tdata->msg->line.req.method.id == PJSIP_ACK_METHOD)
-  {
-    // Report a SIP call ID marker on the trail to make sure it gets
-    // associated with the INVITE transaction at SAS.  There's no need to
-    // report the branch IDs as they won't be used for correlation.
-    TRC_DEBUG("Statelessly forwarding ACK");
-
-    trust->process_request(tdata);
-
-    // About to send the request to notify the ACR. Also, if we have a
-    // downstream ACR, simulate it being received and sent by that ACR.
-    acr->tx_request(tdata->msg);
-
-    if (downstream_acr != NULL)
-    {
-      downstream_acr->rx_request(tdata->msg);
-      downstream_acr->tx_request(tdata->msg);
-    }
-
-    if (target != NULL)
-    {
-      // Target has already been selected for the request, so set it up on the
-      // request.
-      tdata->msg->line.req.uri = target->uri;
-
-      // If the target is routing to the upstream device (we're acting as an access
-      // proxy), strip any extra loose routes on the message to prevent accidental
-      // double routing.
-      if (target->upstream_route)
-      {
-        TRC_DEBUG("Stripping loose routes from proxied message");
-
-        // Tight loop to strip all route headers.
-        while (pjsip_msg_find_remove_hdr(tdata->msg,
-                                         PJSIP_H_ROUTE,
-                                         NULL) != NULL)
-        {
-          // Tight loop.
-        };
-      }
-
-      if (target->transport != NULL)
-      {
-        // The target includes a selected transport, so set it here.
-        pjsip_tpselector tp_selector;
-        tp_selector.type = PJSIP_TPSELECTOR_TRANSPORT;
-        tp_selector.u.transport = target->transport;
-        pjsip_tx_data_set_transport(tdata, &tp_selector);
-
-        tdata->dest_info.addr.count = 1;
-        tdata->dest_info.addr.entry[0].type =
-                           (pjsip_transport_type_e)target->transport->key.type;
-        pj_memcpy(&tdata->dest_info.addr.entry[0].addr,
-                  &target->remote_addr,
-                  sizeof(pj_sockaddr));
-        tdata->dest_info.addr.entry[0].addr_len =
-             (tdata->dest_info.addr.entry[0].addr.addr.sa_family == pj_AF_INET()) ?
-             sizeof(pj_sockaddr_in) : sizeof(pj_sockaddr_in6);
-        tdata->dest_info.cur_addr = 0;
-
-        // Remove the reference to the transport added when it was chosen.
-        pjsip_transport_dec_ref(target->transport);
-      }
-    }
-
-    // Add a via header for ACKs (this is handled in init_uac_transactions
-    // for other methods)
-    PJUtils::add_top_via(tdata);
-
-    status = PJUtils::send_request_stateless(tdata);
-
-    if (status != PJ_SUCCESS)
-    {
-      TRC_ERROR("Error forwarding request, %s",
-                PJUtils::pj_status_to_string(status).c_str());
-    }
-
-    // Send Rf messages and clean up the ACRs.
-    acr->send();
-    delete acr; acr = NULL;
-
-    if (downstream_acr)
-    {
-      downstream_acr->send();
-      delete downstream_acr; downstream_acr = NULL;
-    }
-
-    delete target; target = NULL;
+  //
+  // If stateless relay is enabled, in-dialog requests on established flows
+  // are also forwarded without creating a transaction.
+  if ((tdata->msg->line.req.method.id == PJSIP_ACK_METHOD) ||
+      (can_relay_statelessly(rdata, target)))
+  {
+    forward_request_statelessly(rdata,
+                                tdata,
+                                trust,
+                                target,
+                                acr,
+                                downstream_acr);
     return;
   }
 
@@ -1608,6 +1548,138 @@ static pj_status_t proxy_process_routing(pjsip_tx_data *tdata)
   return PJ_SUCCESS;
 }
 
+/// Determines whether requests with the given method are eligible for
+/// stateless relay.  This is also used to decide which stray responses to
+/// forward upstream.  UPDATEs are excluded because they can refresh the
+/// session timer, which is handled by the UAS transaction.
+static bool is_stateless_relay_method(const pjsip_method* method)
+{
+  return ((method->id != PJSIP_INVITE_METHOD) &&
+          (method->id != PJSIP_ACK_METHOD) &&
+          (method->id != PJSIP_CANCEL_METHOD) &&
+          (method->id != PJSIP_REGISTER_METHOD) &&
+          (pjsip_method_cmp(method, &METHOD_UPDATE) != 0));
+}
+
+
+/// Determines whether a request can be relayed without creating a
+/// transaction.  This is only done (if enabled) for in-dialog non-INVITE
+/// requests where a flow to the target has already been selected, so there
+/// is no routing decision that depends on transaction state.
+static bool can_relay_statelessly(pjsip_rx_data* rdata, Target* target)
+{
+  return ((stateless_in_dialog_relay) &&
+          (is_stateless_relay_method(&rdata->msg_info.msg->line.req.method)) &&
+          (rdata->msg_info.to->tag.slen != 0) &&
+          (target != NULL) &&
+          (target->transport != NULL));
+}
+
+
+/// Forwards a request without creating a transaction, applying trust
+/// boundary processing and the selected target.  Takes ownership of the
+/// request, the target and the ACRs.
+static void forward_request_statelessly(pjsip_rx_data* rdata,
+                                        pjsip_tx_data* tdata,
+                                        TrustBoundary* trust,
+                                        Target* target,
+                                        ACR* acr,
+                                        ACR* downstream_acr)
+{
+  pj_status_t status;
+
+  // Report a SIP call ID marker on the trail to make sure it gets
+  // associated with the INVITE transaction at SAS.  There's no need to
+  // report the branch IDs as they won't be used for correlation.
+  TRC_DEBUG("Statelessly forwarding %.*s",
+            (int)tdata->msg->line.req.method.name.slen,
+            tdata->msg->line.req.method.name.ptr);
+
+  trust->process_request(tdata);
+
+  // About to send the request to notify the ACR. Also, if we have a
+  // downstream ACR, simulate it being received and sent by that ACR.
+  acr->tx_request(tdata->msg);
+
+  if (downstream_acr != NULL)
+  {
+    downstream_acr->rx_request(tdata->msg);
+    downstream_acr->tx_request(tdata->msg);
+  }
+
+  if (target != NULL)
+  {
+    // Target has already been selected for the request, so set it up on the
+    // request.
+    tdata->msg->line.req.uri = target->uri;
+
+    // If the target is routing to the upstream device (we're acting as an access
+    // proxy), strip any extra loose routes on the message to prevent accidental
+    // double routing.
+    if (target->upstream_route)
+    {
+      TRC_DEBUG("Stripping loose routes from proxied message");
+
+      // Tight loop to strip all route headers.
+      while (pjsip_msg_find_remove_hdr(tdata->msg,
+                                       PJSIP_H_ROUTE,
+                                       NULL) != NULL)
+      {
+        // Tight loop.
+      };
+    }
+
+    if (target->transport != NULL)
+    {
+      // The target includes a selected transport, so set it here.
+      pjsip_tpselector tp_selector;
+      tp_selector.type = PJSIP_TPSELECTOR_TRANSPORT;
+      tp_selector.u.transport = target->transport;
+      pjsip_tx_data_set_transport(tdata, &tp_selector);
+
+      tdata->dest_info.addr.count = 1;
+      tdata->dest_info.addr.entry[0].type =
+                         (pjsip_transport_type_e)target->transport->key.type;
+      pj_memcpy(&tdata->dest_info.addr.entry[0].addr,
+                &target->remote_addr,
+                sizeof(pj_sockaddr));
+      tdata->dest_info.addr.entry[0].addr_len =
+           (tdata->dest_info.addr.entry[0].addr.addr.sa_family == pj_AF_INET()) ?
+           sizeof(pj_sockaddr_in) : sizeof(pj_sockaddr_in6);
+      tdata->dest_info.cur_addr = 0;
+
+      // Remove the reference to the transport added when it was chosen.
+      pjsip_transport_dec_ref(target->transport);
+    }
+  }
+
+  // Add a via header (this is handled in init_uac_transactions for requests
+  // forwarded statefully).  The branch is derived from the received request
+  // so that retransmissions are forwarded with the same branch.
+  PJUtils::add_stateless_top_via(tdata, rdata);
+
+  status = PJUtils::send_request_stateless(tdata);
+
+  if (status != PJ_SUCCESS)
+  {
+    TRC_ERROR("Error forwarding request, %s",
+              PJUtils::pj_status_to_string(status).c_str());
+  }
+
+  // Send Rf messages and clean up the ACRs.
+  acr->send();
+  delete acr; acr = NULL;
+
+  if (downstream_acr)
+  {
+    downstream_acr->send();
+    delete downstream_acr; downstream_acr = NULL;
+  }
+
+  delete target; target = NULL;
+}
+
+
 /// For a given message, calculate the role the message is requesting the
 /// node carry out.
 static ACR::NodeRole acr_node_role(pjsip_msg *req)
@@ -3246,7 +3318,8 @@ pj_status_t init_stateful_proxy(SubscriberDataManager* reg_sdm,
                                 QuiescingManager* quiescing_manager,
                                 bool icscf_enabled,
                                 bool scscf_enabled,
-                                bool emerg_reg_accepted)
+                                bool emerg_reg_accepted,
+                                bool stateless_in_dialog_relay_enabled)
 {
   pj_status_t status;
 
@@ -3259,6 +3332,7 @@ pj_status_t init_stateful_proxy(SubscriberDataManager* reg_sdm,
   icscf = icscf_enabled;
   scscf = scscf_enabled;
   allow_emergency_reg = emerg_reg_accepted;
+  stateless_in_dialog_relay = stateless_in_dialog_relay_enabled;
 
   cscf_acr_factory = cscf_rfacr_factory;
   bgcf_acr_factory = bgcf_rfacr_factory;
@@ -3292,13 +3366,16 @@ pj_status_t init_stateful_proxy(SubscriberDataManager* reg_sdm,
     pool_target.port = upstream_proxy_port;
     sprout_ip_tbl = SNMP::IPCountTable::create("bono_connected_sprouts",
                                                ".1.2.826.0.1.1578918.9.2.3.1");
+    upstream_load = new SNMP::U32Scalar("bono_upstream_max_connection_load",
+                                        ".1.2.826.0.1.1578918.9.2.7");
     upstream_conn_pool = new SIPConnectionPool(&pool_target,
         upstream_proxy_connections,
         upstream_proxy_recycle,
         stack_data.pool,
         stack_data.endpt,
         stack_data.pcscf_trusted_tcp_factory,
-        sprout_ip_tbl);
+        sprout_ip_tbl,
+        upstream_load);
     upstream_conn_pool->init();
   }
 
@@ -3390,6 +3467,7 @@ void destroy_stateful_proxy()
   // connections.
   delete upstream_conn_pool; upstream_conn_pool = NULL;
   delete sprout_ip_tbl; sprout_ip_tbl = NULL;
+  delete upstream_load; upstream_load = NULL;
 
   // Destroy the flow table.
   delete flow_count;
@@ -3406,6 +3484,7 @@ void destroy_stateful_proxy()
   icscf = false;
   scscf = false;
   allow_emergency_reg = false;
+  stateless_in_dialog_relay = false;
 
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_stateful_proxy);
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_tu);
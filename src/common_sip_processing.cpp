@@ -77,8 +77,6 @@ static HealthChecker* health_checker = NULL;
 static pj_bool_t process_on_rx_msg(pjsip_rx_data* rdata);
 static pj_status_t process_on_tx_msg(pjsip_tx_data* tdata);
 
-static SAS::TrailId DONT_LOG_TO_SAS = 0xFFFFFFFF;
-
 // Module handling common processing for all SIP messages - logging,
 // overload control, and rejection of bad requests.
 
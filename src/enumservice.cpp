@@ -83,7 +83,232 @@ std::string DummyEnumService::lookup_uri_from_user(const std::string &user, SAS:
   return new_uri;
 }
 
-bool EnumService::parse_regex_replace(const std::string& regex_replace, boost::regex& regex, std::string& replace)
+EnumService::Rewrite::Rewrite() :
+  _simple(false),
+  _capture_start(0)
+{
+}
+
+void EnumService::Rewrite::assign(const std::string& regex,
+                                  const std::string& replace)
+{
+  _regex.assign(regex, boost::regex::extended);
+  _replace = replace;
+  _simple = classify();
+
+  TRC_DEBUG("Regex %s is %s", regex.c_str(), _simple ? "simple" : "not simple");
+}
+
+bool EnumService::Rewrite::classify()
+{
+  // The regular expression must be a ^, then literal characters, then a
+  // single .* which is only followed by an optional $.  There must be
+  // exactly one capture group, and it must contain the .*.
+  static const char* const PLAIN_LITERALS = "-_@:;,=#%~&'\"<>/";
+  static const char* const ESCAPED_LITERALS = ".[]{}()\\*+?|^$";
+
+  const std::string regex = _regex.str();
+  std::string prefix;
+  size_t capture_start = std::string::npos;
+  bool anchored = false;
+  bool wildcard = false;
+  bool closed = false;
+  bool ended = false;
+
+  for (size_t ii = 0; ii < regex.size(); ++ii)
+  {
+    char c = regex[ii];
+
+    if (c == '(')
+    {
+      if (capture_start != std::string::npos)
+      {
+        return false;
+      }
+
+      capture_start = prefix.size();
+    }
+    else if (c == ')')
+    {
+      if ((capture_start == std::string::npos) || (closed) || (!wildcard))
+      {
+        return false;
+      }
+
+      closed = true;
+    }
+    else if (c == '^')
+    {
+      if ((ii != 0) && ((ii != 1) || (regex[0] != '(')))
+      {
+        return false;
+      }
+
+      anchored = true;
+    }
+    else if (c == '$')
+    {
+      if ((!wildcard) || (ended))
+      {
+        return false;
+      }
+
+      ended = true;
+    }
+    else if ((c == '.') &&
+             (ii + 1 < regex.size()) &&
+             (regex[ii + 1] == '*'))
+    {
+      if ((wildcard) || (capture_start == std::string::npos) || (closed))
+      {
+        return false;
+      }
+
+      wildcard = true;
+      ++ii;
+    }
+    else if (wildcard)
+    {
+      // Nothing but ) and $ may follow the .*.
+      return false;
+    }
+    else if (c == '\\')
+    {
+      if ((ii + 1 >= regex.size()) ||
+          (regex[ii + 1] == '\0') ||
+          (strchr(ESCAPED_LITERALS, regex[ii + 1]) == NULL))
+      {
+        return false;
+      }
+
+      prefix += regex[++ii];
+    }
+    else if (((c >= '0') && (c <= '9')) ||
+             ((c >= 'a') && (c <= 'z')) ||
+             ((c >= 'A') && (c <= 'Z')) ||
+             ((c != '\0') && (strchr(PLAIN_LITERALS, c) != NULL)))
+    {
+      prefix += c;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  if ((!anchored) || (!wildcard) || (!closed))
+  {
+    return false;
+  }
+
+  // The replacement must be literal characters and \1 back-references.
+  // Other escapes and $ placeholders are left to Boost, as are (, ) and ?,
+  // which are special in some format modes.
+  std::vector<std::string> segments(1);
+
+  for (size_t ii = 0; ii < _replace.size(); ++ii)
+  {
+    char c = _replace[ii];
+
+    if (c == '\\')
+    {
+      if ((ii + 1 >= _replace.size()) ||
+          (_replace[ii + 1] != '1') ||
+          ((ii + 2 < _replace.size()) &&
+           (_replace[ii + 2] >= '0') &&
+           (_replace[ii + 2] <= '9')))
+      {
+        return false;
+      }
+
+      segments.push_back(std::string());
+      ++ii;
+    }
+    else if ((c == '$') || (c == '(') || (c == ')') || (c == '?'))
+    {
+      return false;
+    }
+    else
+    {
+      segments.back() += c;
+    }
+  }
+
+  _prefix = prefix;
+  _capture_start = capture_start;
+  _template = segments;
+
+  return true;
+}
+
+bool EnumService::Rewrite::simple_applies(const std::string& string)
+{
+  // Line breaks and other control characters change how ^, $ and . match,
+  // so only use the substitution for printable ASCII strings.  Application
+  // Unique Strings are always digits and +.
+  for (std::string::const_iterator c = string.begin(); c != string.end(); ++c)
+  {
+    if ((*c < 0x20) || (*c > 0x7e))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool EnumService::Rewrite::matches(const std::string& string) const
+{
+  if ((_simple) && (simple_applies(string)))
+  {
+    return (string.compare(0, _prefix.size(), _prefix) == 0);
+  }
+
+  return boost::regex_search(string, _regex);
+}
+
+std::string EnumService::Rewrite::replace(const std::string& string) const
+{
+  if ((_simple) && (simple_applies(string)))
+  {
+    if (string.compare(0, _prefix.size(), _prefix) != 0)
+    {
+      // boost::regex_replace leaves strings that don't match unchanged.
+      return string;
+    }
+
+    size_t capture_len = string.size() - _capture_start;
+    size_t len = 0;
+
+    for (std::vector<std::string>::const_iterator segment = _template.begin();
+         segment != _template.end();
+         ++segment)
+    {
+      len += segment->size() + capture_len;
+    }
+
+    std::string result;
+    result.reserve(len);
+
+    for (std::vector<std::string>::const_iterator segment = _template.begin();
+         segment != _template.end();
+         ++segment)
+    {
+      if (segment != _template.begin())
+      {
+        result.append(string, _capture_start, std::string::npos);
+      }
+
+      result.append(*segment);
+    }
+
+    return result;
+  }
+
+  return boost::regex_replace(string, _regex, _replace);
+}
+
+bool EnumService::parse_regex_replace(const std::string& regex_replace, Rewrite& rewrite)
 {
   bool success = false;
 
@@ -99,8 +324,7 @@ bool EnumService::parse_regex_replace(const std::string& regex_replace, boost::r
     TRC_DEBUG("Split regex into match=%s, replace=%s", match_replace[0].c_str(), match_replace[1].c_str());
     try
     {
-      regex.assign(match_replace[0], boost::regex::extended);
-      replace = match_replace[1];
+      rewrite.assign(match_replace[0], match_replace[1]);
       success = true;
     }
     catch (...)
@@ -118,6 +342,7 @@ bool EnumService::parse_regex_replace(const std::string& regex_replace, boost::r
 
 
 JSONEnumService::JSONEnumService(std::string configuration):
+  _number_prefixes(std::make_shared<const NumberPrefixes>()),
   _configuration(configuration),
   _updater(NULL)
 {
@@ -171,7 +396,8 @@ void JSONEnumService::update_enum()
 
   try
   {
-    std::vector<NumberPrefix> new_number_prefixes;
+    std::shared_ptr<NumberPrefixes> new_number_prefixes =
+                                          std::make_shared<NumberPrefixes>();
 
     JSON_ASSERT_CONTAINS(doc, "number_blocks");
     JSON_ASSERT_ARRAY(doc["number_blocks"]);
@@ -193,9 +419,9 @@ void JSONEnumService::update_enum()
         NumberPrefix pfix;
         pfix.prefix = prefix;
 
-        if (parse_regex_replace(regex, pfix.match, pfix.replace))
+        if (parse_regex_replace(regex, pfix.rewrite))
         {
-          new_number_prefixes.push_back(pfix);
+          new_number_prefixes->push_back(pfix);
           TRC_STATUS("  Adding number prefix %s, regex=%s",
                      pfix.prefix.c_str(), regex.c_str());
         }
@@ -214,9 +440,9 @@ void JSONEnumService::update_enum()
       }
     }
 
-    // Take a write lock on the mutex in RAII style
-    boost::lock_guard<boost::shared_mutex> write_lock(_number_prefixes_rw_lock);
-    _number_prefixes = new_number_prefixes;
+    // Swap in the new configuration.  Lookups in progress carry on with the
+    // old one.
+    _number_prefixes.set(new_number_prefixes);
   }
   catch (JsonFormatError err)
   {
@@ -247,10 +473,11 @@ std::string JSONEnumService::lookup_uri_from_user(const std::string &user, SAS::
 
   std::string aus = user_to_aus(user);
 
-  // Take a read lock on the mutex in RAII style
-  boost::shared_lock<boost::shared_mutex> read_lock(_number_prefixes_rw_lock);
+  // The prefix found belongs to this snapshot of the configuration, so must
+  // only be used while the reader exists.
+  ConfigSnapshot<NumberPrefixes>::Reader number_prefixes(_number_prefixes);
 
-  const struct NumberPrefix* pfix = prefix_match(aus);
+  const struct NumberPrefix* pfix = prefix_match(*number_prefixes, aus);
 
   if (pfix == NULL)
   {
@@ -265,7 +492,7 @@ std::string JSONEnumService::lookup_uri_from_user(const std::string &user, SAS::
   // URI.
   try
   {
-    uri = boost::regex_replace(aus, pfix->match, pfix->replace);
+    uri = pfix->rewrite.replace(aus);
   }
   catch(...) // LCOV_EXCL_START Only throws if expression too complex or similar hard-to-hit conditions
   {
@@ -287,16 +514,16 @@ std::string JSONEnumService::lookup_uri_from_user(const std::string &user, SAS::
 }
 
 
-// This function returns a pointer to a struct that may be destroyed by the
-// updater. Callers must therefore ensure that they have the read lock before
-// calling this function and only release the lock once they no longer need
-// the object.
-const JSONEnumService::NumberPrefix* JSONEnumService::prefix_match(const std::string& number) const
+// This function returns a pointer into the given snapshot of the
+// configuration, so callers must hold a reader on the snapshot for as long as
+// they need the object.
+const JSONEnumService::NumberPrefix* JSONEnumService::prefix_match(const NumberPrefixes& number_prefixes,
+                                                                   const std::string& number)
 {
   // For simplicity this uses a linear scan since we don't expect too many
   // entries.  Should shift to a radix tree at some point.
-  for (std::vector<NumberPrefix>::const_iterator it = _number_prefixes.begin();
-       it != _number_prefixes.end();
+  for (NumberPrefixes::const_iterator it = number_prefixes.begin();
+       it != number_prefixes.end();
        it++)
   {
     int len = std::min(number.size(), it->prefix.size());
@@ -565,11 +792,10 @@ void DNSEnumService::parse_naptr_reply(const struct ares_naptr_reply* naptr_repl
         (strcasecmp((char*)record->service, "e2u+pstn:sip") == 0) ||
         (strcasecmp((char*)record->service, "e2u+pstn:tel") == 0))
     {
-      boost::regex regex;
-      std::string replace;
+      EnumService::Rewrite rewrite;
       bool terminal = false;
 
-      if (!EnumService::parse_regex_replace(std::string((char*)record->regexp), regex, replace))
+      if (!EnumService::parse_regex_replace(std::string((char*)record->regexp), rewrite))
       {
         TRC_WARNING("DNS ENUM record contains unparseable regular expression: %s", record->regexp);
         // As above, we don't give up totally here.
@@ -590,8 +816,7 @@ void DNSEnumService::parse_naptr_reply(const struct ares_naptr_reply* naptr_repl
         continue;
       }
 
-      rules.push_back(Rule(regex,
-                           replace,
+      rules.push_back(Rule(rewrite,
                            terminal,
                            record->order,
                            record->preference));
@@ -601,13 +826,11 @@ void DNSEnumService::parse_naptr_reply(const struct ares_naptr_reply* naptr_repl
 }
 
 
-DNSEnumService::Rule::Rule(const boost::regex& regex,
-                           const std::string& replace,
+DNSEnumService::Rule::Rule(const EnumService::Rewrite& rewrite,
                            bool terminal,
                            int order,
                            int preference) :
-                           _regex(regex),
-                           _replace(replace),
+                           _rewrite(rewrite),
                            _terminal(terminal),
                            _order(order),
                            _preference(preference)
@@ -618,13 +841,13 @@ DNSEnumService::Rule::Rule(const boost::regex& regex,
 std::string DNSEnumService::Rule::replace(const std::string& string, SAS::TrailId trail) const
 {
   // Perform the match and replace.
-  std::string result = boost::regex_replace(string, _regex, _replace);
+  std::string result = _rewrite.replace(string);
   // Log the results.
   SAS::Event event(trail, SASEvent::ENUM_MATCH, 0);
   event.add_static_param(_terminal);
   event.add_var_param(string);
-  event.add_var_param(_regex.str());
-  event.add_var_param(_replace);
+  event.add_var_param(_rewrite.regex().str());
+  event.add_var_param(_rewrite.replacement());
   event.add_var_param(result);
   SAS::report_event(event);
 
@@ -41,9 +41,11 @@ extern "C" {
 }
 
 // Common STL includes.
+#include <algorithm>
 #include <cassert>
 #include <map>
 #include <string>
+#include <vector>
 
 #include "log.h"
 #include "utils.h"
@@ -60,11 +62,32 @@ FlowTable::FlowTable(QuiescingManager* qm, SNMP::U32Scalar* connection_count) :
 {
   pthread_mutex_init(&_flow_map_lock, NULL);
   report_flow_count();
+
+  // Set up the flow timer wheel and start sweeping it.
+  pthread_mutex_init(&_wheel_lock, NULL);
+  for (int ii = 0; ii < WHEEL_SLOTS; ++ii)
+  {
+    _wheel[ii] = NULL;
+  }
+  _wheel_time = time(NULL);
+
+  pj_timer_entry_init(&_wheel_timer, PJ_FALSE, (void*)this, &on_wheel_timer);
+  pj_time_val delay = {0, WHEEL_TICK_MS};
+  pj_time_val_normalize(&delay);
+  pjsip_endpt_schedule_timer(stack_data.endpt, &_wheel_timer, &delay);
+  _wheel_timer.id = PJ_TRUE;
 }
 
 
 FlowTable::~FlowTable()
 {
+  if (_wheel_timer.id)
+  {
+    // Stop sweeping the timer wheel.
+    pjsip_endpt_cancel_timer(stack_data.endpt, &_wheel_timer);
+    _wheel_timer.id = PJ_FALSE;
+  }
+
   // Delete all the existing flows.
   for (std::map<FlowKey, Flow*>::iterator i = _tp2flow_map.begin();
        i != _tp2flow_map.end();
@@ -73,6 +96,7 @@ FlowTable::~FlowTable()
     delete i->second;
   }
 
+  pthread_mutex_destroy(&_wheel_lock);
   pthread_mutex_destroy(&_flow_map_lock);
 }
 
@@ -227,6 +251,167 @@ void FlowTable::remove_flow(Flow* flow)
   pthread_mutex_unlock(&_flow_map_lock);
 }
 
+/// Schedules the timer for a flow to pop at the specified absolute time,
+/// replacing any timer that is already running.  If earlier_only is set, an
+/// existing timer with the same id is only moved if it would pop later.
+void FlowTable::schedule_flow(Flow* flow, int id, int expires, bool earlier_only)
+{
+  pthread_mutex_lock(&_wheel_lock);
+
+  if ((!earlier_only) ||
+      (flow->_timer_id != id) ||
+      (flow->_timer_expires > expires))
+  {
+    unlink_flow(flow);
+
+    // Never schedule into a slot the sweep has already passed, as the timer
+    // would then wait a full revolution of the wheel.
+    if (expires <= _wheel_time)
+    {
+      expires = _wheel_time + 1;
+    }
+
+    flow->_timer_id = id;
+    flow->_timer_expires = expires;
+    link_flow(flow);
+  }
+
+  pthread_mutex_unlock(&_wheel_lock);
+}
+
+
+/// Stops the timer for a flow.
+void FlowTable::cancel_flow(Flow* flow)
+{
+  pthread_mutex_lock(&_wheel_lock);
+  unlink_flow(flow);
+  pthread_mutex_unlock(&_wheel_lock);
+}
+
+
+/// Adds a flow to the wheel slot for its expiry time.  Must be called with
+/// the wheel lock held.
+void FlowTable::link_flow(Flow* flow)
+{
+  int slot = flow->_timer_expires % WHEEL_SLOTS;
+  flow->_wheel_slot = slot;
+  flow->_wheel_prev = NULL;
+  flow->_wheel_next = _wheel[slot];
+
+  if (_wheel[slot] != NULL)
+  {
+    _wheel[slot]->_wheel_prev = flow;
+  }
+
+  _wheel[slot] = flow;
+}
+
+
+/// Removes a flow from the wheel if its timer is running.  Must be called
+/// with the wheel lock held.
+void FlowTable::unlink_flow(Flow* flow)
+{
+  if (flow->_wheel_slot >= 0)
+  {
+    if (flow->_wheel_prev != NULL)
+    {
+      flow->_wheel_prev->_wheel_next = flow->_wheel_next;
+    }
+    else
+    {
+      _wheel[flow->_wheel_slot] = flow->_wheel_next;
+    }
+
+    if (flow->_wheel_next != NULL)
+    {
+      flow->_wheel_next->_wheel_prev = flow->_wheel_prev;
+    }
+
+    flow->_wheel_slot = -1;
+    flow->_wheel_prev = NULL;
+    flow->_wheel_next = NULL;
+    flow->_timer_id = 0;
+  }
+}
+
+
+/// Sweeps the slots of the timer wheel that have come due since the last
+/// sweep, popping the timers of any flows that have expired.
+void FlowTable::sweep_wheel()
+{
+  int now = time(NULL);
+  std::vector<std::pair<Flow*, int> > popped;
+
+  // Take the flow map lock as well as the wheel lock, so we can take a
+  // reference to each popped flow before releasing the locks.
+  pthread_mutex_lock(&_flow_map_lock);
+  pthread_mutex_lock(&_wheel_lock);
+
+  int ticks = std::min(now - _wheel_time, WHEEL_SLOTS);
+
+  for (int ii = 1; ii <= ticks; ++ii)
+  {
+    Flow* flow = _wheel[(_wheel_time + ii) % WHEEL_SLOTS];
+
+    while (flow != NULL)
+    {
+      Flow* next = flow->_wheel_next;
+
+      if (flow->_timer_expires <= now)
+      {
+        int idle_expires = flow->_last_touch.load() + Flow::IDLE_TIMEOUT;
+
+        if ((flow->_timer_id == Flow::IDLE_TIMER) && (idle_expires > now))
+        {
+          // The flow has been touched since the idle timer was started, so
+          // just move it to the slot for its new idle expiry time.
+          unlink_flow(flow);
+          flow->_timer_id = Flow::IDLE_TIMER;
+          flow->_timer_expires = idle_expires;
+          link_flow(flow);
+        }
+        else if (flow->_refs > 0)
+        {
+          // Pop the timer.  Flows with no references are already being
+          // removed, so are skipped.
+          popped.push_back(std::make_pair(flow, flow->_timer_id));
+          unlink_flow(flow);
+          flow->inc_ref();
+        }
+      }
+
+      flow = next;
+    }
+  }
+
+  _wheel_time = now;
+
+  pthread_mutex_unlock(&_wheel_lock);
+  pthread_mutex_unlock(&_flow_map_lock);
+
+  TRC_DEBUG("Swept flow timer wheel, %d timers popped", popped.size());
+
+  for (std::vector<std::pair<Flow*, int> >::const_iterator i = popped.begin();
+       i != popped.end();
+       ++i)
+  {
+    i->first->on_timer_expiry(i->second);
+    i->first->dec_ref();
+  }
+}
+
+
+/// Called by PJSIP each time the timer wheel is due to be swept.
+void FlowTable::on_wheel_timer(pj_timer_heap_t *th, pj_timer_entry *e)
+{
+  FlowTable* flow_table = (FlowTable*)e->user_data;
+  flow_table->sweep_wheel();
+
+  pj_time_val delay = {0, WHEEL_TICK_MS};
+  pj_time_val_normalize(&delay);
+  pjsip_endpt_schedule_timer(stack_data.endpt, e, &delay);
+}
+
 void FlowTable::report_flow_count()
 {
   TRC_DEBUG("Reporting current flow count: %d", _tp2flow_map.size());
@@ -268,6 +453,12 @@ Flow::Flow(FlowTable* flow_table, pjsip_transport* transport, const pj_sockaddr*
   _tp_state_listener_key(NULL),
   _remote_addr(*remote_addr),
   _token(),
+  _timer_id(0),
+  _timer_expires(0),
+  _wheel_slot(-1),
+  _wheel_prev(NULL),
+  _wheel_next(NULL),
+  _last_touch(time(NULL)),
   _authorized_ids(),
   _default_id(),
   _refs(1),
@@ -293,10 +484,6 @@ Flow::Flow(FlowTable* flow_table, pjsip_transport* transport, const pj_sockaddr*
     TRC_DEBUG("Added transport listener for flow %p", this);
   }
 
-  // Initialize the timer.
-  pj_timer_entry_init(&_timer, PJ_FALSE, (void*)this, &on_timer_expiry);
-  _timer.id = 0;
-
   // Start the timer as an idle timer.
   restart_timer(IDLE_TIMER, IDLE_TIMEOUT);
 }
@@ -316,26 +503,20 @@ Flow::~Flow()
     pjsip_transport_dec_ref(_transport);
   }
 
-  if (_timer.id)
-  {
-    // Stop the keepalive timer.
-    pjsip_endpt_cancel_timer(stack_data.endpt, &_timer);
-    _timer.id = 0;
-  }
+  // Stop the keepalive timer.
+  _flow_table->cancel_flow(this);
 
   pthread_mutex_destroy(&_flow_lock);
 }
 
 
-/// Called whenever a REGISTER is handled for this flow, to ensure the
-/// flow doesn't time out in the middle of processing the REGISTER.
+/// Called whenever a message is received on this flow, to ensure the
+/// flow doesn't time out in the middle of processing a REGISTER.  This just
+/// records the time - if the idle timer is running it is pushed back when
+/// it next pops.
 void Flow::touch()
 {
-  if (_timer.id == IDLE_TIMER)
-  {
-    // Idle timer is running, so restart it.
-    restart_timer(IDLE_TIMER, IDLE_TIMEOUT);
-  }
+  _last_touch.store(time(NULL));
 }
 
 
@@ -448,11 +629,7 @@ void Flow::set_identity(const pjsip_uri* uri,
     // May need to (re)start the timer if either it's not running, or it's
     // running as an idle timer, or the expires time for these identities is
     // earlier than the timer will next pop.
-    if ((_timer.id != EXPIRY_TIMER) ||
-        (_timer._timer_value.sec > expires))
-    {
-      restart_timer(EXPIRY_TIMER, expires - time(NULL));
-    }
+    _flow_table->schedule_flow(this, EXPIRY_TIMER, expires, true);
   }
   else
   {
@@ -578,16 +755,7 @@ void Flow::select_default_identity()
 /// Restart the timer using the specified id and timeout.
 void Flow::restart_timer(int id, int timeout)
 {
-  if (_timer.id)
-  {
-    // Stop the existing timer.
-    pjsip_endpt_cancel_timer(stack_data.endpt, &_timer);
-    _timer.id = 0;
-  }
-
-  pj_time_val delay = {timeout, 0};
-  pjsip_endpt_schedule_timer(stack_data.endpt, &_timer, &delay);
-  _timer.id = id;
+  _flow_table->schedule_flow(this, id, time(NULL) + timeout, false);
 }
 
 
@@ -659,22 +827,22 @@ void Flow::on_transport_state_changed(pjsip_transport *tp,
 }
 
 
-/// Called by PJSIP when the expiry/idle timer expires.
-void Flow::on_timer_expiry(pj_timer_heap_t *th, pj_timer_entry *e)
+/// Called by the FlowTable when the expiry/idle timer expires.
+void Flow::on_timer_expiry(int id)
 {
   TRC_DEBUG("%s timer expired for flow %p",
-            (e->id == EXPIRY_TIMER) ? "Expiry" : "Idle",
-            e->user_data);
-  if (e->id == EXPIRY_TIMER)
+            (id == EXPIRY_TIMER) ? "Expiry" : "Idle",
+            this);
+  if (id == EXPIRY_TIMER)
   {
     // Timer is an expiry timer.
-    ((Flow*)e->user_data)->expiry_timer();
+    expiry_timer();
   }
   else
   {
     // Timer is an idle timer, so decrement the reference count so the flow
     // will get deleted when there are no more references.
-    ((Flow*)e->user_data)->dec_ref();
+    dec_ref();
   }
 }
 
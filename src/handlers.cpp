@@ -34,6 +34,13 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+
 #include "rapidjson/document.h"
 #include "rapidjson/error/en.h"
 #include "json_parse_utils.h"
@@ -45,6 +52,7 @@ extern "C" {
 }
 
 #include "handlers.h"
+#include "eventq.h"
 #include "log.h"
 #include "subscriber_data_manager.h"
 #include "ifchandler.h"
@@ -53,6 +61,7 @@ extern "C" {
 #include "pjutils.h"
 #include "sproutsasevent.h"
 #include "uri_classifier.h"
+#include "utils.h"
 
 // If we can't find the AoR pair in the current SDM, we will either use the
 // backup_aor_pair or we will try and look up the AoR pair in the remote SDMs.
@@ -169,7 +178,7 @@ static bool get_reg_data(HSSConnection* hss,
 static void report_sip_all_register_marker(SAS::TrailId trail, std::string uri_str)
 {
   // Parse the SIP URI and get the username from it.
-  pj_pool_t* tmp_pool = pj_pool_create(&stack_data.cp.factory, "handlers", 1024, 512, NULL);
+  pj_pool_t* tmp_pool = pj_pool_create(stack_data.pool_cache->factory(), "handlers", 1024, 512, NULL);
   pjsip_uri* uri = PJUtils::uri_from_string(uri_str, tmp_pool);
 
   if (uri != NULL)
@@ -376,6 +385,9 @@ SubscriberDataManager::AoRPair* AoRTimeoutTask::set_aor_data(
   SubscriberDataManager::AoRPair* aor_pair = NULL;
   Store::Status set_rc;
 
+  // Hold the AoR lock across the read-modify-write loop below.
+  SubscriberDataManager::AoRLock aor_lock(current_sdm, aor_id);
+
   do
   {
     if (!sdm_access_common(&aor_pair,
@@ -486,89 +498,296 @@ HTTPCode DeregistrationTask::parse_request(std::string body)
   return HTTP_OK;
 }
 
-HTTPCode DeregistrationTask::handle_request()
+// Queue of helper work for the deregistration helper threads.
+static eventq<std::function<void()> >* dereg_helper_q = NULL;
+static std::vector<pj_thread_t*> dereg_helper_threads;
+
+static int dereg_helper_thread(void* p)
 {
-  std::set<std::string> impis_to_delete;
+  std::function<void()> work;
 
-  for (std::map<std::string, std::string>::iterator it=_bindings.begin();
-       it!=_bindings.end();
-       ++it)
+  while (dereg_helper_q->pop(work))
   {
-    SubscriberDataManager::AoRPair* aor_pair =
-      deregister_bindings(_cfg->_sdm,
-                          it->first,
-                          it->second,
-                          NULL,
-                          _cfg->_remote_sdms,
-                          impis_to_delete);
+    work();
+  }
 
-    // LCOV_EXCL_START
-    if ((aor_pair != NULL) &&
-        (aor_pair->get_current() != NULL))
+  return 0;
+}
+
+pj_status_t DeregistrationTask::start_helper_threads(int num_threads)
+{
+  dereg_helper_q = new eventq<std::function<void()> >();
+
+  // These threads send third-party deregistrations and NOTIFYs, so are
+  // created through PJSIP.
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    pj_thread_t* thread;
+    pj_status_t status = pj_thread_create(stack_data.pool, "dereg",
+                                          &dereg_helper_thread,
+                                          NULL, 0, 0, &thread);
+    if (status != PJ_SUCCESS)
     {
-      // If we have any remote stores, try to store this in them too.  We don't worry
-      // about failures in this case.
-      for (std::vector<SubscriberDataManager*>::const_iterator sdm = _cfg->_remote_sdms.begin();
-           sdm != _cfg->_remote_sdms.end();
-           ++sdm)
+      // LCOV_EXCL_START
+      TRC_ERROR("Error creating deregistration thread, %s",
+                PJUtils::pj_status_to_string(status).c_str());
+      return status;
+      // LCOV_EXCL_STOP
+    }
+    dereg_helper_threads.push_back(thread);
+  }
+
+  return PJ_SUCCESS;
+}
+
+void DeregistrationTask::stop_helper_threads()
+{
+  if (dereg_helper_q != NULL)
+  {
+    dereg_helper_q->terminate();
+  }
+
+  for (std::vector<pj_thread_t*>::iterator i = dereg_helper_threads.begin();
+       i != dereg_helper_threads.end();
+       ++i)
+  {
+    pj_thread_join(*i);
+  }
+  dereg_helper_threads.clear();
+
+  delete dereg_helper_q; dereg_helper_q = NULL;
+}
+
+/// Runs work(ii) for each ii in [0, count) on the calling thread, helped by
+/// up to num_threads - 1 of the shared deregistration helper threads.  Once
+/// any call returns false, no further work is started.
+///
+/// @returns false if any call to work returned false.
+static bool run_in_parallel(size_t count,
+                            int num_threads,
+                            const std::function<bool(size_t)>& work)
+{
+  // Helpers may not get picked up until after this function has returned, so
+  // the state they share with it is reference counted.  Once the calling
+  // thread has finished, it closes the state so late helpers do nothing, and
+  // waits only for helpers that have already started.
+  struct State
+  {
+    std::atomic<size_t> next;
+    std::atomic<bool> ok;
+    const std::function<bool(size_t)>* work;
+    size_t count;
+    std::mutex lock;
+    std::condition_variable cond;
+    int active;
+    bool closed;
+  };
+  std::shared_ptr<State> state = std::make_shared<State>();
+  state->next = 0;
+  state->ok = true;
+  state->work = &work;
+  state->count = count;
+  state->active = 0;
+  state->closed = false;
+
+  std::function<void(State*)> worker = [](State* s)
+  {
+    while (s->ok)
+    {
+      size_t ii = s->next++;
+
+      if (ii >= s->count)
+      {
+        break;
+      }
+
+      if (!(*s->work)(ii))
+      {
+        s->ok = false;
+      }
+    }
+  };
+
+  size_t num_workers = std::min((size_t)std::max(num_threads, 1), count);
+
+  if ((dereg_helper_q != NULL) && (!dereg_helper_threads.empty()))
+  {
+    for (size_t ii = 1; ii < num_workers; ++ii)
+    {
+      dereg_helper_q->push([state, worker]()
       {
-        if ((*sdm)->has_servers())
         {
-          SubscriberDataManager::AoRPair* remote_aor_pair =
-            deregister_bindings(*sdm,
-                                it->first,
-                                it->second,
-                                aor_pair,
-                                {},
-                                impis_to_delete);
-          delete remote_aor_pair;
+          std::unique_lock<std::mutex> l(state->lock);
+          if (state->closed)
+          {
+            return;
+          }
+          ++state->active;
         }
+
+        worker(state.get());
+
+        std::unique_lock<std::mutex> l(state->lock);
+        --state->active;
+        state->cond.notify_all();
+      });
+    }
+  }
+
+  worker(state.get());
+
+  std::unique_lock<std::mutex> l(state->lock);
+  state->closed = true;
+  state->cond.wait(l, [&state]() { return state->active == 0; });
+
+  return state->ok;
+}
+
+HTTPCode DeregistrationTask::handle_request()
+{
+  // Split the registrations into batches, and spread the batches across the
+  // configured number of threads so that a bulk deregistration doesn't
+  // deregister one subscriber at a time.
+  std::vector<std::pair<std::string, std::string> > registrations(_bindings.begin(),
+                                                                  _bindings.end());
+  size_t num_batches = (registrations.size() + BATCH_SIZE - 1) / BATCH_SIZE;
+  size_t batches_done = 0;
+  std::set<std::string> impis_to_delete;
+  std::mutex lock;
+
+  bool ok = run_in_parallel(num_batches, _cfg->_num_threads, [&](size_t batch)
+  {
+    Utils::StopWatch stop_watch;
+    stop_watch.start();
+
+    // IMPIs are collected per batch and merged, so each is only deleted once
+    // however many of its IMPUs are deregistered.
+    std::set<std::string> batch_impis;
+    size_t first = batch * BATCH_SIZE;
+    size_t last = std::min(first + BATCH_SIZE, registrations.size());
+
+    for (size_t ii = first; ii < last; ++ii)
+    {
+      if (!deregister_registration(registrations[ii].first,
+                                   registrations[ii].second,
+                                   batch_impis))
+      {
+        return false;
       }
     }
-    // LCOV_EXCL_STOP
-    else
+
+    unsigned long latency_us = 0;
+    stop_watch.read(latency_us);
+
+    std::unique_lock<std::mutex> l(lock);
+    impis_to_delete.insert(batch_impis.begin(), batch_impis.end());
+    ++batches_done;
+
+    if (_cfg->_batch_latency_tbl != NULL)
     {
-      // Can't connect to memcached, return 500. If this isn't the first AoR being edited
-      // then this will lead to an inconsistency between the HSS and Sprout, as
-      // Sprout will have changed some of the AoRs, but HSS will believe they all failed.
-      // Sprout accepts changes to AoRs that don't exist though.
-      TRC_WARNING("Unable to connect to memcached for AoR %s", it->first.c_str());
-
-      delete aor_pair;
-      return HTTP_SERVER_ERROR;
+      _cfg->_batch_latency_tbl->accumulate(latency_us);
     }
 
-    delete aor_pair;
+    TRC_INFO("Deregistered batch %zu of %zu (%zu registrations in %luus)",
+             batches_done, num_batches, last - first, latency_us);
+
+    return true;
+  });
+
+  if (!ok)
+  {
+    // Can't connect to memcached, return 500. If this isn't the first AoR being edited
+    // then this will lead to an inconsistency between the HSS and Sprout, as
+    // Sprout will have changed some of the AoRs, but HSS will believe they all failed.
+    // Sprout accepts changes to AoRs that don't exist though.
+    return HTTP_SERVER_ERROR;
   }
 
   // Delete IMPIs from the store.
-  for(std::set<std::string>::iterator impi = impis_to_delete.begin();
-      impi != impis_to_delete.end();
-      ++impi)
+  std::vector<std::string> impis(impis_to_delete.begin(), impis_to_delete.end());
+  run_in_parallel(impis.size(), _cfg->_num_threads, [&](size_t ii)
   {
-    TRC_DEBUG("Delete %s from the IMPI store", impi->c_str());
+    delete_impi(impis[ii]);
+    return true;
+  });
 
-    Store::Status store_rc = Store::OK;
-    ImpiStore::Impi* impi_obj = NULL;
+  return HTTP_OK;
+}
 
-    do
+/// Deregisters the bindings for an AoR (or, if a private ID is given, just
+/// those bindings for that private ID) locally and in any remote stores.
+///
+/// @returns false if the local store couldn't be accessed.
+bool DeregistrationTask::deregister_registration(const std::string& aor_id,
+                                                 const std::string& private_id,
+                                                 std::set<std::string>& impis_to_delete)
+{
+  SubscriberDataManager::AoRPair* aor_pair =
+    deregister_bindings(_cfg->_sdm,
+                        aor_id,
+                        private_id,
+                        NULL,
+                        _cfg->_remote_sdms,
+                        impis_to_delete);
+
+  // LCOV_EXCL_START
+  if ((aor_pair != NULL) &&
+      (aor_pair->get_current() != NULL))
+  {
+    // If we have any remote stores, try to store this in them too.  We don't worry
+    // about failures in this case.
+    for (std::vector<SubscriberDataManager*>::const_iterator sdm = _cfg->_remote_sdms.begin();
+         sdm != _cfg->_remote_sdms.end();
+         ++sdm)
     {
-      // Free any IMPI we had from the last loop iteration.
-      delete impi_obj; impi_obj = NULL;
-
-      impi_obj = _cfg->_impi_store->get_impi(*impi, _trail);
-
-      if (impi_obj != NULL)
+      if ((*sdm)->has_servers())
       {
-        store_rc = _cfg->_impi_store->delete_impi(impi_obj, _trail);
+        SubscriberDataManager::AoRPair* remote_aor_pair =
+          deregister_bindings(*sdm,
+                              aor_id,
+                              private_id,
+                              aor_pair,
+                              {},
+                              impis_to_delete);
+        delete remote_aor_pair;
       }
     }
-    while ((impi_obj != NULL) && (store_rc == Store::DATA_CONTENTION));
+  }
+  // LCOV_EXCL_STOP
+  else
+  {
+    TRC_WARNING("Unable to connect to memcached for AoR %s", aor_id.c_str());
+    delete aor_pair;
+    return false;
+  }
+
+  delete aor_pair;
+  return true;
+}
+
+/// Deletes an IMPI from the store.
+void DeregistrationTask::delete_impi(const std::string& impi)
+{
+  TRC_DEBUG("Delete %s from the IMPI store", impi.c_str());
+
+  Store::Status store_rc = Store::OK;
+  ImpiStore::Impi* impi_obj = NULL;
 
+  do
+  {
+    // Free any IMPI we had from the last loop iteration.
     delete impi_obj; impi_obj = NULL;
+
+    impi_obj = _cfg->_impi_store->get_impi(impi, _trail);
+
+    if (impi_obj != NULL)
+    {
+      store_rc = _cfg->_impi_store->delete_impi(impi_obj, _trail);
+    }
   }
+  while ((impi_obj != NULL) && (store_rc == Store::DATA_CONTENTION));
 
-  return HTTP_OK;
+  delete impi_obj; impi_obj = NULL;
 }
 
 SubscriberDataManager::AoRPair* DeregistrationTask::deregister_bindings(
@@ -590,6 +809,9 @@ SubscriberDataManager::AoRPair* DeregistrationTask::deregister_bindings(
   std::map<std::string, Ifcs> ifc_map;
   got_ifcs = get_reg_data(_cfg->_hss, aor_id, irs_impus, ifc_map, trail());
 
+  // Hold the AoR lock across the read-modify-write loop below.
+  SubscriberDataManager::AoRLock aor_lock(current_sdm, aor_id);
+
   do
   {
     if (!sdm_access_common(&aor_pair,
@@ -645,6 +867,8 @@ SubscriberDataManager::AoRPair* DeregistrationTask::deregister_bindings(
   }
   while (set_rc == Store::DATA_CONTENTION);
 
+  aor_lock.release();
+
   if (private_id == "")
   {
     // Deregister with any application servers
@@ -84,7 +84,8 @@ HSSConnection::HSSConnection(const std::string& server,
   _uar_latency_tbl(homestead_uar_latency_tbl),
   _lir_latency_tbl(homestead_lir_latency_tbl),
   _scscf_uri(scscf_uri),
-  _fallback_if_no_matching_ifc(fallback_if_no_matching_ifc)
+  _fallback_if_no_matching_ifc(fallback_if_no_matching_ifc),
+  _coalesced_tbl(NULL)
 {
 }
 
@@ -186,30 +187,47 @@ HTTPCode HSSConnection::get_json_object(const std::string& path,
   return rc;
 }
 
-rapidxml::xml_document<>* HSSConnection::parse_xml(std::string raw_data, const std::string& url = "")
+/// A parsed XML document together with the buffer it was parsed from.  The
+/// document is parsed in place, so its nodes point into the buffer.
+struct XmlDocumentWithBuffer
 {
-  rapidxml::xml_document<>* root = new rapidxml::xml_document<>;
+  std::string buffer;
+  rapidxml::xml_document<> doc;
+};
+
+/// Parse an XML response from Homestead.  The raw data is moved into storage
+/// owned by the returned document and parsed in place rather than copied into
+/// the document's memory pool, so callers should std::move it in.
+std::shared_ptr<rapidxml::xml_document<> > HSSConnection::parse_xml(std::string raw_data,
+                                                                    const std::string& url = "")
+{
+  std::shared_ptr<XmlDocumentWithBuffer> holder =
+                                    std::make_shared<XmlDocumentWithBuffer>();
+  holder->buffer = std::move(raw_data);
+
   try
   {
-    root->parse<0>(root->allocate_string(raw_data.c_str()));
+    // std::string guarantees a null-terminated, contiguous buffer.
+    holder->doc.parse<0>(&holder->buffer[0]);
   }
   catch (rapidxml::parse_error& err)
   {
-    // report to the user the failure and their locations in the document.
-    TRC_WARNING("Failed to parse Homestead response:\n %s\n %s\n %s\n", url.c_str(), raw_data.c_str(), err.what());
-    delete root;
-    root = NULL;
+    // report to the user the failure and their locations in the document.  The
+    // in-place parse may have modified the buffer, so it's not logged.
+    TRC_WARNING("Failed to parse Homestead response:\n %s\n %s\n", url.c_str(), err.what());
+    return std::shared_ptr<rapidxml::xml_document<> >();
   }
-  return root;
+
+  // Share ownership of the buffer and document, but point at the document.
+  return std::shared_ptr<rapidxml::xml_document<> >(holder, &holder->doc);
 }
 
 
-/// Make a PUT to the server and store off the XML response. Caller is
-/// responsible for deleting the filled-in "root" pointer.
+/// Make a PUT to the server and store off the XML response.
 HTTPCode HSSConnection::put_for_xml_object(const std::string& path,
                                            std::string body,
                                            bool cache_allowed,
-                                           rapidxml::xml_document<>*& root,
+                                           std::shared_ptr<rapidxml::xml_document<> >& root,
                                            SAS::TrailId trail)
 {
   std::string raw_data;
@@ -230,16 +248,16 @@ HTTPCode HSSConnection::put_for_xml_object(const std::string& path,
 
   if (http_code == HTTP_OK)
   {
-    root = parse_xml(raw_data, path);
+    root = parse_xml(std::move(raw_data), path);
   }
 
   return http_code;
 }
 
 
-/// Retrieve an XML object from a path on the server. Caller is responsible for deleting.
+/// Retrieve an XML object from a path on the server.
 HTTPCode HSSConnection::get_xml_object(const std::string& path,
-                                       rapidxml::xml_document<>*& root,
+                                       std::shared_ptr<rapidxml::xml_document<> >& root,
                                        SAS::TrailId trail)
 {
   std::string raw_data;
@@ -248,13 +266,105 @@ HTTPCode HSSConnection::get_xml_object(const std::string& path,
 
   if (http_code == HTTP_OK)
   {
-    root = parse_xml(raw_data, path);
+    root = parse_xml(std::move(raw_data), path);
+  }
+
+  return http_code;
+}
+
+
+/// Make an XML request to the server, joining an identical request that is
+/// already in flight if there is one.  The first caller for a given method,
+/// path and body sends the request; any callers that arrive before it
+/// completes block until it does and then share its parsed response, which is
+/// read-only from then on.
+HTTPCode HSSConnection::coalesced_xml_request(const std::string& path,
+                                              const std::string& body,
+                                              bool is_put,
+                                              bool cache_allowed,
+                                              std::shared_ptr<rapidxml::xml_document<> >& root,
+                                              SAS::TrailId trail)
+{
+  std::string key = (is_put ? "PUT " : "GET ") + path + "\n" + body;
+  std::shared_ptr<InFlightRequest> request;
+
+  {
+    std::unique_lock<std::mutex> lock(_in_flight_lock);
+    std::map<std::string, std::shared_ptr<InFlightRequest> >::iterator it =
+                                                          _in_flight.find(key);
+
+    if (it != _in_flight.end())
+    {
+      // There's already an identical request outstanding, so wait for its
+      // result rather than sending another one.
+      TRC_DEBUG("Joining in-flight Homestead request for %s", path.c_str());
+      request = it->second;
+
+      if (_coalesced_tbl != NULL)
+      {
+        _coalesced_tbl->increment();
+      }
+
+      // Record which trail the request was sent on, so that this trail shows
+      // where the response came from.
+      SAS::Event event(trail, SASEvent::HTTP_HOMESTEAD_COALESCED, 0);
+      event.add_var_param(path);
+      event.add_var_param(std::to_string(request->trail));
+      SAS::report_event(event);
+
+      _in_flight_cond.wait(lock, [&request]{ return request->complete; });
+      root = request->root;
+      return request->http_code;
+    }
+
+    request = std::make_shared<InFlightRequest>();
+    request->complete = false;
+    request->http_code = HTTP_SERVER_ERROR;
+    request->trail = trail;
+    _in_flight[key] = request;
+  }
+
+  HTTPCode http_code;
+
+  try
+  {
+    http_code = is_put ?
+                  put_for_xml_object(path, body, cache_allowed, root, trail) :
+                  get_xml_object(path, root, trail);
   }
+  catch (...)
+  {
+    // Don't leave any callers that joined this request waiting for it - they
+    // fail with a server error instead.
+    complete_in_flight_request(key, request, HTTP_SERVER_ERROR, nullptr);
+    throw;
+  }
+
+  complete_in_flight_request(key, request, http_code, root);
 
   return http_code;
 }
 
 
+/// Completes an in-flight XML request, passing its result to any callers that
+/// joined it.
+void HSSConnection::complete_in_flight_request(const std::string& key,
+                                               std::shared_ptr<InFlightRequest> request,
+                                               HTTPCode http_code,
+                                               std::shared_ptr<rapidxml::xml_document<> > root)
+{
+  {
+    std::unique_lock<std::mutex> lock(_in_flight_lock);
+    request->complete = true;
+    request->http_code = http_code;
+    request->root = root;
+    _in_flight.erase(key);
+  }
+
+  _in_flight_cond.notify_all();
+}
+
+
 bool compare_charging_addrs(const rapidxml::xml_node<>* ca1,
                             const rapidxml::xml_node<>* ca2)
 {
@@ -615,14 +725,23 @@ HTTPCode HSSConnection::update_registration_state(const std::string& public_user
   // Needs to be a shared pointer - multiple Ifcs objects will need a reference
   // to it, so we want to delete the underlying document when they all go out
   // of scope.
+  std::string body = "{\"reqtype\": \""+type+"\", \"server_name\": \""+_scscf_uri+"\"}";
+  std::shared_ptr<rapidxml::xml_document<> > root;
+  HTTPCode http_code;
 
-  rapidxml::xml_document<>* root_underlying_ptr = NULL;
-  HTTPCode http_code = put_for_xml_object(path,
-                                          "{\"reqtype\": \""+type+"\", \"server_name\": \""+_scscf_uri+"\"}",
-                                          cache_allowed,
-                                          root_underlying_ptr,
-                                          trail);
-  std::shared_ptr<rapidxml::xml_document<> > root (root_underlying_ptr);
+  if ((cache_allowed) &&
+      ((type == HSSConnection::REG) || (type == HSSConnection::CALL)))
+  {
+    // Registrations and calls don't change the subscriber's state in the
+    // HSS beyond what an identical concurrent request would, so they can
+    // share a single request.  Deregistrations and uncached requests always
+    // go to Homestead.
+    http_code = coalesced_xml_request(path, body, true, true, root, trail);
+  }
+  else
+  {
+    http_code = put_for_xml_object(path, body, cache_allowed, root, trail);
+  }
 
   unsigned long latency_us = 0;
 
@@ -692,13 +811,12 @@ HTTPCode HSSConnection::get_registration_data(const std::string& public_user_ide
   std::string path = "/impu/" + Utils::url_escape(public_user_identity) + "/reg-data";
 
   TRC_DEBUG("Making Homestead request for %s", path.c_str());
-  rapidxml::xml_document<>* root_underlying_ptr = NULL;
-  HTTPCode http_code = get_xml_object(path, root_underlying_ptr, trail);
 
   // Needs to be a shared pointer - multiple Ifcs objects will need a reference
   // to it, so we want to delete the underlying document when they all go out
   // of scope.
-  std::shared_ptr<rapidxml::xml_document<> > root (root_underlying_ptr);
+  std::shared_ptr<rapidxml::xml_document<> > root;
+  HTTPCode http_code = coalesced_xml_request(path, "", false, true, root, trail);
   unsigned long latency_us = 0;
 
   // Only accumulate the latency if we haven't already applied a
@@ -86,9 +86,18 @@ ICSCFRouter::~ICSCFRouter()
 ///                      query. Defaults to 'false'
 int ICSCFRouter::get_scscf(pj_pool_t* pool, pjsip_sip_uri*& scscf_sip_uri, bool do_billing)
 {
-  int status_code = PJSIP_SC_OK;
   std::string scscf;
-  scscf_sip_uri = NULL;
+  int status_code = select_scscf(scscf, do_billing);
+  return get_scscf_uri(pool, status_code, scscf, scscf_sip_uri);
+}
+
+
+/// Selects an S-CSCF for the request, querying the HSS first if it hasn't
+/// been queried already.
+int ICSCFRouter::select_scscf(std::string& scscf, bool do_billing)
+{
+  int status_code = PJSIP_SC_OK;
+  scscf = "";
 
   if (!_queried_caps)
   {
@@ -126,61 +135,77 @@ int ICSCFRouter::get_scscf(pj_pool_t* pool, pjsip_sip_uri*& scscf_sip_uri, bool
     {
       // Found an S-CSCF to try, so add it to the list of attempted S-CSCFs.
       _attempted_scscfs.push_back(scscf);
+    }
+    else
+    {
+      // Failed to select an S-CSCF providing all the mandatory parameters,
+      // so return 600 Busy Everywhere response.
+      status_code = PJSIP_SC_BUSY_EVERYWHERE;
+    }
+  }
 
-      // Check that the returned scscf is a valid SIP URI.
-      pjsip_uri* scscf_uri = PJUtils::uri_from_string(scscf, pool);
+  return status_code;
+}
 
-      if ((scscf_uri != NULL) && PJSIP_URI_SCHEME_IS_SIP(scscf_uri))
+
+/// Converts a selected S-CSCF to a SIP URI, checking that it is valid and
+/// doesn't route back to this I-CSCF.
+int ICSCFRouter::get_scscf_uri(pj_pool_t* pool,
+                               int status_code,
+                               const std::string& scscf,
+                               pjsip_sip_uri*& scscf_sip_uri)
+{
+  scscf_sip_uri = NULL;
+
+  if (status_code == PJSIP_SC_OK)
+  {
+    // Check that the selected scscf is a valid SIP URI.
+    pjsip_uri* scscf_uri = PJUtils::uri_from_string(scscf, pool);
+
+    if ((scscf_uri != NULL) && PJSIP_URI_SCHEME_IS_SIP(scscf_uri))
+    {
+      // Check whether the URI points back to ourselves, i.e.
+      // - The host is either this server or the home domain.
+      // - The port is the I-CSCF port for this deployment
+      //
+      // If the URI matches these criteria, we need to reject this message
+      // now (with a signature SAS log) as this is never valid and would
+      // lead to an infinite loop (were it not for our separate Max-Forwards
+      // checking).
+      //
+      // The motivation for putting an explicit check here (rather than
+      // relying on Max Forwards checking) is that this is reasonably likely
+      // to occur when turning up a new deployment: customers can very easily
+      // get their S-CSCF and I-CSCF ports the wrong way round (resulting in
+      // an I-CSCF loop) and this fix will save them time diagnosing the
+      // condition.
+      //
+      // Note that we are only checking the I-CSCF => I-CSCF loop condition
+      // explicitly in this way.  S-CSCF => S-CSCF loops are much harder to
+      // explicitly block because messages can be legitimately routed by an
+      // S-CSCF back to itself (with subtly changed headers) for various
+      // reasons.  Max Forwards checking should catch these instances.
+      pjsip_sip_uri *sip_uri = (pjsip_sip_uri*)scscf_uri;
+      URIClass uri_class = URIClassifier::classify_uri(scscf_uri);
+
+      if (((uri_class == NODE_LOCAL_SIP_URI) ||
+           (uri_class == HOME_DOMAIN_SIP_URI)) &&
+           (sip_uri->port == _port))
       {
-        // Check whether the URI points back to ourselves, i.e.
-        // - The host is either this server or the home domain.
-        // - The port is the I-CSCF port for this deployment
-        //
-        // If the URI matches these criteria, we need to reject this message
-        // now (with a signature SAS log) as this is never valid and would
-        // lead to an infinite loop (were it not for our separate Max-Forwards
-        // checking).
-        //
-        // The motivation for putting an explicit check here (rather than
-        // relying on Max Forwards checking) is that this is reasonably likely
-        // to occur when turning up a new deployment: customers can very easily
-        // get their S-CSCF and I-CSCF ports the wrong way round (resulting in
-        // an I-CSCF loop) and this fix will save them time diagnosing the
-        // condition.
-        //
-        // Note that we are only checking the I-CSCF => I-CSCF loop condition
-        // explicitly in this way.  S-CSCF => S-CSCF loops are much harder to
-        // explicitly block because messages can be legitimately routed by an
-        // S-CSCF back to itself (with subtly changed headers) for various
-        // reasons.  Max Forwards checking should catch these instances.
-        pjsip_sip_uri *sip_uri = (pjsip_sip_uri*)scscf_uri;
-        URIClass uri_class = URIClassifier::classify_uri(scscf_uri);
-
-        if (((uri_class == NODE_LOCAL_SIP_URI) ||
-             (uri_class == HOME_DOMAIN_SIP_URI)) &&
-             (sip_uri->port == _port))
-        {
-          TRC_WARNING("SCSCF URI %s points back to ICSCF", scscf.c_str());
-          status_code = PJSIP_SC_LOOP_DETECTED;
-          SAS::Event event(_trail, SASEvent::SCSCF_ICSCF_LOOP_DETECTED, 0);
-          SAS::report_event(event);
-        }
-        else
-        {
-          scscf_sip_uri = sip_uri;
-        }
+        TRC_WARNING("SCSCF URI %s points back to ICSCF", scscf.c_str());
+        status_code = PJSIP_SC_LOOP_DETECTED;
+        SAS::Event event(_trail, SASEvent::SCSCF_ICSCF_LOOP_DETECTED, 0);
+        SAS::report_event(event);
       }
       else
       {
-        TRC_WARNING("Invalid SCSCF URI %s", scscf.c_str());
-        status_code = PJSIP_SC_TEMPORARILY_UNAVAILABLE;
+        scscf_sip_uri = sip_uri;
       }
     }
     else
     {
-      // Failed to select an S-CSCF providing all the mandatory parameters,
-      // so return 600 Busy Everywhere response.
-      status_code = PJSIP_SC_BUSY_EVERYWHERE;
+      TRC_WARNING("Invalid SCSCF URI %s", scscf.c_str());
+      status_code = PJSIP_SC_TEMPORARILY_UNAVAILABLE;
     }
   }
 
@@ -165,7 +165,10 @@ ICSCFSproutletRegTsx::ICSCFSproutletRegTsx(SproutletTsxHelper* helper,
   SproutletTsx(helper),
   _icscf(icscf),
   _acr(NULL),
-  _router(NULL)
+  _router(NULL),
+  _pending_req(NULL),
+  _scscf(),
+  _status_code(PJSIP_SC_OK)
 {
 }
 
@@ -269,12 +272,42 @@ void ICSCFSproutletRegTsx::on_rx_initial_request(pjsip_msg* req)
                                             visited_network,
                                             auth_type);
 
-  // We have a router, query it for an S-CSCF to use.
+  // We have a router, query it for an S-CSCF to use.  This sends a UAR to
+  // the HSS, so suspend the transaction while it's outstanding.  The
+  // selection doesn't touch the request's pool, which is only safe to use on
+  // this thread.
+  _pending_req = req;
+  _scscf = "";
+  run_async([this]()
+            {
+              _status_code = _router->select_scscf(_scscf);
+            },
+            NULL);
+}
+
+
+void ICSCFSproutletRegTsx::on_async_complete(void* context, bool success)
+{
+  pjsip_msg* req = _pending_req;
+  _pending_req = NULL;
   pjsip_sip_uri* scscf_sip_uri = NULL;
-  pjsip_status_code status_code =
-    (pjsip_status_code)_router->get_scscf(get_pool(req), scscf_sip_uri);
 
-  if (status_code == PJSIP_SC_OK)
+  if (!success)
+  {
+    // The lookup failed without setting a result.
+    TRC_ERROR("S-CSCF lookup for REGISTER failed");
+    _status_code = PJSIP_SC_INTERNAL_SERVER_ERROR;
+  }
+  else
+  {
+    // Parse the selected S-CSCF into the request's pool.
+    _status_code = _router->get_scscf_uri(get_pool(req),
+                                          _status_code,
+                                          _scscf,
+                                          scscf_sip_uri);
+  }
+
+  if (_status_code == PJSIP_SC_OK)
   {
     TRC_DEBUG("Found SCSCF for REGISTER");
     req->line.req.uri = (pjsip_uri*)scscf_sip_uri;
@@ -282,7 +315,7 @@ void ICSCFSproutletRegTsx::on_rx_initial_request(pjsip_msg* req)
   }
   else
   {
-    pjsip_msg* rsp = create_response(req, status_code);
+    pjsip_msg* rsp = create_response(req, (pjsip_status_code)_status_code);
     send_response(rsp);
     free_msg(req);
   }
@@ -727,12 +727,17 @@ Ifcs::Ifcs(std::shared_ptr<xml_document<> > ifc_doc, xml_node<>* sp) :
       }
     }
 
+    std::vector<Ifc> ifcs;
+    ifcs.reserve(ifc_map.size());
+
     for (std::multimap<int32_t, Ifc>::iterator it = ifc_map.begin();
          it != ifc_map.end();
          ++it)
     {
-      _ifcs.push_back(it->second);
+      ifcs.push_back(it->second);
     }
+
+    _ifcs = std::make_shared<const std::vector<Ifc> >(std::move(ifcs));
   }
   else
   {
@@ -761,8 +766,14 @@ void Ifcs::interpret(const SessionCase& session_case,  //< The session case
                      SAS::TrailId trail) const  //< SAS trail
 {
   TRC_DEBUG("Interpreting %s IFC information", session_case.to_string().c_str());
-  for (std::vector<Ifc>::const_iterator it = _ifcs.begin();
-       it != _ifcs.end();
+
+  if (_ifcs == NULL)
+  {
+    return;
+  }
+
+  for (std::vector<Ifc>::const_iterator it = _ifcs->begin();
+       it != _ifcs->end();
        ++it)
   {
     if (it->filter_matches(session_case, is_registered, is_initial_registration, msg, trail))
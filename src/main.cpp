@@ -157,6 +157,12 @@ enum OptionTypes
   OPT_DEFAULT_TEL_URI_TRANSLATION,
   OPT_CHRONOS_HOSTNAME,
   OPT_ALLOW_FALLBACK_IFCS,
+  OPT_WEBRTC_THREADS,
+  OPT_STATELESS_IN_DIALOG_RELAY,
+  OPT_REG_REFRESH_WINDOW,
+  OPT_ASYNC_LOOKUP_THREADS,
+  OPT_THIRD_PARTY_REG_REFRESH_WINDOW,
+  OPT_DEREG_THREADS,
 };
 
 
@@ -191,8 +197,12 @@ const static struct pj_getopt_option long_opt[] =
   { "enforce-global-only-lookups",  no_argument,       0, 'g'},
   { "reg-max-expires",              required_argument, 0, 'e'},
   { "sub-max-expires",              required_argument, 0, OPT_SUB_MAX_EXPIRES},
+  { "reg-refresh-window",           required_argument, 0, OPT_REG_REFRESH_WINDOW},
+  { "third-party-reg-refresh-window", required_argument, 0, OPT_THIRD_PARTY_REG_REFRESH_WINDOW},
   { "pjsip-threads",                required_argument, 0, 'P'},
   { "worker-threads",               required_argument, 0, 'W'},
+  { "async-lookup-threads",         required_argument, 0, OPT_ASYNC_LOOKUP_THREADS},
+  { "dereg-threads",                required_argument, 0, OPT_DEREG_THREADS},
   { "analytics",                    required_argument, 0, 'a'},
   { "authentication",               no_argument,       0, 'A'},
   { "log-file",                     required_argument, 0, 'F'},
@@ -240,6 +250,8 @@ const static struct pj_getopt_option long_opt[] =
   { "disable-tcp-switch",           no_argument,       0, OPT_DISABLE_TCP_SWITCH},
   { "chronos-hostname",             required_argument, 0, OPT_CHRONOS_HOSTNAME},
   { "allow-fallback-ifcs",          no_argument,       0, OPT_ALLOW_FALLBACK_IFCS},
+  { "webrtc-threads",               required_argument, 0, OPT_WEBRTC_THREADS},
+  { "stateless-in-dialog-relay",    no_argument,       0, OPT_STATELESS_IN_DIALOG_RELAY},
   { NULL,                           0,                 0, 0}
 };
 
@@ -267,6 +279,13 @@ static void usage(void)
        " -s, --scscf <port>         Enable S-CSCF function on the specified port\n"
        " -w, --webrtc-port N        Set local WebRTC listener port to N\n"
        "                            If not specified WebRTC support will be disabled\n"
+       "     --webrtc-threads N     Number of threads servicing WebRTC connections (default: 1)\n"
+       "     --stateless-in-dialog-relay\n"
+       "                            Relay in-dialog non-INVITE requests (other than UPDATE) on\n"
+       "                            established flows statelessly, without creating a\n"
+       "                            transaction (P-CSCF only).  Retransmissions are relayed\n"
+       "                            rather than absorbed, and ACRs for these requests do not\n"
+       "                            include the response\n"
        " -l, --localhost [<hostname>|<private hostname>,<public hostname>]\n"
        "                            Override the local host name with the specified\n"
        "                            hostname(s) or IP address(es).  If one name/address\n"
@@ -331,6 +350,17 @@ static void usage(void)
        "                            The maximum allowed registration period (in seconds)\n"
        "     --sub-max-expires <expiry>\n"
        "                            The maximum allowed subscription period (in seconds)\n"
+       "     --reg-refresh-window <secs>\n"
+       "                            Period (in seconds) for which the registration data returned\n"
+       "                            by Homestead is reused for re-REGISTERs that don't change\n"
+       "                            the registration state, rather than sending a new SAR\n"
+       "                            (defaults to 0, which always sends a SAR)\n"
+       "     --third-party-reg-refresh-window <secs>\n"
+       "                            Period (in seconds) before a third-party registration expires\n"
+       "                            at an application server within which re-REGISTERs are passed\n"
+       "                            on to it. Outside this period, re-REGISTERs that don't change\n"
+       "                            the bindings aren't passed on (defaults to 0, which passes on\n"
+       "                            every re-REGISTER)\n"
        "     --default-session-expires <expiry>\n"
        "                            The session expiry period to request\n"
        "                            (in seconds. Min 90. Defaults to 600)\n"
@@ -355,6 +385,13 @@ static void usage(void)
        " -P, --pjsip-threads N      Number of PJSIP threads (default: 1)\n"
        " -B, --billing-cdf <server> Billing CDF server\n"
        " -W, --worker-threads N     Number of worker threads (default: 1)\n"
+       "     --async-lookup-threads N\n"
+       "                            Number of threads used to make Homestead lookups on behalf\n"
+       "                            of suspended transactions, so worker threads don't block\n"
+       "                            (default: 0, which makes lookups on the worker threads)\n"
+       "     --dereg-threads N      Number of threads each network-initiated deregistration\n"
+       "                            request is spread across, using a pool of N-1 threads\n"
+       "                            shared by all requests (default: 1)\n"
        " -a, --analytics <directory>\n"
        "                            Generate analytics logs in specified directory\n"
        " -A, --authentication       Enable authentication\n"
@@ -790,6 +827,36 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       }
       break;
 
+    case OPT_REG_REFRESH_WINDOW:
+      options->reg_refresh_window = atoi(pj_optarg);
+
+      if (options->reg_refresh_window > 0)
+      {
+        TRC_INFO("Registration refresh window set to %d seconds",
+                 options->reg_refresh_window);
+      }
+      else
+      {
+        // Invalid or zero, so always contact Homestead on re-registration.
+        options->reg_refresh_window = 0;
+      }
+      break;
+
+    case OPT_THIRD_PARTY_REG_REFRESH_WINDOW:
+      options->third_party_reg_refresh_window = atoi(pj_optarg);
+
+      if (options->third_party_reg_refresh_window > 0)
+      {
+        TRC_INFO("Third-party registration refresh window set to %d seconds",
+                 options->third_party_reg_refresh_window);
+      }
+      else
+      {
+        // Invalid or zero, so pass on every re-registration.
+        options->third_party_reg_refresh_window = 0;
+      }
+      break;
+
     case OPT_TARGET_LATENCY_US:
       options->target_latency_us = atoi(pj_optarg);
       if (options->target_latency_us <= 0)
@@ -861,6 +928,35 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       TRC_INFO("Use %d worker threads", options->worker_threads);
       break;
 
+    case OPT_ASYNC_LOOKUP_THREADS:
+      options->async_lookup_threads = atoi(pj_optarg);
+
+      if (options->async_lookup_threads > 0)
+      {
+        TRC_INFO("Use %d async lookup threads", options->async_lookup_threads);
+      }
+      else
+      {
+        // Invalid or zero, so make lookups on the worker threads.
+        options->async_lookup_threads = 0;
+      }
+      break;
+
+    case OPT_DEREG_THREADS:
+      options->dereg_threads = atoi(pj_optarg);
+
+      if (options->dereg_threads > 0)
+      {
+        TRC_INFO("Use %d threads per deregistration request",
+                 options->dereg_threads);
+      }
+      else
+      {
+        // Invalid or zero, so deregister on the HTTP thread alone.
+        options->dereg_threads = 1;
+      }
+      break;
+
     case 'a':
       options->analytics_enabled = PJ_TRUE;
       options->analytics_directory = std::string(pj_optarg);
@@ -1118,6 +1214,16 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       options->allow_fallback_ifcs = true;
       break;
 
+    case OPT_STATELESS_IN_DIALOG_RELAY:
+      TRC_STATUS("Stateless relay of in-dialog requests enabled");
+      options->stateless_in_dialog_relay = true;
+      break;
+
+    case OPT_WEBRTC_THREADS:
+      options->webrtc_threads = atoi(pj_optarg);
+      TRC_INFO("Use %d WebRTC threads", options->webrtc_threads);
+      break;
+
     case 'N':
       {
         std::vector<std::string> fields;
@@ -1339,6 +1445,8 @@ int main(int argc, char* argv[])
   opt.pcscf_untrusted_port = 0;
   opt.upstream_proxy_port = 0;
   opt.webrtc_port = 0;
+  opt.webrtc_threads = 1;
+  opt.stateless_in_dialog_relay = false;
   opt.ibcf = PJ_FALSE;
   opt.external_icscf_uri = "";
   opt.auth_enabled = PJ_FALSE;
@@ -1352,11 +1460,15 @@ int main(int argc, char* argv[])
   opt.reg_max_expires = 300;
 
   opt.sub_max_expires = 300;
+  opt.reg_refresh_window = 0;
+  opt.third_party_reg_refresh_window = 0;
   opt.sas_server = "0.0.0.0";
   opt.record_routing_model = 1;
   opt.default_session_expires = 10 * 60;
   opt.max_session_expires = 10 * 60;
   opt.worker_threads = 1;
+  opt.async_lookup_threads = 0;
+  opt.dereg_threads = 1;
   opt.analytics_enabled = PJ_FALSE;
   opt.http_address = "127.0.0.1";
   opt.http_port = 9888;
@@ -1560,6 +1672,7 @@ int main(int argc, char* argv[])
   SNMP::EventAccumulatorByScopeTable* queue_size_table;
   SNMP::CounterByScopeTable* requests_counter;
   SNMP::CounterByScopeTable* overload_counter;
+  SNMP::CounterByScopeTable* options_fast_path_counter;
 
   SNMP::IPCountTable* homestead_cxn_count = NULL;
 
@@ -1568,6 +1681,10 @@ int main(int argc, char* argv[])
   SNMP::EventAccumulatorTable* homestead_sar_latency_table = NULL;
   SNMP::EventAccumulatorTable* homestead_uar_latency_table = NULL;
   SNMP::EventAccumulatorTable* homestead_lir_latency_table = NULL;
+  SNMP::EventAccumulatorTable* dereg_batch_latency_table = NULL;
+  SNMP::CounterTable* aor_contention_tbl = NULL;
+  SNMP::CounterTable* homestead_coalesced_tbl = NULL;
+  SNMP::CounterTable* third_party_reg_suppressed_tbl = NULL;
 
   SNMP::ContinuousAccumulatorByScopeTable* token_rate_table = NULL;
   SNMP::ScalarByScopeTable* smoothed_latency_scalar = NULL;
@@ -1589,6 +1706,8 @@ int main(int argc, char* argv[])
                                                          ".1.2.826.0.1.1578918.9.2.4");
     overload_counter = SNMP::CounterByScopeTable::create("bono_rejected_overload",
                                                          ".1.2.826.0.1.1578918.9.2.5");
+    options_fast_path_counter = SNMP::CounterByScopeTable::create("bono_options_fast_path",
+                                                                  ".1.2.826.0.1.1578918.9.2.8");
   }
   else
   {
@@ -1600,6 +1719,8 @@ int main(int argc, char* argv[])
                                                          ".1.2.826.0.1.1578918.9.3.6");
     overload_counter = SNMP::CounterByScopeTable::create("sprout_rejected_overload",
                                                          ".1.2.826.0.1.1578918.9.3.7");
+    options_fast_path_counter = SNMP::CounterByScopeTable::create("sprout_options_fast_path",
+                                                                  ".1.2.826.0.1.1578918.9.3.39");
 
     homestead_cxn_count = SNMP::IPCountTable::create("sprout_homestead_cxn_count",
                                                      ".1.2.826.0.1.1578918.9.3.3.1");
@@ -1613,6 +1734,14 @@ int main(int argc, char* argv[])
                                                                  ".1.2.826.0.1.1578918.9.3.3.5");
     homestead_lir_latency_table = SNMP::EventAccumulatorTable::create("sprout_homestead_lir_latency",
                                                                  ".1.2.826.0.1.1578918.9.3.3.6");
+    aor_contention_tbl = SNMP::CounterTable::create("sprout_aor_store_contention",
+                                                    ".1.2.826.0.1.1578918.9.3.40");
+    homestead_coalesced_tbl = SNMP::CounterTable::create("sprout_homestead_coalesced_requests",
+                                                         ".1.2.826.0.1.1578918.9.3.41");
+    third_party_reg_suppressed_tbl = SNMP::CounterTable::create("sprout_third_party_reg_suppressed",
+                                                                ".1.2.826.0.1.1578918.9.3.42");
+    dereg_batch_latency_table = SNMP::EventAccumulatorTable::create("sprout_dereg_batch_latency",
+                                                                   ".1.2.826.0.1.1578918.9.3.43");
 
     reg_stats_tbls.init_reg_tbl = SNMP::SuccessFailCountTable::create("initial_reg_success_fail_count",
                                                                       ".1.2.826.0.1.1578918.9.3.9");
@@ -1802,7 +1931,7 @@ int main(int argc, char* argv[])
   }
 
   // Initialise the OPTIONS handling module.
-  status = init_options();
+  status = init_options(options_fast_path_counter);
 
   if (opt.hss_server != "")
   {
@@ -1820,6 +1949,7 @@ int main(int argc, char* argv[])
                                        hss_comm_monitor,
                                        opt.uri_scscf,
                                        opt.allow_fallback_ifcs);
+    hss_connection->set_coalesced_table(homestead_coalesced_tbl);
   }
 
   // Create ENUM service.
@@ -1873,7 +2003,8 @@ int main(int argc, char* argv[])
                                  quiescing_mgr,
                                  opt.enabled_icscf,
                                  opt.enabled_scscf,
-                                 opt.emerg_reg_accepted);
+                                 opt.emerg_reg_accepted,
+                                 opt.stateless_in_dialog_relay);
     if (status != PJ_SUCCESS)
     {
       TRC_ERROR("Failed to enable P-CSCF edge proxy");
@@ -1883,7 +2014,8 @@ int main(int argc, char* argv[])
     pj_bool_t websockets_enabled = (opt.webrtc_port != 0);
     if (websockets_enabled)
     {
-      status = init_websockets((unsigned short)opt.webrtc_port);
+      status = init_websockets((unsigned short)opt.webrtc_port,
+                               opt.webrtc_threads);
       if (status != PJ_SUCCESS)
       {
         TRC_ERROR("Error initializing websockets, %s",
@@ -1996,6 +2128,7 @@ int main(int argc, char* argv[])
                                         chronos_connection,
                                         analytics_logger,
                                         true);
+  local_sdm->set_contention_table(aor_contention_tbl);
 
   if (remote_data_store != NULL)
   {
@@ -2008,6 +2141,7 @@ int main(int argc, char* argv[])
                                            chronos_connection,
                                            NULL,
                                            false);
+    remote_sdm->set_contention_table(aor_contention_tbl);
   }
 
   // Start the HTTP stack early as plugins might need to register handlers
@@ -2074,7 +2208,10 @@ int main(int argc, char* argv[])
                             opt.reg_max_expires,
                             opt.force_third_party_register_body,
                             &reg_stats_tbls,
-                            &third_party_reg_stats_tbls);
+                            &third_party_reg_stats_tbls,
+                            opt.reg_refresh_window,
+                            opt.third_party_reg_refresh_window,
+                            third_party_reg_suppressed_tbl);
 
     if (status != PJ_SUCCESS)
     {
@@ -2155,7 +2292,8 @@ int main(int argc, char* argv[])
                          latency_table,
                          queue_size_table,
                          load_monitor,
-                         exception_handler);
+                         exception_handler,
+                         opt.async_lookup_threads);
 
   // Create worker threads first as they take work from the PJSIP threads so
   // need to be ready.
@@ -2174,13 +2312,25 @@ int main(int argc, char* argv[])
     return 1;
   }
 
+  // Each deregistration request runs on its HTTP thread, so the shared pool
+  // only needs the other dereg_threads - 1 threads.
+  status = DeregistrationTask::start_helper_threads(opt.dereg_threads - 1);
+  if (status != PJ_SUCCESS)
+  {
+    TRC_ERROR("Error starting deregistration threads, %s",
+              PJUtils::pj_status_to_string(status).c_str());
+    return 1;
+  }
+
   AoRTimeoutTask::Config aor_timeout_config(local_sdm, {remote_sdm}, hss_connection);
   AuthTimeoutTask::Config auth_timeout_config(impi_store, hss_connection);
   DeregistrationTask::Config deregistration_config(local_sdm,
                                                    {remote_sdm},
                                                    hss_connection,
                                                    sip_resolver,
-                                                   impi_store);
+                                                   impi_store,
+                                                   opt.dereg_threads,
+                                                   dereg_batch_latency_table);
   GetCachedDataTask::Config get_cached_data_config(local_sdm, {remote_sdm});
   DeleteImpuTask::Config delete_impu_config(local_sdm, {remote_sdm}, hss_connection);
 
@@ -2267,6 +2417,8 @@ int main(int argc, char* argv[])
     }
   }
 
+  DeregistrationTask::stop_helper_threads();
+
   // Terminate the PJSIP thread and the worker threads to exit.  We kill
   // the PJSIP thread first - if we killed the worker threads first the
   // rx_msg_q will stop getting serviced so could fill up blocking
@@ -2349,6 +2501,7 @@ int main(int argc, char* argv[])
   delete queue_size_table;
   delete requests_counter;
   delete overload_counter;
+  delete options_fast_path_counter;
 
   delete homestead_cxn_count;
 
@@ -2357,6 +2510,10 @@ int main(int argc, char* argv[])
   delete homestead_sar_latency_table;
   delete homestead_uar_latency_table;
   delete homestead_lir_latency_table;
+  delete dereg_batch_latency_table;
+  delete aor_contention_tbl;
+  delete homestead_coalesced_tbl;
+  delete third_party_reg_suppressed_tbl;
 
   delete token_rate_table;
   delete smoothed_latency_scalar;
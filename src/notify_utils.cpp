@@ -49,237 +49,230 @@ extern "C" {
 #include "log.h"
 #include "constants.h"
 
-// Return a XML registration node with the attributes populated
-pj_xml_node* create_reg_node(pj_pool_t *pool,
-                             pj_str_t *aor,
-                             pj_str_t *id,
-                             pj_str_t *state)
+// The reginfo body is written straight into a string, in the same layout
+// pj_xml_print uses.
+static void append(std::string& out, const pj_str_t& str)
 {
-  TRC_DEBUG("Create registration node");
+  out.append(str.ptr, str.slen);
+}
 
-  pj_xml_node *reg_node;
-  pj_xml_attr *attr;
+static void append_indent(std::string& out, int indent)
+{
+  out.push_back('\n');
+  out.append(indent, ' ');
+}
 
-  reg_node = pj_xml_node_new(pool, &STR_REGISTRATION);
+static void append_attr(std::string& out,
+                        const pj_str_t& name,
+                        const std::string& value)
+{
+  out.push_back(' ');
+  append(out, name);
 
-  // Registration node requires a aor, id and state
-  attr = pj_xml_attr_new(pool, &STR_AOR, aor);
-  pj_xml_add_attr(reg_node, attr);
-  attr = pj_xml_attr_new(pool, &STR_ID, id);
-  pj_xml_add_attr(reg_node, attr);
-  attr = pj_xml_attr_new(pool, &STR_STATE, state);
-  pj_xml_add_attr(reg_node, attr);
+  if (!value.empty())
+  {
+    out.append("=\"");
+    out.append(value);
+    out.push_back('"');
+  }
+}
 
-  return reg_node;
+static void append_attr(std::string& out,
+                        const pj_str_t& name,
+                        const pj_str_t& value)
+{
+  append_attr(out, name, std::string(value.ptr, value.slen));
+}
+
+static void append_close(std::string& out, int indent, const pj_str_t& name)
+{
+  append_indent(out, indent);
+  out.append("</");
+  append(out, name);
+  out.push_back('>');
 }
 
-// Return a XML contact node with the attributes populated
-pj_xml_node* create_contact_node(pj_pool_t *pool,
-                                 pj_str_t *id,
-                                 pj_str_t *state,
-                                 pj_str_t *event)
+// Write a contact element for a binding
+static void append_contact(std::string& out,
+                           pj_pool_t* pool,
+                           NotifyUtils::BindingNotifyInformation* bni)
 {
-  TRC_DEBUG("Create contact node");
+  pj_str_t c_state;
+  pj_str_t c_event;
+
+  switch (bni->_contact_event)
+  {
+    case NotifyUtils::ContactEvent::REGISTERED:
+      c_event = STR_REGISTERED;
+      c_state = STR_ACTIVE;
+      break;
+    case NotifyUtils::ContactEvent::CREATED:
+      c_event = STR_CREATED;
+      c_state = STR_ACTIVE;
+      break;
+    case NotifyUtils::ContactEvent::REFRESHED:
+      c_event = STR_REFRESHED;
+      c_state = STR_ACTIVE;
+      break;
+    case NotifyUtils::ContactEvent::SHORTENED:
+      c_event = STR_SHORTENED;
+      c_state = STR_ACTIVE;
+      break;
+    case NotifyUtils::ContactEvent::EXPIRED:
+      c_event = STR_EXPIRED;
+      c_state = STR_TERMINATED;
+      break;
+  }
 
-  pj_xml_node *contact_node;
-  pj_xml_attr *attr;
+  append_indent(out, 2);
+  out.push_back('<');
+  append(out, STR_CONTACT);
+  append_attr(out, STR_ID, Utils::xml_escape(bni->_id));
+  append_attr(out, STR_STATE, c_state);
+  append_attr(out, STR_EVENT_LOWER, c_event);
+  out.push_back('>');
+
+  // Add the URI element
+  append_indent(out, 3);
+  out.push_back('<');
+  append(out, STR_URI);
+  std::string c_uri = Utils::xml_escape(bni->_b->_uri);
+
+  if (c_uri.empty())
+  {
+    out.append(" />");
+  }
+  else
+  {
+    out.push_back('>');
+    out.append(c_uri);
+    out.append("</");
+    append(out, STR_URI);
+    out.push_back('>');
+  }
 
-  contact_node = pj_xml_node_new(pool, &STR_CONTACT);
+  std::string gruu = Utils::xml_escape(bni->_b->pub_gruu_str(pool));
 
-  // Contact node requires an id, state and event
-  attr = pj_xml_attr_new(pool, &STR_ID, id);
-  pj_xml_add_attr(contact_node, attr);
-  attr = pj_xml_attr_new(pool, &STR_STATE, state);
-  pj_xml_add_attr(contact_node, attr);
-  attr = pj_xml_attr_new(pool, &STR_EVENT_LOWER, event);
-  pj_xml_add_attr(contact_node, attr);
+  if (!gruu.empty())
+  {
+    TRC_DEBUG("Create pub-gruu node");
+    append_indent(out, 3);
+    out.push_back('<');
+    append(out, STR_XML_PUB_GRUU);
+    append_attr(out, STR_URI, gruu);
+    out.append(" />");
+  }
 
-  return contact_node;
+  append_close(out, 2, STR_CONTACT);
 }
 
-// Create complete XML body for a NOTIFY
-pj_xml_node* notify_create_reg_state_xml(
-                         pj_pool_t *pool,
-                         std::string& aor,
-                         std::vector<std::string> irs_impus,
-                         SubscriberDataManager::AoR::Subscription* subscription,
-                         std::vector<NotifyUtils::BindingNotifyInformation*> bnis,
-                         NotifyUtils::RegistrationState reg_state)
+// Create the complete XML body for a NOTIFY.  We need one registration
+// element per IMPU in the Implicit Registration Set, with the same
+// binding/contact information in each.
+//
+// Note that TS24.229 is ambiguous on how bindings for different IMPUs in an
+// IRS should be reported (see 5.4.2.1.2 4) e) IV) ).  For now, Clearwater
+// assumes that the same binding/contact data needs to be reported for each
+// IMPU.
+NotifyUtils::RegInfoBody::RegInfoBody(
+                const std::vector<std::string>& irs_impus,
+                const std::vector<NotifyUtils::BindingNotifyInformation*>& bnis,
+                NotifyUtils::RegistrationState reg_state) :
+  _segments(),
+  _length(0)
 {
   TRC_DEBUG("Create the XML body for a SIP NOTIFY");
 
-  pj_xml_node *doc, *reg_node, *contact_node, *uri_node;
-  pj_xml_attr *attr;
-
-  // Create the root document
-  doc = pj_xml_node_new(pool, &STR_REGINFO);
-
-  // Add attributes to the doc
-  attr = pj_xml_attr_new(pool, &STR_XMLNS_NAME, &STR_XMLNS_VAL);
-  pj_xml_add_attr(doc, attr);
-  attr = pj_xml_attr_new(pool, &STR_XMLNS_GRUU_NAME, &STR_XMLNS_GRUU_VAL);
-  pj_xml_add_attr(doc, attr);
-  attr = pj_xml_attr_new(pool, &STR_XMLNS_XSI_NAME, &STR_XMLNS_XSI_VAL);
-  pj_xml_add_attr(doc, attr);
-  attr = pj_xml_attr_new(pool, &STR_VERSION, &STR_VERSION_VAL);
-  pj_xml_add_attr(doc, attr);
-
-  // Add the state - this will be partial except on an initial subscription
-  const pj_str_t* state_str = &STR_FULL;
-  attr = pj_xml_attr_new(pool, &STR_STATE, state_str);
-  pj_xml_add_attr(doc, attr);
-
-  // Create the registration nodes.  We need one per IMPU in the Implicit
-  // Registration Set, with the same binding/contact information in each.
-  //
-  // Note that TS24.229 is ambiguous on how bindings for different IMPUs in an
-  // IRS should be reported (see 5.4.2.1.2 4) e) IV) ).  For now, Clearwater
-  // assumes that the same binding/contact data needs to be reported for each
-  // IMPU.
-  pj_str_t reg_aor;
-  pj_str_t reg_id;
-  pj_str_t reg_state_str;
-
-  // Iterate over the IRS, inserting a registration element for each one
-  for (std::vector<std::string>::const_iterator impu = irs_impus.begin();
-       impu != irs_impus.end();
-       ++impu)
+  pj_pool_t* pool = pj_pool_create(stack_data.pool_cache->factory(),
+                                   "notify",
+                                   1024,
+                                   512,
+                                   NULL);
+
+  // Every registration element has the same contacts, so write them once.
+  std::string contacts;
+  for (std::vector<NotifyUtils::BindingNotifyInformation*>::const_iterator bni =
+         bnis.begin();
+       bni != bnis.end();
+       ++bni)
   {
-    // Escape the IMPU as an aor
-    std::string unescaped_aor = *impu;
-    pj_strdup2(pool, &reg_aor, Utils::xml_escape(unescaped_aor).c_str());
-    std::string unescaped_reg_id = subscription->_to_tag;
-    pj_strdup2(pool, &reg_id, Utils::xml_escape(unescaped_reg_id).c_str());
-    reg_state_str = (reg_state == NotifyUtils::RegistrationState::ACTIVE)
-                                                    ? STR_ACTIVE : STR_TERMINATED;
-    reg_node = create_reg_node(pool, &reg_aor, &reg_id, &reg_state_str);
-
-    // Create the contact nodes
-    // For each binding, add a contact node to the registration node
-    for (std::vector<NotifyUtils::BindingNotifyInformation*>::const_iterator bni =
-           bnis.begin();
-         bni != bnis.end();
-         ++bni)
-    {
-      // for each attribute, correctly populate
-      pj_str_t c_id;
-      pj_str_t c_state;
-      pj_str_t c_event;
-
-      std::string unescaped_c_id = (*bni)->_id;
-      pj_strdup2(pool, &c_id, Utils::xml_escape(unescaped_c_id).c_str());
+    append_contact(contacts, pool, *bni);
+  }
 
-      switch ((*bni)->_contact_event)
-      {
-        case NotifyUtils::ContactEvent::REGISTERED:
-          c_event = STR_REGISTERED;
-          c_state = STR_ACTIVE;
-          break;
-        case NotifyUtils::ContactEvent::CREATED:
-          c_event = STR_CREATED;
-          c_state = STR_ACTIVE;
-          break;
-        case NotifyUtils::ContactEvent::REFRESHED:
-          c_event = STR_REFRESHED;
-          c_state = STR_ACTIVE;
-          break;
-        case NotifyUtils::ContactEvent::SHORTENED:
-          c_event = STR_SHORTENED;
-          c_state = STR_ACTIVE;
-          break;
-        case NotifyUtils::ContactEvent::EXPIRED:
-          c_event = STR_EXPIRED;
-          c_state = STR_TERMINATED;
-          break;
-      }
+  pj_pool_release(pool);
 
-      contact_node = create_contact_node(pool,
-                                         &c_id,
-                                         &c_state,
-                                         &c_event);
+  pj_str_t reg_state_str = (reg_state == NotifyUtils::RegistrationState::ACTIVE)
+                                                  ? STR_ACTIVE : STR_TERMINATED;
 
-      // Create and add URI element
-      pj_str_t c_uri;
+  // The state will be partial except on an initial subscription.
+  std::string out = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<";
+  append(out, STR_REGINFO);
+  append_attr(out, STR_XMLNS_NAME, STR_XMLNS_VAL);
+  append_attr(out, STR_XMLNS_GRUU_NAME, STR_XMLNS_GRUU_VAL);
+  append_attr(out, STR_XMLNS_XSI_NAME, STR_XMLNS_XSI_VAL);
+  append_attr(out, STR_VERSION, STR_VERSION_VAL);
+  append_attr(out, STR_STATE, STR_FULL);
 
-      if ((*bni)->_b->_uri.size() > 0)
-      {
-        std::string unescaped_c_uri = (*bni)->_b->_uri;
-        pj_strdup2(pool, &c_uri, Utils::xml_escape(unescaped_c_uri).c_str());
-      }
+  if (irs_impus.empty())
+  {
+    out.append(" />\n");
+    _length = out.size();
+    _segments.push_back(out);
+    return;
+  }
 
-      uri_node = pj_xml_node_new(pool, &STR_URI);
-      pj_strdup(pool, &uri_node->content, &c_uri);
-      pj_xml_add_node(contact_node, uri_node);
+  out.push_back('>');
 
-      pj_str_t gruu;
-      pj_strdup2(pool,
-                 &gruu,
-                 Utils::xml_escape((*bni)->_b->pub_gruu_str(pool)).c_str());
+  for (std::vector<std::string>::const_iterator impu = irs_impus.begin();
+       impu != irs_impus.end();
+       ++impu)
+  {
+    append_indent(out, 1);
+    out.push_back('<');
+    append(out, STR_REGISTRATION);
+    append_attr(out, STR_AOR, Utils::xml_escape(*impu));
 
-      if (gruu.slen != 0)
-      {
-        TRC_DEBUG("Create pub-gruu node");
+    // The id attribute goes here.
+    _length += out.size();
+    _segments.push_back(out);
+    out.clear();
 
-        pj_xml_node* gruu_node = pj_xml_node_new(pool, &STR_XML_PUB_GRUU);
-        attr = pj_xml_attr_new(pool, &STR_URI, &gruu);
-        pj_xml_add_attr(gruu_node, attr);
-        pj_xml_add_node(contact_node, gruu_node);
-      }
+    append_attr(out, STR_STATE, reg_state_str);
 
-      // Add the contact node to the registration node
-      pj_xml_add_node(reg_node, contact_node);
+    if (contacts.empty())
+    {
+      out.append(" />");
+    }
+    else
+    {
+      out.push_back('>');
+      out.append(contacts);
+      append_close(out, 1, STR_REGISTRATION);
     }
-
-    pj_xml_add_node(doc, reg_node);
-
   }
-  return doc;
-}
 
-// Print XML message body.
-static int xml_print_body( struct pjsip_msg_body *msg_body,
-                         char *buf, pj_size_t size)
-{
-  return pj_xml_print((const pj_xml_node*)msg_body->data, buf, size,
-                       PJ_TRUE);
+  append_close(out, 0, STR_REGINFO);
+  out.push_back('\n');
+  _length += out.size();
+  _segments.push_back(out);
 }
 
-// Create the body of a SIP NOTIFY
-pj_status_t notify_create_body(pjsip_msg_body* body,
-                               pj_pool_t *pool,
-                               std::string& aor,
-                               std::vector<std::string> irs_impus,
-                               SubscriberDataManager::AoR::Subscription* subscription,
-                               std::vector<NotifyUtils::BindingNotifyInformation*> bnis,
-                               NotifyUtils::RegistrationState reg_state)
+std::string NotifyUtils::RegInfoBody::render(const std::string& reg_id) const
 {
-  TRC_DEBUG("Create body of a SIP NOTIFY");
+  std::string id_attr;
+  append_attr(id_attr, STR_ID, Utils::xml_escape(reg_id));
 
-  pj_xml_node *doc;
-  doc = notify_create_reg_state_xml(pool,
-                                    aor,
-                                    irs_impus,
-                                    subscription,
-                                    bnis,
-                                    reg_state);
+  std::string out;
+  out.reserve(_length + (_segments.size() - 1) * id_attr.size());
+  out.append(_segments[0]);
 
-  if (doc == NULL)
+  for (size_t ii = 1; ii < _segments.size(); ++ii)
   {
-    // LCOV_EXCL_START
-    TRC_DEBUG("Failed to create body");
-    return PJ_FALSE;
-    // LCOV_EXCL_STOP
+    out.append(id_attr);
+    out.append(_segments[ii]);
   }
 
-  body->content_type.type = STR_MIME_TYPE;
-  body->content_type.subtype = STR_MIME_SUBTYPE;
-
-  body->data = doc;
-  body->len = 0;
-
-  body->print_body = &xml_print_body;
-
-  return PJ_SUCCESS;
+  return out;
 }
 
 pj_status_t create_request_from_subscription(
@@ -316,10 +309,8 @@ pj_status_t create_request_from_subscription(
 pj_status_t NotifyUtils::create_subscription_notify(
                                     pjsip_tx_data** tdata_notify,
                                     SubscriberDataManager::AoR::Subscription* s,
-                                    std::string aor,
-                                    std::vector<std::string> irs_impus,
                                     SubscriberDataManager::AoR* aor_data,
-                                    std::vector<NotifyUtils::BindingNotifyInformation*> bnis,
+                                    const NotifyUtils::RegInfoBody& body,
                                     NotifyUtils::RegistrationState reg_state,
                                     int now)
 {
@@ -335,10 +326,8 @@ pj_status_t NotifyUtils::create_subscription_notify(
 
   pj_status_t status = NotifyUtils::create_notify(tdata_notify,
                                                   s,
-                                                  aor,
-                                                  irs_impus,
                                                   aor_data->_notify_cseq,
-                                                  bnis,
+                                                  body,
                                                   reg_state,
                                                   state,
                                                   expiry);
@@ -348,10 +337,8 @@ pj_status_t NotifyUtils::create_subscription_notify(
 pj_status_t NotifyUtils::create_notify(
                                     pjsip_tx_data** tdata_notify,
                                     SubscriberDataManager::AoR::Subscription* subscription,
-                                    std::string aor,
-                                    std::vector<std::string> irs_impus,
                                     int cseq,
-                                    std::vector<NotifyUtils::BindingNotifyInformation*> bnis,
+                                    const NotifyUtils::RegInfoBody& body,
                                     NotifyUtils::RegistrationState reg_state,
                                     NotifyUtils::SubscriptionState subscription_state,
                                     int expiry)
@@ -426,16 +413,12 @@ pj_status_t NotifyUtils::create_notify(
     pj_list_push_back( &(*tdata_notify)->msg->hdr, sub_state_hdr);
 
     // complete body
-    pjsip_msg_body *body2;
-    body2 = PJ_POOL_ZALLOC_T((*tdata_notify)->pool, pjsip_msg_body);
-    status = notify_create_body(body2,
-                               (*tdata_notify)->pool,
-                                aor,
-                                irs_impus,
-                                subscription,
-                                bnis,
-                                reg_state);
-    (*tdata_notify)->msg->body = body2;
+    std::string text = body.render(subscription->_to_tag);
+    pj_str_t body_str = pj_str((char*)text.c_str());
+    (*tdata_notify)->msg->body = pjsip_msg_body_create((*tdata_notify)->pool,
+                                                       &STR_MIME_TYPE,
+                                                       &STR_MIME_SUBTYPE,
+                                                       &body_str);
   }
   else
   {
@@ -45,11 +45,17 @@ extern "C" {
 #include "sproutsasevent.h"
 #include "pjutils.h"
 #include "uri_classifier.h"
+#include "common_sip_processing.h"
+#include "thread_dispatcher.h"
+#include "options.h"
+
+static SNMP::CounterByScopeTable* fast_path_counter = NULL;
 
 //
 // mod_options handles SIP OPTIONS polls targeted at this system.
 //
 static pj_bool_t on_rx_request(pjsip_rx_data *rdata);
+static pj_bool_t on_rx_request_fast_path(pjsip_rx_data *rdata);
 
 pjsip_module mod_options =
 {
@@ -68,6 +74,66 @@ pjsip_module mod_options =
   NULL,                               // on_tsx_state()
 };
 
+//
+// mod_options_fast_path answers the same OPTIONS polls on the transport
+// thread, before they are counted by overload control or cloned and queued
+// for the worker threads.  It runs straight after connection tracking, so
+// the polls still keep their connections alive for quiescing purposes.
+//
+pjsip_module mod_options_fast_path =
+{
+  NULL, NULL,                           // prev, next
+  pj_str("mod-options-fast-path"),      // Name
+  -1,                                   // Id
+  PJSIP_MOD_PRIORITY_TRANSPORT_LAYER-3, // Priority
+  NULL,                                 // load()
+  NULL,                                 // start()
+  NULL,                                 // stop()
+  NULL,                                 // unload()
+  &on_rx_request_fast_path,             // on_rx_request()
+  NULL,                                 // on_rx_response()
+  NULL,                                 // on_tx_request()
+  NULL,                                 // on_tx_response()
+  NULL,                                 // on_tsx_state()
+};
+
+
+/// Returns whether the request is an OPTIONS poll targeted at this node,
+/// with either no route header or a single local route header.
+static bool is_local_options_poll(pjsip_rx_data* rdata)
+{
+  return ((rdata->msg_info.msg->line.req.method.id == PJSIP_OPTIONS_METHOD) &&
+          (URIClassifier::classify_uri(rdata->msg_info.msg->line.req.uri) == NODE_LOCAL_SIP_URI) &&
+          (PJUtils::check_route_headers(rdata)));
+}
+
+
+pj_bool_t on_rx_request_fast_path(pjsip_rx_data* rdata)
+{
+  // Leave malformed requests for common processing to reject, and leave
+  // everything to the worker threads if they appear to be deadlocked, so
+  // that health checks notice the problem.
+  if ((!pj_list_empty((pj_list_type*)&rdata->msg_info.parse_err)) ||
+      (!is_local_options_poll(rdata)) ||
+      (worker_threads_deadlocked()))
+  {
+    return PJ_FALSE;
+  }
+
+  TRC_DEBUG("Respond to OPTIONS poll on transport thread");
+
+  // OPTIONS polls aren't logged to SAS.
+  set_trail(rdata, DONT_LOG_TO_SAS);
+  PJUtils::respond_stateless(stack_data.endpt, rdata, 200, NULL, NULL, NULL);
+
+  if (fast_path_counter != NULL)
+  {
+    fast_path_counter->increment();
+  }
+
+  return PJ_TRUE;
+}
+
 
 pj_bool_t on_rx_request(pjsip_rx_data* rdata)
 {
@@ -75,36 +141,40 @@ pj_bool_t on_rx_request(pjsip_rx_data* rdata)
   SAS::Event event(get_trail(rdata), SASEvent::BEGIN_OPTIONS_MODULE, 0);
   SAS::report_event(event);
 
-  URIClass uri_class = URIClassifier::classify_uri(rdata->msg_info.msg->line.req.uri);
-  if (rdata->msg_info.msg->line.req.method.id == PJSIP_OPTIONS_METHOD)
+  if (is_local_options_poll(rdata))
   {
-    if ((uri_class == NODE_LOCAL_SIP_URI) &&
-        PJUtils::check_route_headers(rdata))
-    {
-      // OPTIONS targetted at this node/home domain, and there's either no route
-      // header or a single local route header. espond statelessly.
-      PJUtils::respond_stateless(stack_data.endpt, rdata, 200, NULL, NULL, NULL);
-      return PJ_TRUE;
-    }
+    // OPTIONS targetted at this node/home domain, and there's either no route
+    // header or a single local route header. Respond statelessly.
+    PJUtils::respond_stateless(stack_data.endpt, rdata, 200, NULL, NULL, NULL);
+    return PJ_TRUE;
   }
 
   return PJ_FALSE;
 }
 
 
-pj_status_t init_options()
+pj_status_t init_options(SNMP::CounterByScopeTable* fast_path_counter_arg)
 {
   pj_status_t status;
 
-  // Register the options module.
+  fast_path_counter = fast_path_counter_arg;
+
+  // Register the options modules.
   status = pjsip_endpt_register_module(stack_data.endpt, &mod_options);
 
+  if (status == PJ_SUCCESS)
+  {
+    status = pjsip_endpt_register_module(stack_data.endpt, &mod_options_fast_path);
+  }
+
   return status;
 }
 
 
 void destroy_options()
 {
+  pjsip_endpt_unregister_module(stack_data.endpt, &mod_options_fast_path);
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_options);
+  fast_path_counter = NULL;
 }
 
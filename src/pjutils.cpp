@@ -922,18 +922,19 @@ void PJUtils::resolve(const std::string& name,
 }
 
 
-/// Resolves the next hop target of the SIP message
-void PJUtils::resolve_next_hop(pjsip_tx_data* tdata,
-                               int retries,
-                               std::vector<AddrInfo>& servers,
-                               SAS::TrailId trail)
+/// Works out the name, port and transport to resolve for the next hop target
+/// of the SIP message.
+static void next_hop_resolution_params(pjsip_tx_data* tdata,
+                                       std::string& name,
+                                       int& port,
+                                       int& transport)
 {
   // Get the next hop URI from the message and parse out the destination, port
   // and transport.
   pjsip_sip_uri* next_hop = (pjsip_sip_uri*)PJUtils::next_hop(tdata->msg);
-  std::string name = std::string(next_hop->host.ptr, next_hop->host.slen);
-  int port = next_hop->port;
-  int transport = -1;
+  name = std::string(next_hop->host.ptr, next_hop->host.slen);
+  port = next_hop->port;
+  transport = -1;
   if (pj_stricmp2(&next_hop->transport_param, "TCP") == 0)
   {
     transport = IPPROTO_TCP;
@@ -942,6 +943,19 @@ void PJUtils::resolve_next_hop(pjsip_tx_data* tdata,
   {
     transport = IPPROTO_UDP;
   }
+}
+
+
+/// Resolves the next hop target of the SIP message
+void PJUtils::resolve_next_hop(pjsip_tx_data* tdata,
+                               int retries,
+                               std::vector<AddrInfo>& servers,
+                               SAS::TrailId trail)
+{
+  std::string name;
+  int port;
+  int transport;
+  next_hop_resolution_params(tdata, name, port, transport);
 
   if (retries == 0)
   {
@@ -959,11 +973,37 @@ void PJUtils::resolve_next_hop(pjsip_tx_data* tdata,
 
   TRC_INFO("Resolved destination URI %s to %d servers",
            PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
-                                  (pjsip_uri*)next_hop).c_str(),
+                                  PJUtils::next_hop(tdata->msg)).c_str(),
            servers.size());
 }
 
 
+/// Starts resolving the next hop target of the SIP message on a resolver
+/// thread.  The message is not accessed once this returns.
+std::shared_ptr<SIPResolver::PendingResolution> PJUtils::resolve_next_hop_async(pjsip_tx_data* tdata,
+                                                                                int retries,
+                                                                                SAS::TrailId trail)
+{
+  std::string name;
+  int port;
+  int transport;
+  next_hop_resolution_params(tdata, name, port, transport);
+
+  if (retries == 0)
+  {
+    // Used default number of retries.
+    retries = DEFAULT_RETRIES;
+  }
+
+  return stack_data.sipresolver->resolve_async(name,
+                                               stack_data.addr_family,
+                                               port,
+                                               transport,
+                                               retries,
+                                               trail);
+}
+
+
 /// Blacklists the specified server so it will not be preferred in subsequent
 /// resolve calls.
 void PJUtils::blacklist_server(AddrInfo& server)
@@ -999,6 +1039,74 @@ void PJUtils::generate_new_branch_id(pjsip_tx_data* tdata)
 }
 
 
+/// Adds a top Via header to a request that is being forwarded statelessly.
+/// The branch identifier is derived from the received request rather than
+/// generated at random, so that retransmissions of the request are forwarded
+/// with the same branch (as required by RFC 3261 section 16.11).  It is an
+/// MD5 hash of the received top Via branch, Call-ID, CSeq and Request-URI.
+void PJUtils::add_stateless_top_via(pjsip_tx_data* tdata,
+                                    pjsip_rx_data* rdata)
+{
+  pj_md5_context ctx;
+  pj_uint8_t digest[16];
+  pj_md5_init(&ctx);
+
+  if (rdata->msg_info.via != NULL)
+  {
+    pj_md5_update(&ctx,
+                  (pj_uint8_t*)rdata->msg_info.via->branch_param.ptr,
+                  rdata->msg_info.via->branch_param.slen);
+  }
+
+  if (rdata->msg_info.cid != NULL)
+  {
+    pj_md5_update(&ctx,
+                  (pj_uint8_t*)rdata->msg_info.cid->id.ptr,
+                  rdata->msg_info.cid->id.slen);
+  }
+
+  if (rdata->msg_info.cseq != NULL)
+  {
+    std::string cseq = std::to_string(rdata->msg_info.cseq->cseq) + " " +
+                       pj_str_to_string(&rdata->msg_info.cseq->method.name);
+    pj_md5_update(&ctx, (pj_uint8_t*)cseq.data(), cseq.length());
+  }
+
+  char uri_buf[PJSIP_MAX_URL_SIZE];
+  int uri_len = pjsip_uri_print(PJSIP_URI_IN_REQ_URI,
+                                rdata->msg_info.msg->line.req.uri,
+                                uri_buf,
+                                sizeof(uri_buf));
+  if (uri_len > 0)
+  {
+    pj_md5_update(&ctx, (pj_uint8_t*)uri_buf, uri_len);
+  }
+
+  pj_md5_final(&ctx, digest);
+
+  pjsip_via_hdr *hvia = pjsip_via_hdr_create(tdata->pool);
+  pjsip_msg_insert_first_hdr(tdata->msg, (pjsip_hdr*)hvia);
+
+  // Format the branch as the RFC3261 prefix, "Pj" (to be consistent with
+  // branch IDs generated by PJSIP) and the hex digest.
+  hvia->branch_param.ptr = (char*)
+            pj_pool_alloc(tdata->pool,
+                          PJSIP_RFC3261_BRANCH_LEN + 2 + 2 * sizeof(digest));
+  pj_memcpy(hvia->branch_param.ptr,
+            PJSIP_RFC3261_BRANCH_ID,
+            PJSIP_RFC3261_BRANCH_LEN);
+  char* p = hvia->branch_param.ptr + PJSIP_RFC3261_BRANCH_LEN;
+  *p++ = 'P';
+  *p++ = 'j';
+  for (size_t ii = 0; ii < sizeof(digest); ++ii)
+  {
+    pj_val_to_hex_digit(digest[ii], p);
+    p += 2;
+  }
+  hvia->branch_param.slen = p - hvia->branch_param.ptr;
+}
+
+
 /// Sets the dest_info structure in a pjsip_tx_data structure to the IP address,
 /// port and transport in the specified AddrInfo structure.
 void PJUtils::set_dest_info(pjsip_tx_data* tdata, const AddrInfo& ai)
@@ -2485,7 +2593,7 @@ std::set<pjmedia_type> PJUtils::get_media_types(const pjsip_msg *msg)
       (!pj_stricmp2(&msg->body->content_type.subtype, "sdp")))
   {
     // Parse the SDP, using a temporary pool.
-    pj_pool_t* tmp_pool = pj_pool_create(&stack_data.cp.factory, "Mmtel", 1024, 512, NULL);
+    pj_pool_t* tmp_pool = pj_pool_create(stack_data.pool_cache->factory(), "Mmtel", 1024, 512, NULL);
     pjmedia_sdp_session *sdp_sess;
     if (pjmedia_sdp_parse(tmp_pool, (char *)msg->body->data, msg->body->len, &sdp_sess) == PJ_SUCCESS)
     {
@@ -0,0 +1,320 @@
+/**
+ * @file pool_cache.cpp Per-thread cache of PJLIB memory pools.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <string.h>
+
+#include "log.h"
+#include "pool_cache.h"
+
+// The calling thread's cache, and the ID of the PoolCache it belongs to.  The
+// ID is held separately so that a thread never dereferences a cache that
+// belonged to a PoolCache that has since been destroyed.
+static __thread void* tl_cache = NULL;
+static __thread uint64_t tl_cache_id = 0;
+
+static std::atomic<uint64_t> next_cache_id(1);
+
+PoolCache::PoolCache(pj_caching_pool* cp, size_t max_pools_per_class) :
+  _cp(cp),
+  _max_pools_per_class(max_pools_per_class),
+  _id(next_cache_id++),
+  _thread_caches(),
+  _hits(0),
+  _misses(0),
+  _overflows(0),
+  _cached_pools(0),
+  _cached_pools_hwm(0)
+{
+  // Blocks are allocated and freed using the caching pool's policy, so they
+  // come from (and go back to) the same place regardless of which factory
+  // the pool currently belongs to.
+  memset(&_factory, 0, sizeof(_factory));
+  _factory.base.policy = cp->factory.policy;
+  _factory.base.create_pool = &PoolCache::create_pool;
+  _factory.base.release_pool = &PoolCache::release_pool;
+  _factory.base.dump_status = &PoolCache::dump_status;
+  _factory.base.on_block_alloc = &PoolCache::on_block_alloc;
+  _factory.base.on_block_free = &PoolCache::on_block_free;
+  _factory.cache = this;
+
+  pthread_mutex_init(&_thread_caches_lock, NULL);
+}
+
+PoolCache::~PoolCache()
+{
+  // Return every cached pool to the caching pool.  This must only be called
+  // once no other threads are using the cache.
+  for (std::vector<ThreadCache*>::iterator cache = _thread_caches.begin();
+       cache != _thread_caches.end();
+       ++cache)
+  {
+    for (std::vector<SizeClass>::iterator sc = (*cache)->classes.begin();
+         sc != (*cache)->classes.end();
+         ++sc)
+    {
+      for (std::vector<pj_pool_t*>::iterator pool = sc->pools.begin();
+           pool != sc->pools.end();
+           ++pool)
+      {
+        release_to_caching_pool(*pool);
+      }
+    }
+    delete *cache;
+  }
+
+  if (tl_cache_id == _id)
+  {
+    tl_cache = NULL;
+    tl_cache_id = 0;
+  }
+
+  pthread_mutex_destroy(&_thread_caches_lock);
+}
+
+void PoolCache::get_stats(Stats& stats) const
+{
+  stats.hits = _hits.load();
+  stats.misses = _misses.load();
+  stats.overflows = _overflows.load();
+  stats.cached_pools = _cached_pools.load();
+  stats.cached_pools_hwm = _cached_pools_hwm.load();
+}
+
+void PoolCache::log_stats() const
+{
+  Stats stats;
+  get_stats(stats);
+  TRC_STATUS("Pool cache: %lu hits, %lu misses, %lu overflows, %lu pools cached (high water mark %lu)",
+             stats.hits,
+             stats.misses,
+             stats.overflows,
+             stats.cached_pools,
+             stats.cached_pools_hwm);
+}
+
+pj_pool_t* PoolCache::create_pool(pj_pool_factory* factory,
+                                  const char* name,
+                                  pj_size_t initial_size,
+                                  pj_size_t increment_size,
+                                  pj_pool_callback* callback)
+{
+  return ((Factory*)factory)->cache->create(name,
+                                            initial_size,
+                                            increment_size,
+                                            callback);
+}
+
+void PoolCache::release_pool(pj_pool_factory* factory, pj_pool_t* pool)
+{
+  ((Factory*)factory)->cache->release(pool);
+}
+
+void PoolCache::dump_status(pj_pool_factory* factory, pj_bool_t detail)
+{
+  PoolCache* cache = ((Factory*)factory)->cache;
+  cache->log_stats();
+  cache->_cp->factory.dump_status(&cache->_cp->factory, detail);
+}
+
+pj_bool_t PoolCache::on_block_alloc(pj_pool_factory* factory, pj_size_t size)
+{
+  // Keep the caching pool's usage statistics up to date.
+  pj_caching_pool* cp = ((Factory*)factory)->cache->_cp;
+  return (cp->factory.on_block_alloc != NULL) ?
+                      cp->factory.on_block_alloc(&cp->factory, size) : PJ_TRUE;
+}
+
+void PoolCache::on_block_free(pj_pool_factory* factory, pj_size_t size)
+{
+  pj_caching_pool* cp = ((Factory*)factory)->cache->_cp;
+  if (cp->factory.on_block_free != NULL)
+  {
+    cp->factory.on_block_free(&cp->factory, size);
+  }
+}
+
+pj_pool_t* PoolCache::create(const char* name,
+                             pj_size_t initial_size,
+                             pj_size_t increment_size,
+                             pj_pool_callback* callback)
+{
+  ThreadCache* cache = thread_cache();
+  SizeClass* sc = size_class(cache, increment_size);
+
+  if ((sc != NULL) && (!sc->pools.empty()))
+  {
+    // Reuse a pool from this thread's cache.  It was reset when it was
+    // released, so just needs renaming and its callback setting.
+    pj_pool_t* pool = sc->pools.back();
+    sc->pools.pop_back();
+    --_cached_pools;
+    ++_hits;
+
+    if (name == NULL)
+    {
+      pool->obj_name[0] = '\0';
+    }
+    else if (strchr(name, '%') != NULL)
+    {
+      pj_ansi_snprintf(pool->obj_name, sizeof(pool->obj_name), name, pool);
+    }
+    else
+    {
+      pj_ansi_strncpy(pool->obj_name, name, sizeof(pool->obj_name));
+      pool->obj_name[sizeof(pool->obj_name) - 1] = '\0';
+    }
+    pool->callback = (callback != NULL) ? callback : _factory.base.policy.callback;
+
+    return pool;
+  }
+
+  // Create a new pool from the caching pool.  If we've learned how much
+  // pools of this class typically use, size the first block to match.
+  ++_misses;
+
+  if ((sc != NULL) && (sc->learned_size > initial_size))
+  {
+    initial_size = sc->learned_size;
+  }
+
+  pj_pool_t* pool = _cp->factory.create_pool(&_cp->factory,
+                                             name,
+                                             initial_size,
+                                             increment_size,
+                                             callback);
+  if (pool != NULL)
+  {
+    // Point the pool at this factory so that it is released back here.
+    pool->factory = &_factory.base;
+  }
+
+  return pool;
+}
+
+void PoolCache::release(pj_pool_t* pool)
+{
+  ThreadCache* cache = thread_cache();
+  SizeClass* sc = size_class(cache, pool->increment_size);
+
+  if (sc == NULL)
+  {
+    release_to_caching_pool(pool);
+    return;
+  }
+
+  // Learn from how much of the pool was used, rounding up and capping the
+  // size so one unusually large message doesn't skew it too far.
+  pj_size_t used = pj_pool_get_used_size(pool);
+  sc->learned_size = sc->learned_size - (sc->learned_size / 8) + (used / 8);
+  sc->learned_size = ((sc->learned_size + LEARNED_SIZE_GRANULARITY - 1) /
+                      LEARNED_SIZE_GRANULARITY) * LEARNED_SIZE_GRANULARITY;
+  if (sc->learned_size > MAX_LEARNED_SIZE)
+  {
+    sc->learned_size = MAX_LEARNED_SIZE;
+  }
+
+  if (sc->pools.size() >= _max_pools_per_class)
+  {
+    ++_overflows;
+    release_to_caching_pool(pool);
+    return;
+  }
+
+  pj_pool_reset(pool);
+  sc->pools.push_back(pool);
+
+  size_t cached = ++_cached_pools;
+  size_t hwm = _cached_pools_hwm.load();
+  while ((cached > hwm) &&
+         (!_cached_pools_hwm.compare_exchange_weak(hwm, cached)))
+  {
+    // Another thread raised the high water mark - retry with its value.
+  }
+}
+
+PoolCache::ThreadCache* PoolCache::thread_cache()
+{
+  if (tl_cache_id != _id)
+  {
+    ThreadCache* cache = new ThreadCache();
+    cache->classes.reserve(MAX_SIZE_CLASSES);
+
+    pthread_mutex_lock(&_thread_caches_lock);
+    _thread_caches.push_back(cache);
+    pthread_mutex_unlock(&_thread_caches_lock);
+
+    tl_cache = cache;
+    tl_cache_id = _id;
+  }
+
+  return (ThreadCache*)tl_cache;
+}
+
+PoolCache::SizeClass* PoolCache::size_class(ThreadCache* cache,
+                                           pj_size_t increment_size)
+{
+  for (std::vector<SizeClass>::iterator sc = cache->classes.begin();
+       sc != cache->classes.end();
+       ++sc)
+  {
+    if (sc->increment_size == increment_size)
+    {
+      return &(*sc);
+    }
+  }
+
+  if (cache->classes.size() < MAX_SIZE_CLASSES)
+  {
+    SizeClass sc;
+    sc.increment_size = increment_size;
+    sc.learned_size = 0;
+    sc.pools.reserve(_max_pools_per_class);
+    cache->classes.push_back(sc);
+    return &cache->classes.back();
+  }
+
+  return NULL;
+}
+
+void PoolCache::release_to_caching_pool(pj_pool_t* pool)
+{
+  pool->factory = &_cp->factory;
+  _cp->factory.release_pool(&_cp->factory, pool);
+}
@@ -65,6 +65,7 @@ extern "C" {
 #include "notify_utils.h"
 #include "snmp_success_fail_count_table.h"
 #include "uri_classifier.h"
+#include "expiring_cache.h"
 
 static SubscriberDataManager* sdm;
 static std::vector<SubscriberDataManager*> remote_sdms;
@@ -77,6 +78,49 @@ static ACRFactory* acr_factory;
 
 static int max_expires;
 
+// Period for which registration data returned by Homestead is reused for
+// re-registrations, rather than sending another SAR.  Zero disables this.
+static int reg_refresh_window;
+
+// Registration data returned by Homestead, cached by public ID for the
+// refresh window.
+struct CachedRegData
+{
+  std::string private_id;
+  std::string regstate;
+  std::vector<std::string> uris;
+  std::map<std::string, Ifcs> ifc_map;
+  std::deque<std::string> ccfs;
+  std::deque<std::string> ecfs;
+};
+static const size_t MAX_CACHED_REG_DATA = 100000;
+static ExpiringCache<CachedRegData>* reg_data_cache = NULL;
+
+// Forgets cached registration data when an AoR is deregistered, whether by
+// the UE, by the network or by its bindings expiring, so that the next
+// REGISTER is always reported to Homestead.
+class RegDataInvalidator : public SubscriberDataManager::RegistrationListener
+{
+public:
+  void registration_state_changed(const std::string& aor_id,
+                                  const std::vector<std::string>& irs_impus,
+                                  bool registered)
+  {
+    if (!registered)
+    {
+      reg_data_cache->erase(aor_id);
+
+      for (std::vector<std::string>::const_iterator i = irs_impus.begin();
+           i != irs_impus.end();
+           ++i)
+      {
+        reg_data_cache->erase(*i);
+      }
+    }
+  }
+};
+static RegDataInvalidator reg_data_invalidator;
+
 // Pre-constructed Service Route header added to REGISTER responses.
 static pjsip_routing_hdr* service_route;
 
@@ -244,6 +288,9 @@ SubscriberDataManager::AoRPair* write_to_store(
   bool all_bindings_expired = false;
   Store::Status set_rc;
 
+  // Hold the AoR lock across the read-modify-write loop below.
+  SubscriberDataManager::AoRLock aor_lock(primary_sdm, aor);
+
   do
   {
     // delete NULL is safe, so we can do this on every iteration.
@@ -463,6 +510,71 @@ SubscriberDataManager::AoRPair* write_to_store(
   return aor_pair;
 }
 
+/// Looks up cached registration data for a re-registration.  Returns false if
+/// there is no data, it is outside the refresh window, or it was returned for
+/// a different private ID.
+static bool get_cached_reg_data(const std::string& public_id,
+                                const std::string& private_id,
+                                int now,
+                                std::string& regstate,
+                                std::map<std::string, Ifcs>& ifc_map,
+                                std::vector<std::string>& uris,
+                                std::deque<std::string>& ccfs,
+                                std::deque<std::string>& ecfs)
+{
+  bool found = false;
+  std::shared_ptr<const CachedRegData> data = reg_data_cache->get(public_id,
+                                                                  now);
+
+  if ((data != NULL) &&
+      ((private_id.empty()) || (private_id == data->private_id)))
+  {
+    regstate = data->regstate;
+    ifc_map = data->ifc_map;
+    uris = data->uris;
+    ccfs = data->ccfs;
+    ecfs = data->ecfs;
+    found = true;
+  }
+
+  return found;
+}
+
+
+/// Caches the registration data returned by Homestead for a REGISTER.
+static void cache_reg_data(const std::string& public_id,
+                           const std::string& private_id,
+                           int now,
+                           const std::string& regstate,
+                           const std::map<std::string, Ifcs>& ifc_map,
+                           const std::vector<std::string>& uris,
+                           const std::deque<std::string>& ccfs,
+                           const std::deque<std::string>& ecfs)
+{
+  std::shared_ptr<CachedRegData> data = std::make_shared<CachedRegData>();
+  data->private_id = private_id;
+  data->regstate = regstate;
+  data->ifc_map = ifc_map;
+  data->uris = uris;
+  data->ccfs = ccfs;
+  data->ecfs = ecfs;
+
+  reg_data_cache->set(public_id, data, now + reg_refresh_window, now);
+}
+
+
+/// Removes any cached registration data for the specified public IDs.
+static void invalidate_reg_data(const std::vector<std::string>& uris)
+{
+  for (std::vector<std::string>::const_iterator i = uris.begin();
+       i != uris.end();
+       ++i)
+  {
+    reg_data_cache->erase(*i);
+  }
+}
+
+
 void process_register_request(pjsip_rx_data* rdata)
 {
   pj_status_t status;
@@ -482,6 +594,7 @@ void process_register_request(pjsip_rx_data* rdata)
   // If there are valid registration updates to make then attempt to write to
   // store, which also stops emergency registrations from being deregistered.
   int num_contacts = 0;
+  int num_deregisters = 0;
   int num_emergency_bindings = 0;
   int num_emergency_deregisters = 0;
   bool reject_with_400 = false;
@@ -502,6 +615,11 @@ void process_register_request(pjsip_rx_data* rdata)
       break;
     }
 
+    if (expiry == 0)
+    {
+      num_deregisters++;
+    }
+
     if (PJUtils::is_emergency_registration(contact_hdr))
     {
       num_emergency_bindings++;
@@ -623,15 +741,53 @@ void process_register_request(pjsip_rx_data* rdata)
   std::deque<std::string> ccfs;
   std::deque<std::string> ecfs;
 
-  HTTPCode http_code = hss->update_registration_state(public_id,
-                                                      private_id,
-                                                      HSSConnection::REG,
-                                                      regstate,
-                                                      ifc_map,
-                                                      uris,
-                                                      ccfs,
-                                                      ecfs,
-                                                      trail);
+  HTTPCode http_code = HTTP_OK;
+  bool used_cached_reg_data = false;
+
+  if ((reg_refresh_window > 0) &&
+      (num_contacts > 0) &&
+      (num_deregisters == 0) &&
+      (!reject_with_400) &&
+      (get_cached_reg_data(public_id,
+                           private_id,
+                           now,
+                           regstate,
+                           ifc_map,
+                           uris,
+                           ccfs,
+                           ecfs)))
+  {
+    // This is a refresh within the refresh window, so there's no need to
+    // tell Homestead about it.
+    TRC_DEBUG("Using cached registration data for %s", public_id.c_str());
+    used_cached_reg_data = true;
+  }
+  else
+  {
+    http_code = hss->update_registration_state(public_id,
+                                               private_id,
+                                               HSSConnection::REG,
+                                               regstate,
+                                               ifc_map,
+                                               uris,
+                                               ccfs,
+                                               ecfs,
+                                               trail);
+
+    if ((reg_refresh_window > 0) &&
+        (http_code == HTTP_OK) &&
+        (num_deregisters == 0))
+    {
+      cache_reg_data(public_id,
+                     private_id,
+                     now,
+                     regstate,
+                     ifc_map,
+                     uris,
+                     ccfs,
+                     ecfs);
+    }
+  }
 
   if (process_hss_sip_failure(http_code,
                               regstate,
@@ -745,6 +901,48 @@ void process_register_request(pjsip_rx_data* rdata)
                                    trail);
   }
 
+  if ((reg_refresh_window > 0) &&
+      ((all_bindings_expired) || (num_deregisters > 0)))
+  {
+    invalidate_reg_data(uris);
+  }
+  else if ((used_cached_reg_data) && (is_initial_registration))
+  {
+    // We used cached data, but there were no bindings in the store so this
+    // is actually an initial registration (for example, the bindings have
+    // timed out since the data was cached).  Homestead must be told about
+    // this.
+    TRC_DEBUG("No existing bindings for %s - registering at the HSS",
+              public_id.c_str());
+    http_code = hss->update_registration_state(public_id,
+                                               private_id,
+                                               HSSConnection::REG,
+                                               regstate,
+                                               ifc_map,
+                                               uris,
+                                               ccfs,
+                                               ecfs,
+                                               trail);
+
+    if (http_code == HTTP_OK)
+    {
+      cache_reg_data(public_id,
+                     private_id,
+                     now,
+                     regstate,
+                     ifc_map,
+                     uris,
+                     ccfs,
+                     ecfs);
+    }
+    else
+    {
+      TRC_WARNING("Failed to register %s at the HSS: %d",
+                  public_id.c_str(), http_code);
+      invalidate_reg_data(uris);
+    }
+  }
+
   if ((aor_pair != NULL) && (aor_pair->get_current() != NULL))
   {
     // Log the bindings.
@@ -1098,7 +1296,8 @@ void process_register_request(pjsip_rx_data* rdata)
                                                          expiry,
                                                          is_initial_registration,
                                                          public_id,
-                                                         trail);
+                                                         trail,
+                                                         aor_pair->get_current());
   }
 
   // Now we can free the tdata.
@@ -1157,7 +1356,10 @@ pj_status_t init_registrar(SubscriberDataManager* reg_sdm,
                            int cfg_max_expires,
                            bool force_original_register_inclusion,
                            SNMP::RegistrationStatsTables* reg_stats_tbls,
-                           SNMP::RegistrationStatsTables* third_party_reg_stats_tbls)
+                           SNMP::RegistrationStatsTables* third_party_reg_stats_tbls,
+                           int cfg_reg_refresh_window,
+                           int cfg_third_party_reg_refresh_window,
+                           SNMP::CounterTable* third_party_reg_suppressed_tbl)
 {
   pj_status_t status;
 
@@ -1165,11 +1367,21 @@ pj_status_t init_registrar(SubscriberDataManager* reg_sdm,
   remote_sdms = reg_remote_sdms;
   hss = hss_connection;
   max_expires = cfg_max_expires;
+  reg_refresh_window = cfg_reg_refresh_window;
   acr_factory = rfacr_factory;
   reg_stats_tables = reg_stats_tbls;
   third_party_reg_stats_tables = third_party_reg_stats_tbls;
 
-  RegistrationUtils::init(third_party_reg_stats_tbls, force_original_register_inclusion);
+  if (reg_refresh_window > 0)
+  {
+    reg_data_cache = new ExpiringCache<CachedRegData>(MAX_CACHED_REG_DATA);
+    sdm->add_registration_listener(&reg_data_invalidator);
+  }
+
+  RegistrationUtils::init(third_party_reg_stats_tbls,
+                          force_original_register_inclusion,
+                          cfg_third_party_reg_refresh_window,
+                          third_party_reg_suppressed_tbl);
 
   // Construct a Service-Route header pointing at the S-CSCF ready to be added
   // to REGISTER 200 OK response.
@@ -1226,6 +1438,12 @@ int expiry_for_binding(pjsip_contact_hdr* contact, pjsip_expires_hdr* expires)
 
 void destroy_registrar()
 {
+  if (reg_data_cache != NULL)
+  {
+    sdm->remove_registration_listener(&reg_data_invalidator);
+    delete reg_data_cache; reg_data_cache = NULL;
+  }
+
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_registrar);
 }
 
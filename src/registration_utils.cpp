@@ -54,6 +54,7 @@ extern "C" {
 #include <boost/lexical_cast.hpp>
 #include "sproutsasevent.h"
 #include "snmp_success_fail_count_table.h"
+#include "expiring_cache.h"
 
 #define MAX_SIP_MSG_SIZE 65535
 
@@ -63,11 +64,28 @@ static SNMP::RegistrationStatsTables* third_party_reg_stats_tables;
 // messages to application servers, even if the iFCs don't tell us to?
 static bool force_third_party_register_body;
 
+// Period before a third-party registration expires at an application server
+// within which re-registrations are passed on to it.  Outside this window,
+// re-registrations that don't change the bindings aren't passed on.  Zero
+// passes on every re-registration.
+static int third_party_reg_refresh_window;
+
+// SNMP table that counts third-party REGISTERs that weren't sent.
+static SNMP::CounterTable* third_party_reg_suppressed_tbl;
+
+// Successful third-party registrations, indexed by public ID and application
+// server, and cached until they expire at the application server.  The
+// value is the set of bindings the application server was told about.
+static const size_t MAX_THIRD_PARTY_REGS = 1000000;
+static ExpiringCache<std::string>* third_party_regs = NULL;
+
 /// Temporary data structure maintained while transmitting a third-party
 /// REGISTER to an application server.
 struct ThirdPartyRegData
 {
   std::string public_id;
+  std::string server_name;
+  std::string bindings;
   DefaultHandling default_handling;
   SAS::TrailId trail;
   int expires;
@@ -80,13 +98,126 @@ void send_register_to_as(pjsip_rx_data* received_register,
                          int expires,
                          bool is_initial_registration,
                          const std::string&,
+                         const std::string&,
                          SAS::TrailId);
 
 void RegistrationUtils::init(SNMP::RegistrationStatsTables* third_party_reg_stats_tables_arg,
-                             bool force_third_party_register_body_arg)
+                             bool force_third_party_register_body_arg,
+                             int third_party_reg_refresh_window_arg,
+                             SNMP::CounterTable* third_party_reg_suppressed_tbl_arg)
 {
   third_party_reg_stats_tables = third_party_reg_stats_tables_arg;
   force_third_party_register_body = force_third_party_register_body_arg;
+  third_party_reg_refresh_window = third_party_reg_refresh_window_arg;
+  third_party_reg_suppressed_tbl = third_party_reg_suppressed_tbl_arg;
+
+  delete third_party_regs; third_party_regs = NULL;
+
+  if (third_party_reg_refresh_window > 0)
+  {
+    third_party_regs = new ExpiringCache<std::string>(MAX_THIRD_PARTY_REGS);
+  }
+}
+
+/// Summarises the bindings reported to application servers, so we can tell
+/// whether they have changed since the last third-party REGISTER.
+static std::string binding_set(SubscriberDataManager::AoR* aor_data)
+{
+  std::string bindings;
+
+  if (aor_data != NULL)
+  {
+    for (SubscriberDataManager::AoR::Bindings::const_iterator i =
+                                                aor_data->bindings().begin();
+         i != aor_data->bindings().end();
+         ++i)
+    {
+      bindings.append(i->first).append(1, '\0');
+      bindings.append(i->second->_uri).append(1, '\0');
+    }
+  }
+
+  return bindings;
+}
+
+static std::string third_party_reg_key(const std::string& public_id,
+                                       const std::string& server_name)
+{
+  return public_id + '\0' + server_name;
+}
+
+/// Checks whether an application server already has a registration for the
+/// public ID, with the same bindings, that isn't about to expire.
+static bool third_party_reg_current(const std::string& public_id,
+                                    const std::string& server_name,
+                                    const std::string& bindings,
+                                    int now)
+{
+  // Look the registration up as at the start of the refresh window, so that
+  // registrations that are about to expire aren't returned.
+  std::shared_ptr<const std::string> registered_bindings =
+    third_party_regs->get(third_party_reg_key(public_id, server_name),
+                          now + third_party_reg_refresh_window);
+
+  return ((registered_bindings != NULL) &&
+          (*registered_bindings == bindings));
+}
+
+/// Records the outcome of a third-party REGISTER.  A failure or
+/// deregistration forgets the registration, so the next REGISTER is sent.
+///
+/// @param expires  The expiry the application server granted.
+static void record_third_party_reg(const std::string& public_id,
+                                   const std::string& server_name,
+                                   const std::string& bindings,
+                                   int expires,
+                                   bool success)
+{
+  int now = time(NULL);
+  std::string key = third_party_reg_key(public_id, server_name);
+
+  if ((success) && (expires > 0))
+  {
+    third_party_regs->set(key,
+                          std::make_shared<std::string>(bindings),
+                          now + expires,
+                          now);
+  }
+  else
+  {
+    third_party_regs->erase(key);
+  }
+}
+
+/// Works out the expiry an application server granted in its response to a
+/// third-party REGISTER.  The application server may shorten the expiry we
+/// asked for, in the expires parameter of the Contact (which is the S-CSCF's
+/// URI) or in an Expires header.  If it does neither, it granted the expiry
+/// that was requested.
+static int granted_expiry(pjsip_event* event, int requested_expiry)
+{
+  int expiry = requested_expiry;
+
+  if ((event->type == PJSIP_EVENT_TSX_STATE) &&
+      (event->body.tsx_state.type == PJSIP_EVENT_RX_MSG))
+  {
+    pjsip_msg* msg = event->body.tsx_state.src.rdata->msg_info.msg;
+    pjsip_contact_hdr* contact = (pjsip_contact_hdr*)
+                            pjsip_msg_find_hdr(msg, PJSIP_H_CONTACT, NULL);
+    pjsip_expires_hdr* expires = (pjsip_expires_hdr*)
+                            pjsip_msg_find_hdr(msg, PJSIP_H_EXPIRES, NULL);
+
+    if ((contact != NULL) && (contact->expires != -1))
+    {
+      expiry = contact->expires;
+    }
+    else if (expires != NULL)
+    {
+      expiry = expires->ivalue;
+    }
+  }
+
+  return expiry;
 }
 
 void RegistrationUtils::deregister_with_application_servers(Ifcs& ifcs,
@@ -111,7 +242,8 @@ void RegistrationUtils::register_with_application_servers(Ifcs& ifcs,
                                                           int expires,
                                                           bool is_initial_registration,
                                                           const std::string& served_user,
-                                                          SAS::TrailId trail)
+                                                          SAS::TrailId trail,
+                                                          SubscriberDataManager::AoR* aor_data)
 {
   // Function preconditions
   if (received_register == NULL)
@@ -186,11 +318,37 @@ void RegistrationUtils::register_with_application_servers(Ifcs& ifcs,
 
   TRC_INFO("Found %d Application Servers", as_list.size());
 
+  std::string bindings;
+  int now = time(NULL);
+
+  if (third_party_reg_refresh_window > 0)
+  {
+    bindings = binding_set(aor_data);
+  }
+
   // Loop through the as_list
   for (std::vector<AsInvocation>::iterator as_iter = as_list.begin();
        as_iter != as_list.end();
        as_iter++)
   {
+    if ((third_party_reg_refresh_window > 0) &&
+        (expires > 0) &&
+        (!is_initial_registration) &&
+        (third_party_reg_current(served_user, as_iter->server_name, bindings, now)))
+    {
+      // The application server's registration is good for a while yet and
+      // nothing it was told about has changed, so don't refresh it.
+      TRC_DEBUG("Skip third-party REGISTER for %s to %s",
+                served_user.c_str(), as_iter->server_name.c_str());
+
+      if (third_party_reg_suppressed_tbl != NULL)
+      {
+        third_party_reg_suppressed_tbl->increment();
+      }
+
+      continue;
+    }
+
     if (third_party_reg_stats_tables != NULL)
     {
       if (expires == 0)
@@ -206,7 +364,7 @@ void RegistrationUtils::register_with_application_servers(Ifcs& ifcs,
         third_party_reg_stats_tables->re_reg_tbl->increment_attempts();
       }
     }
-    send_register_to_as(received_register, ok_response, *as_iter, expires, is_initial_registration, served_user, trail);
+    send_register_to_as(received_register, ok_response, *as_iter, expires, is_initial_registration, served_user, bindings, trail);
   }
 }
 
@@ -229,6 +387,15 @@ static void send_register_cb(void* token, pjsip_event *event)
     third_party_register_failed(tsxdata->public_id, tsxdata->trail);
   }
 
+  if (third_party_reg_refresh_window > 0)
+  {
+    record_third_party_reg(tsxdata->public_id,
+                           tsxdata->server_name,
+                           tsxdata->bindings,
+                           granted_expiry(event, tsxdata->expires),
+                           (tsx->status_code == 200));
+  }
+
   if (third_party_reg_stats_tables != NULL)
   {
     if (tsx->status_code == 200)
@@ -274,6 +441,7 @@ void send_register_to_as(pjsip_rx_data *received_register,
                          int expires,
                          bool is_initial_registration,
                          const std::string& served_user,
+                         const std::string& bindings,
                          SAS::TrailId trail)
 {
   pj_status_t status;
@@ -404,6 +572,8 @@ void send_register_to_as(pjsip_rx_data *received_register,
   tsxdata->default_handling = as.default_handling;
   tsxdata->trail = trail;
   tsxdata->public_id = served_user;
+  tsxdata->server_name = as.server_name;
+  tsxdata->bindings = bindings;
   tsxdata->expires = expires;
   tsxdata->is_initial_registration = is_initial_registration;
   pj_status_t resolv_status = PJUtils::send_request(tdata, 0, tsxdata, &send_register_cb);
@@ -430,6 +600,9 @@ static bool expire_bindings(SubscriberDataManager *sdm,
   bool all_bindings_expired = false;
   Store::Status set_rc;
 
+  // Hold the AoR lock across the read-modify-write loop below.
+  SubscriberDataManager::AoRLock aor_lock(sdm, aor);
+
   do
   {
     SubscriberDataManager::AoRPair* aor_pair = sdm->get_aor_data(aor, trail);
@@ -40,6 +40,7 @@
 #include "json_parse_utils.h"
 #include <fstream>
 #include <stdlib.h>
+#include <string.h>
 #include <algorithm>
 
 #include "scscfselector.h"
@@ -52,6 +53,7 @@ SCSCFSelector::SCSCFSelector(const std::string& fallback_scscf_uri,
                              std::string configuration) :
   _fallback_scscf_uri(fallback_scscf_uri),
   _configuration(configuration),
+  _config(std::make_shared<const Config>()),
   _updater(NULL)
 {
   // create an updater
@@ -171,9 +173,50 @@ void SCSCFSelector::update_scscf()
     new_scscfs.push_back(new_scscf);
   }
 
-  // Take a write lock on the mutex in RAII style
-  boost::lock_guard<boost::shared_mutex> write_lock(_scscfs_rw_lock);
-  _scscfs = new_scscfs;
+  // Compile the capabilities into bitsets, so that get_scscf can match each
+  // S-CSCF with a few word operations rather than set operations on vectors.
+  std::map<int, size_t> new_capability_bits;
+  for (std::vector<scscf_t>::const_iterator it = new_scscfs.begin();
+       it != new_scscfs.end();
+       ++it)
+  {
+    for (std::vector<int>::const_iterator cap = it->capabilities.begin();
+         cap != it->capabilities.end();
+         ++cap)
+    {
+      if (new_capability_bits.find(*cap) == new_capability_bits.end())
+      {
+        size_t bit = new_capability_bits.size();
+        new_capability_bits[*cap] = bit;
+      }
+    }
+  }
+
+  size_t new_capability_words = (new_capability_bits.size() + 63) / 64;
+  std::vector<uint64_t> new_capability_sets(new_scscfs.size() *
+                                            new_capability_words, 0);
+
+  for (size_t ii = 0; ii < new_scscfs.size(); ++ii)
+  {
+    uint64_t* caps = &new_capability_sets[ii * new_capability_words];
+
+    for (std::vector<int>::const_iterator cap = new_scscfs[ii].capabilities.begin();
+         cap != new_scscfs[ii].capabilities.end();
+         ++cap)
+    {
+      size_t bit = new_capability_bits[*cap];
+      caps[bit / 64] |= ((uint64_t)1 << (bit % 64));
+    }
+  }
+
+  // Swap in the new configuration.  Selections in progress carry on with the
+  // old one.
+  std::shared_ptr<Config> new_config = std::make_shared<Config>();
+  new_config->scscfs.swap(new_scscfs);
+  new_config->capability_bits.swap(new_capability_bits);
+  new_config->capability_words = new_capability_words;
+  new_config->capability_sets.swap(new_capability_sets);
+  _config.set(new_config);
 }
 
 SCSCFSelector::~SCSCFSelector()
@@ -183,95 +226,177 @@ SCSCFSelector::~SCSCFSelector()
   _updater = NULL;
 }
 
+// Renders a list of capabilities for SAS and logging, sorted and with
+// duplicates removed.
+static std::string capabilities_to_str(const std::vector<int>& capabilities)
+{
+  std::vector<int> caps = capabilities;
+  std::sort(caps.begin(), caps.end());
+  caps.erase(unique(caps.begin(), caps.end()), caps.end());
+
+  std::string caps_str;
+  for (std::vector<int>::const_iterator ii = caps.begin(); ii != caps.end(); ++ii)
+  {
+    caps_str = caps_str + std::to_string(*ii) + ";";
+  }
+
+  return caps_str;
+}
+
+// Renders a list of rejected S-CSCFs for SAS.
+static std::string rejects_to_str(const std::vector<std::string>& rejects)
+{
+  std::string reject_str;
+  for (std::vector<std::string>::const_iterator ii = rejects.begin(); ii != rejects.end(); ++ii)
+  {
+    reject_str = reject_str + *ii + ";";
+  }
+
+  return reject_str;
+}
+
+bool SCSCFSelector::has_capabilities(const Config& config,
+                                     size_t index,
+                                     const uint64_t* mask)
+{
+  const uint64_t* caps = config.capability_sets.data() + (index * config.capability_words);
+
+  for (size_t ii = 0; ii < config.capability_words; ++ii)
+  {
+    if ((caps[ii] & mask[ii]) != mask[ii])
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int SCSCFSelector::count_capabilities(const Config& config,
+                                      size_t index,
+                                      const uint64_t* mask)
+{
+  const uint64_t* caps = config.capability_sets.data() + (index * config.capability_words);
+  int count = 0;
+
+  for (size_t ii = 0; ii < config.capability_words; ++ii)
+  {
+    count += __builtin_popcountll(caps[ii] & mask[ii]);
+  }
+
+  return count;
+}
+
 std::string SCSCFSelector::get_scscf(const std::vector<int> &mandatory,
                                      const std::vector<int> &optional,
                                      const std::vector<std::string> &rejects,
                                      SAS::TrailId trail)
 {
-  // Take a read lock on the mutex in RAII style. See
-  // http://www.boost.org/doc/libs/1_41_0/doc/html/thread/synchronization.html
-  // for documentation.
-  boost::shared_lock<boost::shared_mutex> read_lock(_scscfs_rw_lock);
+  ConfigSnapshot<Config>::Reader config(_config);
 
-  // There's at least one S-CSCF, so check if any match the capabilities requested
-  std::string reject_str;
-  for (std::vector<std::string>::const_iterator ii = rejects.begin(); ii != rejects.end(); ++ii)
+  // Convert the requested capabilities into bitsets using the capability
+  // index. These live on the stack unless the configuration has an unusually
+  // large number of distinct capabilities.
+  uint64_t inline_masks[2 * MAX_INLINE_CAPABILITY_WORDS];
+  std::vector<uint64_t> heap_masks;
+  uint64_t* mandatory_mask = inline_masks;
+
+  if (config->capability_words > MAX_INLINE_CAPABILITY_WORDS)
   {
-    reject_str = reject_str + *ii + ";";
+    // LCOV_EXCL_START
+    heap_masks.resize(2 * config->capability_words);
+    mandatory_mask = heap_masks.data();
+    // LCOV_EXCL_STOP
   }
 
-  // Sort the mandatory capabilities, and remove duplicates.
-  std::vector<int> mandatory_cap = mandatory;
-  std::sort(mandatory_cap.begin(), mandatory_cap.end());
-  mandatory_cap.erase(unique(mandatory_cap.begin(), mandatory_cap.end()), mandatory_cap.end());
-  std::string mandatory_str;
-  for (std::vector<int>::const_iterator ii = mandatory_cap.begin(); ii != mandatory_cap.end(); ++ii)
+  uint64_t* optional_mask = mandatory_mask + config->capability_words;
+  memset(mandatory_mask, 0, 2 * config->capability_words * sizeof(uint64_t));
+
+  // If a mandatory capability isn't supported by any S-CSCF then none of them
+  // can match. Optional capabilities that no S-CSCF supports can't affect the
+  // choice, so are just ignored.
+  bool mandatory_supported = true;
+
+  for (std::vector<int>::const_iterator ii = mandatory.begin(); ii != mandatory.end(); ++ii)
   {
-    mandatory_str = mandatory_str + std::to_string(*ii) + ";";
+    std::map<int, size_t>::const_iterator bit = config->capability_bits.find(*ii);
+
+    if (bit == config->capability_bits.end())
+    {
+      mandatory_supported = false;
+      break;
+    }
+
+    mandatory_mask[bit->second / 64] |= ((uint64_t)1 << (bit->second % 64));
   }
 
-  // Sort the optional capabilities, and remove duplicates.
-  std::vector<int> optional_cap = optional;
-  std::sort(optional_cap.begin(), optional_cap.end());
-  optional_cap.erase(unique(optional_cap.begin(), optional_cap.end()), optional_cap.end());
-  std::string optional_str;
-  for (std::vector<int>::const_iterator ii = optional_cap.begin(); ii != optional_cap.end(); ++ii)
+  for (std::vector<int>::const_iterator ii = optional.begin(); ii != optional.end(); ++ii)
   {
-    optional_str = optional_str + std::to_string(*ii) + ";";
+    std::map<int, size_t>::const_iterator bit = config->capability_bits.find(*ii);
+
+    if (bit != config->capability_bits.end())
+    {
+      optional_mask[bit->second / 64] |= ((uint64_t)1 << (bit->second % 64));
+    }
   }
 
   // Find all S-CSCFs that have all the mandatory capabilities, the highest possible number
   // of optional capabilities, and the highest priority (closest to 0).
-  // Also sum up the weights of the valid S-CSCFs as part of the iteration
-  std::vector<scscf> matches;
-  u_int max_size = 0;
+  // Also sum up the weights of the valid S-CSCFs as part of the iteration.
+  // Rather than building a list of matches, remember the best score and pick
+  // the S-CSCF out on a second pass if there is more than one match.
+  size_t num_matches = 0;
+  size_t match_index = 0;
+  int max_size = 0;
   int priority = 0;
   int sum = 0;
 
-  for (std::vector<scscf>::iterator it=_scscfs.begin(); it!=_scscfs.end(); ++it)
+  for (size_t ii = 0; mandatory_supported && (ii < config->scscfs.size()); ++ii)
   {
-    // Only include the S-CSCF if its name isn't in the list of S-CSCFs to reject and it has all of
-    // the mandatory capabilities
-    if ((std::find(rejects.begin(), rejects.end(), it->server) == rejects.end()) &&
-        (std::includes(it->capabilities.begin(), it->capabilities.end(), mandatory_cap.begin(), mandatory_cap.end())))
+    // Only include the S-CSCF if it has all of the mandatory capabilities and
+    // its name isn't in the list of S-CSCFs to reject
+    if ((!has_capabilities(*config, ii, mandatory_mask)) ||
+        (std::find(rejects.begin(), rejects.end(), config->scscfs[ii].server) != rejects.end()))
     {
-      std::vector<int> intersection;
-      std::set_intersection(it->capabilities.begin(), it->capabilities.end(),
-                            optional_cap.begin(), optional_cap.end(),
-                            std::back_inserter(intersection));
+      continue;
+    }
+
+    int intersection_size = count_capabilities(*config, ii, optional_mask);
 
-      if (intersection.size() > max_size ||
-          matches.size() == 0)
+    if (intersection_size > max_size ||
+        num_matches == 0)
+    {
+      num_matches = 1;
+      match_index = ii;
+      max_size = intersection_size;
+      priority = config->scscfs[ii].priority;
+      sum = config->scscfs[ii].weight;
+    }
+    else if (intersection_size == max_size)
+    {
+      if (config->scscfs[ii].priority == priority)
       {
-        matches.clear();
-        matches.push_back(*it);
-        max_size = intersection.size();
-        priority = it->priority;
-        sum = it->weight;
+        num_matches++;
+        sum += config->scscfs[ii].weight;
       }
-      else if (intersection.size() == max_size)
+      else if (config->scscfs[ii].priority < priority)
       {
-        if (it->priority == priority)
-        {
-          matches.push_back(*it);
-          sum += it->weight;
-        }
-        else if (it->priority < priority)
-        {
-          matches.clear();
-          matches.push_back(*it);
-          priority = it->priority;
-          sum = it->weight;
-        }
+        num_matches = 1;
+        match_index = ii;
+        priority = config->scscfs[ii].priority;
+        sum = config->scscfs[ii].weight;
       }
     }
   }
 
   // If there are no matches, return an empty string (there will only be no matches
   // if no S-CSCFs had all the requested mandatory capabilities).
-  // If there's only one match, then return its name.
-  if (matches.empty())
+  if (num_matches == 0)
   {
+    std::string mandatory_str = capabilities_to_str(mandatory);
+    std::string optional_str = capabilities_to_str(optional);
+    std::string reject_str = rejects_to_str(rejects);
+
     TRC_WARNING("There are no configured S-CSCFs that have the requested mandatory capabilities (%s)",
                 mandatory_str.c_str());
 
@@ -283,51 +408,55 @@ std::string SCSCFSelector::get_scscf(const std::vector<int> &mandatory,
 
     return std::string();
   }
-  else if (matches.size() == 1)
+  else if (num_matches > 1)
   {
-    TRC_DEBUG("Selected S-CSCF is %s",  matches[0].server.c_str());
+    // There are multiple S-CSCFs that match on all mandatory capabilities, the highest number of optional
+    // capabilities, and the highest priority. Select one using a weighted random choice.
+    srand(time(NULL));
+    int random;
+    random = rand() % sum;
+
+    int accumulator = 0;
+
+    for (size_t ii = match_index; ii < config->scscfs.size(); ++ii)
+    {
+      if ((config->scscfs[ii].priority == priority) &&
+          (has_capabilities(*config, ii, mandatory_mask)) &&
+          (count_capabilities(*config, ii, optional_mask) == max_size) &&
+          (std::find(rejects.begin(), rejects.end(), config->scscfs[ii].server) == rejects.end()))
+      {
+        match_index = ii;
+        accumulator += config->scscfs[ii].weight;
+
+        if (accumulator > random)
+        {
+          break;
+        }
+      }
+    }
+  }
+
+  const scscf_t& selected = config->scscfs[match_index];
+  TRC_DEBUG("Selected S-CSCF is %s",  selected.server.c_str());
 
+  // Only build the strings for the SAS event if there's a trail to log it
+  // on, as this is the common path.
+  if (trail != 0)
+  {
     SAS::Event event(trail, SASEvent::SCSCF_SELECTED, 0);
-    event.add_var_param(matches[0].server);
+    event.add_var_param(selected.server);
+    std::string mandatory_str = capabilities_to_str(mandatory);
+    std::string optional_str = capabilities_to_str(optional);
+    std::string priority_str = std::to_string(selected.priority);
+    std::string weight_str = std::to_string(selected.weight);
+    std::string reject_str = rejects_to_str(rejects);
     event.add_var_param(mandatory_str);
     event.add_var_param(optional_str);
-    std::string priority_str = std::to_string(matches[0].priority);
-    std::string weight_str = std::to_string(matches[0].weight);
     event.add_var_param(priority_str);
     event.add_var_param(weight_str);
     event.add_var_param(reject_str);
     SAS::report_event(event);
-
-    return matches[0].server.c_str();
   }
 
-  // There are multiple S-CSCFs that match on all mandatory capabilities, the highest number of optional
-  // capabilities, and the highest priority. Select one using a weighted random choice.
-  srand(time(NULL));
-  int random;
-  random = rand() % sum;
-
-  int index = 0;
-  int accumulator = matches[index].weight;
-
-  while (accumulator <= random)
-  {
-    index++;
-    accumulator +=  matches[index].weight;
-  }
-
-  TRC_DEBUG("Selected S-CSCF is %s",  matches[index].server.c_str());
-
-  SAS::Event event(trail, SASEvent::SCSCF_SELECTED, 0);
-  event.add_var_param(matches[index].server);
-  event.add_var_param(mandatory_str);
-  event.add_var_param(optional_str);
-  std::string priority_str = std::to_string(matches[index].priority);
-  std::string weight_str = std::to_string(matches[index].weight);
-  event.add_var_param(priority_str);
-  event.add_var_param(weight_str);
-  event.add_var_param(reject_str);
-  SAS::report_event(event);
-
-  return matches[index].server;
+  return selected.server;
 }
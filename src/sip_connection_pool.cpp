@@ -44,6 +44,7 @@ extern "C" {
 // Common STL includes.
 #include <cassert>
 #include <string>
+#include <algorithm>
 
 #include "log.h"
 #include "utils.h"
@@ -56,7 +57,8 @@ SIPConnectionPool::SIPConnectionPool(pjsip_host_port* target,
                                pj_pool_t* pool,
                                pjsip_endpoint* endpt,
                                pjsip_tpfactory* tp_factory,
-                               SNMP::IPCountTable* sprout_count_tbl) :
+                               SNMP::IPCountTable* sprout_count_tbl,
+                               SNMP::U32Scalar* max_load_scalar) :
   _target(*target),
   _num_connections(num_connections),
   _recycle_period(recycle_period),
@@ -67,12 +69,19 @@ SIPConnectionPool::SIPConnectionPool(pjsip_host_port* target,
   _recycler(NULL),
   _terminated(false),
   _active_connections(0),
-  _sprout_count_tbl(sprout_count_tbl)
+  _sprout_count_tbl(sprout_count_tbl),
+  _max_load_scalar(max_load_scalar)
 {
   TRC_STATUS("Creating connection pool to %.*s:%d", _target.host.slen, _target.host.ptr, _target.port);
   TRC_STATUS("  connections = %d, recycle time = %d +/- %d seconds", _num_connections, _recycle_period, _recycle_margin);
 
-  pthread_mutex_init(&_tp_hash_lock, NULL);
+  // Prefer writers on the hash lock, so a steady stream of requests can't
+  // starve connection state updates.
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&_tp_hash_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
   _tp_hash.resize(_num_connections);
 }
 
@@ -90,6 +99,8 @@ SIPConnectionPool::~SIPConnectionPool()
 
   // Quiesce all the connections.
   quiesce_connections();
+
+  pthread_rwlock_destroy(&_tp_hash_lock);
 }
 
 
@@ -101,9 +112,9 @@ void SIPConnectionPool::init()
     create_connection(ii);
   }
 
-  if (_recycle_period != 0)
+  if ((_recycle_period != 0) || (_max_load_scalar != NULL))
   {
-    // Spawn a thread to recycle connections
+    // Spawn a thread to recycle connections and report on their load
     pj_status_t status = pj_thread_create(_pool, "recycler",
                                           &recycle_thread,
                                           (void*)this, 0, 0, &_recycler);
@@ -122,27 +133,28 @@ pjsip_transport* SIPConnectionPool::get_connection()
 {
   pjsip_transport* tp = NULL;
 
-  pthread_mutex_lock(&_tp_hash_lock);
+  pthread_rwlock_rdlock(&_tp_hash_lock);
 
   if (_active_connections > 0)
   {
-    // Select a transport by starting at a random point in the hash and
-    // stepping through the hash until a connected entry is found.
-    int start_slot = rand() % _num_connections;
-    int ii = start_slot;
-    while (!_tp_hash[ii].connected)
+    // Pick two connected slots at random and use whichever has less
+    // outstanding work.  This avoids both the herd behaviour of always picking
+    // the least loaded connection and the imbalance of a purely random choice.
+    int slot = random_connected_slot();
+    int other_slot = random_connected_slot();
+
+    if ((slot != -1) &&
+        (other_slot != -1) &&
+        (other_slot != slot) &&
+        (connection_load(_tp_hash[other_slot].tp) < connection_load(_tp_hash[slot].tp)))
     {
-      ii = (ii + 1) % _num_connections;
-      if (ii == start_slot)
-      {
-        break;
-      }
+      slot = other_slot;
     }
 
-    tp = _tp_hash[ii].tp;
-
-    if (tp != NULL)
+    if (slot != -1)
     {
+      tp = _tp_hash[slot].tp;
+
       // Add a reference to the transport to make sure it is not destroyed.
       // The reference must be decremented once again when the transport is set
       // on the message.
@@ -150,12 +162,69 @@ pjsip_transport* SIPConnectionPool::get_connection()
     }
   }
 
-  pthread_mutex_unlock(&_tp_hash_lock);
+  pthread_rwlock_unlock(&_tp_hash_lock);
 
   return tp;
 }
 
 
+int SIPConnectionPool::random_connected_slot()
+{
+  // Each thread keeps its own random state, as rand() takes a global lock.
+  static __thread unsigned int seed = 0;
+
+  if (seed == 0)
+  {
+    seed = (unsigned int)time(NULL) ^ (unsigned int)pthread_self();
+  }
+
+  // Start at a random point in the hash and step through the hash until a
+  // connected entry is found.
+  int start_slot = rand_r(&seed) % _num_connections;
+  int ii = start_slot;
+
+  while ((!_tp_hash[ii].connected) || (_tp_hash[ii].tp == NULL))
+  {
+    ii = (ii + 1) % _num_connections;
+    if (ii == start_slot)
+    {
+      return -1;
+    }
+  }
+
+  return ii;
+}
+
+
+int SIPConnectionPool::connection_load(pjsip_transport* tp)
+{
+  return pj_atomic_get(tp->ref_cnt) - 1;
+}
+
+
+void SIPConnectionPool::report_connection_load()
+{
+  int max_load = 0;
+
+  pthread_rwlock_rdlock(&_tp_hash_lock);
+
+  for (size_t ii = 0; ii < _tp_hash.size(); ++ii)
+  {
+    if ((_tp_hash[ii].connected) && (_tp_hash[ii].tp != NULL))
+    {
+      int load = connection_load(_tp_hash[ii].tp);
+      TRC_VERBOSE("Transport %s in slot %zu has load %d",
+                  _tp_hash[ii].tp->obj_name, ii, load);
+      max_load = std::max(max_load, load);
+    }
+  }
+
+  pthread_rwlock_unlock(&_tp_hash_lock);
+
+  _max_load_scalar->value = max_load;
+}
+
+
 pj_status_t SIPConnectionPool::resolve_host(const pj_str_t* host,
                                             int port,
                                             pj_sockaddr* addr)
@@ -252,7 +321,7 @@ pj_status_t SIPConnectionPool::create_connection(int hash_slot)
   status = pjsip_transport_add_state_listener(tp, &transport_state, (void*)this, &key);
 
   // Store the new transport in the hash slot, but marked as disconnected.
-  pthread_mutex_lock(&_tp_hash_lock);
+  pthread_rwlock_wrlock(&_tp_hash_lock);
   _tp_hash[hash_slot].tp = tp;
   _tp_hash[hash_slot].listener_key = key;
   _tp_hash[hash_slot].connected = PJ_FALSE;
@@ -261,7 +330,7 @@ pj_status_t SIPConnectionPool::create_connection(int hash_slot)
   // Don't increment the connection count here, wait until we get confirmation
   // that the transport is connected.
 
-  pthread_mutex_unlock(&_tp_hash_lock);
+  pthread_rwlock_unlock(&_tp_hash_lock);
 
   return PJ_SUCCESS;
 }
@@ -269,7 +338,7 @@ pj_status_t SIPConnectionPool::create_connection(int hash_slot)
 
 void SIPConnectionPool::quiesce_connection(int hash_slot)
 {
-  pthread_mutex_lock(&_tp_hash_lock);
+  pthread_rwlock_wrlock(&_tp_hash_lock);
   pjsip_transport* tp = _tp_hash[hash_slot].tp;
 
   if (tp != NULL)
@@ -294,7 +363,7 @@ void SIPConnectionPool::quiesce_connection(int hash_slot)
 
     // Release the lock now so we don't have a deadlock if pjsip_transport_shutdown
     // calls the transport state listener.
-    pthread_mutex_unlock(&_tp_hash_lock);
+    pthread_rwlock_unlock(&_tp_hash_lock);
 
     // Quiesce the transport.  PJSIP will destroy the transport when there
     // are no further references to it.
@@ -305,7 +374,7 @@ void SIPConnectionPool::quiesce_connection(int hash_slot)
   }
   else
   {
-    pthread_mutex_unlock(&_tp_hash_lock);
+    pthread_rwlock_unlock(&_tp_hash_lock);
   }
 }
 
@@ -322,7 +391,7 @@ void SIPConnectionPool::quiesce_connections()
 void SIPConnectionPool::transport_state_update(pjsip_transport* tp, pjsip_transport_state state)
 {
   // Transport state has changed.
-  pthread_mutex_lock(&_tp_hash_lock);
+  pthread_rwlock_wrlock(&_tp_hash_lock);
 
   std::map<pjsip_transport*, int>::const_iterator i = _tp_map.find(tp);
 
@@ -409,7 +478,7 @@ void SIPConnectionPool::transport_state_update(pjsip_transport* tp, pjsip_transp
     }
   }
 
-  pthread_mutex_unlock(&_tp_hash_lock);
+  pthread_rwlock_unlock(&_tp_hash_lock);
 }
 
 
@@ -427,6 +496,17 @@ void SIPConnectionPool::recycle_connections()
     sleep(1);
 #endif
 
+    if (_max_load_scalar != NULL)
+    {
+      report_connection_load();
+    }
+
+    if (_recycle_period == 0)
+    {
+      // Connection recycling is disabled, so there's nothing else to do.
+      continue;
+    }
+
     int now = time(NULL);
 
     // Walk the vector of connections.  This is safe to do without the lock
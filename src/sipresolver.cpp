@@ -34,14 +34,26 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <cstdlib>
+#include <limits>
+
 #include "log.h"
 #include "sipresolver.h"
 #include "sas.h"
 #include "sproutsasevent.h"
 
 SIPResolver::SIPResolver(DnsCachedResolver* dns_client,
-                         int blacklist_duration) :
-  BaseResolver(dns_client)
+                         int blacklist_duration,
+                         int num_threads) :
+  BaseResolver(dns_client),
+  _cached_targets(MAX_CACHED_TARGETS),
+  _work_lock(),
+  _work_cond(),
+  _idle_cond(),
+  _work(),
+  _next_due(std::numeric_limits<time_t>::max()),
+  _busy_threads(0),
+  _terminated(false)
 {
   TRC_DEBUG("Creating SIP resolver");
 
@@ -57,11 +69,30 @@ SIPResolver::SIPResolver(DnsCachedResolver* dns_client,
   // Create the blacklist.
   create_blacklist(blacklist_duration);
 
+  // Start the threads that run asynchronous resolutions and refreshes.
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    _threads.push_back(std::thread(&SIPResolver::thread_fn, this));
+  }
+
   TRC_STATUS("Created SIP resolver");
 }
 
 SIPResolver::~SIPResolver()
 {
+  {
+    std::unique_lock<std::mutex> lock(_work_lock);
+    _terminated = true;
+  }
+  _work_cond.notify_all();
+
+  for (std::vector<std::thread>::iterator i = _threads.begin();
+       i != _threads.end();
+       ++i)
+  {
+    i->join();
+  }
+
   destroy_blacklist();
   destroy_srv_cache();
   destroy_naptr_cache();
@@ -75,7 +106,286 @@ void SIPResolver::resolve(const std::string& name,
                           std::vector<AddrInfo>& targets,
                           SAS::TrailId trail)
 {
-  int dummy_ttl = 0;
+  std::string key = name + ":" + std::to_string(af) + ":" +
+                    std::to_string(port) + ":" + std::to_string(transport) +
+                    ":" + std::to_string(retries);
+  time_t now = time(NULL);
+
+  if (_next_due <= now)
+  {
+    // A refresh scheduled ahead of time has become due.
+    _work_cond.notify_one();
+  }
+
+  std::shared_ptr<const CachedTargets> cached = _cached_targets.get(key, now);
+
+  if (cached != NULL)
+  {
+    RefreshRequest request = {key, name, af, port, transport, retries};
+
+    if (cached->expires <= now)
+    {
+      // The DNS records for this name have only recently expired, so select
+      // from the targets they could resolve to last time and refresh them in
+      // the background, rather than blocking on DNS.
+      TRC_DEBUG("Serving stale targets for %s", name.c_str());
+      select_targets(cached->targets, retries, targets);
+
+      if (trail != 0)
+      {
+        SAS::Event event(trail, SASEvent::SIPRESOLVE_STALE_TARGETS, 0);
+        event.add_var_param(name);
+        event.add_static_param(now - cached->expires);
+        SAS::report_event(event);
+      }
+
+      refresh_targets(cached, request, now);
+      return;
+    }
+    else if (cached->expires <= now + REFRESH_AHEAD_TIME)
+    {
+      // The DNS records are about to expire, so refresh them as soon as
+      // they have.
+      refresh_targets(cached, request, cached->expires);
+    }
+  }
+
+  int ttl = 0;
+  std::vector<WeightedTarget> candidates;
+  resolve_uncached(name,
+                   af,
+                   port,
+                   transport,
+                   retries,
+                   targets,
+                   ttl,
+                   trail,
+                   (cached == NULL) ? &candidates : NULL);
+
+  if (cached == NULL)
+  {
+    cache_targets(key, targets, candidates, ttl);
+  }
+}
+
+SIPResolver::PendingResolution::PendingResolution(std::function<void(std::vector<AddrInfo>&)> resolve) :
+  _lock(),
+  _cond(),
+  _state(PENDING),
+  _resolve(resolve),
+  _targets()
+{
+}
+
+std::vector<AddrInfo> SIPResolver::PendingResolution::get()
+{
+  std::unique_lock<std::mutex> lock(_lock);
+
+  if (_state == PENDING)
+  {
+    // No resolver thread has picked this up yet, so do it now rather than
+    // wait for one to become free.
+    lock.unlock();
+    run();
+    lock.lock();
+  }
+
+  _cond.wait(lock, [this]() { return ((_state == DONE) ||
+                                      (_state == CANCELLED)); });
+
+  return _targets;
+}
+
+void SIPResolver::PendingResolution::cancel()
+{
+  std::unique_lock<std::mutex> lock(_lock);
+
+  if (_state == PENDING)
+  {
+    _state = CANCELLED;
+    _resolve = nullptr;
+  }
+}
+
+void SIPResolver::PendingResolution::run()
+{
+  std::unique_lock<std::mutex> lock(_lock);
+
+  if (_state != PENDING)
+  {
+    return;
+  }
+
+  _state = RUNNING;
+  lock.unlock();
+
+  std::vector<AddrInfo> targets;
+  _resolve(targets);
+
+  lock.lock();
+  _targets = targets;
+  _resolve = nullptr;
+  _state = DONE;
+  _cond.notify_all();
+}
+
+std::shared_ptr<SIPResolver::PendingResolution> SIPResolver::resolve_async(const std::string& name,
+                                                                           int af,
+                                                                           int port,
+                                                                           int transport,
+                                                                           int retries,
+                                                                           SAS::TrailId trail)
+{
+  std::shared_ptr<PendingResolution> resolution =
+    std::make_shared<PendingResolution>(
+      [this, name, af, port, transport, retries, trail](std::vector<AddrInfo>& targets)
+      {
+        resolve(name, af, port, transport, retries, targets, trail);
+      });
+
+  // Resolutions are due straight away, so run ahead of any refreshes.
+  queue_work(0, [resolution]() { resolution->run(); });
+
+  return resolution;
+}
+
+void SIPResolver::wait_for_idle()
+{
+  std::unique_lock<std::mutex> lock(_work_lock);
+  _work_cond.notify_all();
+  _idle_cond.wait(lock, [this]()
+  {
+    return ((_busy_threads == 0) &&
+            ((_work.empty()) || (_work.begin()->first > time(NULL))));
+  });
+}
+
+/// Stores the targets a name could resolve to, so they can be selected from
+/// if the DNS records have expired.
+void SIPResolver::cache_targets(const std::string& key,
+                                const std::vector<AddrInfo>& targets,
+                                const std::vector<WeightedTarget>& candidates,
+                                int ttl)
+{
+  time_t now = time(NULL);
+
+  if ((ttl <= 0) || (targets.empty()))
+  {
+    // Nothing worth keeping (for example, the name is an IP address or the
+    // resolution failed).  Allow another refresh to be attempted.
+    std::shared_ptr<const CachedTargets> cached = _cached_targets.get(key, now);
+
+    if (cached != NULL)
+    {
+      cached->refreshing = false;
+    }
+    return;
+  }
+
+  std::shared_ptr<CachedTargets> entry = std::make_shared<CachedTargets>();
+  entry->targets = candidates;
+
+  if (entry->targets.empty())
+  {
+    // The candidates couldn't be worked out from the DNS cache, so fall back
+    // to the targets that were selected.
+    for (std::vector<AddrInfo>::const_iterator i = targets.begin();
+         i != targets.end();
+         ++i)
+    {
+      WeightedTarget target = {*i, 0, 1};
+      entry->targets.push_back(target);
+    }
+  }
+
+  entry->expires = now + ttl;
+  entry->refreshing = false;
+  _cached_targets.set(key, entry, entry->expires + MAX_STALE_TIME, now);
+}
+
+/// Queues a refresh of a cached set of targets for when it is due, unless
+/// one is already queued.
+void SIPResolver::refresh_targets(std::shared_ptr<const CachedTargets> cached,
+                                  const RefreshRequest& request,
+                                  time_t due)
+{
+  if (cached->refreshing.exchange(true))
+  {
+    return;
+  }
+
+  queue_work(due, [this, request]()
+  {
+    TRC_DEBUG("Refreshing targets for %s", request.name.c_str());
+    std::vector<AddrInfo> targets;
+    std::vector<WeightedTarget> candidates;
+    int ttl = 0;
+    resolve_uncached(request.name,
+                     request.af,
+                     request.port,
+                     request.transport,
+                     request.retries,
+                     targets,
+                     ttl,
+                     0,
+                     &candidates);
+    cache_targets(request.key, targets, candidates, ttl);
+  });
+}
+
+void SIPResolver::queue_work(time_t due, std::function<void()> work)
+{
+  std::unique_lock<std::mutex> lock(_work_lock);
+  _work.insert(std::make_pair(due, work));
+  _next_due = _work.begin()->first;
+
+  if (due <= time(NULL))
+  {
+    _work_cond.notify_one();
+  }
+}
+
+/// Runs asynchronous resolutions and refreshes as they become due.
+void SIPResolver::thread_fn()
+{
+  std::unique_lock<std::mutex> lock(_work_lock);
+
+  while (!_terminated)
+  {
+    std::multimap<time_t, std::function<void()> >::iterator i = _work.begin();
+
+    if ((i == _work.end()) || (i->first > time(NULL)))
+    {
+      _idle_cond.notify_all();
+      _work_cond.wait(lock);
+      continue;
+    }
+
+    std::function<void()> work = i->second;
+    _work.erase(i);
+    _next_due = (_work.empty()) ? std::numeric_limits<time_t>::max() :
+                                  _work.begin()->first;
+    ++_busy_threads;
+    lock.unlock();
+
+    work();
+
+    lock.lock();
+    --_busy_threads;
+  }
+}
+
+void SIPResolver::resolve_uncached(const std::string& name,
+                                   int af,
+                                   int port,
+                                   int transport,
+                                   int retries,
+                                   std::vector<AddrInfo>& targets,
+                                   int& ttl,
+                                   SAS::TrailId trail,
+                                   std::vector<WeightedTarget>* candidates)
+{
+  int naptr_ttl = 0;
   targets.clear();
 
   // First determine the transport following the process in RFC3263 section
@@ -151,7 +461,7 @@ void SIPResolver::resolve(const std::string& name,
         SAS::report_event(event);
       }
 
-      NAPTRReplacement* naptr = _naptr_cache->get(name, dummy_ttl, trail);
+      NAPTRReplacement* naptr = _naptr_cache->get(name, naptr_ttl, trail);
 
       if (naptr != NULL)
       {
@@ -289,7 +599,32 @@ void SIPResolver::resolve(const std::string& name,
         SAS::report_event(event);
       }
 
-      srv_resolve(srv_name, af, transport, retries, targets, dummy_ttl, trail);
+      srv_resolve(srv_name, af, transport, retries, targets, ttl, trail);
+
+      if ((candidates != NULL) && (!targets.empty()))
+      {
+        // Record every target the SRV records point at, so that a selection
+        // can be made from them if the records expire.  The records have
+        // just been looked up, so they are in the DNS cache.
+        DnsResult result = _dns_client->dns_query(srv_name, ns_t_srv, 0);
+
+        for (std::vector<DnsRRecord*>::const_iterator i = result.records().begin();
+             i != result.records().end();
+             ++i)
+        {
+          if ((*i)->rrtype() == ns_t_srv)
+          {
+            DnsSrvRecord* srv = (DnsSrvRecord*)(*i);
+            add_candidates(srv->target(),
+                           af,
+                           srv->port(),
+                           transport,
+                           srv->priority(),
+                           srv->weight(),
+                           *candidates);
+          }
+        }
+      }
     }
     else
     {
@@ -307,9 +642,134 @@ void SIPResolver::resolve(const std::string& name,
         SAS::report_event(event);
       }
 
-      a_resolve(a_name, af, port, transport, retries, targets, dummy_ttl, trail);
+      a_resolve(a_name, af, port, transport, retries, targets, ttl, trail);
+
+      if ((candidates != NULL) && (!targets.empty()))
+      {
+        add_candidates(a_name, af, port, transport, 0, 1, *candidates);
+      }
+    }
+
+    if ((naptr_ttl > 0) && (naptr_ttl < ttl))
+    {
+      // The targets are only valid for as long as the NAPTR record that led
+      // to them.
+      ttl = naptr_ttl;
+    }
+  }
+}
+
+/// Adds the addresses a host name resolves to in the DNS cache to a list of
+/// candidate targets.
+void SIPResolver::add_candidates(const std::string& name,
+                                 int af,
+                                 int port,
+                                 int transport,
+                                 int priority,
+                                 int weight,
+                                 std::vector<WeightedTarget>& candidates)
+{
+  int dnstype = (af == AF_INET) ? ns_t_a : ns_t_aaaa;
+  DnsResult result = _dns_client->dns_query(name, dnstype, 0);
+
+  for (std::vector<DnsRRecord*>::const_iterator i = result.records().begin();
+       i != result.records().end();
+       ++i)
+  {
+    WeightedTarget target;
+    target.ai.port = port;
+    target.ai.transport = transport;
+    target.ai.address.af = af;
+    target.priority = priority;
+    target.weight = weight;
+
+    if ((*i)->rrtype() == ns_t_a)
+    {
+      target.ai.address.addr.ipv4 = ((DnsARecord*)(*i))->address();
+      candidates.push_back(target);
+    }
+    else if ((*i)->rrtype() == ns_t_aaaa)
+    {
+      target.ai.address.addr.ipv6 = ((DnsAAAARecord*)(*i))->address();
+      candidates.push_back(target);
+    }
+  }
+}
+
+/// Selects up to the specified number of targets from a list of candidates,
+/// in the same way as a resolution from the DNS cache.  Candidates are
+/// ordered by priority, and then by weighted random selection within each
+/// priority (as per RFC 2782).  Blacklisted candidates are only selected if
+/// there aren't enough others.
+void SIPResolver::select_targets(const std::vector<WeightedTarget>& candidates,
+                                 int retries,
+                                 std::vector<AddrInfo>& targets)
+{
+  targets.clear();
+
+  std::map<int, std::vector<WeightedTarget> > priorities;
+
+  for (std::vector<WeightedTarget>::const_iterator i = candidates.begin();
+       i != candidates.end();
+       ++i)
+  {
+    priorities[i->priority].push_back(*i);
+  }
+
+  std::vector<AddrInfo> blacklisted_targets;
+
+  for (std::map<int, std::vector<WeightedTarget> >::iterator i = priorities.begin();
+       (i != priorities.end()) && ((int)targets.size() < retries);
+       ++i)
+  {
+    std::vector<WeightedTarget>& group = i->second;
+
+    while ((!group.empty()) && ((int)targets.size() < retries))
+    {
+      int total_weight = 0;
+
+      for (size_t jj = 0; jj < group.size(); ++jj)
+      {
+        total_weight += group[jj].weight;
+      }
+
+      size_t selected = 0;
+
+      if (total_weight > 0)
+      {
+        int r = rand() % total_weight;
+
+        while (r >= group[selected].weight)
+        {
+          r -= group[selected].weight;
+          ++selected;
+        }
+      }
+      else
+      {
+        // All the remaining candidates have zero weight.
+        selected = rand() % group.size();
+      }
+
+      if (blacklisted(group[selected].ai))
+      {
+        blacklisted_targets.push_back(group[selected].ai);
+      }
+      else
+      {
+        targets.push_back(group[selected].ai);
+      }
+
+      group.erase(group.begin() + selected);
     }
   }
+
+  for (std::vector<AddrInfo>::const_iterator i = blacklisted_targets.begin();
+       (i != blacklisted_targets.end()) && ((int)targets.size() < retries);
+       ++i)
+  {
+    targets.push_back(*i);
+  }
 }
 
 std::string SIPResolver::get_transport_str(int transport)
@@ -55,6 +55,7 @@ extern "C" {
 #include "sproutletproxy.h"
 #include "snmp_sip_request_types.h"
 #include "subscription.h"
+#include "thread_dispatcher.h"
 
 const pj_str_t SproutletProxy::STR_SERVICE = {"service", 7};
 
@@ -94,6 +95,32 @@ SproutletProxy::SproutletProxy(pjsip_endpoint* endpt,
                                                        false);
     _root_uris.insert(std::make_pair((*it)->service_name(), root_uri));
   }
+
+  // Build the indexes used to route requests to Sproutlets.  Sproutlets
+  // earlier in the list take precedence, so never overwrite an existing
+  // entry, and index each Sproutlet's service name ahead of its aliases.
+  size_t position = 0;
+  for (std::list<Sproutlet*>::iterator it = _sproutlets.begin();
+       it != _sproutlets.end();
+       ++it, ++position)
+  {
+    SproutletIndexEntry entry = {*it, position, false};
+    _sproutlet_index.insert(std::make_pair((*it)->service_name(), entry));
+
+    entry.is_alias = true;
+    std::list<std::string> aliases = (*it)->aliases();
+    for (std::list<std::string>::const_iterator alias = aliases.begin();
+         alias != aliases.end();
+         ++alias)
+    {
+      _sproutlet_index.insert(std::make_pair(*alias, entry));
+    }
+
+    if ((*it)->port() != 0)
+    {
+      _port_index.insert(std::make_pair((*it)->port(), *it));
+    }
+  }
 }
 
 
@@ -157,17 +184,35 @@ Sproutlet* SproutletProxy::target_sproutlet(pjsip_msg* req,
 
     TRC_DEBUG("Found next routable URI: %s", uri_str.c_str());
 
-    for (std::list<Sproutlet*>::iterator it = _sproutlets.begin();
-         it != _sproutlets.end();
-         ++it)
+    // Extract the candidate service names from the URI once, then resolve
+    // each through the index.  The Sproutlet earliest in the list that
+    // matches any candidate wins; for that Sproutlet, the first matching
+    // candidate is used.
+    std::list<std::string> possible_service_names =
+                                              extract_possible_services(uri);
+    const SproutletIndexEntry* match = NULL;
+
+    for (std::list<std::string>::const_iterator name =
+                                                possible_service_names.begin();
+         name != possible_service_names.end();
+         ++name)
     {
-      if (does_uri_match_sproutlet((pjsip_uri*)uri, *it, alias, trail))
+      std::unordered_map<std::string, SproutletIndexEntry>::const_iterator
+                                         entry = _sproutlet_index.find(*name);
+      if ((entry != _sproutlet_index.end()) &&
+          ((match == NULL) || (entry->second.position < match->position)))
       {
-        sproutlet = *it;
-        break;
+        match = &entry->second;
+        alias = *name;
       }
     }
 
+    if (match != NULL)
+    {
+      sproutlet = match->sproutlet;
+      report_sproutlet_match(sproutlet, alias, match->is_alias, uri_str, trail);
+    }
+
     if ((port == 0) &&
         (PJSIP_URI_SCHEME_IS_SIP(uri)) &&
         (is_host_local(&((pjsip_sip_uri*)uri)->host)))
@@ -198,22 +243,17 @@ Sproutlet* SproutletProxy::target_sproutlet(pjsip_msg* req,
       event.add_static_param(port);
       SAS::report_event(event);
 
-      for (std::list<Sproutlet*>::iterator it = _sproutlets.begin();
-           it != _sproutlets.end();
-           ++it)
+      std::unordered_map<int, Sproutlet*>::const_iterator it =
+                                                      _port_index.find(port);
+      if (it != _port_index.end())
       {
-        if ((*it)->port() == port)
-        {
-          sproutlet = *it;
-          alias = (*it)->service_name();
-
-          SAS::Event event(trail, SASEvent::SPROUTLET_SELECTION_PORT, 0);
-          event.add_var_param(alias);
-          event.add_static_param(port);
-          SAS::report_event(event);
+        sproutlet = it->second;
+        alias = sproutlet->service_name();
 
-          break;
-        }
+        SAS::Event event(trail, SASEvent::SPROUTLET_SELECTION_PORT, 0);
+        event.add_var_param(alias);
+        event.add_static_param(port);
+        SAS::report_event(event);
       }
     }
   }
@@ -251,7 +291,10 @@ std::list<std::string> SproutletProxy::extract_possible_services(const pjsip_sip
 {
   std::string service_name;
   std::list<std::string> possible_service_names;
-  std::string domain;
+
+  // The services parameter and the username only count if the host is local,
+  // so check that once up front.
+  bool host_local = is_host_local(&sip_uri->host);
 
   // Check services parameter.
   pjsip_param* services_param = pjsip_param_find(&sip_uri->other_param,
@@ -264,7 +307,7 @@ std::list<std::string> SproutletProxy::extract_possible_services(const pjsip_sip
               services_param->value.ptr);
     service_name = PJUtils::pj_str_to_string(&services_param->value);
 
-    if (is_host_local(&sip_uri->host))
+    if (host_local)
     {
       TRC_DEBUG("Adding possible service name %s based on services parameter",
                 service_name.c_str());
@@ -278,7 +321,7 @@ std::list<std::string> SproutletProxy::extract_possible_services(const pjsip_sip
     TRC_DEBUG("Found user - %.*s", sip_uri->user.slen, sip_uri->user.ptr);
     service_name = PJUtils::pj_str_to_string(&sip_uri->user);
 
-    if (is_host_local(&sip_uri->host))
+    if (host_local)
     {
       TRC_DEBUG("Adding possible service name %s based on userpart", service_name.c_str());
       possible_service_names.push_back(service_name);
@@ -336,30 +379,21 @@ bool SproutletProxy::does_uri_match_sproutlet(const pjsip_uri* uri,
 
   // Check if any of the possible service names from the URI match any of the
   // aliases for the sproutlet.
+  std::list<std::string> aliases = sproutlet->aliases();
+
   for (std::string alias_from_msg : possible_service_names)
   {
-    if (alias_from_msg == sproutlet->service_name())
-    {
-      std::string uri_str = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, uri);
-      alias = alias_from_msg;
-      SAS::Event event(trail, SASEvent::SPROUTLET_SELECTION_SERVICE_NAME, 0);
-      event.add_var_param(alias);
-      event.add_var_param(uri_str);
-      SAS::report_event(event);
-      return true;
-    }
+    bool is_alias = (alias_from_msg != sproutlet->service_name());
 
-    std::list<std::string> aliases = sproutlet->aliases();
-    std::list<std::string>::const_iterator it = std::find(aliases.begin(), aliases.end(), alias_from_msg);
-    if (it != aliases.end())
+    if ((!is_alias) ||
+        (std::find(aliases.begin(), aliases.end(), alias_from_msg) != aliases.end()))
     {
-      std::string uri_str = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, uri);
       alias = alias_from_msg;
-      SAS::Event event(trail, SASEvent::SPROUTLET_SELECTION_ALIAS, 0);
-      event.add_var_param(sproutlet->service_name());
-      event.add_var_param(alias);
-      event.add_var_param(uri_str);
-      SAS::report_event(event);
+      report_sproutlet_match(sproutlet,
+                             alias,
+                             is_alias,
+                             PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, uri),
+                             trail);
       return true;
     }
   }
@@ -368,6 +402,30 @@ bool SproutletProxy::does_uri_match_sproutlet(const pjsip_uri* uri,
 }
 
 
+void SproutletProxy::report_sproutlet_match(Sproutlet* sproutlet,
+                                            const std::string& alias,
+                                            bool is_alias,
+                                            const std::string& uri_str,
+                                            SAS::TrailId trail)
+{
+  if (!is_alias)
+  {
+    SAS::Event event(trail, SASEvent::SPROUTLET_SELECTION_SERVICE_NAME, 0);
+    event.add_var_param(alias);
+    event.add_var_param(uri_str);
+    SAS::report_event(event);
+  }
+  else
+  {
+    SAS::Event event(trail, SASEvent::SPROUTLET_SELECTION_ALIAS, 0);
+    event.add_var_param(sproutlet->service_name());
+    event.add_var_param(alias);
+    event.add_var_param(uri_str);
+    SAS::report_event(event);
+  }
+}
+
+
 pjsip_sip_uri* SproutletProxy::create_sproutlet_uri(pj_pool_t* pool,
                                                     Sproutlet* sproutlet) const
 {
@@ -483,7 +541,8 @@ SproutletProxy::UASTsx::UASTsx(SproutletProxy* proxy) :
   _pending_req_q(),
   _sproutlet_proxy(proxy),
   _timers(),
-  _pending_timers()
+  _pending_timers(),
+  _pending_async(0)
 {
   TRC_VERBOSE("Sproutlet Proxy transaction (%p) created", this);
 }
@@ -491,7 +550,7 @@ SproutletProxy::UASTsx::UASTsx(SproutletProxy* proxy) :
 
 SproutletProxy::UASTsx::~UASTsx()
 {
-  for (std::set<pj_timer_entry*>::const_iterator timer = _timers.begin();
+  for (SmallSet<pj_timer_entry*, 8>::const_iterator timer = _timers.begin();
        timer != _timers.end();
        ++timer)
   {
@@ -501,6 +560,15 @@ SproutletProxy::UASTsx::~UASTsx()
   }
   _timers.clear();
 
+  // Release the requests whose bodies were shared with clones.
+  for (SmallSet<pjsip_tx_data*, 8>::const_iterator it = _body_owners.begin();
+       it != _body_owners.end();
+       ++it)
+  {
+    pjsip_tx_data_dec_ref(*it);
+  }
+  _body_owners.clear();
+
   if (_trail != 0)
   {
     // Flush the trail so it appears promptly in SAS. Note that we also log an
@@ -774,7 +842,7 @@ void SproutletProxy::UASTsx::tx_request(SproutletWrapper* upstream,
   PendingRequest pr;
   pr.req = req;
   pr.upstream = std::make_pair(upstream, fork_id);
-  _pending_req_q.push(pr);
+  _pending_req_q.push_back(pr);
 }
 
 
@@ -783,7 +851,7 @@ void SproutletProxy::UASTsx::schedule_requests()
   while (!_pending_req_q.empty())
   {
     PendingRequest req = _pending_req_q.front();
-    _pending_req_q.pop();
+    _pending_req_q.pop_front();
 
     // Reject the request if the Max-Forwards value has dropped to zero.
     pjsip_max_fwd_hdr* mf_hdr = (pjsip_max_fwd_hdr*)
@@ -860,8 +928,10 @@ void SproutletProxy::UASTsx::schedule_requests()
       }
       else
       {
-        // No local Sproutlet, proxy the request.
+        // No local Sproutlet, proxy the request.  The request may outlive
+        // this transaction, so it can no longer share its body.
         TRC_DEBUG("No local sproutlet matches request");
+        unshare_body(req.req);
         size_t index;
 
         pj_status_t status = allocate_uac(req.req, index);
@@ -956,6 +1026,42 @@ void SproutletProxy::UASTsx::process_timer_pop(pj_timer_entry* tentry)
 }
 
 
+bool SproutletProxy::UASTsx::run_async(SproutletWrapper* tsx,
+                                       std::function<void()> work,
+                                       void* context)
+{
+  // Run the work on an async lookup thread.  The completion is passed back to
+  // a worker thread even if the work fails, and the UASTsx persists until it
+  // has been processed.
+  bool queued = add_async_work_to_queue(work,
+                                        [this, tsx, context](bool success)
+  {
+    process_async_complete(tsx, context, success);
+  });
+
+  if (queued)
+  {
+    ++_pending_async;
+  }
+
+  return queued;
+}
+
+
+void SproutletProxy::UASTsx::process_async_complete(SproutletWrapper* tsx,
+                                                    void* context,
+                                                    bool success)
+{
+  enter_context();
+
+  --_pending_async;
+  tsx->on_async_complete(context, success);
+  schedule_requests();
+
+  exit_context();
+}
+
+
 void SproutletProxy::UASTsx::tx_response(SproutletWrapper* downstream,
                                          pjsip_tx_data* rsp)
 {
@@ -1065,6 +1171,7 @@ void SproutletProxy::UASTsx::check_destroy()
       (_umap.empty()) &&
       (_pending_req_q.empty()) &&
       (_pending_timers.empty()) &&
+      (_pending_async == 0) &&
       (_tsx == NULL))
   {
     // UAS transaction has been destroyed and all Sproutlets are complete.
@@ -1074,6 +1181,65 @@ void SproutletProxy::UASTsx::check_destroy()
 }
 
 
+pjsip_tx_data* SproutletProxy::UASTsx::clone_request(pjsip_tx_data* req)
+{
+  pjsip_tx_data* clone = NULL;
+  pj_status_t status = pjsip_endpt_create_tdata(stack_data.endpt, &clone);
+
+  if (status != PJ_SUCCESS)
+  {
+    //LCOV_EXCL_START
+    return NULL;
+    //LCOV_EXCL_STOP
+  }
+
+  pjsip_tx_data_add_ref(clone);
+
+  // Clone everything except the body.
+  pjsip_msg_body* body = req->msg->body;
+  req->msg->body = NULL;
+  clone->msg = pjsip_msg_clone(clone->pool, req->msg);
+  req->msg->body = body;
+  set_trail(clone, get_trail(req));
+
+  if (body != NULL)
+  {
+    // The body structure itself is copied (so the clone's body can be
+    // replaced or removed independently), but the data it points to is
+    // shared.  The content type is copied as it contains a list head.
+    pjsip_msg_body* shared = PJ_POOL_ZALLOC_T(clone->pool, pjsip_msg_body);
+    pjsip_media_type_cp(clone->pool, &shared->content_type, &body->content_type);
+    shared->data = body->data;
+    shared->len = body->len;
+    shared->print_body = body->print_body;
+    shared->clone_data = body->clone_data;
+    clone->msg->body = shared;
+
+    if (_body_owners.insert(req))
+    {
+      pjsip_tx_data_add_ref(req);
+    }
+    _shared_bodies.insert(clone);
+  }
+
+  TRC_DEBUG("Cloned %s to %s", req->obj_name, clone->obj_name);
+  return clone;
+}
+
+
+void SproutletProxy::UASTsx::unshare_body(pjsip_tx_data* req)
+{
+  if (_shared_bodies.erase(req) > 0)
+  {
+    if (req->msg->body != NULL)
+    {
+      TRC_DEBUG("Copy shared message body into %s", req->obj_name);
+      req->msg->body = pjsip_msg_body_clone(req->pool, req->msg->body);
+    }
+  }
+}
+
+
 //
 // UASTsx::SproutletWrapper methods.
 //
@@ -1102,6 +1268,9 @@ SproutletWrapper::SproutletWrapper(SproutletProxy* proxy,
   _process_actions_entered(0),
   _forks(),
   _pending_timers(),
+  _pending_async(0),
+  _deferred_cancel(NULL),
+  _deferred_error(0),
   _trail_id(trail_id)
 {
   _req_type = SNMP::string_to_request_type(_req->msg->line.req.method.name.ptr,
@@ -1184,7 +1353,7 @@ const std::string& SproutletWrapper::service_name() const
 /// or as the basis for constructing a response.
 pjsip_msg* SproutletWrapper::original_request()
 {
-  pjsip_tx_data* clone = PJUtils::clone_msg(stack_data.endpt, _req);
+  pjsip_tx_data* clone = _proxy_tsx->clone_request(_req);
 
   if (clone == NULL)
   {
@@ -1286,7 +1455,7 @@ pjsip_msg* SproutletWrapper::clone_request(pjsip_msg* req)
   }
 
   // Clone the tdata and put it back into the map
-  pjsip_tx_data* new_tdata = PJUtils::clone_msg(stack_data.endpt, it->second);
+  pjsip_tx_data* new_tdata = _proxy_tsx->clone_request(it->second);
 
   if (new_tdata == NULL)
   {
@@ -1520,6 +1689,23 @@ bool SproutletWrapper::timer_running(TimerID id)
   return _proxy_tsx->timer_running(id);
 }
 
+void SproutletWrapper::run_async(std::function<void()> work, void* context)
+{
+  if (_proxy_tsx->run_async(this, work, context))
+  {
+    ++_pending_async;
+  }
+  else
+  {
+    // There are no async lookup threads, so do the work now and tell the
+    // Sproutlet straight away.  Any actions it takes are processed when it
+    // returns to us.
+    TRC_DEBUG("No async lookup threads - run work inline");
+    bool success = run_async_work(work);
+    _sproutlet_tsx->on_async_complete(context, success);
+  }
+}
+
 SAS::TrailId SproutletWrapper::trail() const
 {
   return _trail_id;
@@ -1656,6 +1842,22 @@ void SproutletWrapper::rx_response(pjsip_tx_data* rsp, int fork_id)
 
 void SproutletWrapper::rx_cancel(pjsip_tx_data* cancel)
 {
+  if (_pending_async > 0)
+  {
+    // The Sproutlet is waiting for async work to complete, so hold on to the
+    // CANCEL until it has.
+    TRC_VERBOSE("%s received CANCEL request - deferred", _id.c_str());
+    if (_deferred_cancel == NULL)
+    {
+      _deferred_cancel = cancel;
+    }
+    else
+    {
+      pjsip_tx_data_dec_ref(cancel);
+    }
+    return;
+  }
+
   TRC_VERBOSE("%s received CANCEL request", _id.c_str());
   _sproutlet_tsx->on_rx_cancel(PJSIP_SC_REQUEST_TERMINATED,
                            cancel->msg);
@@ -1666,6 +1868,15 @@ void SproutletWrapper::rx_cancel(pjsip_tx_data* cancel)
 
 void SproutletWrapper::rx_error(int status_code)
 {
+  if (_pending_async > 0)
+  {
+    // The Sproutlet is waiting for async work to complete, so hold on to the
+    // error until it has.
+    TRC_VERBOSE("%s received error %d - deferred", _id.c_str(), status_code);
+    _deferred_error = status_code;
+    return;
+  }
+
   TRC_VERBOSE("%s received error %d", _id.c_str(), status_code);
   _sproutlet_tsx->on_rx_cancel(status_code, NULL);
   cancel_pending_forks();
@@ -1731,6 +1942,42 @@ void SproutletWrapper::on_timer_pop(TimerID id, void* context)
   process_actions(false);
 }
 
+void SproutletWrapper::on_async_complete(void* context, bool success)
+{
+  TRC_DEBUG("Async work has completed (%s)", success ? "success" : "failure");
+  --_pending_async;
+
+  // Work out whether we need to pass on a CANCEL or error that arrived while
+  // the work was outstanding.  If so, process_actions won't delete us.
+  bool deferred = ((_pending_async == 0) &&
+                   ((_deferred_cancel != NULL) || (_deferred_error != 0)));
+
+  _sproutlet_tsx->on_async_complete(context, success);
+  process_actions(false);
+
+  if (deferred)
+  {
+    pjsip_tx_data* cancel = _deferred_cancel;
+    int status_code = _deferred_error;
+    _deferred_cancel = NULL;
+    _deferred_error = 0;
+
+    if (status_code != 0)
+    {
+      // An error supersedes a CANCEL.
+      if (cancel != NULL)
+      {
+        pjsip_tx_data_dec_ref(cancel);
+      }
+      rx_error(status_code);
+    }
+    else
+    {
+      rx_cancel(cancel);
+    }
+  }
+}
+
 void SproutletWrapper::register_tdata(pjsip_tx_data* tdata)
 {
   TRC_DEBUG("Adding message %p => txdata %p mapping",
@@ -1784,7 +2031,7 @@ void SproutletWrapper::process_actions(bool complete_after_actions)
   // forwarded/generated by the Sproutlet.
   while (!_send_requests.empty())
   {
-    std::map<int, pjsip_tx_data*>::iterator i = _send_requests.begin();
+    Requests::iterator i = _send_requests.begin();
     int fork_id = i->first;
     pjsip_tx_data* tdata = i->second;
     _send_requests.erase(i);
@@ -1823,6 +2070,9 @@ void SproutletWrapper::process_actions(bool complete_after_actions)
   if ((_complete) &&
       (_pending_responses == 0) &&
       (_pending_timers.empty()) &&
+      (_pending_async == 0) &&
+      (_deferred_cancel == NULL) &&
+      (_deferred_error == 0) &&
       (_process_actions_entered == 0))
   {
     // Sproutlet has sent a final response, has no downstream forks waiting
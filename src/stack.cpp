@@ -535,18 +535,24 @@ pj_status_t init_pjsip()
   status = pjlib_util_init();
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
 
-  // Must create a pool factory before we can allocate any memory.
+  // Must create a pool factory before we can allocate any memory.  Pools are
+  // allocated through a per-thread cache in front of the caching pool so
+  // that the pools for each message and transaction can be recycled without
+  // contending on the caching pool's lock.
   pj_caching_pool_init(&stack_data.cp, &pj_pool_factory_default_policy, 0);
+  stack_data.pool_cache = new PoolCache(&stack_data.cp);
   // Create the endpoint.
-  status = pjsip_endpt_create(&stack_data.cp.factory, NULL, &stack_data.endpt);
+  status = pjsip_endpt_create(stack_data.pool_cache->factory(), NULL, &stack_data.endpt);
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
 
   // Init transaction layer.
   status = pjsip_tsx_layer_init_module(stack_data.endpt);
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, status);
 
-  // Create pool for the application
-  stack_data.pool = pj_pool_create(&stack_data.cp.factory,
+  // Create pool for the application.  This uses the pool cache's factory, as
+  // group locks created from it (one per transaction) take their own pools
+  // from the same factory.
+  stack_data.pool = pj_pool_create(stack_data.pool_cache->factory(),
                                    "sprout-bono",
                                    4000,
                                    4000,
@@ -916,6 +922,8 @@ void term_pjsip()
 {
   pjsip_endpt_destroy(stack_data.endpt);
   pj_pool_release(stack_data.pool);
+  stack_data.pool_cache->log_stats();
+  delete stack_data.pool_cache; stack_data.pool_cache = NULL;
   pj_caching_pool_destroy(&stack_data.cp);
   pj_shutdown();
 }
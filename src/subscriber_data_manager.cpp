@@ -53,6 +53,7 @@ extern "C" {
 #include <fstream>
 #include <iomanip>
 #include <algorithm>
+#include <functional>
 #include <time.h>
 
 #include "log.h"
@@ -106,8 +107,14 @@ SubscriberDataManager::SubscriberDataManager(Store* data_store,
                                              ChronosConnection* chronos_connection,
                                              AnalyticsLogger* analytics_logger,
                                              bool is_primary) :
+  _contention_tbl(NULL),
   _primary_sdm(is_primary)
 {
+  for (int ii = 0; ii < NUM_AOR_LOCKS; ++ii)
+  {
+    pthread_mutex_init(&_aor_locks[ii], NULL);
+  }
+
   _connector = new Connector(data_store, serializer, deserializers);
   _chronos_timer_request_sender = new ChronosTimerRequestSender(chronos_connection);
   _notify_sender = new NotifySender();
@@ -118,8 +125,14 @@ SubscriberDataManager::SubscriberDataManager(Store* data_store,
 SubscriberDataManager::SubscriberDataManager(Store* data_store,
                                              ChronosConnection* chronos_connection,
                                              bool is_primary) :
+  _contention_tbl(NULL),
   _primary_sdm(is_primary)
 {
+  for (int ii = 0; ii < NUM_AOR_LOCKS; ++ii)
+  {
+    pthread_mutex_init(&_aor_locks[ii], NULL);
+  }
+
   SerializerDeserializer* serializer = new JsonSerializerDeserializer();
   std::vector<SerializerDeserializer*> deserializers = {
     new JsonSerializerDeserializer(),
@@ -137,6 +150,53 @@ SubscriberDataManager::~SubscriberDataManager()
   delete _notify_sender;
   delete _chronos_timer_request_sender;
   delete _connector;
+
+  for (int ii = 0; ii < NUM_AOR_LOCKS; ++ii)
+  {
+    pthread_mutex_destroy(&_aor_locks[ii]);
+  }
+}
+
+
+SubscriberDataManager::AoRLock::AoRLock(SubscriberDataManager* sdm,
+                                        const std::string& aor_id)
+{
+  size_t stripe = std::hash<std::string>()(aor_id) % NUM_AOR_LOCKS;
+  _lock = &sdm->_aor_locks[stripe];
+  pthread_mutex_lock(_lock);
+}
+
+
+SubscriberDataManager::AoRLock::~AoRLock()
+{
+  release();
+}
+
+
+void SubscriberDataManager::AoRLock::release()
+{
+  if (_lock != NULL)
+  {
+    pthread_mutex_unlock(_lock);
+    _lock = NULL;
+  }
+}
+
+
+void SubscriberDataManager::add_registration_listener(
+                                            RegistrationListener* listener)
+{
+  _registration_listeners.push_back(listener);
+}
+
+
+void SubscriberDataManager::remove_registration_listener(
+                                            RegistrationListener* listener)
+{
+  _registration_listeners.erase(std::remove(_registration_listeners.begin(),
+                                            _registration_listeners.end(),
+                                            listener),
+                                _registration_listeners.end());
 }
 
 /// Retrieve the registration data for a given SIP Address of Record.
@@ -197,6 +257,7 @@ Store::Status SubscriberDataManager::set_aor_data(
   // 5. Log new or extended bindings
   // 6. Send any messages we were asked to by the caller
   // 7. Send any NOTIFYs
+  // 8. Tell any registration listeners if the AoR was (de)registered
   //
   // This ordering is important to ensure that we don't send
   // duplicate NOTIFYs (so we send these after writing to memcached) and
@@ -265,6 +326,13 @@ Store::Status SubscriberDataManager::set_aor_data(
 
   if (rc != Store::Status::OK)
   {
+    if ((rc == Store::Status::DATA_CONTENTION) && (_contention_tbl != NULL))
+    {
+      // Another node (or a caller not holding an AoRLock) updated the AoR
+      // since we read it, so the caller will have to retry.
+      _contention_tbl->increment();
+    }
+
     // We were unable to write to the store - return to the caller and
     // send no further messages
     delete_bindings(classified_bindings);
@@ -294,6 +362,20 @@ Store::Status SubscriberDataManager::set_aor_data(
     // 7. Send any NOTIFYs
  
     _notify_sender->send_notifys(aor_id, irs_impus, aor_pair, now, trail);
+
+    // 8. Tell any registration listeners if the AoR was (de)registered
+    bool registered = !aor_pair->get_current()->bindings().empty();
+
+    if (aor_pair->get_orig()->bindings().empty() == registered)
+    {
+      for (std::vector<RegistrationListener*>::const_iterator listener =
+                                             _registration_listeners.begin();
+           listener != _registration_listeners.end();
+           ++listener)
+      {
+        (*listener)->registration_state_changed(aor_id, irs_impus, registered);
+      }
+    }
   }
 
   delete_bindings(classified_bindings);
@@ -1569,7 +1651,7 @@ SubscriberDataManager::NotifySender::~NotifySender()
 
 void SubscriberDataManager::NotifySender::send_notifys(
                                const std::string& aor_id,
-                               std::vector<std::string> irs_impus,
+                               const std::vector<std::string>& irs_impus,
                                SubscriberDataManager::AoRPair* aor_pair,
                                int now,
                                SAS::TrailId trail)
@@ -1584,7 +1666,7 @@ void SubscriberDataManager::NotifySender::send_notifys(
 
 void SubscriberDataManager::NotifySender::send_notifys_for_expired_subscriptions(
                                const std::string& aor_id,
-                               std::vector<std::string> irs_impus,
+                               const std::vector<std::string>& irs_impus,
                                SubscriberDataManager::AoRPair* aor_pair,
                                int now,
                                SAS::TrailId trail)
@@ -1609,6 +1691,39 @@ void SubscriberDataManager::NotifySender::send_notifys_for_expired_subscriptions
     }
   }
 
+  // The final NOTIFY for a deleted subscription reports the state of the
+  // bindings in the original AoR.  This is the same for every subscription,
+  // so the body is built once (when the first deleted subscription is
+  // found) and shared.
+  NotifyUtils::ContactEvent contact_event;
+  NotifyUtils::RegistrationState reg_state;
+
+  // There are no non-emergency bindings left; the subscription has been
+  // terminated.
+  bool bindings_remaining = false;
+  for (std::pair<std::string, SubscriberDataManager::AoR::Binding*> aor_current_b : 
+         aor_pair->get_current()->bindings())
+  {
+    if (!aor_current_b.second->_emergency_registration)
+    {
+      bindings_remaining = true;
+      break;
+    }
+  } // LCOV_EXCL_LINE
+
+  if (bindings_remaining)
+  {
+    contact_event = NotifyUtils::ContactEvent::REGISTERED;
+    reg_state = NotifyUtils::RegistrationState::ACTIVE;
+  }
+  else
+  {
+    contact_event = NotifyUtils::ContactEvent::EXPIRED;
+    reg_state = NotifyUtils::RegistrationState::TERMINATED;
+  }
+
+  NotifyUtils::RegInfoBody* body = NULL;
+
   // Iterate over the subscriptions in the original AoR, and send NOTIFYs for
   // any subscriptions that aren't in the current AoR
   for (SubscriberDataManager::AoR::Subscriptions::const_iterator aor_orig_s =
@@ -1635,47 +1750,26 @@ void SubscriberDataManager::NotifySender::send_notifys_for_expired_subscriptions
     {
       TRC_DEBUG("The subscription (%s) has been terminated", s_id.c_str());
 
-      NotifyUtils::ContactEvent contact_event;
-      NotifyUtils::RegistrationState reg_state;
-
-      // There are no non-emergency bindings left; the subscription has been
-      // terminated.
-      bool bindings_remaining = false;
-      for (std::pair<std::string, SubscriberDataManager::AoR::Binding*> aor_current_b : 
-             aor_pair->get_current()->bindings())
+      if (body == NULL)
       {
-        if (!aor_current_b.second->_emergency_registration)
-        {
-          bindings_remaining = true;
-          break;
-        }
-      } // LCOV_EXCL_LINE
-
-      if (bindings_remaining)
-      {
-        contact_event = NotifyUtils::ContactEvent::REGISTERED;
-        reg_state = NotifyUtils::RegistrationState::ACTIVE;
-      }
-      else
-      {
-        contact_event = NotifyUtils::ContactEvent::EXPIRED;
-        reg_state = NotifyUtils::RegistrationState::TERMINATED;
-      }
+        std::vector<NotifyUtils::BindingNotifyInformation*> binding_notify;
 
-      std::vector<NotifyUtils::BindingNotifyInformation*> binding_notify;
-
-      for (std::pair<std::string, SubscriberDataManager::AoR::Binding*> aor_orig_b : 
-             aor_pair->get_orig()->bindings())
-      {
-        // Don't include emergency registrations
-        if (!aor_orig_b.second->_emergency_registration)
+        for (std::pair<std::string, SubscriberDataManager::AoR::Binding*> aor_orig_b : 
+               aor_pair->get_orig()->bindings())
         {
-          NotifyUtils::BindingNotifyInformation* bni =
-               new NotifyUtils::BindingNotifyInformation(aor_orig_b.first,
-                                                         aor_orig_b.second,
-                                                         contact_event);
-          binding_notify.push_back(bni);
+          // Don't include emergency registrations
+          if (!aor_orig_b.second->_emergency_registration)
+          {
+            NotifyUtils::BindingNotifyInformation* bni =
+                 new NotifyUtils::BindingNotifyInformation(aor_orig_b.first,
+                                                           aor_orig_b.second,
+                                                           contact_event);
+            binding_notify.push_back(bni);
+          }
         }
+
+        body = new NotifyUtils::RegInfoBody(irs_impus, binding_notify, reg_state);
+        delete_bindings(binding_notify);
       }
 
       pjsip_tx_data* tdata_notify = NULL;
@@ -1685,10 +1779,8 @@ void SubscriberDataManager::NotifySender::send_notifys_for_expired_subscriptions
       pj_status_t status = NotifyUtils::create_subscription_notify(
                                           &tdata_notify,
                                           s,
-                                          aor_id,
-                                          irs_impus,
                                           aor_pair->get_orig(),
-                                          binding_notify,
+                                          *body,
                                           reg_state,
                                           now);
 
@@ -1708,106 +1800,117 @@ void SubscriberDataManager::NotifySender::send_notifys_for_expired_subscriptions
          // LCOV_EXCL_STOP
         }
       }
-
-      delete_bindings(binding_notify);
     }
   }
+
+  delete body;
 }
 
 void SubscriberDataManager::NotifySender::send_notifys_for_current_subscriptions(
                                const std::string& aor_id,
-                               std::vector<std::string> irs_impus,
+                               const std::vector<std::string>& irs_impus,
                                SubscriberDataManager::AoRPair* aor_pair,
                                int now,
                                SAS::TrailId trail)
 {
-  // Iterate over the subscriptions in the current AoR.
-  for (std::pair<std::string, SubscriberDataManager::AoR::Subscription*> aor_current_sub : 
-         aor_pair->get_current()->subscriptions())
+  if (aor_pair->get_current()->subscriptions().empty())
   {
-    TRC_DEBUG("The subscription (%s) is still active", aor_current_sub.first.c_str());
-    std::vector<NotifyUtils::BindingNotifyInformation*> binding_notify;
+    return;
+  }
+
+  // Work out the state of each binding.  This is the same for every
+  // subscription, so the NOTIFY body is built once and shared.
+  std::vector<NotifyUtils::BindingNotifyInformation*> binding_notify;
 
-    // Iterate over the bindings in the original AoR. If they're not present
-    // the current AoR, mark them as expired
-    for (std::pair<std::string, SubscriberDataManager::AoR::Binding*> aor_orig_b : 
-           aor_pair->get_orig()->bindings())
+  // Iterate over the bindings in the original AoR. If they're not present
+  // the current AoR, mark them as expired
+  for (std::pair<std::string, SubscriberDataManager::AoR::Binding*> aor_orig_b : 
+         aor_pair->get_orig()->bindings())
+  {
+    if (!aor_orig_b.second->_emergency_registration)
     {
-      if (!aor_orig_b.second->_emergency_registration)
-      {
-        SubscriberDataManager::AoR::Bindings::const_iterator aor_current_b_match =
-          aor_pair->get_current()->bindings().find(aor_orig_b.first);
+      SubscriberDataManager::AoR::Bindings::const_iterator aor_current_b_match =
+        aor_pair->get_current()->bindings().find(aor_orig_b.first);
 
-        if (aor_current_b_match == aor_pair->get_current()->bindings().end())
-        {
-          TRC_DEBUG("Binding %s has been removed", aor_orig_b.first.c_str());
-          NotifyUtils::BindingNotifyInformation* bni =
-             new NotifyUtils::BindingNotifyInformation(aor_orig_b.first,
-                                                       aor_orig_b.second,
-                                                       NotifyUtils::ContactEvent::EXPIRED);
-          binding_notify.push_back(bni);
-        }
+      if (aor_current_b_match == aor_pair->get_current()->bindings().end())
+      {
+        TRC_DEBUG("Binding %s has been removed", aor_orig_b.first.c_str());
+        NotifyUtils::BindingNotifyInformation* bni =
+           new NotifyUtils::BindingNotifyInformation(aor_orig_b.first,
+                                                     aor_orig_b.second,
+                                                     NotifyUtils::ContactEvent::EXPIRED);
+        binding_notify.push_back(bni);
       }
     }
+  }
 
-    // Iterate over the bindings in the current AoR.
-    for (std::pair<std::string, SubscriberDataManager::AoR::Binding*> aor_current_b : 
-           aor_pair->get_current()->bindings())
+  // Iterate over the bindings in the current AoR.
+  for (std::pair<std::string, SubscriberDataManager::AoR::Binding*> aor_current_b : 
+         aor_pair->get_current()->bindings())
+  {
+    if (!aor_current_b.second->_emergency_registration)
     {
-      if (!aor_current_b.second->_emergency_registration)
+      // If the binding is only in the current AoR, mark it as created
+      SubscriberDataManager::AoR::Bindings::const_iterator aor_orig_b_match =
+        aor_pair->get_orig()->bindings().find(aor_current_b.first);
+
+      if (aor_orig_b_match == aor_pair->get_orig()->bindings().end())
+      {
+        TRC_DEBUG("Binding %s has been created", aor_current_b.first.c_str());
+        NotifyUtils::BindingNotifyInformation* bni =
+             new NotifyUtils::BindingNotifyInformation(aor_current_b.first,
+                                                       aor_current_b.second,
+                                                       NotifyUtils::ContactEvent::CREATED);
+        binding_notify.push_back(bni);
+      }
+      else
       {
-        // If the binding is only in the current AoR, mark it as created
-        SubscriberDataManager::AoR::Bindings::const_iterator aor_orig_b_match =
-          aor_pair->get_orig()->bindings().find(aor_current_b.first);
+        // The binding is in both AoRs. Check if the expiry time has changed at all
+        NotifyUtils::ContactEvent event;
 
-        if (aor_orig_b_match == aor_pair->get_orig()->bindings().end())
+        if (aor_orig_b_match->second->_expires < aor_current_b.second->_expires)
         {
-          TRC_DEBUG("Binding %s has been created", aor_current_b.first.c_str());
-          NotifyUtils::BindingNotifyInformation* bni =
-               new NotifyUtils::BindingNotifyInformation(aor_current_b.first,
-                                                         aor_current_b.second,
-                                                         NotifyUtils::ContactEvent::CREATED);
-          binding_notify.push_back(bni);
+          TRC_DEBUG("Binding %s has been refreshed", aor_current_b.first.c_str());
+          event = NotifyUtils::ContactEvent::REFRESHED;
+        }
+        else if (aor_orig_b_match->second->_expires > aor_current_b.second->_expires)
+        {
+          TRC_DEBUG("Binding %s has been shortened", aor_current_b.first.c_str());
+          event = NotifyUtils::ContactEvent::SHORTENED;
         }
         else
         {
-          // The binding is in both AoRs. Check if the expiry time has changed at all
-          NotifyUtils::ContactEvent event;
-
-          if (aor_orig_b_match->second->_expires < aor_current_b.second->_expires)
-          {
-            TRC_DEBUG("Binding %s has been refreshed", aor_current_b.first.c_str());
-            event = NotifyUtils::ContactEvent::REFRESHED;
-          }
-          else if (aor_orig_b_match->second->_expires > aor_current_b.second->_expires)
-          {
-            TRC_DEBUG("Binding %s has been shortened", aor_current_b.first.c_str());
-            event = NotifyUtils::ContactEvent::SHORTENED;
-          }
-          else
-          {
-            TRC_DEBUG("Binding %s is unchanged", aor_current_b.first.c_str());
-            event = NotifyUtils::ContactEvent::REGISTERED;
-          }
+          TRC_DEBUG("Binding %s is unchanged", aor_current_b.first.c_str());
+          event = NotifyUtils::ContactEvent::REGISTERED;
+        }
 
 
-          NotifyUtils::BindingNotifyInformation* bni =
-               new NotifyUtils::BindingNotifyInformation(aor_current_b.first,
-                                                         aor_current_b.second,
-                                                         event);
-          binding_notify.push_back(bni);
-        }
+        NotifyUtils::BindingNotifyInformation* bni =
+             new NotifyUtils::BindingNotifyInformation(aor_current_b.first,
+                                                       aor_current_b.second,
+                                                       event);
+        binding_notify.push_back(bni);
       }
     }
+  }
+
+  NotifyUtils::RegInfoBody body(irs_impus,
+                                binding_notify,
+                                NotifyUtils::RegistrationState::ACTIVE);
+  delete_bindings(binding_notify);
+
+  // Iterate over the subscriptions in the current AoR.
+  for (std::pair<std::string, SubscriberDataManager::AoR::Subscription*> aor_current_sub : 
+         aor_pair->get_current()->subscriptions())
+  {
+    TRC_DEBUG("The subscription (%s) is still active", aor_current_sub.first.c_str());
 
     pjsip_tx_data* tdata_notify = NULL;
     pj_status_t status = NotifyUtils::create_subscription_notify(
                                           &tdata_notify,
                                           aor_current_sub.second,
-                                          aor_id,
-                                          irs_impus,
                                           aor_pair->get_orig(),
-                                          binding_notify,
+                                          body,
                                           NotifyUtils::RegistrationState::ACTIVE,
                                           now);
 
@@ -1827,7 +1930,5 @@ void SubscriberDataManager::NotifySender::send_notifys_for_current_subscriptions
        // LCOV_EXCL_STOP
       }
     }
-
-    delete_bindings(binding_notify);
   }
 }
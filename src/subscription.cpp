@@ -58,6 +58,7 @@ extern "C" {
 #include "sas.h"
 #include "sproutsasevent.h"
 #include "uri_classifier.h"
+#include "expiring_cache.h"
 
 static SubscriberDataManager* sdm;
 static std::vector<SubscriberDataManager*> remote_sdms;
@@ -78,6 +79,43 @@ static const int DEFAULT_SUBSCRIPTION_EXPIRES = 3761;
 uint32_t id_deployment = 0;
 uint32_t id_instance = 0;
 
+// Subscriber data returned by the HSS for SUBSCRIBEs, indexed by public ID.
+// This lets in-dialog refreshes skip the HSS query.  Entries are kept for
+// at most MAX_SUBSCRIBER_DATA_AGE seconds after they were fetched, however
+// often the subscription is refreshed, so that changes to the subscriber's
+// implicit registration set or charging addresses are picked up.  They are
+// dropped when the AoR is registered or deregistered.
+struct SubscriberData
+{
+  std::string aor;
+  std::vector<std::string> irs_impus;
+  std::deque<std::string> ccfs;
+  std::deque<std::string> ecfs;
+};
+static const int MAX_SUBSCRIBER_DATA_AGE = 600;
+static const size_t MAX_CACHED_SUBSCRIBER_DATA = 100000;
+static ExpiringCache<SubscriberData>* subscriber_data_cache = NULL;
+
+class SubscriberDataInvalidator :
+  public SubscriberDataManager::RegistrationListener
+{
+public:
+  void registration_state_changed(const std::string& aor_id,
+                                  const std::vector<std::string>& irs_impus,
+                                  bool registered)
+  {
+    subscriber_data_cache->erase(aor_id);
+
+    for (std::vector<std::string>::const_iterator i = irs_impus.begin();
+         i != irs_impus.end();
+         ++i)
+    {
+      subscriber_data_cache->erase(*i);
+    }
+  }
+};
+static SubscriberDataInvalidator subscriber_data_invalidator;
+
 //
 // mod_subscription is the module to receive SIP SUBSCRIBE requests.  This
 // must get invoked before the proxy UA module.
@@ -124,6 +162,122 @@ void log_subscriptions(const std::string& aor_name,
   }
 }
 
+/// Caches the subscriber data the HSS returned for a SUBSCRIBE, so that
+/// refreshes of subscriptions for the public ID don't have to query the HSS.
+static void cache_subscriber_data(const std::string& public_id,
+                                  const std::string& aor,
+                                  const std::vector<std::string>& irs_impus,
+                                  const std::deque<std::string>& ccfs,
+                                  const std::deque<std::string>& ecfs,
+                                  int now)
+{
+  std::shared_ptr<SubscriberData> data = std::make_shared<SubscriberData>();
+  data->aor = aor;
+  data->irs_impus = irs_impus;
+  data->ccfs = ccfs;
+  data->ecfs = ecfs;
+
+  subscriber_data_cache->set(public_id,
+                             data,
+                             now + MAX_SUBSCRIBER_DATA_AGE,
+                             now);
+}
+
+/// Works out the expiry period for a SUBSCRIBE.
+static int subscription_expiry(pjsip_msg* msg)
+{
+  pjsip_expires_hdr* expires = (pjsip_expires_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_EXPIRES, NULL);
+  int expiry = (expires != NULL) ? expires->ivalue : DEFAULT_SUBSCRIPTION_EXPIRES;
+
+  if (expiry > max_expires)
+  {
+    // Expiry is too long, set it to the maximum.
+    expiry = max_expires;
+  }
+
+  return expiry;
+}
+
+/// Returns the contact URI to store for a SUBSCRIBE, or an empty string if
+/// the Contact header isn't a SIP URI.
+static std::string subscription_contact_uri(pjsip_contact_hdr* contact)
+{
+  std::string contact_uri;
+  pjsip_uri* uri = (contact->uri != NULL) ?
+                   (pjsip_uri*)pjsip_uri_get_uri(contact->uri) :
+                   NULL;
+
+  if ((uri != NULL) &&
+      (PJSIP_URI_SCHEME_IS_SIP(uri)))
+  {
+    contact_uri = PJUtils::uri_to_string(PJSIP_URI_IN_CONTACT_HDR, uri);
+  }
+
+  return contact_uri;
+}
+
+/// Builds the 200 OK for a SUBSCRIBE and passes it to the ACR.  If the
+/// response can't be built, the SUBSCRIBE is rejected with a 500.
+///
+/// @returns the response, or NULL on failure.
+static pjsip_tx_data* create_subscribe_ok(pjsip_rx_data* rdata,
+                                          int expiry,
+                                          const std::string& subscription_id,
+                                          SAS::TrailId trail,
+                                          const std::string& public_id,
+                                          ACR* acr,
+                                          const std::deque<std::string>& ccfs,
+                                          const std::deque<std::string>& ecfs)
+{
+  pjsip_tx_data* tdata = NULL;
+  pj_status_t status = PJUtils::create_response(stack_data.endpt, rdata, PJSIP_SC_OK, NULL, &tdata);
+
+  if (status != PJ_SUCCESS)
+  {
+    // LCOV_EXCL_START - don't know how to get PJSIP to fail to create a response
+    TRC_ERROR("Error building SUBSCRIBE %d response %s", PJSIP_SC_OK,
+              PJUtils::pj_status_to_string(status).c_str());
+
+    SAS::Event event(trail, SASEvent::SUBSCRIBE_FAILED, 0);
+    event.add_var_param(public_id);
+    std::string error_msg = "Error building SUBSCRIBE (" + std::to_string(PJSIP_SC_OK) + ") " + PJUtils::pj_status_to_string(status);
+    event.add_var_param(error_msg);
+    SAS::report_event(event);
+
+    PJUtils::respond_stateless(stack_data.endpt,
+                               rdata,
+                               PJSIP_SC_INTERNAL_SERVER_ERROR,
+                               NULL,
+                               NULL,
+                               NULL);
+    return NULL;
+    // LCOV_EXCL_STOP
+  }
+
+  // Add expires headers
+  pjsip_expires_hdr* expires_hdr = pjsip_expires_hdr_create(tdata->pool, expiry);
+  pjsip_msg_add_hdr(tdata->msg, (pjsip_hdr*)expires_hdr);
+
+  // Add the to tag to the response
+  pjsip_to_hdr *to = (pjsip_to_hdr*) pjsip_msg_find_hdr(tdata->msg,
+                                                        PJSIP_H_TO,
+                                                        NULL);
+  pj_strdup2(tdata->pool, &to->tag, subscription_id.c_str());
+
+  // Add a P-Charging-Function-Addresses header to the successful SUBSCRIBE
+  // response containing the charging addresses returned by the HSS.
+  PJUtils::add_pcfa_header(tdata->msg,
+                           tdata->pool,
+                           ccfs,
+                           ecfs,
+                           false);
+
+  // Pass the response to the ACR.
+  acr->tx_response(tdata->msg);
+
+  return tdata;
+}
+
 /// Write to the registration store. If we can't find the AoR pair in the
 /// primary SDM, we will either use the backup_aor or we will try and look up
 /// the AoR pair in the backup SDMs. Therefore either the backup_aor should be
@@ -147,7 +301,6 @@ SubscriberDataManager::AoRPair* write_subscriptions_to_store(
   // Parse the headers
   std::string cid = PJUtils::pj_str_to_string((const pj_str_t*)&rdata->msg_info.cid->id);;
   pjsip_msg *msg = rdata->msg_info.msg;
-  pjsip_expires_hdr* expires = (pjsip_expires_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_EXPIRES, NULL);
   pjsip_fromto_hdr* from = (pjsip_fromto_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_FROM, NULL);
   pjsip_fromto_hdr* to = (pjsip_fromto_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_TO, NULL);
 
@@ -156,12 +309,14 @@ SubscriberDataManager::AoRPair* write_subscriptions_to_store(
   // reading, updating and writing the AoR until the write is successful.
   bool backup_aor_alloced = false;
   int expiry = 0;
-  pj_status_t status = PJ_FALSE;
   Store::Status set_rc;
   SubscriberDataManager::AoRPair* aor_pair = NULL;
   std::string subscription_contact;
   std::string subscription_id;
 
+  // Hold the AoR lock across the read-modify-write loop below.
+  SubscriberDataManager::AoRLock aor_lock(primary_sdm, aor);
+
   do
   {
     // delete NULL is safe, so we can do this on every iteration.
@@ -240,16 +395,7 @@ SubscriberDataManager::AoRPair* write_subscriptions_to_store(
 
     if (contact != NULL)
     {
-      std::string contact_uri;
-      pjsip_uri* uri = (contact->uri != NULL) ?
-                       (pjsip_uri*)pjsip_uri_get_uri(contact->uri) :
-                       NULL;
-
-      if ((uri != NULL) &&
-          (PJSIP_URI_SCHEME_IS_SIP(uri)))
-      {
-        contact_uri = PJUtils::uri_to_string(PJSIP_URI_IN_CONTACT_HDR, uri);
-      }
+      std::string contact_uri = subscription_contact_uri(contact);
 
       subscription_id = PJUtils::pj_str_to_string(&to->tag);
 
@@ -295,13 +441,7 @@ SubscriberDataManager::AoRPair* write_subscriptions_to_store(
       subscription->_from_tag = PJUtils::pj_str_to_string(&from->tag);
 
       // Calculate the expiry period for the subscription.
-      expiry = (expires != NULL) ? expires->ivalue : DEFAULT_SUBSCRIPTION_EXPIRES;
-
-      if (expiry > max_expires)
-      {
-        // Expiry is too long, set it to the maximum.
-        expiry = max_expires;
-      }
+      expiry = subscription_expiry(msg);
 
       subscription->_expires = now + expiry;
       subscription_contact = subscription->_req_uri;
@@ -312,51 +452,23 @@ SubscriberDataManager::AoRPair* write_subscriptions_to_store(
 
     if (send_ok)
     {
-      status = PJUtils::create_response(stack_data.endpt, rdata, PJSIP_SC_OK, NULL, &tdata);
-      if (status != PJ_SUCCESS)
+      tdata = create_subscribe_ok(rdata,
+                                  expiry,
+                                  subscription_id,
+                                  trail,
+                                  public_id,
+                                  acr,
+                                  ccfs,
+                                  ecfs);
+
+      if (tdata == NULL)
       {
         // LCOV_EXCL_START - don't know how to get PJSIP to fail to create a response
-        TRC_ERROR("Error building SUBSCRIBE %d response %s", PJSIP_SC_OK,
-                  PJUtils::pj_status_to_string(status).c_str());
-
-        SAS::Event event(trail, SASEvent::SUBSCRIBE_FAILED, 0);
-        event.add_var_param(public_id);
-        std::string error_msg = "Error building SUBSCRIBE (" + std::to_string(PJSIP_SC_OK) + ") " + PJUtils::pj_status_to_string(status);
-        event.add_var_param(error_msg);
-        SAS::report_event(event);
-
-        PJUtils::respond_stateless(stack_data.endpt,
-                                   rdata,
-                                   PJSIP_SC_INTERNAL_SERVER_ERROR,
-                                   NULL,
-                                   NULL,
-                                   NULL);
         delete acr;
         delete aor_pair;
-        return PJ_FALSE;
+        return NULL;
         // LCOV_EXCL_STOP
       }
-
-      // Add expires headers
-      pjsip_expires_hdr* expires_hdr = pjsip_expires_hdr_create(tdata->pool, expiry);
-      pjsip_msg_add_hdr(tdata->msg, (pjsip_hdr*)expires_hdr);
-
-      // Add the to tag to the response
-      pjsip_to_hdr *to = (pjsip_to_hdr*) pjsip_msg_find_hdr(tdata->msg,
-                                                            PJSIP_H_TO,
-                                                            NULL);
-      pj_strdup2(tdata->pool, &to->tag, subscription_id.c_str());
-
-      // Add a P-Charging-Function-Addresses header to the successful SUBSCRIBE
-      // response containing the charging addresses returned by the HSS.
-      PJUtils::add_pcfa_header(tdata->msg,
-                               tdata->pool,
-                               ccfs,
-                               ecfs,
-                               false);
-
-      // Pass the response to the ACR.
-      acr->tx_response(tdata->msg);
     }
 
     // Try to write the AoR back to the store.
@@ -370,6 +482,12 @@ SubscriberDataManager::AoRPair* write_subscriptions_to_store(
   }
   while (set_rc == Store::DATA_CONTENTION);
 
+  if ((send_ok) &&
+      (aor_pair != NULL))
+  {
+    cache_subscriber_data(public_id, aor, irs_impus, ccfs, ecfs, now);
+  }
+
   if (analytics != NULL)
   {
     // Generate an analytics log for this subscription update.
@@ -388,6 +506,127 @@ SubscriberDataManager::AoRPair* write_subscriptions_to_store(
   return aor_pair;
 }
 
+/// Refreshes a subscription in the registration store.  Only the expiry of
+/// the subscription is changed, so this can only be used for in-dialog
+/// refreshes whose Contact matches the stored subscription.
+///
+/// @returns the AoR pair written to the store, or NULL.  found is set to
+/// false if the store doesn't hold a matching subscription, in which case
+/// nothing has been written or sent.
+static SubscriberDataManager::AoRPair* refresh_subscription_in_store(
+                   SubscriberDataManager* primary_sdm,
+                   const std::string& aor,
+                   const std::vector<std::string>& irs_impus,
+                   pjsip_rx_data* rdata,
+                   int now,
+                   const std::string& subscription_id,
+                   SAS::TrailId trail,
+                   const std::string& public_id,
+                   ACR* acr,
+                   const std::deque<std::string>& ccfs,
+                   const std::deque<std::string>& ecfs,
+                   bool& found)
+{
+  pjsip_msg* msg = rdata->msg_info.msg;
+  pjsip_contact_hdr* contact = (pjsip_contact_hdr*)pjsip_msg_find_hdr(msg, PJSIP_H_CONTACT, NULL);
+
+  if (contact == NULL)
+  {
+    found = false;
+    return NULL;
+  }
+
+  std::string cid = PJUtils::pj_str_to_string(&rdata->msg_info.cid->id);
+  std::string from_tag = PJUtils::pj_str_to_string(&rdata->msg_info.from->tag);
+  std::string contact_uri = subscription_contact_uri(contact);
+  int expiry = subscription_expiry(msg);
+  Store::Status set_rc;
+  SubscriberDataManager::AoRPair* aor_pair = NULL;
+
+  found = true;
+
+  // Hold the AoR lock across the read-modify-write loop below.
+  SubscriberDataManager::AoRLock aor_lock(primary_sdm, aor);
+
+  do
+  {
+    // delete NULL is safe, so we can do this on every iteration.
+    delete aor_pair;
+
+    aor_pair = primary_sdm->get_aor_data(aor, trail);
+
+    if ((aor_pair == NULL) ||
+        (aor_pair->get_current() == NULL))
+    {
+      // LCOV_EXCL_START - local store (used in testing) never fails
+      TRC_ERROR("Failed to get AoR subscriptions for %s from store", aor.c_str());
+      break;
+      // LCOV_EXCL_STOP
+    }
+
+    SubscriberDataManager::AoR::Subscriptions::const_iterator i =
+      aor_pair->get_current()->subscriptions().find(subscription_id);
+
+    if ((i == aor_pair->get_current()->subscriptions().end()) ||
+        (i->second->_cid != cid) ||
+        (i->second->_from_tag != from_tag) ||
+        (i->second->_req_uri != contact_uri))
+    {
+      // The subscription has gone or its dialog has changed, so it needs the
+      // full processing.
+      TRC_DEBUG("Subscription %s can't be refreshed in place",
+                subscription_id.c_str());
+      delete aor_pair;
+      found = false;
+      return NULL;
+    }
+
+    TRC_DEBUG("Refresh subscription %s, expires in %d seconds",
+              subscription_id.c_str(),
+              expiry);
+    i->second->_expires = now + expiry;
+
+    pjsip_tx_data* tdata = create_subscribe_ok(rdata,
+                                               expiry,
+                                               subscription_id,
+                                               trail,
+                                               public_id,
+                                               acr,
+                                               ccfs,
+                                               ecfs);
+
+    if (tdata == NULL)
+    {
+      // LCOV_EXCL_START - don't know how to get PJSIP to fail to create a response
+      delete acr;
+      delete aor_pair;
+      return NULL;
+      // LCOV_EXCL_STOP
+    }
+
+    // Try to write the AoR back to the store.
+    bool unused;
+    set_rc = primary_sdm->set_aor_data(aor, irs_impus, aor_pair, trail, unused, rdata, tdata);
+
+    if (set_rc != Store::OK)
+    {
+      delete aor_pair; aor_pair = NULL;
+    }
+  }
+  while (set_rc == Store::DATA_CONTENTION);
+
+  if (analytics != NULL)
+  {
+    // Generate an analytics log for this subscription update.
+    analytics->subscription(aor,
+                            subscription_id,
+                            contact_uri,
+                            expiry);
+  }
+
+  return aor_pair;
+}
+
 void process_subscription_request(pjsip_rx_data* rdata)
 {
   int st_code = PJSIP_SC_OK;
@@ -490,58 +729,97 @@ void process_subscription_request(pjsip_rx_data* rdata)
   SAS::Marker start_marker(trail, MARKER_ID_START, 1u);
   SAS::report_marker(start_marker);
 
-  // Query the HSS for the associated URIs.
-  std::vector<std::string> uris;
-  std::map<std::string, Ifcs> ifc_map;
+  // Get the system time in seconds for calculating absolute expiry times.
+  int now = time(NULL);
 
-  // Subscriber must have already registered to be making a subscribe
-  std::string state;
+  std::string aor;
+  std::vector<std::string> uris;
   std::deque<std::string> ccfs;
   std::deque<std::string> ecfs;
-  HTTPCode http_code = hss->get_registration_data(public_id,
-                                                  state,
-                                                  ifc_map,
-                                                  uris,
-                                                  ccfs,
-                                                  ecfs,
-                                                  trail);
-
-  if (process_hss_sip_failure(http_code,
-                              state,
-                              rdata,
-                              stack_data,
-                              NULL,
-                              "SUBSCRIBE"))
-  {
-    delete acr;
-    return;
-  }
+  SubscriberDataManager::AoRPair* aor_pair = NULL;
+  bool refreshed = false;
 
-  // Determine the AOR from the first entry in the uris array.
-  std::string aor = uris.front();
+  // An in-dialog refresh of an existing subscription doesn't need to query
+  // the HSS again if we have recent subscriber data for the public ID, and
+  // only has to update the subscription's expiry.
+  std::string subscription_id = PJUtils::pj_str_to_string(&rdata->msg_info.to->tag);
+  std::shared_ptr<const SubscriberData> subscriber_data;
 
-  TRC_DEBUG("aor = %s", aor.c_str());
-  TRC_DEBUG("SUBSCRIBE for public ID %s uses AOR %s", public_id.c_str(), aor.c_str());
+  if ((subscription_id != "") &&
+      ((subscriber_data = subscriber_data_cache->get(public_id, now)) != NULL))
+  {
+    TRC_DEBUG("Refresh subscription %s for public ID %s without querying the HSS",
+              subscription_id.c_str(),
+              public_id.c_str());
+    aor = subscriber_data->aor;
+    uris = subscriber_data->irs_impus;
+    ccfs = subscriber_data->ccfs;
+    ecfs = subscriber_data->ecfs;
+    aor_pair = refresh_subscription_in_store(sdm,
+                                             aor,
+                                             uris,
+                                             rdata,
+                                             now,
+                                             subscription_id,
+                                             trail,
+                                             public_id,
+                                             acr,
+                                             ccfs,
+                                             ecfs,
+                                             refreshed);
+  }
 
-  // Get the system time in seconds for calculating absolute expiry times.
-  int now = time(NULL);
+  if (!refreshed)
+  {
+    // Query the HSS for the associated URIs.
+    std::map<std::string, Ifcs> ifc_map;
+
+    // Subscriber must have already registered to be making a subscribe
+    std::string state;
+    uris.clear();
+    ccfs.clear();
+    ecfs.clear();
+    HTTPCode http_code = hss->get_registration_data(public_id,
+                                                    state,
+                                                    ifc_map,
+                                                    uris,
+                                                    ccfs,
+                                                    ecfs,
+                                                    trail);
+
+    if (process_hss_sip_failure(http_code,
+                                state,
+                                rdata,
+                                stack_data,
+                                NULL,
+                                "SUBSCRIBE"))
+    {
+      delete acr;
+      return;
+    }
 
-  // Write to the local store, checking the remote stores if there is no entry locally.
-  // If the write to the local store succeeds, then write to the remote stores.
-  SubscriberDataManager::AoRPair* aor_pair =
-                              write_subscriptions_to_store(sdm,
-                                                           aor,
-                                                           uris,
-                                                           rdata,
-                                                           now,
-                                                           NULL,
-                                                           remote_sdms,
-                                                           trail,
-                                                           public_id,
-                                                           true,
-                                                           acr,
-                                                           ccfs,
-                                                           ecfs);
+    // Determine the AOR from the first entry in the uris array.
+    aor = uris.front();
+
+    TRC_DEBUG("aor = %s", aor.c_str());
+    TRC_DEBUG("SUBSCRIBE for public ID %s uses AOR %s", public_id.c_str(), aor.c_str());
+
+    // Write to the local store, checking the remote stores if there is no entry locally.
+    // If the write to the local store succeeds, then write to the remote stores.
+    aor_pair = write_subscriptions_to_store(sdm,
+                                            aor,
+                                            uris,
+                                            rdata,
+                                            now,
+                                            NULL,
+                                            remote_sdms,
+                                            trail,
+                                            public_id,
+                                            true,
+                                            acr,
+                                            ccfs,
+                                            ecfs);
+  }
 
   if (aor_pair != NULL)
   {
@@ -790,6 +1068,10 @@ pj_status_t init_subscription(SubscriberDataManager* reg_sdm,
   analytics = analytics_logger;
   max_expires = cfg_max_expires;
 
+  subscriber_data_cache =
+    new ExpiringCache<SubscriberData>(MAX_CACHED_SUBSCRIBER_DATA);
+  sdm->add_registration_listener(&subscriber_data_invalidator);
+
   status = pjsip_endpt_register_module(stack_data.endpt, &mod_subscription);
   PJ_ASSERT_RETURN(status == PJ_SUCCESS, 1);
 
@@ -798,5 +1080,8 @@ pj_status_t init_subscription(SubscriberDataManager* reg_sdm,
 
 void destroy_subscription()
 {
+  sdm->remove_registration_listener(&subscriber_data_invalidator);
+  delete subscriber_data_cache; subscriber_data_cache = NULL;
+
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_subscription);
 }
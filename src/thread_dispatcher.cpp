@@ -54,7 +54,9 @@ extern "C" {
 #include <set>
 #include <list>
 #include <queue>
+#include <deque>
 #include <string>
+#include <functional>
 
 #include "constants.h"
 #include "eventq.h"
@@ -78,15 +80,31 @@ extern "C" {
 #include "snmp_event_accumulator_by_scope_table.h"
 
 static std::vector<pj_thread_t*> worker_threads;
+static std::vector<pj_thread_t*> async_threads;
 
-// Queue for incoming messages.
+// Queue for incoming messages and callbacks to run on worker threads.  Each
+// entry holds either a message or a callback.
 struct rx_msg_qe
 {
   pjsip_rx_data* rdata;    // received message
+  std::function<void()>* callback;  // callback to run
   Utils::StopWatch stop_watch;    // stop watch for tracking message latency
 };
 eventq<struct rx_msg_qe> rx_msg_q;
 
+// Queue entry for blocking work to run on the async lookup threads.
+struct async_work_qe
+{
+  std::function<void()> work;            // work to run
+  std::function<void(bool)> complete;    // completion to queue once it has
+  Utils::StopWatch stop_watch;           // stop watch for tracking latency
+};
+eventq<struct async_work_qe*> async_work_q;
+
+// Unit test support - async work held by hold_async_work.
+static bool async_work_held = false;
+static std::deque<struct async_work_qe*> held_async_work;
+
 // Deadlock detection threshold for the message queue (in milliseconds).  This
 // is set to roughly twice the expected maximum service time for each message
 // (currently four seconds, allowing for four Homestead/Homer interactions
@@ -145,7 +163,44 @@ static int worker_thread(void* p)
   {
     pjsip_rx_data* rdata = qe.rdata;
 
-    if (rdata)
+    if (qe.callback)
+    {
+      TRC_DEBUG("Worker thread dequeue callback %p", qe.callback);
+
+      CW_TRY
+      {
+        (*qe.callback)();
+      }
+      CW_EXCEPT(exception_handler)
+      {
+        TRC_ERROR("Exception running callback %p", qe.callback);
+
+        if (num_worker_threads == 1)
+        {
+          // There's only one worker thread, so we can't sensibly proceed.
+          exit(1);
+        }
+      }
+      CW_END
+
+      delete qe.callback;
+      qe.callback = NULL;
+
+      // Callbacks resume processing of a request, so count towards the
+      // request latency and load in the same way as messages.
+      unsigned long latency_us = 0;
+      if (qe.stop_watch.read(latency_us))
+      {
+        TRC_DEBUG("Callback latency = %ldus", latency_us);
+        latency_table->accumulate(latency_us);
+        load_monitor->request_complete(latency_us);
+      }
+      else
+      {
+        TRC_ERROR("Failed to get done timestamp: %s", strerror(errno));
+      }
+    }
+    else if (rdata)
     {
       TRC_DEBUG("Worker thread dequeue message %p", rdata);
 
@@ -219,6 +274,68 @@ static int worker_thread(void* p)
   return 0;
 }
 
+bool run_async_work(const std::function<void()>& work)
+{
+  try
+  {
+    work();
+  }
+  catch (...)
+  {
+    TRC_ERROR("Exception thrown by async work");
+    return false;
+  }
+
+  return true;
+}
+
+
+/// Async lookup threads run blocking work (such as Homestead requests) for
+/// transactions that have suspended themselves, so the worker threads don't
+/// have to wait for it.
+static int async_thread(void* p)
+{
+  TRC_DEBUG("Async lookup thread started");
+
+  struct async_work_qe* qe = NULL;
+
+  while (async_work_q.pop(qe))
+  {
+    // This is volatile as CW_EXCEPT is reached by longjmp.
+    volatile bool success = false;
+
+    CW_TRY
+    {
+      success = run_async_work(qe->work);
+    }
+    CW_EXCEPT(exception_handler)
+    {
+      TRC_ERROR("Exception running async work %p", qe);
+    }
+    CW_END
+
+    // Always pass the completion back, even if the work failed, as the
+    // transaction is waiting for it.
+    struct rx_msg_qe cqe;
+    cqe.rdata = NULL;
+    std::function<void(bool)> complete = qe->complete;
+    bool succeeded = success;
+    cqe.callback = new std::function<void()>([complete, succeeded]()
+    {
+      complete(succeeded);
+    });
+    cqe.stop_watch = qe->stop_watch;
+    rx_msg_q.push(cqe);
+
+    delete qe;
+    qe = NULL;
+  }
+
+  TRC_DEBUG("Async lookup thread ended");
+
+  return 0;
+}
+
 static pj_bool_t threads_on_rx_msg(pjsip_rx_data* rdata)
 {
   // SAS log the start of processing by this module
@@ -263,6 +380,7 @@ static pj_bool_t threads_on_rx_msg(pjsip_rx_data* rdata)
 
   TRC_DEBUG("Queuing cloned received message %p for worker threads", clone_rdata);
   qe.rdata = clone_rdata;
+  qe.callback = NULL;
 
   // Track the current queue size
   queue_size_table->accumulate(rx_msg_q.size());
@@ -276,11 +394,13 @@ pj_status_t init_thread_dispatcher(int num_worker_threads_arg,
                                    SNMP::EventAccumulatorByScopeTable* latency_table_arg,
                                    SNMP::EventAccumulatorByScopeTable* queue_size_table_arg,
                                    LoadMonitor* load_monitor_arg,
-                                   ExceptionHandler* exception_handler_arg)
+                                   ExceptionHandler* exception_handler_arg,
+                                   int num_async_threads_arg)
 {
   // Set up the vectors of threads.  The threads don't get created until
   // start_worker_threads is called.
   worker_threads.resize(num_worker_threads_arg);
+  async_threads.resize(num_async_threads_arg);
 
   // Enable deadlock detection on the message queue.
   rx_msg_q.set_deadlock_threshold(MSG_Q_DEADLOCK_TIME);
@@ -298,6 +418,12 @@ pj_status_t init_thread_dispatcher(int num_worker_threads_arg,
 }
 
 
+bool worker_threads_deadlocked()
+{
+  return rx_msg_q.is_deadlocked();
+}
+
+
 pj_status_t start_worker_threads()
 {
   pj_status_t status = PJ_SUCCESS;
@@ -316,11 +442,36 @@ pj_status_t start_worker_threads()
     worker_threads[ii] = thread;
   }
 
+  for (size_t ii = 0; ii < async_threads.size(); ++ii)
+  {
+    pj_thread_t* thread;
+    status = pj_thread_create(stack_data.pool, "async", &async_thread,
+                              NULL, 0, 0, &thread);
+    if (status != PJ_SUCCESS)
+    {
+      TRC_ERROR("Error creating async lookup thread, %s",
+                PJUtils::pj_status_to_string(status).c_str());
+      return 1;
+    }
+    async_threads[ii] = thread;
+  }
+
   return status;
 }
 
 void stop_worker_threads()
 {
+  // Stop the async lookup threads first, so they don't queue completions to
+  // worker threads that have exited.
+  async_work_q.terminate();
+  for (std::vector<pj_thread_t*>::iterator i = async_threads.begin();
+       i != async_threads.end();
+       ++i)
+  {
+    pj_thread_join(*i);
+  }
+  async_threads.clear();
+
   // Now it is safe to signal the worker threads to exit via the queue and to
   // wait for them to terminate.
   rx_msg_q.terminate();
@@ -333,6 +484,54 @@ void stop_worker_threads()
   worker_threads.clear();
 }
 
+bool add_async_work_to_queue(std::function<void()> work,
+                             std::function<void(bool)> complete)
+{
+  if ((async_threads.empty()) && (!async_work_held))
+  {
+    // No async lookup threads, so the caller must do the work itself.
+    return false;
+  }
+
+  // The latency of the completion is measured from here, as it would have
+  // been if the work had run inline on the worker thread.
+  struct async_work_qe* qe = new async_work_qe;
+  qe->stop_watch.start();
+  qe->work = work;
+  qe->complete = complete;
+
+  if (async_work_held)
+  {
+    held_async_work.push_back(qe);
+  }
+  else
+  {
+    async_work_q.push(qe);
+  }
+
+  return true;
+}
+
+
+void hold_async_work(bool hold)
+{
+  async_work_held = hold;
+}
+
+
+void run_held_async_work()
+{
+  while (!held_async_work.empty())
+  {
+    struct async_work_qe* qe = held_async_work.front();
+    held_async_work.pop_front();
+    bool success = run_async_work(qe->work);
+    qe->complete(success);
+    delete qe;
+  }
+}
+
+
 void unregister_thread_dispatcher(void)
 {
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_thread_dispatcher);
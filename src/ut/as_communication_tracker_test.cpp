@@ -34,6 +34,9 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <thread>
+#include <vector>
+
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
 
@@ -324,3 +327,49 @@ TEST_F(AsCommunicationTrackerTest, MultipleFailureReasons)
   advance_time();
   _comm_tracker->on_failure(AS1, "Another failure reason");
 }
+
+
+// Test that ASs failing concurrently on several threads are each logged once,
+// that the alarm is only raised once, and that they all recover.
+TEST_F(AsCommunicationTrackerTest, ConcurrentAsFailures)
+{
+  const int NUM_THREADS = 4;
+  const int NUM_ASES_PER_THREAD = 25;
+
+  EXPECT_CALL(*_mock_alarm, set());
+  EXPECT_CALL(*_mock_error_log, log(_, StrEq("Timeout")))
+    .Times(NUM_THREADS * NUM_ASES_PER_THREAD);
+
+  std::vector<std::thread> threads;
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    threads.push_back(std::thread([this, ii, NUM_ASES_PER_THREAD]()
+    {
+      for (int jj = 0; jj < NUM_ASES_PER_THREAD; ++jj)
+      {
+        std::string as_uri = "as" + std::to_string(ii) + "-" + std::to_string(jj);
+        _comm_tracker->on_failure(as_uri, "Timeout");
+        _comm_tracker->on_failure(as_uri, "Timeout");
+        _comm_tracker->on_success(AS1);
+      }
+    }));
+  }
+
+  for (std::vector<std::thread>::iterator it = threads.begin();
+       it != threads.end();
+       ++it)
+  {
+    it->join();
+  }
+
+  // All the ASs recover.
+  EXPECT_CALL(*_mock_alarm, clear()).Times(AtLeast(1));
+  EXPECT_CALL(*_mock_ok_log, log(_)).Times(NUM_THREADS * NUM_ASES_PER_THREAD);
+
+  advance_time();
+  _comm_tracker->on_success(AS1);
+
+  advance_time();
+  _comm_tracker->on_success(AS1);
+}
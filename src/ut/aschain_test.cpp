@@ -35,6 +35,8 @@
  */
 
 #include <string>
+#include <thread>
+#include <atomic>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -180,6 +182,63 @@ TEST_F(AsChainTest, AsInvocation)
   EXPECT_EQ(server_name, "sip:pancommunicon.cw-ngv.com");
 }
 
+// Registers, looks up and unregisters chains from many threads at once, to
+// check the sharded token table under contention.
+TEST_F(AsChainTest, ConcurrentLookups)
+{
+  const int NUM_THREADS = 32;
+  const int NUM_CHAINS_PER_THREAD = 200;
+
+  Ifcs ifcs = simple_ifcs(2, "sip:pancommunicon.cw-ngv.com", "sip:mmtel.homedomain");
+  std::atomic<int> failures(0);
+  std::vector<std::thread> threads;
+
+  for (int ii = 0; ii < NUM_THREADS; ++ii)
+  {
+    threads.push_back(std::thread([this, &ifcs, &failures, NUM_CHAINS_PER_THREAD]()
+    {
+      for (int jj = 0; jj < NUM_CHAINS_PER_THREAD; ++jj)
+      {
+        std::string token;
+
+        {
+          AsChain as_chain(_as_chain_table, SessionCase::Originating, "sip:5755550011@homedomain", true, 0, ifcs, NULL);
+          AsChainLink as_chain_link(&as_chain, 0u);
+          token = as_chain_link.next_odi_token();
+
+          AsChainLink res = _as_chain_table->lookup(token);
+          if ((res._as_chain != &as_chain) || (res._index != 1u))
+          {
+            failures++;
+          }
+          res.release();
+        }
+
+        // The chain has been destroyed so its tokens must no longer resolve.
+        AsChainLink res = _as_chain_table->lookup(token);
+        if (res.is_set())
+        {
+          failures++;
+          res.release();
+        }
+      }
+    }));
+  }
+
+  for (std::vector<std::thread>::iterator it = threads.begin();
+       it != threads.end();
+       ++it)
+  {
+    it->join();
+  }
+
+  EXPECT_EQ(0, failures.load());
+
+  // Tokens of the wrong length are rejected without touching the table.
+  EXPECT_FALSE(_as_chain_table->lookup("").is_set());
+  EXPECT_FALSE(_as_chain_table->lookup("notanoditokenatall").is_set());
+}
+
 // ++@@@ aschain.to_string
 // @@@ initial request: has MMTEL, orig and term
 // ++@@@ has ASs but URI is invalid.
@@ -1511,6 +1511,84 @@ TEST_F(BasicProxyTest, ForkedRequestConnFail)
 }
 
 
+TEST_F(BasicProxyTest, ForkedRequestDnsFailure)
+{
+  // Tests forking of request to a home domain RequestURI where the next hop
+  // of one of the targets can't be resolved, so the next hops resolved in
+  // parallel for the forks don't all succeed.
+
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Add two test targets for bob@homedomain, one with a path via a proxy that
+  // resolves and one with a path via a proxy that isn't configured in DNS.
+  _basic_proxy->add_test_target("sip:bob@homedomain",
+                                "sip:bob@node1.homedomain;transport=TCP",
+                                std::list<std::string>(1, "sip:proxy1.homedomain;transport=TCP;lr"));
+  _basic_proxy->add_test_target("sip:bob@homedomain",
+                                "sip:bob@node2.homedomain;transport=TCP",
+                                std::list<std::string>(1, "sip:proxy-x.homedomain;transport=TCP;lr"));
+
+  // Inject a request with a Route header referring to this node and a
+  // RequestURI with a URI in the home domain.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@homedomain;transport=TCP";
+  msg1._from = "alice";
+  msg1._to = "bob";
+  msg1._todomain = "awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:127.0.0.1;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting 100 Trying and a single forwarded INVITE - the fork to
+  // proxy-x.homedomain fails with an internal 408.
+  ASSERT_EQ(2, txdata_count());
+
+  // Check the 100 Trying.
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  tp->expect_target(tdata);
+  EXPECT_EQ("To: <sip:bob@awaydomain>", get_headers(tdata->msg, "To")); // No tag
+  free_txdata();
+
+  // Catch the request forked to node1.homedomain via proxy1.homedomain.
+  pjsip_tx_data* tdata1 = pop_txdata();
+  expect_target("TCP", "10.10.10.1", 5060, tdata1);
+  ReqMatcher("INVITE").matches(tdata1->msg);
+  EXPECT_EQ("sip:bob@node1.homedomain;transport=TCP",
+            str_uri(tdata1->msg->line.req.uri));
+  EXPECT_EQ("Route: <sip:proxy1.homedomain;transport=TCP;lr>",
+            get_headers(tdata1->msg, "Route"));
+
+  // Send a 486 response from node1, and check the proxy ACKs it.
+  inject_msg(respond_to_txdata(tdata1, 486));
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("ACK").matches(tdata->msg);
+  free_txdata();
+
+  // The proxy sends the best response (the 486) to the source.
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(486).matches(tdata->msg);
+  free_txdata();
+
+  // Send an ACK to complete the UAS transaction.
+  msg1._method = "ACK";
+  inject_msg(msg1.get_request(), tp);
+
+  _basic_proxy->remove_test_targets("sip:bob@homedomain");
+
+  delete tp;
+}
+
+
 TEST_F(BasicProxyTest, ForkedRequestCancel)
 {
   // Tests CANCELing a forked of request to a home domain RequestURI.
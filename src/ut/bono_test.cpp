@@ -56,6 +56,7 @@ using namespace std;
 using testing::StrEq;
 using testing::ElementsAre;
 using testing::MatchesRegex;
+using testing::StartsWith;
 using testing::HasSubstr;
 using testing::Not;
 
@@ -256,7 +257,8 @@ public:
                             bool icscf_enabled = false,
                             bool scscf_enabled = false,
                             const string& icscf_uri_str = "",
-                            bool emerg_reg_enabled = false)
+                            bool emerg_reg_enabled = false,
+                            bool stateless_relay_enabled = false)
   {
     SipTest::SetUpTestCase();
 
@@ -281,6 +283,7 @@ public:
     _icscf = icscf_enabled;
     _scscf = scscf_enabled;
     _emerg_reg = emerg_reg_enabled;
+    _stateless_relay = stateless_relay_enabled;
     _acr_factory = new ACRFactory();
     pj_status_t ret = init_stateful_proxy(_sdm,
                                           NULL,
@@ -305,7 +308,8 @@ public:
                                           &_quiescing_manager,
                                           _icscf,
                                           _scscf,
-                                          _emerg_reg);
+                                          _emerg_reg,
+                                          _stateless_relay);
     ASSERT_EQ(PJ_SUCCESS, ret) << PjStatus(ret);
 
     // Schedule timers.
@@ -397,6 +401,7 @@ protected:
   static bool _icscf;
   static bool _scscf;
   static bool _emerg_reg;
+  static bool _stateless_relay;
 
   void doTestHeaders(TransportFlow* tpA,
                      bool tpAset,
@@ -427,6 +432,7 @@ string StatefulProxyTestBase::_icscf_uri_str;
 bool StatefulProxyTestBase::_icscf;
 bool StatefulProxyTestBase::_scscf;
 bool StatefulProxyTestBase::_emerg_reg;
+bool StatefulProxyTestBase::_stateless_relay;
 QuiescingManager StatefulProxyTestBase::_quiescing_manager;
 
 class StatefulEdgeProxyTest : public StatefulProxyTestBase
@@ -466,6 +472,21 @@ protected:
   BT::Message doInviteEdge(string token);
 };
 
+class StatefulEdgeProxyStatelessRelayTest : public StatefulEdgeProxyTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    StatefulProxyTestBase::SetUpTestCase("upstreamnode", "", "", "", false, false, false, "", false, true);
+    add_host_mapping("upstreamnode", "10.6.6.8");
+  }
+
+  static void TearDownTestCase()
+  {
+    StatefulProxyTestBase::TearDownTestCase();
+  }
+};
+
 class StatefulEdgeProxyAcceptRegisterTest : public StatefulProxyTestBase
 {
 public:
@@ -1826,6 +1847,147 @@ TEST_F(StatefulEdgeProxyTest, TestLoopbackReqUri)
   free_txdata();
 }
 
+// Test that, with stateless relay enabled, in-dialog non-INVITE requests on
+// an established flow are forwarded without a transaction.
+TEST_F(StatefulEdgeProxyStatelessRelayTest, TestInDialogRelay)
+{
+  SCOPED_TRACE("");
+
+  // Register client.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.pcscf_untrusted_port,
+                                        "1.2.3.4",
+                                        49152);
+  string token;
+  string baretoken;
+  doRegisterEdge(tp, token, baretoken);
+
+  // Send an in-dialog BYE to the client, then retransmit it.  Both copies
+  // are forwarded, as there is no transaction to absorb the retransmission,
+  // and both carry the same branch so the client sees a retransmission
+  // rather than a new transaction.
+  Message msg;
+  msg._method = "BYE";
+  msg._to = "6505551000";
+  msg._from = "6505551234";
+  msg._extra = "Route: ";
+  msg._extra.append(token);
+  msg._requri = "sip:wuntootreefower@10.114.61.213:5061;transport=tcp;ob";
+  msg._in_dialog = true;
+
+  string branch;
+  for (int i = 1; i <= 2; i++)
+  {
+    SCOPED_TRACE(i);
+    inject_msg(msg.get_request());
+    ASSERT_EQ(1, txdata_count());
+    pjsip_tx_data* tdata = current_txdata();
+    ReqMatcher("BYE").matches(tdata->msg);
+    tp->expect_target(tdata);
+
+    pjsip_via_hdr* via =
+          (pjsip_via_hdr*)pjsip_msg_find_hdr(tdata->msg, PJSIP_H_VIA, NULL);
+    ASSERT_TRUE(via != NULL);
+    string fwd_branch = PJUtils::pj_str_to_string(&via->branch_param);
+    EXPECT_THAT(fwd_branch, StartsWith("z9hG4bKPj"));
+
+    if (i == 1)
+    {
+      branch = fwd_branch;
+      free_txdata();
+    }
+    else
+    {
+      EXPECT_EQ(branch, fwd_branch);
+    }
+  }
+
+  // The client's response is forwarded back upstream.
+  inject_msg(respond_to_current_txdata(200), tp);
+  ASSERT_EQ(1, txdata_count());
+  pjsip_tx_data* tdata = current_txdata();
+  RespMatcher(200).matches(tdata->msg);
+  _tp_default->expect_target(tdata);
+  free_txdata();
+
+  // A BYE with a different CSeq is a new transaction, so gets a new branch.
+  msg._cseq++;
+  inject_msg(msg.get_request());
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  pjsip_via_hdr* via =
+          (pjsip_via_hdr*)pjsip_msg_find_hdr(tdata->msg, PJSIP_H_VIA, NULL);
+  ASSERT_TRUE(via != NULL);
+  EXPECT_NE(branch, PJUtils::pj_str_to_string(&via->branch_param));
+  free_txdata();
+
+  delete tp;
+}
+
+// Test that, with stateless relay enabled, in-dialog UPDATEs are still
+// forwarded statefully, so that session timer processing is applied to them.
+TEST_F(StatefulEdgeProxyStatelessRelayTest, TestInDialogUpdateNotRelayed)
+{
+  SCOPED_TRACE("");
+
+  // Register client.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.pcscf_untrusted_port,
+                                        "1.2.3.4",
+                                        49152);
+  string token;
+  string baretoken;
+  doRegisterEdge(tp, token, baretoken);
+
+  // Send an in-dialog UPDATE refreshing the session to the client, where the
+  // sender supports session timers.
+  Message msg;
+  msg._method = "UPDATE";
+  msg._to = "6505551000";
+  msg._from = "6505551234";
+  msg._extra = "Route: ";
+  msg._extra.append(token);
+  msg._extra.append("\r\nSupported: timer");
+  msg._requri = "sip:wuntootreefower@10.114.61.213:5061;transport=tcp;ob";
+  msg._in_dialog = true;
+  inject_msg(msg.get_request());
+
+  // The UPDATE is forwarded with a Session-Expires header.
+  ASSERT_EQ(1, txdata_count());
+  pjsip_tx_data* tdata = current_txdata();
+  ReqMatcher("UPDATE").matches(tdata->msg);
+  tp->expect_target(tdata);
+  EXPECT_NE("", get_headers(tdata->msg, "Session-Expires"));
+
+  // A retransmission is absorbed by the transaction.
+  inject_msg(msg.get_request());
+  ASSERT_EQ(1, txdata_count());
+
+  // The client's response is forwarded back upstream, with a Session-Expires
+  // header added as the client doesn't support session timers.
+  inject_msg(respond_to_current_txdata(200), tp);
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(200).matches(tdata->msg);
+  _tp_default->expect_target(tdata);
+  EXPECT_NE("", get_headers(tdata->msg, "Session-Expires"));
+  free_txdata();
+
+  delete tp;
+}
+
+// Test that, with stateless relay enabled, stray responses to methods that
+// are never relayed statelessly are not forwarded.
+TEST_F(StatefulEdgeProxyStatelessRelayTest, TestStrayResponseNotForwarded)
+{
+  SCOPED_TRACE("");
+
+  Message msg;
+  msg._method = "REGISTER";
+  inject_msg(msg.get_response(), _tp_default);
+  ASSERT_EQ(0, txdata_count());
+}
+
 // Test that Bono routes all initial requests to Sprout.
 TEST_F(StatefulEdgeProxyTest, TestAlwaysRouteUpstream)
 {
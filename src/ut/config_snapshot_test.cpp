@@ -0,0 +1,187 @@
+/**
+ * @file config_snapshot_test.cpp
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "config_snapshot.h"
+
+/// A configuration whose fields are always set together, so that a reader
+/// that sees a mixture of two snapshots can be spotted.
+struct TestConfig
+{
+  TestConfig(int version) : version(version), check(version * 2) {}
+
+  int version;
+  int check;
+};
+
+TEST(ConfigSnapshotTest, ReadersSeeLatestSnapshot)
+{
+  ConfigSnapshot<TestConfig> config(std::make_shared<const TestConfig>(1));
+
+  {
+    ConfigSnapshot<TestConfig>::Reader reader(config);
+    EXPECT_EQ(1, reader->version);
+  }
+
+  config.set(std::make_shared<const TestConfig>(2));
+
+  {
+    ConfigSnapshot<TestConfig>::Reader reader(config);
+    EXPECT_EQ(2, reader->version);
+  }
+}
+
+TEST(ConfigSnapshotTest, NestedReadersAreConsistent)
+{
+  ConfigSnapshot<TestConfig> config(std::make_shared<const TestConfig>(1));
+
+  ConfigSnapshot<TestConfig>::Reader outer(config);
+  config.set(std::make_shared<const TestConfig>(2));
+
+  // The outer reader's snapshot is still in use, so a nested reader on the
+  // same thread sees it too.
+  ConfigSnapshot<TestConfig>::Reader inner(config);
+  EXPECT_EQ(1, outer->version);
+  EXPECT_EQ(1, inner->version);
+}
+
+TEST(ConfigSnapshotTest, OldSnapshotsFreed)
+{
+  std::shared_ptr<const TestConfig> first = std::make_shared<const TestConfig>(1);
+  std::weak_ptr<const TestConfig> first_weak = first;
+  ConfigSnapshot<TestConfig> config(first);
+  first.reset();
+
+  {
+    ConfigSnapshot<TestConfig>::Reader reader(config);
+    EXPECT_EQ(1, reader->version);
+  }
+
+  // The snapshot is kept until this thread reads the new one.
+  config.set(std::make_shared<const TestConfig>(2));
+  EXPECT_FALSE(first_weak.expired());
+
+  {
+    ConfigSnapshot<TestConfig>::Reader reader(config);
+    EXPECT_EQ(2, reader->version);
+  }
+
+  EXPECT_TRUE(first_weak.expired());
+
+  // A thread's reference to a snapshot goes when the thread exits.
+  std::thread t([&]()
+  {
+    ConfigSnapshot<TestConfig>::Reader reader(config);
+    EXPECT_EQ(2, reader->version);
+  });
+  t.join();
+
+  std::shared_ptr<const TestConfig> third = std::make_shared<const TestConfig>(3);
+  std::weak_ptr<const TestConfig> third_weak = third;
+  config.set(third);
+  third.reset();
+
+  std::thread t2([&]()
+  {
+    ConfigSnapshot<TestConfig>::Reader reader(config);
+    EXPECT_EQ(3, reader->version);
+  });
+  t2.join();
+
+  config.set(std::make_shared<const TestConfig>(4));
+  EXPECT_TRUE(third_weak.expired());
+}
+
+/// Readers on 1 to 64 threads while the configuration is repeatedly
+/// replaced.  Each reader must always see a whole snapshot, and must never
+/// go back to an older one.
+TEST(ConfigSnapshotTest, ConcurrentReadersAndUpdates)
+{
+  const int READS_PER_THREAD = 20000;
+  const int UPDATES = 1000;
+
+  for (int num_threads = 1; num_threads <= 64; num_threads *= 2)
+  {
+    SCOPED_TRACE(num_threads);
+    ConfigSnapshot<TestConfig> config(std::make_shared<const TestConfig>(0));
+    std::atomic<int> errors(0);
+    std::vector<std::thread> readers;
+
+    for (int ii = 0; ii < num_threads; ++ii)
+    {
+      readers.push_back(std::thread([&]()
+      {
+        int last_version = 0;
+
+        for (int jj = 0; jj < READS_PER_THREAD; ++jj)
+        {
+          ConfigSnapshot<TestConfig>::Reader reader(config);
+
+          if ((reader->check != reader->version * 2) ||
+              (reader->version < last_version))
+          {
+            ++errors;
+          }
+
+          last_version = reader->version;
+        }
+      }));
+    }
+
+    for (int ii = 1; ii <= UPDATES; ++ii)
+    {
+      config.set(std::make_shared<const TestConfig>(ii));
+    }
+
+    for (std::vector<std::thread>::iterator t = readers.begin();
+         t != readers.end();
+         ++t)
+    {
+      t->join();
+    }
+
+    EXPECT_EQ(0, errors);
+
+    ConfigSnapshot<TestConfig>::Reader reader(config);
+    EXPECT_EQ(UPDATES, reader->version);
+  }
+}
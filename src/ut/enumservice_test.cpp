@@ -434,3 +434,57 @@ TEST_F(DNSEnumServiceTest, PosixRegexTest)
   ET("1234", "").test(enum_);
 }
 
+
+/// Check that rules applied by direct substitution give exactly the same
+/// results as Boost regex, and that anything else is left to Boost.
+TEST_F(EnumServiceTest, SimpleRewriteMatchesRegex)
+{
+  struct
+  {
+    std::string regex_replace;
+    bool simple;
+  } rules[] = {
+    {"!(^.*$)!sip:\\1@ut.cw-ngv.com!", true},
+    {"!^(.*)$!sip:\\1@ut.cw-ngv.com!", true},
+    {"!^\\+1(.*)$!sip:\\1@ut.cw-ngv.com!", true},
+    {"!^0111(.*)$!sip:\\1@ut.cw-ngv.com!", true},
+    {"!^\\+16901(.*$)!tel:+16901\\1;npdi;rn=16901!", true},
+    {"!^(\\+44.*)!tel:\\1;phone-context=uk!", true},
+    {"!^(.*)$!\\1!", true},
+    {"!^(.*)$!sip:\\1@ut.cw-ngv.com;user=\\1!", true},
+    {"!^(.*)$!fixed!", true},
+    {"!(1234)!sip:\\1@ut.cw-ngv.com!", false},
+    {"!1234!5678!", false},
+    {"!^\\+1(.*)$!sip:$1@ut.cw-ngv.com!", false},
+    {"!^\\+1(.*)$!sip:\\2@ut.cw-ngv.com!", false},
+    {"!^\\+1(.*)$!sip:\\10@ut.cw-ngv.com!", false},
+    {"!^\\+1(.*)(.*)$!sip:\\1@ut.cw-ngv.com!", false},
+    {"!^\\+1(.*)5$!sip:\\1@ut.cw-ngv.com!", false},
+    {"!^\\+1[0-9](.*)$!sip:\\1@ut.cw-ngv.com!", false},
+    {"!^+1(.*)$!sip:\\1@ut.cw-ngv.com!", false},
+    {"!^1.(.*)$!sip:\\1@ut.cw-ngv.com!", false},
+    {"!\\+1(.*)$!sip:\\1@ut.cw-ngv.com!", false},
+    {"!(^[[:digit:]]+)!sip:\\1@ut.cw-ngv.com!", false},
+  };
+
+  std::string inputs[] = {"", "+", "+1", "+15108580271", "15108580271",
+                          "01115108580271", "+16901234", "+441234",
+                          "1234", "5", "+1\n234", "+1 234"};
+
+  for (size_t ii = 0; ii < sizeof(rules) / sizeof(rules[0]); ++ii)
+  {
+    SCOPED_TRACE(rules[ii].regex_replace);
+    EnumService::Rewrite rewrite;
+    ASSERT_TRUE(EnumService::parse_regex_replace(rules[ii].regex_replace, rewrite));
+    EXPECT_EQ(rules[ii].simple, rewrite.is_simple());
+
+    for (size_t jj = 0; jj < sizeof(inputs) / sizeof(inputs[0]); ++jj)
+    {
+      SCOPED_TRACE(inputs[jj]);
+      EXPECT_EQ(boost::regex_replace(inputs[jj], rewrite.regex(), rewrite.replacement()),
+                rewrite.replace(inputs[jj]));
+      EXPECT_EQ(boost::regex_search(inputs[jj], rewrite.regex()),
+                rewrite.matches(inputs[jj]));
+    }
+  }
+}
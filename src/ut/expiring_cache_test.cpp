@@ -0,0 +1,145 @@
+/**
+ * @file expiring_cache_test.cpp UT for the ExpiringCache template.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "expiring_cache.h"
+
+TEST(ExpiringCacheTest, ValuesExpire)
+{
+  ExpiringCache<int> cache(100);
+
+  cache.set("key", std::make_shared<int>(1), 110, 100);
+  ASSERT_TRUE(cache.get("key", 100) != NULL);
+  EXPECT_EQ(1, *cache.get("key", 109));
+
+  // Setting the key again replaces the value and its expiry.
+  cache.set("key", std::make_shared<int>(2), 120, 105);
+  EXPECT_EQ(2, *cache.get("key", 115));
+
+  // Once expired, the value isn't returned, and is removed.
+  EXPECT_TRUE(cache.get("key", 120) == NULL);
+  EXPECT_EQ(0u, cache.size());
+}
+
+TEST(ExpiringCacheTest, Erase)
+{
+  ExpiringCache<int> cache(100);
+
+  cache.set("key1", std::make_shared<int>(1), 200, 100);
+  cache.set("key2", std::make_shared<int>(2), 200, 100);
+  cache.erase("key1");
+  cache.erase("unknown");
+  EXPECT_TRUE(cache.get("key1", 100) == NULL);
+  EXPECT_EQ(2, *cache.get("key2", 100));
+
+  cache.clear();
+  EXPECT_TRUE(cache.get("key2", 100) == NULL);
+  EXPECT_EQ(0u, cache.size());
+}
+
+TEST(ExpiringCacheTest, SizeIsBounded)
+{
+  ExpiringCache<int> cache(64);
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    cache.set(std::to_string(ii), std::make_shared<int>(ii), 200, 100);
+  }
+
+  EXPECT_LE(cache.size(), 64u);
+
+  // The most recently set value is always kept.
+  EXPECT_EQ(999, *cache.get("999", 100));
+}
+
+TEST(ExpiringCacheTest, ExpiredValuesArePrunedOnSet)
+{
+  ExpiringCache<int> cache(10000);
+
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    cache.set(std::to_string(ii), std::make_shared<int>(ii), 110, 100);
+  }
+
+  EXPECT_EQ(100u, cache.size());
+
+  // Each set after the values have expired removes some of them, so they
+  // are all gone well before the new values fill the cache.
+  for (int ii = 100; ii < 1100; ++ii)
+  {
+    cache.set(std::to_string(ii), std::make_shared<int>(ii), 300, 200);
+  }
+
+  EXPECT_EQ(1000u, cache.size());
+  EXPECT_TRUE(cache.get("0", 200) == NULL);
+}
+
+TEST(ExpiringCacheTest, ConcurrentAccess)
+{
+  ExpiringCache<int> cache(256);
+  std::vector<std::thread> threads;
+
+  for (int ii = 0; ii < 8; ++ii)
+  {
+    threads.push_back(std::thread([&cache, ii]()
+    {
+      for (int jj = 0; jj < 10000; ++jj)
+      {
+        std::string key = std::to_string((ii * jj) % 512);
+        cache.set(key, std::make_shared<int>(jj), jj % 7, jj % 5);
+
+        std::shared_ptr<const int> value = cache.get(key, jj % 3);
+
+        if (jj % 11 == 0)
+        {
+          cache.erase(key);
+        }
+      }
+    }));
+  }
+
+  for (std::thread& t : threads)
+  {
+    t.join();
+  }
+
+  EXPECT_LE(cache.size(), 256u);
+}
@@ -122,7 +122,7 @@ void FakeHSSConnection::delete_result(const std::string& url)
   _results.erase(UrlBody(url, ""));
 }
 
-long FakeHSSConnection::put_for_xml_object(const std::string& path, std::string body, bool cache_allowed, rapidxml::xml_document<>*& root, SAS::TrailId trail)
+long FakeHSSConnection::put_for_xml_object(const std::string& path, std::string body, bool cache_allowed, std::shared_ptr<rapidxml::xml_document<> >& root, SAS::TrailId trail)
 {
   return FakeHSSConnection::get_xml_object(path,
                                            body,
@@ -148,7 +148,10 @@ long FakeHSSConnection::get_json_object(const std::string& path,
                                         rapidjson::Document*& object,
                                         SAS::TrailId trail)
 {
-  _calls.insert(UrlBody(path, ""));
+  {
+    std::unique_lock<std::mutex> lock(_calls_lock);
+    _calls.insert(UrlBody(path, ""));
+  }
   HTTPCode http_code = HTTP_NOT_FOUND;
 
   std::map<UrlBody, std::string>::const_iterator i = _results.find(UrlBody(path, ""));
@@ -189,7 +192,7 @@ long FakeHSSConnection::get_json_object(const std::string& path,
 }
 
 long FakeHSSConnection::get_xml_object(const std::string& path,
-                                       rapidxml::xml_document<>*& root,
+                                       std::shared_ptr<rapidxml::xml_document<> >& root,
                                        SAS::TrailId trail)
 {
   return get_xml_object(path, "", root, trail);
@@ -197,17 +200,20 @@ long FakeHSSConnection::get_xml_object(const std::string& path,
 
 long FakeHSSConnection::get_xml_object(const std::string& path,
                                        std::string body,
-                                       rapidxml::xml_document<>*& root,
+                                       std::shared_ptr<rapidxml::xml_document<> >& root,
                                        SAS::TrailId trail)
 {
-  _calls.insert(UrlBody(path, body));
+  {
+    std::unique_lock<std::mutex> lock(_calls_lock);
+    _calls.insert(UrlBody(path, body));
+  }
   HTTPCode http_code = HTTP_NOT_FOUND;
 
   std::map<UrlBody, std::string>::const_iterator i = _results.find(UrlBody(path, body));
 
   if (i != _results.end())
   {
-    root = new rapidxml::xml_document<>;
+    root = std::make_shared<rapidxml::xml_document<> >();
     try
     {
       root->parse<0>(root->allocate_string(i->second.c_str()));
@@ -224,8 +230,7 @@ long FakeHSSConnection::get_xml_object(const std::string& path,
                 path.c_str(),
                 i->second.c_str(),
                 err.what());
-      delete root;
-      root = NULL;
+      root.reset();
     }
   }
   else
@@ -251,6 +256,7 @@ long FakeHSSConnection::get_xml_object(const std::string& path,
 
 bool FakeHSSConnection::url_was_requested(const std::string& url, const std::string& body)
 {
+  std::unique_lock<std::mutex> lock(_calls_lock);
   return (_calls.find(UrlBody(url, body)) != _calls.end());
 }
 
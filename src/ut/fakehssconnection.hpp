@@ -36,6 +36,7 @@
 
 #pragma once
 
+#include <mutex>
 #include <set>
 #include <string>
 #include "log.h"
@@ -87,15 +88,16 @@ public:
 
 private:
   long get_json_object(const std::string& path, rapidjson::Document*& object, SAS::TrailId trail);
-  long get_xml_object(const std::string& path, rapidxml::xml_document<>*& root, SAS::TrailId trail);
-  long get_xml_object(const std::string& path, std::string body, rapidxml::xml_document<>*& root, SAS::TrailId trail);
-  long put_for_xml_object(const std::string& path, std::string body, bool cache_allowed, rapidxml::xml_document<>*& root, SAS::TrailId trail);
+  long get_xml_object(const std::string& path, std::shared_ptr<rapidxml::xml_document<> >& root, SAS::TrailId trail);
+  long get_xml_object(const std::string& path, std::string body, std::shared_ptr<rapidxml::xml_document<> >& root, SAS::TrailId trail);
+  long put_for_xml_object(const std::string& path, std::string body, bool cache_allowed, std::shared_ptr<rapidxml::xml_document<> >& root, SAS::TrailId trail);
 
   // Map of URL/body pair to result
   typedef std::pair<std::string, std::string> UrlBody;
   std::map<UrlBody, std::string> _results;
   std::map<std::string, long> _rcs;
   std::set<UrlBody> _calls;
+  std::mutex _calls_lock;
 
   // Optional MockHSSConnection object.  May be NULL if the creator of the
   // FakeHSSConnection  does not want to explicitly check method invocation.
@@ -156,3 +156,63 @@ TEST_F(FlowTest, FlowUnQuiesceMidDialog)
   EXPECT_FALSE(flow->should_quiesce());
 }
 
+
+
+TEST_F(FlowTest, IdleFlowExpires)
+{
+  pj_sockaddr addr2 = addr;
+  pj_sockaddr_set_port(&addr2, 5080);
+  pjsip_transport* tp = TransportFlow::udp_transport(stack_data.pcscf_untrusted_port);
+
+  // Create a flow and drop our reference to it, so only the idle timer is
+  // keeping it alive.
+  Flow* flow2 = ft->find_create_flow(tp, &addr2);
+  flow2->dec_ref();
+
+  // Touch the flow partway through the idle period, and check it survives
+  // past the original idle timeout.
+  cwtest_advance_time_ms(300 * 1000);
+  poll();
+  flow2->touch();
+
+  cwtest_advance_time_ms(301 * 1000);
+  poll();
+  flow2 = ft->find_flow(tp, &addr2);
+  ASSERT_TRUE(flow2 != NULL);
+  flow2->dec_ref();
+
+  // The flow is expired once it has been idle for the full timeout.
+  cwtest_advance_time_ms(300 * 1000);
+  poll();
+  EXPECT_TRUE(ft->find_flow(tp, &addr2) == NULL);
+}
+
+
+TEST_F(FlowTest, ManyIdleFlowsExpire)
+{
+  pjsip_transport* tp = TransportFlow::udp_transport(stack_data.pcscf_untrusted_port);
+  const int num_flows = 10000;
+
+  // Create lots of flows, spread across the wheel.
+  for (int ii = 0; ii < num_flows; ++ii)
+  {
+    pj_sockaddr addr2 = addr;
+    pj_sockaddr_set_port(&addr2, 10000 + ii);
+    ft->find_create_flow(tp, &addr2)->dec_ref();
+
+    if (ii % 100 == 0)
+    {
+      cwtest_advance_time_ms(1000);
+    }
+  }
+
+  cwtest_advance_time_ms(601 * 1000);
+  poll();
+
+  for (int ii = 0; ii < num_flows; ++ii)
+  {
+    pj_sockaddr addr2 = addr;
+    pj_sockaddr_set_port(&addr2, 10000 + ii);
+    EXPECT_TRUE(ft->find_flow(tp, &addr2) == NULL);
+  }
+}
@@ -49,6 +49,7 @@
 #include "mock_subscriber_data_manager.h"
 #include "mock_impi_store.h"
 #include "mock_hss_connection.h"
+#include "fakesnmp.hpp"
 #include "rapidjson/document.h"
 
 using namespace std;
@@ -513,6 +514,8 @@ class DeregistrationTaskTest : public SipTest
   MockHttpStack::Request* _req;
   DeregistrationTask::Config* _cfg;
   DeregistrationTask* _task;
+  int _num_threads;
+  SNMP::FakeEventAccumulatorTable _batch_latency_tbl;
 
   static void SetUpTestCase()
   {
@@ -526,6 +529,7 @@ class DeregistrationTaskTest : public SipTest
     _httpstack = new MockHttpStack();
     _subscriber_data_manager = new MockSubscriberDataManager();
     _hss = new FakeHSSConnection();
+    _num_threads = 1;
   }
 
   void TearDown()
@@ -553,7 +557,9 @@ class DeregistrationTaskTest : public SipTest
                                           {},
                                           _hss,
                                           NULL,
-                                          _impi_store);
+                                          _impi_store,
+                                          _num_threads,
+                                          &_batch_latency_tbl);
     _task = new DeregistrationTask(*_req, _cfg, 0);
   }
 
@@ -1042,6 +1048,57 @@ TEST_F(DeregistrationTaskTest, ImpiStoreDataContention)
 }
 
 
+// Test that a bulk deregistration is spread across several threads in
+// batches, and that each IMPI is only deleted once.
+TEST_F(DeregistrationTaskTest, ParallelBatchesTest)
+{
+  const int NUM_AORS = 250;
+  const int NUM_IMPIS = 10;
+  int now = time(NULL);
+
+  std::string body = "{\"registrations\": [";
+  std::vector<std::string> aor_ids;
+  std::vector<SubscriberDataManager::AoRPair*> aors;
+
+  for (int ii = 0; ii < NUM_AORS; ++ii)
+  {
+    std::string aor_id = "sip:65055" + std::to_string(50000 + ii) + "@homedomain";
+    body += ((ii == 0) ? "" : ", ");
+    body += "{\"primary-impu\": \"" + aor_id + "\"}";
+
+    SubscriberDataManager::AoR* aor = new SubscriberDataManager::AoR(aor_id);
+    SubscriberDataManager::AoR::Binding* b1 = aor->get_binding(std::string("<urn:uuid:00000000-0000-0000-0000-b4dd32817622>:1"));
+    b1->_expires = now + 300;
+    b1->_emergency_registration = false;
+    b1->_private_id = "impi" + std::to_string(ii % NUM_IMPIS);
+
+    SubscriberDataManager::AoR* backup_aor = new SubscriberDataManager::AoR(*aor);
+    aor_ids.push_back(aor_id);
+    aors.push_back(new SubscriberDataManager::AoRPair(aor, backup_aor));
+  }
+
+  body += "]}";
+  _num_threads = 4;
+  build_dereg_request(body, "false");
+  expect_sdm_updates(aor_ids, aors);
+
+  for (int ii = 0; ii < NUM_IMPIS; ++ii)
+  {
+    std::string impi_id = "impi" + std::to_string(ii);
+    ImpiStore::Impi* impi = new ImpiStore::Impi(impi_id);
+    EXPECT_CALL(*_impi_store, get_impi(impi_id, _)).WillOnce(Return(impi));
+    EXPECT_CALL(*_impi_store, delete_impi(impi, _)).WillOnce(Return(Store::OK));
+  }
+
+  EXPECT_CALL(*_httpstack, send_reply(_, 200, _));
+  DeregistrationTask::start_helper_threads(3);
+  _task->run();
+  DeregistrationTask::stop_helper_threads();
+
+  // 250 registrations make three batches.
+  EXPECT_EQ(3, _batch_latency_tbl._count);
+}
+
 class AuthTimeoutTest : public SipTest
 {
   FakeChronosConnection* chronos_connection;
@@ -39,6 +39,9 @@
 
 #include <string>
 #include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <thread>
 #include "gtest/gtest.h"
 
 #include "utils.h"
@@ -622,3 +625,233 @@ TEST_F(HssConnectionTest, CacheNotAllowed)
   EXPECT_EQ(rc, 200);
 }
 
+
+TEST_F(HssConnectionTest, LargeImplicitRegistrationSetSharesIfcs)
+{
+  // A single ServiceProfile containing 50 public identities.  Every identity
+  // gets the same iFCs, and they share one parsed list rather than a copy
+  // each.
+  std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+                    "<ClearwaterRegData>"
+                      "<RegistrationState>REGISTERED</RegistrationState>"
+                      "<IMSSubscription>"
+                        "<ServiceProfile>";
+  for (int ii = 0; ii < 50; ii++)
+  {
+    xml += "<PublicIdentity><Identity>sip:" + std::to_string(ii) +
+           "@example.com</Identity></PublicIdentity>";
+  }
+  xml +=                  "<InitialFilterCriteria>"
+                            "<TriggerPoint>"
+                              "<ConditionTypeCNF>0</ConditionTypeCNF>"
+                              "<SPT>"
+                                "<ConditionNegated>0</ConditionNegated>"
+                                "<Group>0</Group>"
+                                "<Method>INVITE</Method>"
+                              "</SPT>"
+                            "</TriggerPoint>"
+                            "<ApplicationServer>"
+                              "<ServerName>mmtel.narcissi.example.com</ServerName>"
+                              "<DefaultHandling>0</DefaultHandling>"
+                            "</ApplicationServer>"
+                          "</InitialFilterCriteria>"
+                        "</ServiceProfile>"
+                      "</IMSSubscription>"
+                    "</ClearwaterRegData>";
+  fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/pubid50/reg-data", "")] = xml;
+
+  std::map<std::string, Ifcs> ifcs_map;
+  std::vector<std::string> uris;
+  std::string regstate;
+  HTTPCode rc = _hss.get_registration_data("pubid50",
+                                           regstate,
+                                           ifcs_map,
+                                           uris,
+                                           0);
+  EXPECT_EQ(HTTP_OK, rc);
+  ASSERT_EQ(50u, uris.size());
+  ASSERT_EQ(50u, ifcs_map.size());
+
+  const Ifc* first_ifc = &ifcs_map["sip:0@example.com"][0];
+  for (std::vector<std::string>::iterator it = uris.begin();
+       it != uris.end();
+       ++it)
+  {
+    ASSERT_EQ(1u, ifcs_map[*it].size());
+    EXPECT_EQ(first_ifc, &ifcs_map[*it][0]);
+  }
+}
+
+/// Counter table that can be safely polled from another thread.
+class AtomicCounterTable : public SNMP::FakeCounterTable
+{
+public:
+  std::atomic_int _atomic_count;
+  AtomicCounterTable() : _atomic_count(0) {};
+  void increment() { _atomic_count++; SNMP::FakeCounterTable::increment(); };
+};
+
+/// HSSConnection whose GETs block until a given number of other callers have
+/// joined them, so that request coalescing can be tested deterministically.
+/// The GETs can also be made to throw once the other callers have joined.
+class BlockingHSSConnection : public HSSConnection
+{
+public:
+  BlockingHSSConnection(HttpResolver* resolver,
+                        CommunicationMonitor* comm_monitor,
+                        AtomicCounterTable* coalesced_tbl,
+                        int waiters,
+                        bool throw_on_get = false) :
+    HSSConnection("narcissus",
+                  resolver,
+                  NULL,
+                  &SNMP::FAKE_IP_COUNT_TABLE,
+                  &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                  &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                  &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                  &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                  &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                  comm_monitor,
+                  "server_name"),
+    _requests(0),
+    _coalesced_tbl(coalesced_tbl),
+    _waiters(waiters),
+    _throw_on_get(throw_on_get)
+  {
+    set_coalesced_table(coalesced_tbl);
+  }
+
+  std::atomic_int _requests;
+
+private:
+  long get_xml_object(const std::string& path,
+                      std::shared_ptr<rapidxml::xml_document<> >& root,
+                      SAS::TrailId trail)
+  {
+    _requests++;
+
+    while (_coalesced_tbl->_atomic_count < _waiters)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    if (_throw_on_get)
+    {
+      throw std::runtime_error("GET failed");
+    }
+
+    root = parse_xml("<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+                     "<ClearwaterRegData>"
+                       "<RegistrationState>NOT_REGISTERED</RegistrationState>"
+                     "</ClearwaterRegData>",
+                     path);
+    return HTTP_OK;
+  }
+
+  AtomicCounterTable* _coalesced_tbl;
+  int _waiters;
+  bool _throw_on_get;
+};
+
+TEST_F(HssConnectionTest, CoalesceConcurrentRequests)
+{
+  // Four threads ask for the same subscriber's registration data at once.
+  // Only the first request reaches Homestead, and the other three share its
+  // response.
+  AtomicCounterTable coalesced_tbl;
+  BlockingHSSConnection hss(&_resolver, &_cm, &coalesced_tbl, 3);
+  std::atomic_int successes(0);
+  std::vector<std::thread> threads;
+
+  for (int ii = 0; ii < 4; ii++)
+  {
+    threads.push_back(std::thread([&hss, &successes]()
+    {
+      std::map<std::string, Ifcs> ifcs_map;
+      std::vector<std::string> uris;
+      std::string regstate;
+      HTTPCode rc = hss.get_registration_data("pubid47",
+                                              regstate,
+                                              ifcs_map,
+                                              uris,
+                                              0);
+      if ((rc == HTTP_OK) &&
+          (regstate == HSSConnection::STATE_NOT_REGISTERED))
+      {
+        successes++;
+      }
+    }));
+  }
+
+  for (std::vector<std::thread>::iterator it = threads.begin();
+       it != threads.end();
+       ++it)
+  {
+    it->join();
+  }
+
+  EXPECT_EQ(4, successes);
+  EXPECT_EQ(1, hss._requests);
+  EXPECT_EQ(3, coalesced_tbl._count);
+
+  // Once the request has completed, a later request goes to Homestead again.
+  std::map<std::string, Ifcs> ifcs_map;
+  std::vector<std::string> uris;
+  std::string regstate;
+  EXPECT_EQ(HTTP_OK, hss.get_registration_data("pubid47",
+                                               regstate,
+                                               ifcs_map,
+                                               uris,
+                                               0));
+  EXPECT_EQ(2, hss._requests);
+}
+
+TEST_F(HssConnectionTest, CoalescedRequestThrows)
+{
+  // Three threads ask for the same subscriber's registration data at once,
+  // and the request that is sent throws.  The thread that sent it sees the
+  // exception, and the other two fail rather than waiting forever.
+  AtomicCounterTable coalesced_tbl;
+  BlockingHSSConnection hss(&_resolver, &_cm, &coalesced_tbl, 2, true);
+  std::atomic_int exceptions(0);
+  std::atomic_int failures(0);
+  std::vector<std::thread> threads;
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    threads.push_back(std::thread([&hss, &exceptions, &failures]()
+    {
+      std::map<std::string, Ifcs> ifcs_map;
+      std::vector<std::string> uris;
+      std::string regstate;
+
+      try
+      {
+        HTTPCode rc = hss.get_registration_data("pubid47",
+                                                regstate,
+                                                ifcs_map,
+                                                uris,
+                                                0);
+        if (rc != HTTP_OK)
+        {
+          failures++;
+        }
+      }
+      catch (const std::runtime_error&)
+      {
+        exceptions++;
+      }
+    }));
+  }
+
+  for (std::vector<std::thread>::iterator it = threads.begin();
+       it != threads.end();
+       ++it)
+  {
+    it->join();
+  }
+
+  EXPECT_EQ(1, exceptions);
+  EXPECT_EQ(2, failures);
+  EXPECT_EQ(1, hss._requests);
+}
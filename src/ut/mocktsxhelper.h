@@ -75,6 +75,7 @@ public:
   MOCK_METHOD3(schedule_timer, bool(void*, TimerID&, int));
   MOCK_METHOD1(cancel_timer, void(TimerID));
   MOCK_METHOD1(timer_running, bool(TimerID));
+  MOCK_METHOD2(run_async, void(std::function<void()>, void*));
 };
 
 #endif
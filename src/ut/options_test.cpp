@@ -200,3 +200,29 @@ TEST_F(OptionsTest, SimpleMainline)
   free_txdata();
 }
 
+
+/// OPTIONS polls targeted at this node are answered by the fast path module.
+TEST_F(OptionsTest, FastPath)
+{
+  Message msg;
+  pj_bool_t ret = inject_msg_direct(msg.get(), &mod_options_fast_path);
+  EXPECT_EQ(PJ_TRUE, ret);
+  ASSERT_EQ(1, txdata_count());
+  pjsip_msg* out = current_txdata()->msg;
+  EXPECT_EQ(200, out->line.status.code);
+  free_txdata();
+}
+
+/// Other requests are left for the worker threads.
+TEST_F(OptionsTest, FastPathNotOurs)
+{
+  Message msg;
+  msg._domain = "not-us.example.org";
+  pj_bool_t ret = inject_msg_direct(msg.get(), &mod_options_fast_path);
+  EXPECT_EQ(PJ_FALSE, ret);
+
+  msg._domain = "127.0.0.1";
+  msg._method = "INVITE";
+  ret = inject_msg_direct(msg.get(), &mod_options_fast_path);
+  EXPECT_EQ(PJ_FALSE, ret);
+}
@@ -0,0 +1,160 @@
+/**
+ * @file pool_cache_test.cpp
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include "pool_cache.h"
+
+/// Fixture for PoolCacheTest.
+class PoolCacheTest : public ::testing::Test
+{
+public:
+  pj_caching_pool _cp;
+  PoolCache* _cache;
+
+  PoolCacheTest()
+  {
+    pj_init();
+    pj_caching_pool_init(&_cp, &pj_pool_factory_default_policy, 0);
+    _cache = new PoolCache(&_cp, 4);
+  }
+
+  ~PoolCacheTest()
+  {
+    delete _cache; _cache = NULL;
+    pj_caching_pool_destroy(&_cp);
+    pj_shutdown();
+  }
+};
+
+TEST_F(PoolCacheTest, RecyclesPools)
+{
+  PoolCache::Stats stats;
+
+  pj_pool_t* pool1 = pj_pool_create(_cache->factory(), "pool1", 1000, 1000, NULL);
+  ASSERT_TRUE(pool1 != NULL);
+  pj_pool_alloc(pool1, 500);
+  pj_pool_release(pool1);
+
+  // The next pool with the same increment comes from the cache, and is
+  // renamed and empty.
+  pj_pool_t* pool2 = pj_pool_create(_cache->factory(), "pool2-%p", 1000, 1000, NULL);
+  EXPECT_EQ(pool1, pool2);
+  EXPECT_EQ(0, strncmp(pool2->obj_name, "pool2-", 6));
+  EXPECT_LE(pj_pool_get_used_size(pool2), (pj_size_t)500);
+
+  // A pool with a different increment is a different class.
+  pj_pool_t* pool3 = pj_pool_create(_cache->factory(), "pool3", 256, 256, NULL);
+  EXPECT_NE(pool2, pool3);
+
+  _cache->get_stats(stats);
+  EXPECT_EQ(1u, stats.hits);
+  EXPECT_EQ(2u, stats.misses);
+  EXPECT_EQ(0u, stats.cached_pools);
+  EXPECT_EQ(1u, stats.cached_pools_hwm);
+
+  pj_pool_release(pool2);
+  pj_pool_release(pool3);
+}
+
+TEST_F(PoolCacheTest, Overflow)
+{
+  PoolCache::Stats stats;
+  std::vector<pj_pool_t*> pools;
+
+  for (int ii = 0; ii < 6; ++ii)
+  {
+    pools.push_back(pj_pool_create(_cache->factory(), "pool", 1000, 1000, NULL));
+  }
+  for (int ii = 0; ii < 6; ++ii)
+  {
+    pj_pool_release(pools[ii]);
+  }
+
+  // Only four pools per class are cached, so the rest go back to the
+  // caching pool.
+  _cache->get_stats(stats);
+  EXPECT_EQ(4u, stats.cached_pools);
+  EXPECT_EQ(2u, stats.overflows);
+}
+
+TEST_F(PoolCacheTest, LearnsPoolSize)
+{
+  // Repeatedly use much more of each pool than its initial size.
+  for (int ii = 0; ii < 64; ++ii)
+  {
+    pj_pool_t* pool = pj_pool_create(_cache->factory(), "pool", 512, 512, NULL);
+    pj_pool_alloc(pool, 4000);
+    pj_pool_release(pool);
+  }
+
+  // A new pool (not from the cache) is created with room for that much.
+  std::vector<pj_pool_t*> pools;
+  for (int ii = 0; ii < 5; ++ii)
+  {
+    pools.push_back(pj_pool_create(_cache->factory(), "pool", 512, 512, NULL));
+  }
+  EXPECT_GE(pj_pool_get_capacity(pools[4]), (pj_size_t)4000);
+
+  for (int ii = 0; ii < 5; ++ii)
+  {
+    pj_pool_release(pools[ii]);
+  }
+}
+
+TEST_F(PoolCacheTest, ReleaseOnAnotherThread)
+{
+  pj_pool_t* pool = pj_pool_create(_cache->factory(), "pool", 1000, 1000, NULL);
+
+  // Pools can be released on a different thread from the one that created
+  // them, and go into the releasing thread's cache.
+  std::thread t([pool]()
+  {
+    pj_pool_release(pool);
+  });
+  t.join();
+
+  PoolCache::Stats stats;
+  _cache->get_stats(stats);
+  EXPECT_EQ(1u, stats.cached_pools);
+}
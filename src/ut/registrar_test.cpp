@@ -2606,6 +2606,270 @@ TEST_F(RegistrarTest, MultipleRegistrationsWithSubscription)
 }
 
 
+/// Fixture for tests of the re-registration refresh window.
+class RegistrarRefreshWindowTest : public RegistrarTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    RegistrarTest::SetUpTestCase();
+
+    // Restart the registrar with a 100s refresh window.
+    destroy_registrar();
+    pj_status_t ret = init_registrar(_sdm,
+                                     _remote_sdms,
+                                     _hss_connection,
+                                     _acr_factory,
+                                     300,
+                                     false,
+                                     &SNMP::FAKE_REGISTRATION_STATS_TABLES,
+                                     &SNMP::FAKE_THIRD_PARTY_REGISTRATION_STATS_TABLES,
+                                     100);
+    ASSERT_EQ(PJ_SUCCESS, ret);
+  }
+};
+
+// Check that re-registrations within the refresh window don't go to the HSS,
+// and that initial registrations, deregistrations and re-registrations
+// outside the window do.
+TEST_F(RegistrarRefreshWindowTest, ReRegisterSkipsHSS)
+{
+  // Initial registration goes to the HSS.
+  Message msg;
+  EXPECT_CALL(*_hss_connection_observer,
+              update_registration_state("sip:6505550231@homedomain", _, HSSConnection::REG, _, _, _, _, _, _)).WillOnce(Return(HTTP_OK));
+  inject_msg(msg.get());
+  ASSERT_EQ(1, txdata_count());
+  pjsip_msg* out = current_txdata()->msg;
+  EXPECT_EQ(200, out->line.status.code);
+  free_txdata();
+  ::testing::Mock::VerifyAndClear(_hss_connection_observer);
+
+  // A re-registration within the window is served from the cached data.
+  msg._cseq = "16568";
+  EXPECT_CALL(*_hss_connection_observer,
+              update_registration_state(_, _, _, _, _, _, _, _, _)).Times(0);
+  inject_msg(msg.get());
+  ASSERT_EQ(1, txdata_count());
+  out = current_txdata()->msg;
+  EXPECT_EQ(200, out->line.status.code);
+  EXPECT_EQ("P-Associated-URI: <sip:6505550231@homedomain>", get_headers(out, "P-Associated-URI"));
+  EXPECT_EQ(1,((SNMP::FakeSuccessFailCountTable*)SNMP::FAKE_REGISTRATION_STATS_TABLES.re_reg_tbl)->_successes);
+  free_txdata();
+  ::testing::Mock::VerifyAndClear(_hss_connection_observer);
+
+  // Once the window has elapsed, the re-registration goes to the HSS again.
+  cwtest_advance_time_ms(101000L);
+  msg._cseq = "16569";
+  EXPECT_CALL(*_hss_connection_observer,
+              update_registration_state("sip:6505550231@homedomain", _, HSSConnection::REG, _, _, _, _, _, _)).WillOnce(Return(HTTP_OK));
+  inject_msg(msg.get());
+  ASSERT_EQ(1, txdata_count());
+  out = current_txdata()->msg;
+  EXPECT_EQ(200, out->line.status.code);
+  free_txdata();
+  ::testing::Mock::VerifyAndClear(_hss_connection_observer);
+
+  // Deregistration always goes to the HSS, and clears the cached data.
+  msg._cseq = "16570";
+  msg._expires = "Expires: 0";
+  msg._contact_params = "";
+  EXPECT_CALL(*_hss_connection_observer,
+              update_registration_state("sip:6505550231@homedomain", _, HSSConnection::REG, _, _, _, _, _, _)).WillOnce(Return(HTTP_OK));
+  EXPECT_CALL(*_hss_connection_observer,
+              update_registration_state("sip:6505550231@homedomain", _, HSSConnection::DEREG_USER, _)).WillOnce(Return(HTTP_OK));
+  inject_msg(msg.get());
+  ASSERT_EQ(1, txdata_count());
+  out = current_txdata()->msg;
+  EXPECT_EQ(200, out->line.status.code);
+  free_txdata();
+  ::testing::Mock::VerifyAndClear(_hss_connection_observer);
+
+  // So the next registration goes to the HSS.
+  Message msg2;
+  msg2._cseq = "16571";
+  EXPECT_CALL(*_hss_connection_observer,
+              update_registration_state("sip:6505550231@homedomain", _, HSSConnection::REG, _, _, _, _, _, _)).WillOnce(Return(HTTP_OK));
+  inject_msg(msg2.get());
+  ASSERT_EQ(1, txdata_count());
+  out = current_txdata()->msg;
+  EXPECT_EQ(200, out->line.status.code);
+  free_txdata();
+}
+
+
+/// Fixture for tests of the third-party registration refresh window.
+class RegistrarThirdPartyRefreshWindowTest : public RegistrarTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    RegistrarTest::SetUpTestCase();
+
+    // Restart the registrar with a 100s third-party refresh window.
+    destroy_registrar();
+    pj_status_t ret = init_registrar(_sdm,
+                                     _remote_sdms,
+                                     _hss_connection,
+                                     _acr_factory,
+                                     300,
+                                     false,
+                                     &SNMP::FAKE_REGISTRATION_STATS_TABLES,
+                                     &SNMP::FAKE_THIRD_PARTY_REGISTRATION_STATS_TABLES,
+                                     0,
+                                     100,
+                                     &_suppressed_tbl);
+    ASSERT_EQ(PJ_SUCCESS, ret);
+  }
+
+  void SetUp()
+  {
+    RegistrarTest::SetUp();
+    _suppressed_tbl.reset_count();
+  }
+
+  static SNMP::FakeCounterTable _suppressed_tbl;
+};
+
+SNMP::FakeCounterTable RegistrarThirdPartyRefreshWindowTest::_suppressed_tbl;
+
+// Check that re-registrations are only passed on to an application server
+// when its registration is about to expire or the bindings have changed.
+TEST_F(RegistrarThirdPartyRefreshWindowTest, ReRegisterSkipsAS)
+{
+  _hss_connection->set_impu_result("sip:6505550231@homedomain", "reg", HSSConnection::STATE_REGISTERED,
+                              "<IMSSubscription><ServiceProfile>\n"
+                              "  <PublicIdentity><Identity>sip:6505550231@homedomain</Identity></PublicIdentity>\n"
+                              "  <InitialFilterCriteria>\n"
+                              "    <Priority>1</Priority>\n"
+                              "    <TriggerPoint>\n"
+                              "      <ConditionTypeCNF>0</ConditionTypeCNF>\n"
+                              "      <SPT>\n"
+                              "        <ConditionNegated>0</ConditionNegated>\n"
+                              "        <Group>0</Group>\n"
+                              "        <Method>REGISTER</Method>\n"
+                              "        <Extension></Extension>\n"
+                              "      </SPT>\n"
+                              "    </TriggerPoint>\n"
+                              "    <ApplicationServer>\n"
+                              "      <ServerName>sip:1.2.3.4:56789;transport=UDP</ServerName>\n"
+                              "      <DefaultHandling>0</DefaultHandling>\n"
+                              "    </ApplicationServer>\n"
+                              "  </InitialFilterCriteria>\n"
+                              "</ServiceProfile></IMSSubscription>");
+
+  TransportFlow tpAS(TransportFlow::Protocol::UDP, stack_data.scscf_port, "1.2.3.4", 56789);
+
+  // The initial registration is passed on.
+  Message msg;
+  inject_msg(msg.get());
+  ASSERT_EQ(2, txdata_count());
+  EXPECT_EQ(200, current_txdata()->msg->line.status.code);
+  free_txdata();
+  ReqMatcher r1("REGISTER");
+  ASSERT_NO_FATAL_FAILURE(r1.matches(current_txdata()->msg));
+  tpAS.expect_target(current_txdata(), false);
+  inject_msg(respond_to_current_txdata(200));
+  free_txdata();
+
+  // A re-registration with the same bindings isn't.
+  msg._cseq = "16568";
+  inject_msg(msg.get());
+  ASSERT_EQ(1, txdata_count());
+  EXPECT_EQ(200, current_txdata()->msg->line.status.code);
+  free_txdata();
+  EXPECT_EQ(1, _suppressed_tbl._count);
+
+  // A re-registration that adds a binding is.
+  msg._cseq = "16569";
+  msg._contact = "sip:f5cc3de4334589d89c661a7acf228ed7@10.114.61.214:5061;transport=tcp;ob";
+  msg._contact_instance = ";+sip.instance=\"<urn:uuid:00000000-0000-0000-0000-b665231f1214>\"";
+  inject_msg(msg.get());
+  ASSERT_EQ(2, txdata_count());
+  EXPECT_EQ(200, current_txdata()->msg->line.status.code);
+  free_txdata();
+  ASSERT_NO_FATAL_FAILURE(r1.matches(current_txdata()->msg));
+  inject_msg(respond_to_current_txdata(200));
+  free_txdata();
+  EXPECT_EQ(1, _suppressed_tbl._count);
+
+  // Once the application server's registration is within the window of
+  // expiring, re-registrations are passed on again.
+  cwtest_advance_time_ms(201000L);
+  msg._cseq = "16570";
+  inject_msg(msg.get());
+  ASSERT_EQ(2, txdata_count());
+  EXPECT_EQ(200, current_txdata()->msg->line.status.code);
+  free_txdata();
+  ASSERT_NO_FATAL_FAILURE(r1.matches(current_txdata()->msg));
+  inject_msg(respond_to_current_txdata(200));
+  free_txdata();
+  EXPECT_EQ(1, _suppressed_tbl._count);
+}
+
+// Check that the expiry an application server grants is respected when it is
+// shorter than the one requested.
+TEST_F(RegistrarThirdPartyRefreshWindowTest, ASShortensExpiry)
+{
+  _hss_connection->set_impu_result("sip:6505550231@homedomain", "reg", HSSConnection::STATE_REGISTERED,
+                              "<IMSSubscription><ServiceProfile>\n"
+                              "  <PublicIdentity><Identity>sip:6505550231@homedomain</Identity></PublicIdentity>\n"
+                              "  <InitialFilterCriteria>\n"
+                              "    <Priority>1</Priority>\n"
+                              "    <TriggerPoint>\n"
+                              "      <ConditionTypeCNF>0</ConditionTypeCNF>\n"
+                              "      <SPT>\n"
+                              "        <ConditionNegated>0</ConditionNegated>\n"
+                              "        <Group>0</Group>\n"
+                              "        <Method>REGISTER</Method>\n"
+                              "        <Extension></Extension>\n"
+                              "      </SPT>\n"
+                              "    </TriggerPoint>\n"
+                              "    <ApplicationServer>\n"
+                              "      <ServerName>sip:1.2.3.4:56789;transport=UDP</ServerName>\n"
+                              "      <DefaultHandling>0</DefaultHandling>\n"
+                              "    </ApplicationServer>\n"
+                              "  </InitialFilterCriteria>\n"
+                              "</ServiceProfile></IMSSubscription>");
+
+  TransportFlow tpAS(TransportFlow::Protocol::UDP, stack_data.scscf_port, "1.2.3.4", 56789);
+
+  // The initial registration is passed on, and the application server only
+  // grants 150s.
+  Message msg;
+  inject_msg(msg.get());
+  ASSERT_EQ(2, txdata_count());
+  EXPECT_EQ(200, current_txdata()->msg->line.status.code);
+  free_txdata();
+  ReqMatcher r1("REGISTER");
+  ASSERT_NO_FATAL_FAILURE(r1.matches(current_txdata()->msg));
+  tpAS.expect_target(current_txdata(), false);
+  inject_msg(respond_to_current_txdata(200, "", "Contact: <sip:all.the.sprout.nodes:5058;transport=TCP>;expires=150"));
+  free_txdata();
+
+  // A re-registration straight away isn't passed on.
+  msg._cseq = "16568";
+  inject_msg(msg.get());
+  ASSERT_EQ(1, txdata_count());
+  EXPECT_EQ(200, current_txdata()->msg->line.status.code);
+  free_txdata();
+  EXPECT_EQ(1, _suppressed_tbl._count);
+
+  // But one 60s later is, as the application server's registration is then
+  // within the 100s window of expiring.
+  cwtest_advance_time_ms(60000L);
+  msg._cseq = "16569";
+  inject_msg(msg.get());
+  ASSERT_EQ(2, txdata_count());
+  EXPECT_EQ(200, current_txdata()->msg->line.status.code);
+  free_txdata();
+  ASSERT_NO_FATAL_FAILURE(r1.matches(current_txdata()->msg));
+  inject_msg(respond_to_current_txdata(200, "", "Expires: 150"));
+  free_txdata();
+  EXPECT_EQ(1, _suppressed_tbl._count);
+}
+
+
 /// Fixture for RegistrarTest.
 class RegistrarTestMockStore : public SipTest
 {
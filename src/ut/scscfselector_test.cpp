@@ -36,6 +36,8 @@
 
 #include <string>
 #include <vector>
+#include <fstream>
+#include <unistd.h>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -193,3 +195,46 @@ TEST_F(SCSCFSelectorTest, MissingFile)
   // Check that one default S-CSCF is returned
   ST({}, {}, {}, "scscf_uri").test(scscf_);
 }
+
+TEST_F(SCSCFSelectorTest, LargeConfig)
+{
+  // Build a configuration with 1000 S-CSCFs. S-CSCF i has capabilities
+  // i % 10, 100 + (i % 7) and 1000 + i, and priority i % 3.
+  std::string config_file = "/tmp/test_scscf_large_" + std::to_string(getpid()) + ".json";
+  std::ofstream fs(config_file.c_str());
+  fs << "{\"s-cscfs\": [";
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    fs << ((ii == 0) ? "" : ",")
+       << "{\"server\": \"cw-scscf" << ii << ".cw-ngv.com\","
+       << " \"priority\": " << (ii % 3) << ","
+       << " \"weight\": 100,"
+       << " \"capabilities\": [" << (ii % 10) << ", " << (100 + (ii % 7)) << ", " << (1000 + ii) << "]}";
+  }
+
+  fs << "]}";
+  fs.close();
+
+  SCSCFSelector scscf_("scscf_uri", config_file);
+  unlink(config_file.c_str());
+
+  // Only one S-CSCF has capability 1500.
+  ST({1500}, {}, {}, "cw-scscf500.cw-ngv.com").test(scscf_);
+
+  // S-CSCFs 503 and 513 both have one of the optional capabilities, and 513
+  // has the better priority.
+  ST({3}, {1503, 1513}, {}, "cw-scscf513.cw-ngv.com").test(scscf_);
+  ST({3}, {1503, 1513}, {"cw-scscf513.cw-ngv.com"}, "cw-scscf503.cw-ngv.com").test(scscf_);
+
+  // No S-CSCF has both 1500 and 1501.
+  ST({1500, 1501}, {}, {}, "").test(scscf_);
+
+  // Repeatedly select from the full set of S-CSCFs. The elapsed time for this
+  // test gives a rough measure of the cost of selection on a large
+  // configuration.
+  for (int ii = 0; ii < 10000; ++ii)
+  {
+    ST({ii % 10}, {1000 + (ii % 1000)}, {}, "cw-scscf" + std::to_string(ii % 1000) + ".cw-ngv.com").test(scscf_);
+  }
+}
@@ -399,6 +399,144 @@ TEST_F(SIPResolverTest, ExpiryNoInvalidRead)
   cwtest_reset_time();
 }
 
+TEST_F(SIPResolverTest, StaleTargetsServedWhileRefreshing)
+{
+  cwtest_completely_control_time();
+  std::vector<DnsRRecord*> records;
+  records.push_back(a("sprout.cw-ngv.com", 2, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  EXPECT_EQ("3.0.0.1:5054;transport=TCP",
+            RT(_sipresolver, "sprout.cw-ngv.com").set_port(5054).set_transport(IPPROTO_TCP).resolve());
+
+  // Let the records expire and change them.  The targets from the previous
+  // resolution are served straight away while they are refreshed.
+  cwtest_advance_time_ms(3000);
+  records.clear();
+  records.push_back(a("sprout.cw-ngv.com", 3600, "3.0.0.2"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  EXPECT_EQ("3.0.0.1:5054;transport=TCP",
+            RT(_sipresolver, "sprout.cw-ngv.com").set_port(5054).set_transport(IPPROTO_TCP).resolve());
+
+  // Wait for the background refresh to pick up the new records.
+  _sipresolver.wait_for_idle();
+  EXPECT_EQ("3.0.0.2:5054;transport=TCP",
+            RT(_sipresolver, "sprout.cw-ngv.com").set_port(5054).set_transport(IPPROTO_TCP).resolve());
+
+  cwtest_reset_time();
+}
+
+TEST_F(SIPResolverTest, StaleTargetsWeightedAndBlacklisted)
+{
+  cwtest_completely_control_time();
+  std::vector<DnsRRecord*> records;
+  records.push_back(srv("_sip._tcp.sprout.cw-ngv.com", 2, 0, 100, 5054, "sprout-1.cw-ngv.com"));
+  records.push_back(srv("_sip._tcp.sprout.cw-ngv.com", 2, 1, 100, 5054, "sprout-2.cw-ngv.com"));
+  records.push_back(srv("_sip._tcp.sprout.cw-ngv.com", 2, 1, 300, 5054, "sprout-3.cw-ngv.com"));
+  _dnsresolver.add_to_cache("_sip._tcp.sprout.cw-ngv.com", ns_t_srv, records);
+
+  records.push_back(a("sprout-1.cw-ngv.com", 3600, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout-1.cw-ngv.com", ns_t_a, records);
+  records.push_back(a("sprout-2.cw-ngv.com", 3600, "3.0.0.2"));
+  _dnsresolver.add_to_cache("sprout-2.cw-ngv.com", ns_t_a, records);
+  records.push_back(a("sprout-3.cw-ngv.com", 3600, "3.0.0.3"));
+  _dnsresolver.add_to_cache("sprout-3.cw-ngv.com", ns_t_a, records);
+
+  // Use a resolver without any threads, so the stale targets are never
+  // refreshed.
+  SIPResolver resolver(&_dnsresolver, SIPResolver::DEFAULT_BLACKLIST_DURATION, 0);
+
+  EXPECT_EQ("3.0.0.1:5054;transport=TCP",
+            RT(resolver, "sprout.cw-ngv.com").set_transport(IPPROTO_TCP).resolve());
+
+  // Let the SRV records expire.  The highest priority target is still
+  // selected from the stale targets.
+  cwtest_advance_time_ms(3000);
+  EXPECT_EQ("3.0.0.1:5054;transport=TCP",
+            RT(resolver, "sprout.cw-ngv.com").set_transport(IPPROTO_TCP).resolve());
+
+  // Blacklist 3.0.0.1.
+  AddrInfo ai;
+  ai.address.af = AF_INET;
+  inet_pton(AF_INET, "3.0.0.1", &ai.address.addr.ipv4);
+  ai.port = 5054;
+  ai.transport = IPPROTO_TCP;
+  resolver.blacklist(ai, 300);
+
+  // Do 1000 resolutions and check that 3.0.0.1 is never selected and that
+  // the other targets are selected according to their weights.  The error
+  // bounds are chosen to be 5 standard deviations.
+  std::map<std::string, int> counts;
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    counts[RT(resolver, "sprout.cw-ngv.com").set_transport(IPPROTO_TCP).resolve()]++;
+  }
+
+  EXPECT_EQ(0, counts["3.0.0.1:5054;transport=TCP"]);
+  EXPECT_LT(250-5*14, counts["3.0.0.2:5054;transport=TCP"]);
+  EXPECT_GT(250+5*14, counts["3.0.0.2:5054;transport=TCP"]);
+  EXPECT_LT(750-5*14, counts["3.0.0.3:5054;transport=TCP"]);
+  EXPECT_GT(750+5*14, counts["3.0.0.3:5054;transport=TCP"]);
+
+  cwtest_reset_time();
+}
+
+TEST_F(SIPResolverTest, TargetsRefreshedAheadOfExpiry)
+{
+  cwtest_completely_control_time();
+  std::vector<DnsRRecord*> records;
+  records.push_back(a("sprout.cw-ngv.com", 10, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  EXPECT_EQ("3.0.0.1:5054;transport=TCP",
+            RT(_sipresolver, "sprout.cw-ngv.com").set_port(5054).set_transport(IPPROTO_TCP).resolve());
+
+  // Look the name up again shortly before the records expire.  This
+  // schedules a refresh for when they do.
+  cwtest_advance_time_ms(7000);
+  EXPECT_EQ("3.0.0.1:5054;transport=TCP",
+            RT(_sipresolver, "sprout.cw-ngv.com").set_port(5054).set_transport(IPPROTO_TCP).resolve());
+
+  // Let the records expire and change them.  The refresh runs as soon as
+  // they have expired, so the new targets are used without the old ones
+  // being served stale.
+  cwtest_advance_time_ms(4000);
+  records.clear();
+  records.push_back(a("sprout.cw-ngv.com", 3600, "3.0.0.2"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+  _sipresolver.wait_for_idle();
+
+  EXPECT_EQ("3.0.0.2:5054;transport=TCP",
+            RT(_sipresolver, "sprout.cw-ngv.com").set_port(5054).set_transport(IPPROTO_TCP).resolve());
+
+  cwtest_reset_time();
+}
+
+TEST_F(SIPResolverTest, AsyncResolution)
+{
+  std::vector<DnsRRecord*> records;
+  records.push_back(a("sprout.cw-ngv.com", 3600, "3.0.0.1"));
+  _dnsresolver.add_to_cache("sprout.cw-ngv.com", ns_t_a, records);
+
+  // Use a resolver without any threads, so the resolutions are only run when
+  // they are collected.
+  SIPResolver resolver(&_dnsresolver, SIPResolver::DEFAULT_BLACKLIST_DURATION, 0);
+
+  std::shared_ptr<SIPResolver::PendingResolution> resolution =
+    resolver.resolve_async("sprout.cw-ngv.com", AF_INET, 5054, IPPROTO_TCP, 1);
+  std::vector<AddrInfo> targets = resolution->get();
+  ASSERT_EQ(1u, targets.size());
+  EXPECT_EQ(5054, targets[0].port);
+  EXPECT_EQ(IPPROTO_TCP, targets[0].transport);
+
+  // A cancelled resolution is never run.
+  resolution = resolver.resolve_async("sprout.cw-ngv.com", AF_INET, 5054, IPPROTO_TCP, 1);
+  resolution->cancel();
+  EXPECT_TRUE(resolution->get().empty());
+}
+
 TEST_F(SIPResolverTest, SimpleAAAAResolution)
 {
   // Test resolution using AAAA records only.
@@ -0,0 +1,121 @@
+/**
+ * @file small_containers_test.cpp
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "gtest/gtest.h"
+
+#include "small_containers.h"
+
+/// Fixture for SmallContainersTest.
+class SmallContainersTest : public ::testing::Test
+{
+};
+
+TEST_F(SmallContainersTest, VectorInlineAndSpill)
+{
+  SmallVector<int, 4> v;
+  EXPECT_TRUE(v.empty());
+
+  // Fill beyond the inline capacity so the contents move to the heap.
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    v.push_back(ii);
+  }
+  ASSERT_EQ(10u, v.size());
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    EXPECT_EQ(ii, v[ii]);
+  }
+
+  // Erasing preserves order.
+  v.erase(v.begin() + 3);
+  v.pop_front();
+  ASSERT_EQ(8u, v.size());
+  EXPECT_EQ(1, v.front());
+  EXPECT_EQ(2, v[1]);
+  EXPECT_EQ(4, v[2]);
+
+  // Copies are independent.
+  SmallVector<int, 4> copy(v);
+  copy.clear();
+  EXPECT_TRUE(copy.empty());
+  EXPECT_EQ(8u, v.size());
+
+  // The vector can be reused inline after clearing.
+  v.clear();
+  v.push_back(42);
+  EXPECT_EQ(1u, v.size());
+  EXPECT_EQ(42, v.front());
+}
+
+TEST_F(SmallContainersTest, Set)
+{
+  SmallSet<int, 2> s;
+
+  EXPECT_TRUE(s.insert(1));
+  EXPECT_TRUE(s.insert(2));
+  EXPECT_FALSE(s.insert(1));
+  EXPECT_TRUE(s.insert(3));
+  EXPECT_EQ(3u, s.size());
+
+  EXPECT_TRUE(s.find(2) != s.end());
+  EXPECT_EQ(1u, s.erase(2));
+  EXPECT_EQ(0u, s.erase(2));
+  EXPECT_TRUE(s.find(2) == s.end());
+  EXPECT_EQ(2u, s.size());
+}
+
+TEST_F(SmallContainersTest, Map)
+{
+  SmallMap<std::pair<int, int>, std::string, 2> m;
+
+  m[std::make_pair(1, 0)] = "a";
+  m[std::make_pair(2, 0)] = "b";
+  m[std::make_pair(3, 0)] = "c";
+  m[std::make_pair(1, 0)] = "d";
+  EXPECT_EQ(3u, m.size());
+
+  // Iteration is in insertion order.
+  SmallMap<std::pair<int, int>, std::string, 2>::iterator it = m.begin();
+  EXPECT_EQ("d", it->second);
+  ++it;
+  EXPECT_EQ("b", it->second);
+
+  EXPECT_EQ(1u, m.erase(std::make_pair(2, 0)));
+  EXPECT_TRUE(m.find(std::make_pair(2, 0)) == m.end());
+  it = m.erase(m.begin());
+  EXPECT_EQ("c", it->second);
+  EXPECT_EQ(1u, m.size());
+}
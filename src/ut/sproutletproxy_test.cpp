@@ -43,11 +43,13 @@
 #include "siptest.hpp"
 #include "test_interposer.hpp"
 #include "sproutletproxy.h"
+#include "thread_dispatcher.h"
 #include "pjutils.h"
 #include "pjsip.h"
 #include "pjsip_simple.h"
 
 #include <mutex>
+#include <stdexcept>
 
 using namespace std;
 using testing::InSequence;
@@ -579,6 +581,56 @@ class FakeSproutletTsxDelayAfterFwd : public SproutletTsx
   pjsip_msg* _second_request;
 };
 
+class FakeSproutletTsxAsync : public SproutletTsx
+{
+public:
+  FakeSproutletTsxAsync(SproutletTsxHelper* helper) :
+    SproutletTsx(helper),
+    _req(NULL)
+  {
+  }
+
+  void on_rx_initial_request(pjsip_msg* req)
+  {
+    // Suspend the request while some async work runs.  The work fails if
+    // the user part of the Request-URI is "fail".
+    _req = req;
+    bool fail = (PJUtils::pj_str_to_string(&((pjsip_sip_uri*)req->line.req.uri)->user) == "fail");
+    run_async([fail]()
+              {
+                if (fail)
+                {
+                  throw std::runtime_error("Async work failed");
+                }
+              },
+              NULL);
+  }
+
+  void on_async_complete(void* context, bool success)
+  {
+    pjsip_msg* req = _req;
+    _req = NULL;
+
+    if (success)
+    {
+      send_request(req);
+    }
+    else
+    {
+      pjsip_msg* rsp = create_response(req, PJSIP_SC_INTERNAL_SERVER_ERROR);
+      free_msg(req);
+      send_response(rsp);
+    }
+  }
+
+  void on_rx_response(pjsip_msg* rsp, int fork_id)
+  {
+    send_response(rsp);
+  }
+
+  pjsip_msg* _req;
+};
+
 class FakeSproutletTsxDummySCSCF : public SproutletTsx
 {
 public:
@@ -627,6 +679,7 @@ public:
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxDelayAfterRsp<1> >("delayafterrsp", 0, "sip:delayafterrsp.homedomain;transport=tcp", ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxDelayAfterFwd<1> >("delayafterfwd", 0, "sip:delayafterfwd.homedomain;transport=tcp", ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxDummySCSCF>("scscf", 44444, "sip:scscf.homedomain:44444;transport=tcp", "scscf"));
+    _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxAsync>("async", 0, "sip:async.homedomain;transport=tcp", ""));
 
     // Create a host alias.
     std::unordered_set<std::string> host_aliases;
@@ -698,6 +751,15 @@ public:
     return _proxy->extract_possible_services(s);
   }
 
+  Sproutlet* target_sproutlet(std::string uri, std::string& alias)
+  {
+    pjsip_msg* msg = pjsip_msg_create(stack_data.pool, PJSIP_REQUEST_MSG);
+    pjsip_method_set(&msg->line.req.method, PJSIP_OPTIONS_METHOD);
+    msg->line.req.uri = PJUtils::uri_from_string(uri, stack_data.pool, PJ_FALSE);
+    bool force_external_routing;
+    return _proxy->target_sproutlet(msg, 0, alias, force_external_routing, 0);
+  }
+
   class Message
   {
   public:
@@ -1905,6 +1967,240 @@ TEST_F(SproutletProxyTest, UASError)
   ASSERT_EQ(0, txdata_count());
 }
 
+TEST_F(SproutletProxyTest, AsyncWork)
+{
+  // Tests a Sproutlet that suspends a request while async work runs.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  hold_async_work(true);
+
+  // Inject a request with a Route header referencing the async Sproutlet.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@proxy1.awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:async.proxy1.homedomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting just the 100 Trying while the work is outstanding.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  tp->expect_target(tdata);
+  free_txdata();
+
+  // Complete the work, and check the request is forwarded.
+  run_held_async_work();
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("INVITE").matches(tdata->msg);
+
+  // Reject the request, and check the response is passed back.
+  inject_msg(respond_to_current_txdata(486));
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("ACK").matches(tdata->msg);
+  free_txdata();
+  tdata = current_txdata();
+  RespMatcher(486).matches(tdata->msg);
+  tp->expect_target(tdata);
+  free_txdata();
+
+  ASSERT_EQ(0, txdata_count());
+
+  hold_async_work(false);
+  delete tp;
+}
+
+TEST_F(SproutletProxyTest, AsyncWorkFails)
+{
+  // Tests a Sproutlet whose async work fails.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  hold_async_work(true);
+
+  // Inject a request with a Route header referencing the async Sproutlet.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:fail@proxy1.awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:async.proxy1.homedomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  // The work throws an exception.  The Sproutlet is still told it has
+  // completed, so rejects the request.
+  run_held_async_work();
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(500).matches(tdata->msg);
+  tp->expect_target(tdata);
+  free_txdata();
+
+  ASSERT_EQ(0, txdata_count());
+
+  hold_async_work(false);
+  delete tp;
+}
+
+TEST_F(SproutletProxyTest, AsyncWorkCancel)
+{
+  // Tests a CANCEL received while a Sproutlet is waiting for async work.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  hold_async_work(true);
+
+  // Inject a request with a Route header referencing the async Sproutlet.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@proxy1.awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:async.proxy1.homedomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  // Send a CANCEL for the INVITE.  This is answered, but isn't passed to the
+  // Sproutlet until the work has completed.
+  msg1._method = "CANCEL";
+  inject_msg(msg1.get_request(), tp);
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // Complete the work.  The Sproutlet forwards the request, and is then
+  // passed the CANCEL.
+  run_held_async_work();
+  ASSERT_EQ(1, txdata_count());
+  pjsip_tx_data* req = pop_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, req);
+  ReqMatcher("INVITE").matches(req->msg);
+
+  // The CANCEL is sent downstream once the request gets a provisional
+  // response.
+  inject_msg(respond_to_txdata(req, 100));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("CANCEL").matches(tdata->msg);
+  inject_msg(respond_to_txdata(tdata, 200));
+  free_txdata();
+
+  // Send a 487 response, which is passed back.
+  inject_msg(respond_to_txdata(req, 487));
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("ACK").matches(tdata->msg);
+  free_txdata();
+  tdata = current_txdata();
+  RespMatcher(487).matches(tdata->msg);
+  tp->expect_target(tdata);
+  free_txdata();
+
+  ASSERT_EQ(0, txdata_count());
+
+  hold_async_work(false);
+  delete tp;
+}
+
+TEST_F(SproutletProxyTest, AsyncWorkUASError)
+{
+  // Tests an error on the UAS transaction while a Sproutlet is waiting for
+  // async work.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  hold_async_work(true);
+
+  // Inject a request with a Route header referencing the async Sproutlet.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@proxy1.awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:async.proxy1.homedomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  // Terminate the incoming transport to force a transport error on the UAS
+  // transaction.  The error isn't passed to the Sproutlet until the work has
+  // completed.
+  delete tp;
+  poll();
+  ASSERT_EQ(0, txdata_count());
+
+  // Complete the work.  The Sproutlet forwards the request, and is then
+  // passed the error.
+  run_held_async_work();
+  ASSERT_EQ(1, txdata_count());
+  pjsip_tx_data* req = pop_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, req);
+  ReqMatcher("INVITE").matches(req->msg);
+
+  // The request is cancelled once it gets a provisional response.
+  inject_msg(respond_to_txdata(req, 100));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("CANCEL").matches(tdata->msg);
+  inject_msg(respond_to_txdata(tdata, 200));
+  free_txdata();
+
+  // The 487 response is absorbed.
+  inject_msg(respond_to_txdata(req, 487));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  ReqMatcher("ACK").matches(tdata->msg);
+  free_txdata();
+
+  ASSERT_EQ(0, txdata_count());
+
+  hold_async_work(false);
+}
+
 TEST_F(SproutletProxyTest, SproutletChain)
 {
   // Tests passing a request through a chain of sproutlets.
@@ -2327,3 +2623,89 @@ TEST_F(SproutletProxyTest, ServiceExtraction)
   ASSERT_EQ(0, names.size());
 }
 
+// Tests that where a URI names several Sproutlets, the one loaded first is
+// selected, and that aliases resolve to the first Sproutlet that has them.
+TEST_F(SproutletProxyTest, TargetSproutletPrecedence)
+{
+  std::string alias;
+  Sproutlet* sproutlet;
+
+  sproutlet = target_sproutlet("sip:forker@proxy1.homedomain;service=fwd", alias);
+  ASSERT_TRUE(sproutlet != NULL);
+  EXPECT_EQ("fwd", sproutlet->service_name());
+  EXPECT_EQ("fwd", alias);
+
+  sproutlet = target_sproutlet("sip:fwd@proxy1.homedomain;service=forker", alias);
+  ASSERT_TRUE(sproutlet != NULL);
+  EXPECT_EQ("fwd", sproutlet->service_name());
+  EXPECT_EQ("fwd", alias);
+
+  sproutlet = target_sproutlet("sip:forker.proxy1.homedomain", alias);
+  ASSERT_TRUE(sproutlet != NULL);
+  EXPECT_EQ("forker", sproutlet->service_name());
+  EXPECT_EQ("forker", alias);
+
+  sproutlet = target_sproutlet("sip:alias@proxy1.homedomain", alias);
+  ASSERT_TRUE(sproutlet != NULL);
+  EXPECT_EQ("fwd", sproutlet->service_name());
+  EXPECT_EQ("alias", alias);
+
+  alias = "";
+  sproutlet = target_sproutlet("sip:unknown@proxy1.homedomain", alias);
+  EXPECT_TRUE(sproutlet == NULL);
+  EXPECT_EQ("", alias);
+}
+
+// Tests that a message body passed through a chain of Sproutlets (which
+// share it rather than copying it at each hop) is forwarded intact.
+TEST_F(SproutletProxyTest, SproutletChainBody)
+{
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Inject a request with an SDP body, routed through two forwarding
+  // Sproutlets and then to an external node.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._body = "v=0\r\no=- 2728 2728 IN IP4 10.0.0.1\r\ns=-\r\nc=IN IP4 10.0.0.1\r\nt=0 0\r\nm=audio 4000 RTP/AVP 0\r\n";
+  msg1._route = "Route: <sip:fwd.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:fwdrr.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting 100 Trying and forwarded INVITE.
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  // Check the forwarded INVITE carries the original body.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("INVITE").matches(tdata->msg);
+  ASSERT_TRUE(tdata->msg->body != NULL);
+  EXPECT_EQ(msg1._body,
+            std::string((char*)tdata->msg->body->data, tdata->msg->body->len));
+  EXPECT_EQ(0, pj_strcmp2(&tdata->msg->body->content_type.subtype, "sdp"));
+
+  // Send a 200 OK response and check it is forwarded back to the source.
+  inject_msg(respond_to_current_txdata(200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // All done!
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
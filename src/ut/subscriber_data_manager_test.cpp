@@ -36,6 +36,8 @@
 
 
 #include <string>
+#include <set>
+#include <thread>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -52,6 +54,8 @@
 #include "mock_chronos_connection.h"
 #include "mock_store.h"
 #include "analyticslogger.h"
+#include "fakesnmp.hpp"
+#include "rapidxml/rapidxml.hpp"
 
 using ::testing::_;
 using ::testing::DoAll;
@@ -340,6 +344,94 @@ TYPED_TEST(BasicSubscriberDataManagerTest, SubscriptionTests)
   delete aor_data1; aor_data1 = NULL;
 }
 
+/// Check that each subscription to an AoR with a large Implicit Registration
+/// Set gets a NOTIFY with a registration element per IMPU, carrying its own
+/// registration id, when the body is rendered once and shared.
+TYPED_TEST(BasicSubscriberDataManagerTest, NotifyBodySharedAcrossSubscriptions)
+{
+  SubscriberDataManager::AoRPair* aor_data1;
+  SubscriberDataManager::AoR::Binding* b1;
+  int now = time(NULL);
+
+  std::vector<std::string> irs_impus;
+  for (int ii = 0; ii < 20; ++ii)
+  {
+    irs_impus.push_back("sip:51021756" + std::to_string(10 + ii) + "@cw-ngv.com");
+  }
+
+  aor_data1 = this->_store->get_aor_data(irs_impus[0], 0);
+  ASSERT_TRUE(aor_data1 != NULL);
+  b1 = aor_data1->get_current()->get_binding(std::string("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1"));
+  b1->_uri = std::string("<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>");
+  b1->_cid = std::string("gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq");
+  b1->_cseq = 17038;
+  b1->_expires = now + 300;
+  b1->_priority = 0;
+  b1->_private_id = "5102175698@cw-ngv.com";
+  b1->_emergency_registration = false;
+
+  for (int ii = 0; ii < 10; ++ii)
+  {
+    std::string to_tag = "tag" + std::to_string(ii);
+    SubscriberDataManager::AoR::Subscription* s1 =
+                               aor_data1->get_current()->get_subscription(to_tag);
+    s1->_req_uri = std::string("sip:5102175698@192.91.191.29:59934;transport=tcp");
+    s1->_from_uri = std::string("<sip:5102175698@cw-ngv.com>");
+    s1->_from_tag = std::string("4321");
+    s1->_to_uri = std::string("<sip:5102175698@cw-ngv.com>");
+    s1->_to_tag = to_tag;
+    s1->_cid = std::string("xyzabc@192.91.191.29");
+    s1->_expires = now + 300;
+  }
+
+  bool rc = this->_store->set_aor_data(irs_impus[0], irs_impus, aor_data1, 0);
+  EXPECT_TRUE(rc);
+  delete aor_data1; aor_data1 = NULL;
+
+  ASSERT_EQ(10, this->txdata_count());
+  std::set<std::string> reg_ids;
+
+  while (this->txdata_count() > 0)
+  {
+    pjsip_msg* out = this->current_txdata()->msg;
+    char buf[65536];
+    int n = out->body->print_body(out->body, buf, sizeof(buf));
+    ASSERT_GT(n, 0);
+    std::string body(buf, n);
+
+    rapidxml::xml_document<> doc;
+    doc.parse<rapidxml::parse_strip_xml_namespaces>(doc.allocate_string(body.c_str()));
+    rapidxml::xml_node<>* reg_info = doc.first_node("reginfo");
+    ASSERT_TRUE(reg_info != NULL);
+
+    // Every registration element carries this subscription's id.
+    std::string reg_id;
+    int registrations = 0;
+    for (rapidxml::xml_node<>* registration = reg_info->first_node("registration");
+         registration != NULL;
+         registration = registration->next_sibling("registration"))
+    {
+      EXPECT_EQ(irs_impus[registrations],
+                std::string(registration->first_attribute("aor")->value()));
+      std::string id = registration->first_attribute("id")->value();
+      if (reg_id.empty())
+      {
+        reg_id = id;
+      }
+      EXPECT_EQ(reg_id, id);
+      EXPECT_TRUE(registration->first_node("contact") != NULL);
+      registrations++;
+    }
+
+    EXPECT_EQ(20, registrations);
+    reg_ids.insert(reg_id);
+    this->free_txdata();
+  }
+
+  EXPECT_EQ(10u, reg_ids.size());
+}
+
+
 TYPED_TEST(BasicSubscriberDataManagerTest, CopyTests)
 {
   SubscriberDataManager::AoRPair* aor_data1;
@@ -410,6 +502,154 @@ TYPED_TEST(BasicSubscriberDataManagerTest, CopyTests)
 }
 
 
+TYPED_TEST(BasicSubscriberDataManagerTest, ContentionTests)
+{
+  SNMP::FakeCounterTable contention_tbl;
+  this->_store->set_contention_table(&contention_tbl);
+  std::string aor_id = "5102175698@cw-ngv.com";
+  std::vector<std::string> irs_impus;
+  irs_impus.push_back(aor_id);
+  int now = time(NULL);
+
+  // Read the AoR twice, then write both copies back.  The second write is
+  // rejected and counted.
+  SubscriberDataManager::AoRPair* aor_data1 = this->_store->get_aor_data(aor_id, 0);
+  SubscriberDataManager::AoRPair* aor_data2 = this->_store->get_aor_data(aor_id, 0);
+  ASSERT_TRUE(aor_data1 != NULL);
+  ASSERT_TRUE(aor_data2 != NULL);
+  SubscriberDataManager::AoR::Binding* b1 = aor_data1->get_current()->get_binding("1");
+  b1->_cseq = 0;
+  b1->_expires = now + 300;
+  b1->_priority = 0;
+  b1->_emergency_registration = false;
+  SubscriberDataManager::AoR::Binding* b2 = aor_data2->get_current()->get_binding("2");
+  b2->_cseq = 0;
+  b2->_expires = now + 300;
+  b2->_priority = 0;
+  b2->_emergency_registration = false;
+
+  EXPECT_EQ(Store::OK, this->_store->set_aor_data(aor_id, irs_impus, aor_data1, 0));
+  EXPECT_EQ(Store::DATA_CONTENTION, this->_store->set_aor_data(aor_id, irs_impus, aor_data2, 0));
+  EXPECT_EQ(1, contention_tbl._count);
+  delete aor_data1; aor_data1 = NULL;
+  delete aor_data2; aor_data2 = NULL;
+
+  // Concurrent updates that hold the AoR lock don't contend.
+  const int num_threads = 4;
+  const int num_updates = 25;
+  std::vector<std::thread> threads;
+
+  for (int ii = 0; ii < num_threads; ++ii)
+  {
+    threads.push_back(std::thread([this, &aor_id, &irs_impus, now, num_updates]()
+    {
+      for (int jj = 0; jj < num_updates; ++jj)
+      {
+        SubscriberDataManager::AoRLock aor_lock(this->_store, aor_id);
+        Store::Status set_rc;
+
+        do
+        {
+          SubscriberDataManager::AoRPair* aor_pair = this->_store->get_aor_data(aor_id, 0);
+          SubscriberDataManager::AoR::Binding* b = aor_pair->get_current()->get_binding("1");
+          b->_cseq++;
+          b->_expires = now + 300;
+          set_rc = this->_store->set_aor_data(aor_id, irs_impus, aor_pair, 0);
+          delete aor_pair;
+        }
+        while (set_rc == Store::DATA_CONTENTION);
+      }
+    }));
+  }
+
+  for (std::thread& t : threads)
+  {
+    t.join();
+  }
+
+  EXPECT_EQ(1, contention_tbl._count);
+  aor_data1 = this->_store->get_aor_data(aor_id, 0);
+  EXPECT_EQ(num_threads * num_updates,
+            aor_data1->get_current()->get_binding("1")->_cseq);
+  delete aor_data1; aor_data1 = NULL;
+
+  this->_store->set_contention_table(NULL);
+}
+
+
+/// Registration listener that records the changes it is told about.
+class RecordingRegistrationListener :
+  public SubscriberDataManager::RegistrationListener
+{
+public:
+  void registration_state_changed(const std::string& aor_id,
+                                  const std::vector<std::string>& irs_impus,
+                                  bool registered)
+  {
+    _changes.push_back(aor_id + (registered ? " registered" : " deregistered"));
+  }
+
+  std::vector<std::string> _changes;
+};
+
+
+TYPED_TEST(BasicSubscriberDataManagerTest, RegistrationListenerTests)
+{
+  RecordingRegistrationListener listener;
+  this->_store->add_registration_listener(&listener);
+  std::string aor_id = "5102175698@cw-ngv.com";
+  std::vector<std::string> irs_impus;
+  irs_impus.push_back(aor_id);
+  int now = time(NULL);
+
+  // Adding the first binding registers the AoR.
+  SubscriberDataManager::AoRPair* aor_data1 = this->_store->get_aor_data(aor_id, 0);
+  ASSERT_TRUE(aor_data1 != NULL);
+  SubscriberDataManager::AoR::Binding* b1 = aor_data1->get_current()->get_binding("1");
+  b1->_cseq = 0;
+  b1->_expires = now + 300;
+  b1->_priority = 0;
+  b1->_emergency_registration = false;
+  EXPECT_EQ(Store::OK, this->_store->set_aor_data(aor_id, irs_impus, aor_data1, 0));
+  delete aor_data1; aor_data1 = NULL;
+  ASSERT_EQ(1u, listener._changes.size());
+  EXPECT_EQ(aor_id + " registered", listener._changes[0]);
+
+  // Refreshing or adding bindings doesn't change the registration state.
+  aor_data1 = this->_store->get_aor_data(aor_id, 0);
+  aor_data1->get_current()->get_binding("1")->_cseq = 1;
+  SubscriberDataManager::AoR::Binding* b2 = aor_data1->get_current()->get_binding("2");
+  b2->_cseq = 0;
+  b2->_expires = now + 300;
+  b2->_priority = 0;
+  b2->_emergency_registration = false;
+  EXPECT_EQ(Store::OK, this->_store->set_aor_data(aor_id, irs_impus, aor_data1, 0));
+  delete aor_data1; aor_data1 = NULL;
+  EXPECT_EQ(1u, listener._changes.size());
+
+  // Removing the last binding deregisters the AoR.
+  aor_data1 = this->_store->get_aor_data(aor_id, 0);
+  aor_data1->get_current()->remove_binding("1");
+  aor_data1->get_current()->remove_binding("2");
+  EXPECT_EQ(Store::OK, this->_store->set_aor_data(aor_id, irs_impus, aor_data1, 0));
+  delete aor_data1; aor_data1 = NULL;
+  ASSERT_EQ(2u, listener._changes.size());
+  EXPECT_EQ(aor_id + " deregistered", listener._changes[1]);
+
+  // Once removed, the listener isn't told about further changes.
+  this->_store->remove_registration_listener(&listener);
+  aor_data1 = this->_store->get_aor_data(aor_id, 0);
+  b1 = aor_data1->get_current()->get_binding("1");
+  b1->_cseq = 2;
+  b1->_expires = now + 300;
+  b1->_priority = 0;
+  b1->_emergency_registration = false;
+  EXPECT_EQ(Store::OK, this->_store->set_aor_data(aor_id, irs_impus, aor_data1, 0));
+  delete aor_data1; aor_data1 = NULL;
+  EXPECT_EQ(2u, listener._changes.size());
+}
+
+
 TYPED_TEST(BasicSubscriberDataManagerTest, ExpiryTests)
 {
   // The expiry tests require pjsip, so initialise for this test
@@ -367,6 +367,138 @@ TEST_F(SubscriptionTest, SimpleMainlineWithTelURI)
   check_OK_and_NOTIFY("active", std::make_pair("active", "registered"), irs_impus, true, "timeout");
 }
 
+/// Check that an in-dialog refresh doesn't query the HSS, and that a refresh
+/// of a subscription that has gone from the store does.
+TEST_F(SubscriptionTest, RefreshWithoutHSSQuery)
+{
+  SubscribeMessage msg;
+  inject_msg(msg.get());
+
+  std::vector<std::string> irs_impus;
+  irs_impus.push_back("sip:6505550231@homedomain");
+
+  std::string to_tag = check_OK_and_NOTIFY("active", std::make_pair("active", "registered"), irs_impus);
+  check_subscriptions("sip:6505550231@homedomain", 1u);
+
+  // Fail any HSS queries, then refresh the subscription.  The refresh
+  // still succeeds.
+  _hss_connection->set_rc("/impu/sip%3A6505550231%40homedomain/reg-data",
+                          500);
+  msg._to_tag = to_tag;
+  inject_msg(msg.get());
+  check_OK_and_NOTIFY("active", std::make_pair("active", "registered"), irs_impus);
+  check_subscriptions("sip:6505550231@homedomain", 1u);
+
+  // Remove the subscription from the store.  The next refresh has to query
+  // the HSS, so fails.
+  _local_data_store->flush_all();
+  inject_msg(msg.get());
+  ASSERT_EQ(1, txdata_count());
+  pjsip_msg* out = current_txdata()->msg;
+  EXPECT_EQ(500, out->line.status.code);
+  free_txdata();
+
+  _hss_connection->delete_rc("/impu/sip%3A6505550231%40homedomain/reg-data");
+}
+
+/// Check that in-dialog refreshes go back to the HSS once the subscriber data
+/// they were accepted with reaches its maximum age.
+TEST_F(SubscriptionTest, RefreshQueriesHSSAfterMaxAge)
+{
+  // Extend the binding so that it outlives the test.
+  int now = time(NULL);
+  SubscriberDataManager::AoRPair* aor_pair = _sdm->get_aor_data(std::string("sip:6505550231@homedomain"), 0);
+  aor_pair->get_current()->get_binding(std::string("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1"))->_expires = now + 3000;
+  std::vector<std::string> irs_impus;
+  irs_impus.push_back("sip:6505550231@homedomain");
+  _sdm->set_aor_data(irs_impus[0], irs_impus, aor_pair, 0);
+  delete aor_pair; aor_pair = NULL;
+
+  SubscribeMessage msg;
+  inject_msg(msg.get());
+  std::string to_tag = check_OK_and_NOTIFY("active", std::make_pair("active", "registered"), irs_impus);
+
+  // Fail any HSS queries.  Refreshes within the maximum age are still
+  // accepted.
+  _hss_connection->set_rc("/impu/sip%3A6505550231%40homedomain/reg-data",
+                          500);
+  msg._to_tag = to_tag;
+  cwtest_advance_time_ms(250000);
+  inject_msg(msg.get());
+  check_OK_and_NOTIFY("active", std::make_pair("active", "registered"), irs_impus);
+  cwtest_advance_time_ms(250000);
+  inject_msg(msg.get());
+  check_OK_and_NOTIFY("active", std::make_pair("active", "registered"), irs_impus);
+
+  // The data is now older than the maximum age, so the next refresh queries
+  // the HSS, and fails.
+  cwtest_advance_time_ms(150000);
+  inject_msg(msg.get());
+  ASSERT_EQ(1, txdata_count());
+  pjsip_msg* out = current_txdata()->msg;
+  EXPECT_EQ(500, out->line.status.code);
+  free_txdata();
+
+  _hss_connection->delete_rc("/impu/sip%3A6505550231%40homedomain/reg-data");
+}
+
+/// Check that the subscriber data cached for refreshes is dropped when the
+/// AoR is deregistered.
+TEST_F(SubscriptionTest, RefreshQueriesHSSAfterDeregistration)
+{
+  SubscribeMessage msg;
+  inject_msg(msg.get());
+
+  std::vector<std::string> irs_impus;
+  irs_impus.push_back("sip:6505550231@homedomain");
+
+  std::string to_tag = check_OK_and_NOTIFY("active", std::make_pair("active", "registered"), irs_impus);
+
+  // Save the subscription, then deregister the AoR.  This terminates the
+  // subscription.
+  SubscriberDataManager::AoRPair* aor_pair = _sdm->get_aor_data(std::string("sip:6505550231@homedomain"), 0);
+  SubscriberDataManager::AoR::Subscription subscription =
+    *aor_pair->get_current()->get_subscription(to_tag);
+  SubscriberDataManager::AoR::Binding binding =
+    *aor_pair->get_current()->get_binding(std::string("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1"));
+  aor_pair->get_current()->remove_binding(std::string("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1"));
+  _sdm->set_aor_data(irs_impus[0], irs_impus, aor_pair, 0);
+  delete aor_pair; aor_pair = NULL;
+
+  while (txdata_count() > 0)
+  {
+    inject_msg(respond_to_current_txdata(200));
+  }
+
+  // Re-register the AoR and put the subscription back, as if another node
+  // had accepted it.
+  aor_pair = _sdm->get_aor_data(std::string("sip:6505550231@homedomain"), 0);
+  *aor_pair->get_current()->get_binding(std::string("urn:uuid:00000000-0000-0000-0000-b4dd32817622:1")) = binding;
+  *aor_pair->get_current()->get_subscription(to_tag) = subscription;
+  _sdm->set_aor_data(irs_impus[0], irs_impus, aor_pair, 0);
+  delete aor_pair; aor_pair = NULL;
+
+  while (txdata_count() > 0)
+  {
+    inject_msg(respond_to_current_txdata(200));
+  }
+
+  check_subscriptions("sip:6505550231@homedomain", 1u);
+
+  // The refresh can't use the data cached before the deregistration, so
+  // queries the HSS, and fails.
+  _hss_connection->set_rc("/impu/sip%3A6505550231%40homedomain/reg-data",
+                          500);
+  msg._to_tag = to_tag;
+  inject_msg(msg.get());
+  ASSERT_EQ(1, txdata_count());
+  pjsip_msg* out = current_txdata()->msg;
+  EXPECT_EQ(500, out->line.status.code);
+  free_txdata();
+
+  _hss_connection->delete_rc("/impu/sip%3A6505550231%40homedomain/reg-data");
+}
+
 /// Check that a subscription with immediate expiry is treated correctly
 TEST_F(SubscriptionTest, OneShotSubscription)
 {
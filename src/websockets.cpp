@@ -45,6 +45,7 @@ extern "C" {
 
 #include <string>
 #include <cstring>
+#include <boost/thread.hpp>
 
 #include "stack.h"
 #include "log.h"
@@ -54,6 +55,7 @@ extern "C" {
 using websocketpp::server;
 
 static unsigned short ws_port;
+static int ws_threads;
 
 //
 // mod_ws_transport is the module implementing websockets
@@ -97,12 +99,15 @@ static pj_status_t ws_send_msg(pjsip_transport *transport,
                                void *token,
                                pjsip_transport_callback callback)
 {
-  std::string body(tdata->buf.start);
   TRC_DEBUG("Sending message over WS");
 
+  // The websocket library takes the payload as a string, so build it directly
+  // from the encoded message using its length, rather than treating the
+  // buffer as NUL-terminated.
+  std::string body(tdata->buf.start, tdata->buf.cur - tdata->buf.start);
+
   struct ws_transport *ws = (struct ws_transport*)transport;
-  server::handler::connection_ptr con = ws->con;
-  con->send(body, websocketpp::frame::opcode::TEXT);
+  ws->con->send(body, websocketpp::frame::opcode::TEXT);
 
   return PJ_SUCCESS;
 }
@@ -237,6 +242,33 @@ static pj_status_t ws_transport_create(pjsip_endpoint *endpt,
   /* Set endpoint. */
   tp->base.endpt = endpt;
 
+  /* Create the pool for received messages.  This is reset after each
+   * message rather than being recreated, as the TCP transport does.
+   */
+  tp->rdata.tp_info.pool = pjsip_endpt_create_pool(endpt,
+                                                   "rtd%p",
+                                                   PJSIP_POOL_RDATA_LEN,
+                                                   PJSIP_POOL_RDATA_INC);
+  if (!tp->rdata.tp_info.pool)
+  {
+    TRC_ERROR("Unable to create pool");
+    status = PJ_ENOMEM;
+    goto on_error;
+  }
+
+  /* Initialize the parts of rdata that don't change between messages. */
+  tp->rdata.tp_info.transport = &tp->base;
+  tp->rdata.tp_info.tp_data = tp;
+  tp->rdata.tp_info.op_key.rdata = &tp->rdata;
+
+  tp->rdata.pkt_info.src_addr = tp->base.key.rem_addr;
+  tp->rdata.pkt_info.src_addr_len = sizeof(tp->rdata.pkt_info.src_addr);
+  pj_sockaddr_print(&tp->base.key.rem_addr,
+                    tp->rdata.pkt_info.src_name,
+                    sizeof(tp->rdata.pkt_info.src_name),
+                    0);
+  tp->rdata.pkt_info.src_port = pj_sockaddr_get_port(&tp->base.key.rem_addr);
+
   /* Transport manager and timer will be initialized by tpmgr */
 
   /* Set functions. */
@@ -292,39 +324,14 @@ static pj_bool_t on_ws_data(ws_transport *ws,
     return PJ_FALSE;
   }
 
-  /* Initialize rdata */
-  pj_pool_t *pool;
-  pj_sockaddr *rem_addr;
-
-  /* Init rdata */
-  pool = pjsip_endpt_create_pool(ws->base.endpt,
-      "rtd%p",
-      PJSIP_POOL_RDATA_LEN,
-      PJSIP_POOL_RDATA_INC);
-  if (!pool) {
-    TRC_ERROR("Unable to create pool");
-    return PJ_ENOMEM;
-  }
-
-  ws->rdata.tp_info.pool = pool;
-
-  ws->rdata.tp_info.transport = &ws->base;
-  ws->rdata.tp_info.tp_data = ws;
-  ws->rdata.tp_info.op_key.rdata = &ws->rdata;
-
-  ws->rdata.pkt_info.src_addr = ws->base.key.rem_addr;
-  ws->rdata.pkt_info.src_addr_len = sizeof(ws->rdata.pkt_info.src_addr);
-  rem_addr = &ws->base.key.rem_addr;
-  pj_sockaddr_print(rem_addr, ws->rdata.pkt_info.src_name,
-      sizeof(ws->rdata.pkt_info.src_name), 0);
-  ws->rdata.pkt_info.src_port = pj_sockaddr_get_port(rem_addr);
-
-  const char *msg_str = msg->get_payload().c_str();
-  if (strlen(msg_str) <= PJSIP_MAX_PKT_LEN) {
-    ws->rdata.pkt_info.packet = (char*)pj_pool_alloc(ws->rdata.tp_info.pool, strlen(msg_str) + 1);
-    strcpy(ws->rdata.pkt_info.packet, msg_str);
-  } else {
-    TRC_ERROR("Dropping incoming websocket message as it is larger than PJSIP_MAX_PKT_LEN, %d", strlen(msg_str));
+  /* Copy the message out of the websocket frame into the rdata pool, as the
+   * parser writes to the packet.  The pool is reset once the transport
+   * manager has finished with the packet (anything that keeps the message
+   * clones the rdata), so it doesn't grow.
+   */
+  const std::string& payload = msg->get_payload();
+  if (payload.size() > PJSIP_MAX_PKT_LEN) {
+    TRC_ERROR("Dropping incoming websocket message as it is larger than PJSIP_MAX_PKT_LEN, %d", payload.size());
     return PJ_FALSE;
   }
 
@@ -332,7 +339,11 @@ static pj_bool_t on_ws_data(ws_transport *ws,
   rdata = &ws->rdata;
 
   /* Init pkt_info part. */
-  rdata->pkt_info.len = strlen(msg_str);
+  rdata->pkt_info.packet = (char*)pj_pool_alloc(rdata->tp_info.pool,
+                                                payload.size() + 1);
+  pj_memcpy(rdata->pkt_info.packet, payload.data(), payload.size());
+  rdata->pkt_info.packet[payload.size()] = '\0';
+  rdata->pkt_info.len = payload.size();
   rdata->pkt_info.zero = 0;
   pj_gettimeofday(&rdata->pkt_info.timestamp);
 
@@ -352,7 +363,8 @@ static pj_bool_t on_ws_data(ws_transport *ws,
    */
   pj_assert(size_eaten == (pj_size_t)rdata->pkt_info.len);
 
-  /* Reset pool. */
+  /* Reset pool, and make sure nothing refers to the packet any more. */
+  rdata->pkt_info.packet = NULL;
   pj_pool_reset(rdata->tp_info.pool);
 
   return PJ_TRUE;
@@ -395,6 +407,35 @@ static pj_status_t ws_destroy_transport(pjsip_transport *transport)
   return PJ_SUCCESS;
 }
 
+/*
+ * PJSIP thread descriptor for each websocket server thread.  This must stay
+ * in scope for the lifetime of the thread, so is thread-local rather than on
+ * the stack.
+ */
+static __thread pj_thread_desc ws_thread_desc;
+
+/*
+ * Registers the calling thread with PJSIP if it isn't already.  The
+ * websocket server may run its callbacks on a pool of threads that it creates
+ * itself, and each of them must be registered before using PJSIP APIs.
+ */
+static void ws_register_thread()
+{
+  if (!pj_thread_is_registered())
+  {
+    pj_thread_t *thread = 0;
+
+    pj_status_t status = pj_thread_register("WebSocketThread",
+                                            ws_thread_desc,
+                                            &thread);
+
+    if (status != PJ_SUCCESS)
+    {
+      TRC_ERROR("Failed to register websocket thread with PJSIP");
+    }
+  }
+}
+
 /* Setup callbacks for WebSockets events */
 class sip_server_handler : public server::handler {
   public:
@@ -428,6 +469,8 @@ class sip_server_handler : public server::handler {
     }
 
     void on_open(connection_ptr con) {
+      ws_register_thread();
+
       TRC_DEBUG("New web socket connection, creating PJSIP transport");
       pjsip_transport *transport;
       pj_status_t status = ws_transport_create(stack_data.endpt,
@@ -439,18 +482,41 @@ class sip_server_handler : public server::handler {
       }
       else{
         TRC_DEBUG("Failed to create WS transport");
+        return;
       }
 
+      boost::lock_guard<boost::shared_mutex> write_lock(connectionMapLock);
       connectionMap.insert(
           std::pair<connection_ptr, struct ws_transport*>(con, (struct ws_transport*)transport));
     }
 
     void on_message(connection_ptr con, message_ptr msg) {
-      ws_transport *transport;
+      ws_transport *transport = NULL;
+
+      ws_register_thread();
 
       TRC_DEBUG("Received message from websockets");
 
-      transport = connectionMap.find(con)->second;
+      {
+        // The websocket server only reads one message at a time from each
+        // connection, so only the lookup needs protecting - the transport's
+        // rdata is never used by two threads at once.
+        boost::shared_lock<boost::shared_mutex> read_lock(connectionMapLock);
+        std::map<connection_ptr, struct ws_transport*>::iterator it =
+          connectionMap.find(con);
+
+        if (it != connectionMap.end())
+        {
+          transport = it->second;
+        }
+      }
+
+      if (transport == NULL)
+      {
+        TRC_WARNING("Dropping message received on unknown websocket connection");
+        return;
+      }
+
       TRC_DEBUG("Sending message to PJSIP...");
       pj_status_t status = on_ws_data(transport, msg);
       if (status == PJ_TRUE){
@@ -465,8 +531,24 @@ class sip_server_handler : public server::handler {
       ws_transport *transport;
       pjsip_tp_state_callback state_cb;
 
+      ws_register_thread();
+
       TRC_DEBUG("Closing websocket...");
-      transport = connectionMap.find(con)->second;
+
+      {
+        boost::lock_guard<boost::shared_mutex> write_lock(connectionMapLock);
+        std::map<connection_ptr, struct ws_transport*>::iterator it =
+          connectionMap.find(con);
+
+        if (it == connectionMap.end())
+        {
+          TRC_WARNING("Closing unknown websocket connection");
+          return;
+        }
+
+        transport = it->second;
+        connectionMap.erase(it);
+      }
 
       /* Notify application of transport disconnected state */
       state_cb = pjsip_tpmgr_get_state_cb(transport->base.tpmgr);
@@ -488,7 +570,11 @@ class sip_server_handler : public server::handler {
 
   private:
     static std::string SUBPROTOCOL;
+
+    // Map from connection to PJSIP transport.  This is accessed from all the
+    // websocket server threads so is protected by connectionMapLock.
     std::map<connection_ptr, struct ws_transport*> connectionMap;
+    boost::shared_mutex connectionMapLock;
 };
 
 std::string sip_server_handler::SUBPROTOCOL = "sip";
@@ -510,9 +596,10 @@ static int websocket_thread(void* p)
     sip_endpoint.elog().set_level(websocketpp::log::elevel::RERROR);
     sip_endpoint.elog().set_level(websocketpp::log::elevel::FATAL);
 
-    TRC_DEBUG("Starting WebSocket SIP server on port %hu", ws_port);
+    TRC_DEBUG("Starting WebSocket SIP server on port %hu with %d threads",
+              ws_port, ws_threads);
     boost::asio::ip::tcp::endpoint ep(boost::asio::ip::tcp::v4(), ws_port);
-    sip_endpoint.listen(ep);
+    sip_endpoint.listen(ep, ws_threads);
   } catch (std::exception& e) {
     TRC_ERROR("Exception: %s", e.what());
   }
@@ -537,9 +624,10 @@ static pj_bool_t ws_transport_on_start()
   return PJ_SUCCESS;
 }
 
-pj_status_t init_websockets(unsigned short port)
+pj_status_t init_websockets(unsigned short port, int num_threads)
 {
   ws_port = port;
+  ws_threads = (num_threads > 0) ? num_threads : 1;
 
   pj_status_t status;
   status = pjsip_endpt_register_module(stack_data.endpt, &mod_ws_transport);